@@ -30,13 +30,15 @@
 #include <openssl/crypto.h>
 #include <openssl/err.h>
 #include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <zlib.h>
 
-#ifndef OPENR_OBJECT
-#ifdef WIN32
-#include <windows.h>
-#else
-#include <pthread.h>
-#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PYCONNECT_CRC32C_SSE42
+#include <nmmintrin.h>
+#elif defined(__ARM_FEATURE_CRC32)
+#define PYCONNECT_CRC32C_ARM
+#include <arm_acle.h>
 #endif
 
 #define ENCRYPTION_KEY_LENGTH 32
@@ -67,22 +69,101 @@ namespace pyconnect {
 static const unsigned char encrypt_key_text[] =
     "Mk80Z2J4TXJ1N0x4Q3RsQXhQNlB0d1NNWWNjd3Nzdjk=";
 static const unsigned char encrypt_iv[] = "HrWOZK1H"; // must be 8 bytes
-static unsigned char *encrypt_key;
-static unsigned char *encryptbuffer = NULL;
-static unsigned char *decryptbuffer = NULL;
-
-#ifndef OPENR_OBJECT
-#ifdef WIN32
-static CRITICAL_SECTION t_criticalSection_1_;
-static CRITICAL_SECTION t_criticalSection_2_;
+static const char seal_key_label[] = "PyConnect AES-256-GCM";
+static unsigned char *encrypt_key = NULL;
+static unsigned char seal_key[ENCRYPTION_KEY_LENGTH];
+static bool seal_key_ready = false;
+
+// en/decryption state of one thread. The cipher contexts are keyed on
+// first use and after that only get a new IV for each message, which
+// saves the Blowfish key setup a fresh context costs. Keeping the result
+// buffers per thread as well means threads never wait on each other.
+struct CipherState {
+  EVP_CIPHER_CTX *encryptCtx; // Blowfish CBC
+  EVP_CIPHER_CTX *decryptCtx;
+  EVP_CIPHER_CTX *sealCtx; // AES-256-GCM
+  EVP_CIPHER_CTX *openCtx;
+  unsigned char *encryptbuffer;
+  unsigned char *decryptbuffer;
+  unsigned char *sealbuffer;
+  int encryptbufferSize;
+  int decryptbufferSize;
+  int sealbufferSize;
+  unsigned char nonce[PYCONNECT_AEAD_NONCE_SIZE]; // random prefix + count
+  unsigned int sealCount;
+
+  CipherState()
+      : encryptCtx(NULL), decryptCtx(NULL), sealCtx(NULL), openCtx(NULL),
+        encryptbuffer(NULL), decryptbuffer(NULL), sealbuffer(NULL),
+        encryptbufferSize(0), decryptbufferSize(0), sealbufferSize(0),
+        sealCount(0) {}
+  ~CipherState() {
+    EVP_CIPHER_CTX_free(encryptCtx);
+    EVP_CIPHER_CTX_free(decryptCtx);
+    EVP_CIPHER_CTX_free(sealCtx);
+    EVP_CIPHER_CTX_free(openCtx);
+    free(encryptbuffer);
+    free(decryptbuffer);
+    free(sealbuffer);
+  }
+};
+
+// deflate and inflate state of one thread, set up on first use and only
+// reset for each message after that.
+struct CompressState {
+  z_stream deflater;
+  z_stream inflater;
+  bool deflaterReady;
+  bool inflaterReady;
+  unsigned char *compressbuffer;
+  unsigned char *decompressbuffer;
+  int compressbufferSize;
+  int decompressbufferSize;
+
+  CompressState()
+      : deflaterReady(false), inflaterReady(false), compressbuffer(NULL),
+        decompressbuffer(NULL), compressbufferSize(0),
+        decompressbufferSize(0) {}
+  ~CompressState() {
+    if (deflaterReady)
+      deflateEnd(&deflater);
+    if (inflaterReady)
+      inflateEnd(&inflater);
+    free(compressbuffer);
+    free(decompressbuffer);
+  }
+};
+
+#ifdef OPENR_OBJECT
+static CipherState s_cipherState;
+static CompressState s_compressState;
 #else
-static pthread_mutex_t t_mutex_1;
-static pthread_mutex_t t_mutex_2;
-static pthread_mutexattr_t t_mta;
-#endif
+static thread_local CipherState s_cipherState;
+static thread_local CompressState s_compressState;
 #endif
 
 // helper functions
+// grow a malloc'ed en/decryption buffer to hold at least required bytes.
+static bool reserveEnDecryptBuffer(unsigned char *&buffer, int &bufferSize,
+                                   int required) {
+  if (buffer && bufferSize >= required)
+    return true;
+
+  int newSize = bufferSize > 0 ? bufferSize : PYCONNECT_MSG_ENDECRYPT_BUFFER_SIZE;
+  while (newSize < required)
+    newSize *= 2;
+
+  unsigned char *newBuffer = (unsigned char *)realloc(buffer, newSize);
+  if (!newBuffer) {
+    ERROR_MSG("Unable to allocate %d bytes for en/decryption buffer.\n",
+              newSize);
+    return false;
+  }
+  buffer = newBuffer;
+  bufferSize = newSize;
+  return true;
+}
+
 /* NOTE: encodeBase64 and decodeBase64 are not thread safe!!!! */
 unsigned char *decodeBase64(char *input, size_t *outLen) {
   BIO *bmem, *b64;
@@ -127,21 +208,63 @@ char *encodeBase64(const unsigned char *input, size_t length) {
   return buf;
 }
 
+
+// the context in ctx, keyed for cipher on first use
+static EVP_CIPHER_CTX *cipherContext(EVP_CIPHER_CTX *&ctx,
+                                     const EVP_CIPHER *cipher,
+                                     const unsigned char *key, int enc) {
+  if (ctx || !key)
+    return ctx;
+
+  ctx = EVP_CIPHER_CTX_new();
+  if (!ctx || EVP_CipherInit_ex(ctx, cipher, NULL, key, NULL, enc) != 1) {
+    ERROR_MSG("Unable to set up cipher context.\n");
+    EVP_CIPHER_CTX_free(ctx);
+    ctx = NULL;
+  }
+  return ctx;
+}
+
+// a nonce is never used twice with the key: it is a random prefix drawn
+// for each thread followed by a count, the prefix being drawn anew
+// whenever the count wraps around.
+static bool nextNonce(CipherState &state) {
+  const int prefixLength = PYCONNECT_AEAD_NONCE_SIZE - sizeof(unsigned int);
+  if (state.sealCount == 0 && RAND_bytes(state.nonce, prefixLength) != 1)
+    return false;
+
+  state.sealCount++;
+  memcpy(state.nonce + prefixLength, &state.sealCount, sizeof(unsigned int));
+  return true;
+}
+
+// seal length bytes at mesg into sealed as nonce, ciphertext and tag. mesg
+// may be sealed + PYCONNECT_AEAD_NONCE_SIZE to seal in place.
+static int sealInto(const unsigned char *mesg, int length,
+                    unsigned char *sealed) {
+  CipherState &state = s_cipherState;
+  unsigned char *cipherText = sealed + PYCONNECT_AEAD_NONCE_SIZE;
+  int oLen = 0, tLen = 0;
+
+  EVP_CIPHER_CTX *ctx =
+      cipherContext(state.sealCtx, EVP_aes_256_gcm(),
+                    seal_key_ready ? seal_key : NULL, 1);
+  if (!ctx || !nextNonce(state) ||
+      EVP_EncryptInit_ex(ctx, NULL, NULL, NULL, state.nonce) != 1 ||
+      EVP_EncryptUpdate(ctx, cipherText, &oLen, mesg, length) != 1 ||
+      EVP_EncryptFinal_ex(ctx, cipherText + oLen, &tLen) != 1 ||
+      EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, PYCONNECT_AEAD_TAG_SIZE,
+                          cipherText + length) != 1) {
+    // ERROR_MSG( "AES-GCM seal failed.\n" );
+    return 0;
+  }
+  memcpy(sealed, state.nonce, PYCONNECT_AEAD_NONCE_SIZE);
+  return 1;
+}
+
 void endecryptInit() {
   INFO_MSG("Communication encryption enabled.\n");
 
-#ifndef OPENR_OBJECT
-#ifdef WIN32
-  InitializeCriticalSection(&t_criticalSection_1_);
-  InitializeCriticalSection(&t_criticalSection_2_);
-#else
-  pthread_mutexattr_init(&t_mta);
-  pthread_mutexattr_settype(&t_mta, PTHREAD_MUTEX_RECURSIVE);
-  pthread_mutex_init(&t_mutex_1, &t_mta);
-  pthread_mutex_init(&t_mutex_2, &t_mta);
-#endif
-#endif
-
   size_t keyLen = 0;
   if (encrypt_key) {
     free(encrypt_key);
@@ -152,185 +275,224 @@ void endecryptInit() {
     ERROR_MSG("Encryption key decode error.\n");
   }
 
-  if (!encryptbuffer) {
-    encryptbuffer =
-        (unsigned char *)malloc(PYCONNECT_MSG_ENDECRYPT_BUFFER_SIZE);
-  }
-  if (!decryptbuffer) {
-    decryptbuffer =
-        (unsigned char *)malloc(PYCONNECT_MSG_ENDECRYPT_BUFFER_SIZE);
-  }
+  // AES-GCM gets a key of its own, derived from the shared one
+  unsigned char keyMaterial[ENCRYPTION_KEY_LENGTH + sizeof(seal_key_label)];
+  unsigned int sealKeyLen = 0;
+  memcpy(keyMaterial, encrypt_key, ENCRYPTION_KEY_LENGTH);
+  memcpy(keyMaterial + ENCRYPTION_KEY_LENGTH, seal_key_label,
+         sizeof(seal_key_label));
+  seal_key_ready = keyLen == ENCRYPTION_KEY_LENGTH &&
+                   EVP_Digest(keyMaterial, sizeof(keyMaterial), seal_key,
+                              &sealKeyLen, EVP_sha256(), NULL) == 1 &&
+                   sealKeyLen == ENCRYPTION_KEY_LENGTH;
 }
 
+// the cipher state of each thread goes with the thread
 void endecryptFini() {
-  if (encryptbuffer) {
-    free(encryptbuffer);
-    encryptbuffer = NULL;
-  }
-  if (decryptbuffer) {
-    free(decryptbuffer);
-    decryptbuffer = NULL;
-  }
   if (encrypt_key) {
     free(encrypt_key);
     encrypt_key = NULL;
   }
-#ifndef OPENR_OBJECT
-#ifdef WIN32
-  DeleteCriticalSection(&t_criticalSection_1_);
-  DeleteCriticalSection(&t_criticalSection_2_);
-#else
-  pthread_mutex_destroy(&t_mutex_1);
-  pthread_mutex_destroy(&t_mutex_2);
-  pthread_mutexattr_destroy(&t_mta);
-#endif
-#endif
 }
 
-int decryptMessage(const unsigned char *origMesg, int origMesgLength,
-                   unsigned char **decryptedMesg, int *decryptedMesgLength) {
-#ifndef OPENR_OBJECT
-#ifdef WIN32
-  EnterCriticalSection(&t_criticalSection_1_);
-#else
-  pthread_mutex_lock(&t_mutex_1);
-#endif
-#endif
+int decryptMessageTo(const unsigned char *origMesg, int origMesgLength,
+                     unsigned char *decryptedMesg, int *decryptedMesgLength) {
   int oLen = 0, tLen = 0;
-#if OPENSSL_VERSION_NUMBER < 0x10100000L
-  EVP_CIPHER_CTX ectx;
-  EVP_CIPHER_CTX *ctx = &ectx;
-#else
-  EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
-#endif
-  EVP_CIPHER_CTX_init(ctx);
-  EVP_DecryptInit(ctx, EVP_bf_cbc(), encrypt_key, encrypt_iv);
-
-  memset(decryptbuffer, 0, PYCONNECT_MSG_ENDECRYPT_BUFFER_SIZE);
 
-  if (EVP_DecryptUpdate(ctx, decryptbuffer, &oLen, origMesg, origMesgLength) !=
-      1) {
+  EVP_CIPHER_CTX *ctx =
+      cipherContext(s_cipherState.decryptCtx, EVP_bf_cbc(), encrypt_key, 0);
+  if (!ctx || EVP_DecryptInit_ex(ctx, NULL, NULL, NULL, encrypt_iv) != 1 ||
+      EVP_DecryptUpdate(ctx, decryptedMesg, &oLen, origMesg,
+                        origMesgLength) != 1) {
     // ERROR_MSG( "EVP_DecryptUpdate failed.\n" );
-#if OPENSSL_VERSION_NUMBER < 0x10100000L
-    EVP_CIPHER_CTX_cleanup(ctx);
-#else
-    EVP_CIPHER_CTX_free(ctx);
-#endif
-#ifndef OPENR_OBJECT
-#ifdef WIN32
-    LeaveCriticalSection(&t_criticalSection_1_);
-#else
-    pthread_mutex_unlock(&t_mutex_1);
-#endif
-#endif
     return 0;
   }
-  if (EVP_DecryptFinal(ctx, decryptbuffer + oLen, &tLen) != 1) {
+  if (EVP_DecryptFinal_ex(ctx, decryptedMesg + oLen, &tLen) != 1) {
     // ERROR_MSG( "EVP_DecryptFinal failed.\n" );
-#if OPENSSL_VERSION_NUMBER < 0x10100000L
-    EVP_CIPHER_CTX_cleanup(ctx);
-#else
-    EVP_CIPHER_CTX_free(ctx);
-#endif
-#ifndef OPENR_OBJECT
-#ifdef WIN32
-    LeaveCriticalSection(&t_criticalSection_1_);
-#else
-    pthread_mutex_unlock(&t_mutex_1);
-#endif
-#endif
     return 0;
   }
 
   *decryptedMesgLength = oLen + tLen;
-  *decryptedMesg = decryptbuffer;
-#if OPENSSL_VERSION_NUMBER < 0x10100000L
-  EVP_CIPHER_CTX_cleanup(ctx);
-#else
-  EVP_CIPHER_CTX_free(ctx);
-#endif
+  return 1;
+}
 
-#ifndef OPENR_OBJECT
-#ifdef WIN32
-  LeaveCriticalSection(&t_criticalSection_1_);
-#else
-  pthread_mutex_unlock(&t_mutex_1);
-#endif
-#endif
+int encryptMessageTo(const unsigned char *origMesg, int origMesgLength,
+                     unsigned char *encryptedMesg, int *encryptedMesgLength) {
+  int oLen = 0, tLen = 0;
+
+  EVP_CIPHER_CTX *ctx =
+      cipherContext(s_cipherState.encryptCtx, EVP_bf_cbc(), encrypt_key, 1);
+  if (!ctx || EVP_EncryptInit_ex(ctx, NULL, NULL, NULL, encrypt_iv) != 1 ||
+      EVP_EncryptUpdate(ctx, encryptedMesg, &oLen, origMesg,
+                        origMesgLength) != 1) {
+    // ERROR_MSG( "EVP_EncryptUpdate failed.\n" );
+    return 0;
+  }
+  if (EVP_EncryptFinal_ex(ctx, encryptedMesg + oLen, &tLen) != 1) {
+    // ERROR_MSG( "EVP_EncryptFinal failed.\n" );
+    return 0;
+  }
+
+  *encryptedMesgLength = oLen + tLen;
+  return 1;
+}
+
+int decryptMessage(const unsigned char *origMesg, int origMesgLength,
+                   unsigned char **decryptedMesg, int *decryptedMesgLength) {
+  CipherState &state = s_cipherState;
+
+  if (!reserveEnDecryptBuffer(state.decryptbuffer, state.decryptbufferSize,
+                              origMesgLength + PYCONNECT_CIPHER_BLOCK_SIZE) ||
+      !decryptMessageTo(origMesg, origMesgLength, state.decryptbuffer,
+                        decryptedMesgLength))
+    return 0;
+
+  *decryptedMesg = state.decryptbuffer;
   return 1;
 }
 
 int encryptMessage(const unsigned char *origMesg, int origMesgLength,
                    unsigned char **encryptedMesg, int *encryptedMesgLength) {
-#ifndef OPENR_OBJECT
-#ifdef WIN32
-  EnterCriticalSection(&t_criticalSection_2_);
-#else
-  pthread_mutex_lock(&t_mutex_2);
-#endif
-#endif
+  CipherState &state = s_cipherState;
+
+  if (!reserveEnDecryptBuffer(state.encryptbuffer, state.encryptbufferSize,
+                              origMesgLength + PYCONNECT_CIPHER_BLOCK_SIZE) ||
+      !encryptMessageTo(origMesg, origMesgLength, state.encryptbuffer,
+                        encryptedMesgLength))
+    return 0;
+
+  *encryptedMesg = state.encryptbuffer;
+  return 1;
+}
+
+int sealMessage(const unsigned char *origMesg, int origMesgLength,
+                unsigned char **sealedMesg, int *sealedMesgLength) {
+  CipherState &state = s_cipherState;
+
+  if (!reserveEnDecryptBuffer(state.sealbuffer, state.sealbufferSize,
+                              origMesgLength + PYCONNECT_AEAD_OVERHEAD) ||
+      !sealInto(origMesg, origMesgLength, state.sealbuffer))
+    return 0;
+
+  *sealedMesgLength = origMesgLength + PYCONNECT_AEAD_OVERHEAD;
+  *sealedMesg = state.sealbuffer;
+  return 1;
+}
+
+int sealMessageInPlace(unsigned char *mesg, int mesgLength) {
+  return sealInto(mesg, mesgLength, mesg - PYCONNECT_AEAD_NONCE_SIZE);
+}
+
+int openMessage(unsigned char *sealedMesg, int sealedMesgLength,
+                unsigned char **openedMesg, int *openedMesgLength) {
+  CipherState &state = s_cipherState;
+  unsigned char *cipherText = sealedMesg + PYCONNECT_AEAD_NONCE_SIZE;
+  int length = sealedMesgLength - PYCONNECT_AEAD_OVERHEAD;
   int oLen = 0, tLen = 0;
 
-#if OPENSSL_VERSION_NUMBER < 0x10100000L
-  EVP_CIPHER_CTX ectx;
-  EVP_CIPHER_CTX *ctx = &ectx;
-#else
-  EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
-#endif
-  EVP_CIPHER_CTX_init(ctx);
-  EVP_EncryptInit(ctx, EVP_bf_cbc(), encrypt_key, encrypt_iv);
+  if (length < 0)
+    return 0;
 
-  memset(encryptbuffer, 0, PYCONNECT_MSG_ENDECRYPT_BUFFER_SIZE);
+  EVP_CIPHER_CTX *ctx =
+      cipherContext(state.openCtx, EVP_aes_256_gcm(),
+                    seal_key_ready ? seal_key : NULL, 0);
+  if (!ctx || EVP_DecryptInit_ex(ctx, NULL, NULL, NULL, sealedMesg) != 1 ||
+      EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, PYCONNECT_AEAD_TAG_SIZE,
+                          cipherText + length) != 1 ||
+      EVP_DecryptUpdate(ctx, cipherText, &oLen, cipherText, length) != 1 ||
+      EVP_DecryptFinal_ex(ctx, cipherText + oLen, &tLen) != 1) {
+    // ERROR_MSG( "AES-GCM open failed.\n" );
+    return 0;
+  }
 
-  if (EVP_EncryptUpdate(ctx, encryptbuffer, &oLen, origMesg, origMesgLength) !=
-      1) {
-    // ERROR_MSG( "EVP_EncryptUpdate failed.\n" );
-#if OPENSSL_VERSION_NUMBER < 0x10100000L
-    EVP_CIPHER_CTX_cleanup(ctx);
-#else
-    EVP_CIPHER_CTX_free(ctx);
-#endif
-#ifndef OPENR_OBJECT
-#ifdef WIN32
-    LeaveCriticalSection(&t_criticalSection_2_);
-#else
-    pthread_mutex_unlock(&t_mutex_2);
-#endif
-#endif
+  *openedMesgLength = oLen + tLen;
+  *openedMesg = cipherText;
+  return 1;
+}
+
+// a compressed message is its LE 32 bit length followed by the raw deflate
+// stream of it. Compression is done at the fastest level, it is meant to
+// save bandwidth on slow links rather than to squeeze out every byte.
+int compressMessage(const unsigned char *origMesg, int origMesgLength,
+                    unsigned char **compressedMesg,
+                    int *compressedMesgLength) {
+  CompressState &state = s_compressState;
+  z_stream &zs = state.deflater;
+
+  if (!state.deflaterReady) {
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, Z_BEST_SPEED, Z_DEFLATED, -MAX_WBITS, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK) {
+      ERROR_MSG("Unable to set up deflate stream.\n");
+      return 0;
+    }
+    state.deflaterReady = true;
+  } else if (deflateReset(&zs) != Z_OK) {
     return 0;
   }
+  // anything that does not shrink is not worth sending compressed
+  int maxLength = origMesgLength - 1;
+  if (maxLength <= (int)sizeof(int) ||
+      !reserveEnDecryptBuffer(state.compressbuffer, state.compressbufferSize,
+                              maxLength))
+    return 0;
 
-  if (EVP_EncryptFinal(ctx, encryptbuffer + oLen, &tLen) != 1) {
-    // ERROR_MSG( "EVP_EncryptFinal failed.\n" );
-#if OPENSSL_VERSION_NUMBER < 0x10100000L
-    EVP_CIPHER_CTX_cleanup(ctx);
-#else
-    EVP_CIPHER_CTX_free(ctx);
-#endif
-#ifndef OPENR_OBJECT
-#ifdef WIN32
-    LeaveCriticalSection(&t_criticalSection_2_);
-#else
-    pthread_mutex_unlock(&t_mutex_2);
-#endif
-#endif
+  unsigned char *lengthPtr = state.compressbuffer;
+  packToLENumber(origMesgLength, lengthPtr);
+  zs.next_in = (Bytef *)origMesg;
+  zs.avail_in = origMesgLength;
+  zs.next_out = lengthPtr;
+  zs.avail_out = maxLength - sizeof(int);
+  if (deflate(&zs, Z_FINISH) != Z_STREAM_END)
+    return 0;
+
+  *compressedMesg = state.compressbuffer;
+  *compressedMesgLength = maxLength - zs.avail_out;
+  return 1;
+}
+
+int decompressMessage(const unsigned char *origMesg, int origMesgLength,
+                      unsigned char **decompressedMesg,
+                      int *decompressedMesgLength) {
+  CompressState &state = s_compressState;
+  z_stream &zs = state.inflater;
+  unsigned char *lengthPtr = (unsigned char *)origMesg;
+  int remainingLength = origMesgLength;
+  int length = 0;
+
+  if (origMesgLength <= (int)sizeof(int))
+    return 0;
+  unpackLENumber(length, lengthPtr, remainingLength);
+  // no buffer is reserved for more than the data can possibly inflate to
+  if (length <= 0 || length > PYCONNECT_MSG_MAX_SIZE ||
+      (long long)length >
+          (long long)remainingLength * PYCONNECT_MAX_INFLATE_RATIO)
+    return 0;
+
+  if (!state.inflaterReady) {
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit2(&zs, -MAX_WBITS) != Z_OK) {
+      ERROR_MSG("Unable to set up inflate stream.\n");
+      return 0;
+    }
+    state.inflaterReady = true;
+  } else if (inflateReset(&zs) != Z_OK) {
     return 0;
   }
+  if (!reserveEnDecryptBuffer(state.decompressbuffer,
+                              state.decompressbufferSize, length))
+    return 0;
 
-  *encryptedMesgLength = oLen + tLen;
-  *encryptedMesg = encryptbuffer;
-#if OPENSSL_VERSION_NUMBER < 0x10100000L
-  EVP_CIPHER_CTX_cleanup(ctx);
-#else
-  EVP_CIPHER_CTX_free(ctx);
-#endif
-#ifndef OPENR_OBJECT
-#ifdef WIN32
-  LeaveCriticalSection(&t_criticalSection_2_);
-#else
-  pthread_mutex_unlock(&t_mutex_2);
-#endif
-#endif
+  zs.next_in = lengthPtr;
+  zs.avail_in = remainingLength;
+  zs.next_out = state.decompressbuffer;
+  zs.avail_out = length;
+  if (inflate(&zs, Z_FINISH) != Z_STREAM_END || zs.avail_in != 0 ||
+      zs.total_out != (uLong)length)
+    return 0;
+
+  *decompressedMesg = state.decompressbuffer;
+  *decompressedMesgLength = length;
   return 1;
 }
 } // namespace pyconnect
@@ -378,6 +540,107 @@ int packedIntLen(int num) {
     return 0;
 }
 
+// tables for the software CRC32C, one per byte position of an eight byte
+// word so that a word takes eight lookups and no shifting through the CRC.
+struct CRC32CTables {
+  unsigned int table[8][256];
+
+  CRC32CTables() {
+    for (unsigned int i = 0; i < 256; i++) {
+      unsigned int crc = i;
+      for (int bit = 0; bit < 8; bit++)
+        crc = (crc >> 1) ^ (0x82F63B78 & (0 - (crc & 1)));
+      table[0][i] = crc;
+    }
+    for (unsigned int i = 0; i < 256; i++) {
+      for (int k = 1; k < 8; k++)
+        table[k][i] = (table[k - 1][i] >> 8) ^ table[0][table[k - 1][i] & 0xff];
+    }
+  }
+};
+
+static unsigned int crc32cSoftware(const unsigned char *data, int length,
+                                   unsigned int crc) {
+  static const CRC32CTables tables;
+  const unsigned int(*t)[256] = tables.table;
+
+  while (length >= 8) {
+    unsigned int low = (data[0] | data[1] << 8 | data[2] << 16 |
+                        (unsigned int)data[3] << 24) ^
+                       crc;
+    unsigned int high = data[4] | data[5] << 8 | data[6] << 16 |
+                        (unsigned int)data[7] << 24;
+    crc = t[7][low & 0xff] ^ t[6][(low >> 8) & 0xff] ^
+          t[5][(low >> 16) & 0xff] ^ t[4][low >> 24] ^ t[3][high & 0xff] ^
+          t[2][(high >> 8) & 0xff] ^ t[1][(high >> 16) & 0xff] ^
+          t[0][high >> 24];
+    data += 8;
+    length -= 8;
+  }
+  while (length-- > 0)
+    crc = (crc >> 8) ^ t[0][(crc ^ *data++) & 0xff];
+  return crc;
+}
+
+#ifdef PYCONNECT_CRC32C_SSE42
+// built for SSE4.2 whatever the rest is built for, and only called on a
+// CPU that has it.
+__attribute__((target("sse4.2"))) static unsigned int
+crc32cSSE42(const unsigned char *data, int length, unsigned int crc) {
+#ifdef __x86_64__
+  unsigned long long crc64 = crc;
+  while (length >= 8) {
+    unsigned long long word;
+    memcpy(&word, data, sizeof(word));
+    crc64 = _mm_crc32_u64(crc64, word);
+    data += 8;
+    length -= 8;
+  }
+  crc = (unsigned int)crc64;
+#endif
+  while (length >= 4) {
+    unsigned int word;
+    memcpy(&word, data, sizeof(word));
+    crc = _mm_crc32_u32(crc, word);
+    data += 4;
+    length -= 4;
+  }
+  while (length-- > 0)
+    crc = _mm_crc32_u8(crc, *data++);
+  return crc;
+}
+#endif
+
+#ifdef PYCONNECT_CRC32C_ARM
+static unsigned int crc32cARM(const unsigned char *data, int length,
+                              unsigned int crc) {
+  while (length >= 8) {
+    unsigned long long word;
+    memcpy(&word, data, sizeof(word));
+    crc = __crc32cd(crc, word);
+    data += 8;
+    length -= 8;
+  }
+  while (length-- > 0)
+    crc = __crc32cb(crc, *data++);
+  return crc;
+}
+#endif
+
+unsigned int crc32c(const unsigned char *data, int length, unsigned int crc) {
+  crc = ~crc;
+#if defined(PYCONNECT_CRC32C_SSE42)
+  static const bool hasSSE42 = __builtin_cpu_supports("sse4.2");
+  crc = hasSSE42 ? crc32cSSE42(data, length, crc)
+                 : crc32cSoftware(data, length, crc);
+#elif defined(PYCONNECT_CRC32C_ARM)
+  crc = crc32cARM(data, length, crc);
+#else
+  crc = crc32cSoftware(data, length, crc);
+#endif
+  return ~crc;
+}
+
 void packString(unsigned char *str, int length, unsigned char *&dataBufPtr,
                 bool extendSize) {
   if (!dataBufPtr || !str)
@@ -396,34 +659,35 @@ void packString(unsigned char *str, int length, unsigned char *&dataBufPtr,
   }
 }
 
-std::string unpackString(unsigned char *&dataBufPtr, int &remainingBytes,
-                         bool extendSize) {
+int unpackStringRef(unsigned char *&dataBufPtr, int &remainingBytes,
+                    const char *&str, bool extendSize) {
+  str = "";
   if (!dataBufPtr)
-    return std::string("");
+    return 0;
 
   int strLen = 0;
-  char *str = NULL;
 
   if (extendSize) {
     strLen = unpackStrToInt(dataBufPtr, remainingBytes);
   } else {
     strLen = (int)*dataBufPtr;
     dataBufPtr++;
+    remainingBytes--;
   }
 
-  if (strLen == 0)
-    return std::string("");
-
-  str = new char[strLen + 1];
-  memcpy(str, dataBufPtr, strLen);
-  str[strLen] = '\0';
-  dataBufPtr += strLen;
-  remainingBytes -= strLen;
-
-  std::string retVal = std::string(str);
-  delete[] str;
+  if (strLen > 0) {
+    str = (const char *)dataBufPtr;
+    dataBufPtr += strLen;
+    remainingBytes -= strLen;
+  }
+  return strLen;
+}
 
-  return retVal;
+std::string unpackString(unsigned char *&dataBufPtr, int &remainingBytes,
+                         bool extendSize) {
+  const char *str = NULL;
+  int strLen = unpackStringRef(dataBufPtr, remainingBytes, str, extendSize);
+  return std::string(str, strLen);
 }
 
 const PyConnectType::Type PyConnectType::typeName(const char *type) {
@@ -463,13 +727,411 @@ const std::string PyConnectType::typeName(const Type type) {
   case COMPOSITE:
     return std::string("composite object");
     break;
+  case INT_ARRAY:
+    return std::string("integer array");
+    break;
+  case FLOAT_ARRAY:
+    return std::string("float array");
+    break;
+  case DOUBLE_ARRAY:
+    return std::string("double array");
+    break;
+  case BLOB:
+    return std::string("bytes");
+    break;
   default:
     return std::string("unknown");
   }
 }
 
 #ifdef PYTHON_SERVER
-int PyConnectType::validateTypeAndSize(PyObject *obj, Type type) {
+static int arrayElementSize(PyConnectType::Type type) {
+  switch (type) {
+  case PyConnectType::INT_ARRAY:
+    return sizeof(int);
+  case PyConnectType::FLOAT_ARRAY:
+    return sizeof(float);
+  case PyConnectType::DOUBLE_ARRAY:
+    return sizeof(double);
+  default:
+    return 0;
+  }
+}
+
+// objects exporting a buffer of the right item type (array.array, NumPy
+// arrays, memoryviews) are copied in one go, anything else is taken as a
+// sequence of numbers.
+static bool getArrayBuffer(PyObject *obj, PyConnectType::Type type,
+                           Py_buffer *view) {
+#if PY_MAJOR_VERSION >= 3
+  if (!PyObject_CheckBuffer(obj) || PyBytes_Check(obj) ||
+      PyByteArray_Check(obj))
+    return false;
+  if (PyObject_GetBuffer(obj, view, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) < 0) {
+    PyErr_Clear();
+    return false;
+  }
+  const char *format = view->format ? view->format : "B";
+#ifdef WITH_BIG_ENDIAN
+  if (*format == '@' || *format == '=' || *format == '>')
+#else
+  if (*format == '@' || *format == '=' || *format == '<')
+#endif
+    format++;
+
+  char wanted = (type == PyConnectType::INT_ARRAY)     ? 'i'
+                : (type == PyConnectType::FLOAT_ARRAY) ? 'f'
+                                                       : 'd';
+  bool matches = (view->itemsize == arrayElementSize(type) &&
+                  format[0] != '\0' && format[1] == '\0' &&
+                  (format[0] == wanted ||
+                   (wanted == 'i' && format[0] == 'l')));
+  if (!matches)
+    PyBuffer_Release(view);
+  return matches;
+#else
+  return false;
+#endif
+}
+
+// length is that of a fixed size array, -1 for any
+static int validateArray(PyObject *obj, PyConnectType::Type type,
+                         int length) {
+  int size = arrayElementSize(type);
+  int count = 0;
+  Py_buffer view;
+
+  if (getArrayBuffer(obj, type, &view)) {
+    count = (int)(view.len / view.itemsize);
+    PyBuffer_Release(&view);
+  } else {
+#if PY_MAJOR_VERSION >= 3
+    if (PyUnicode_Check(obj) || PyBytes_Check(obj) || !PySequence_Check(obj))
+#else
+    if (PyString_Check(obj) || PyUnicode_Check(obj) || !PySequence_Check(obj))
+#endif
+      return 0;
+    PyObject *seq = PySequence_Fast(obj, "");
+    if (!seq) {
+      PyErr_Clear();
+      return 0;
+    }
+    count = (int)PySequence_Fast_GET_SIZE(seq);
+    PyObject **items = PySequence_Fast_ITEMS(seq);
+    for (int i = 0; i < count; i++) {
+      bool isNumber = (type == PyConnectType::INT_ARRAY)
+                          ? PyIndex_Check(items[i])
+                          : (PyNumber_Check(items[i]) != 0);
+      if (!isNumber) {
+        Py_DECREF(seq);
+        return 0;
+      }
+    }
+    Py_DECREF(seq);
+  }
+  if (count > (PYCONNECT_MSG_MAX_SIZE - 64) / size ||
+      (length >= 0 && count != length))
+    return 0;
+  return (int)sizeof(int) + count * size;
+}
+
+static void packArray(PyObject *arg, PyConnectType::Type type,
+                      unsigned char *&dataPtr) {
+  Py_buffer view;
+
+  if (getArrayBuffer(arg, type, &view)) {
+    int count = (int)(view.len / view.itemsize);
+    packToLENumber(count, dataPtr);
+    if (type == PyConnectType::INT_ARRAY)
+      packLEArray((const int *)view.buf, count, dataPtr);
+    else if (type == PyConnectType::FLOAT_ARRAY)
+      packLEArray((const float *)view.buf, count, dataPtr);
+    else
+      packLEArray((const double *)view.buf, count, dataPtr);
+    PyBuffer_Release(&view);
+    return;
+  }
+
+  PyObject *seq = PySequence_Fast(arg, "");
+  int count = seq ? (int)PySequence_Fast_GET_SIZE(seq) : 0;
+  packToLENumber(count, dataPtr);
+  if (!seq) {
+    PyErr_Clear();
+    return;
+  }
+  PyObject **items = PySequence_Fast_ITEMS(seq);
+  for (int i = 0; i < count; i++) {
+    if (type == PyConnectType::INT_ARRAY) {
+      int value = (int)PyInt_AsLong(items[i]);
+      packToLENumber(value, dataPtr);
+    } else if (type == PyConnectType::FLOAT_ARRAY) {
+      float value = (float)PyFloat_AsDouble(items[i]);
+      packToLENumber(value, dataPtr);
+    } else {
+      double value = PyFloat_AsDouble(items[i]);
+      packToLENumber(value, dataPtr);
+    }
+  }
+  Py_DECREF(seq);
+}
+
+// under Python 3 a received array becomes a read-only memoryview of the
+// element type over a single copy of the values, which NumPy can wrap with
+// numpy.asarray without copying again.
+static PyObject *unpackArray(PyConnectType::Type type, int count,
+                             unsigned char *&dataPtr, int &remainingLength) {
+  int size = arrayElementSize(type);
+#if PY_MAJOR_VERSION >= 3
+  PyObject *values = PyBytes_FromStringAndSize(NULL, (Py_ssize_t)count * size);
+  if (!values)
+    return NULL;
+  void *buf = PyBytes_AS_STRING(values);
+  if (type == PyConnectType::INT_ARRAY)
+    unpackLEArray((int *)buf, count, dataPtr, remainingLength);
+  else if (type == PyConnectType::FLOAT_ARRAY)
+    unpackLEArray((float *)buf, count, dataPtr, remainingLength);
+  else
+    unpackLEArray((double *)buf, count, dataPtr, remainingLength);
+
+  PyObject *bytesView = PyMemoryView_FromObject(values);
+  Py_DECREF(values);
+  if (!bytesView)
+    return NULL;
+  const char *format = (type == PyConnectType::INT_ARRAY)     ? "i"
+                       : (type == PyConnectType::FLOAT_ARRAY) ? "f"
+                                                              : "d";
+  PyObject *array = PyObject_CallMethod(bytesView, "cast", "s", format);
+  Py_DECREF(bytesView);
+  return array;
+#else
+  PyObject *array = PyList_New(count);
+  for (int i = 0; i < count; i++) {
+    PyObject *item = NULL;
+    if (type == PyConnectType::INT_ARRAY) {
+      int value = 0;
+      unpackLENumber(value, dataPtr, remainingLength);
+      item = PyInt_FromLong(value);
+    } else if (type == PyConnectType::FLOAT_ARRAY) {
+      float value = 0.0;
+      unpackLENumber(value, dataPtr, remainingLength);
+      item = PyFloat_FromDouble(value);
+    } else {
+      double value = 0.0;
+      unpackLENumber(value, dataPtr, remainingLength);
+      item = PyFloat_FromDouble(value);
+    }
+    PyList_SET_ITEM(array, i, item);
+  }
+  return array;
+#endif
+}
+
+const std::string PyConnectType::typeName(const Type type,
+                                          const PyConnectLayout *layout) {
+  std::string name = typeName(type);
+  if (type == STRING) {
+    char length[32];
+    snprintf(length, sizeof(length), " of up to %d bytes", MAX_STR_LENGTH);
+    name += length;
+  } else if (layout && type != COMPOSITE) {
+    char length[16];
+    snprintf(length, sizeof(length), " of %d", layout->length);
+    name += length;
+  }
+  return name;
+}
+
+PyConnectLayout::~PyConnectLayout() {
+  for (size_t i = 0; i < fieldLayouts.size(); i++)
+    delete fieldLayouts[i];
+  Py_XDECREF(tupleType);
+}
+
+// a short name in a layout, false if it runs past the message
+static bool unpackLayoutName(unsigned char *&dataPtr, int &remainingBytes,
+                             std::string &name) {
+  if (remainingBytes < 1 || (int)*dataPtr >= remainingBytes)
+    return false;
+  name = unpackString(dataPtr, remainingBytes);
+  return true;
+}
+
+PyConnectLayout *PyConnectLayout::unpackDeclared(unsigned char typeByte,
+                                                 unsigned char *&dataPtr,
+                                                 int &remainingBytes,
+                                                 bool &valid, int depth) {
+  PyConnectType::Type type = (PyConnectType::Type)(typeByte & 0x3f);
+  PyConnectLayout *layout = NULL;
+
+  if (type == PyConnectType::COMPOSITE) {
+    layout = unpack(dataPtr, remainingBytes, depth);
+    valid = (layout != NULL);
+  } else if (typeByte & PYCONNECT_FIXED_LENGTH) {
+    int length = 0;
+    valid = (type == PyConnectType::INT_ARRAY ||
+             type == PyConnectType::FLOAT_ARRAY ||
+             type == PyConnectType::DOUBLE_ARRAY) &&
+            remainingBytes >= (int)sizeof(int);
+    if (valid) {
+      unpackLENumber(length, dataPtr, remainingBytes);
+      valid = (length >= 0);
+    }
+    if (valid) {
+      layout = new PyConnectLayout();
+      layout->length = length;
+    } else {
+      ERROR_MSG("PyConnectLayout::unpackDeclared: invalid fixed length.\n");
+    }
+  }
+  return layout;
+}
+
+PyConnectLayout *PyConnectLayout::unpack(unsigned char *&dataPtr,
+                                         int &remainingBytes, int depth) {
+  if (depth >= PYCONNECT_MAX_LAYOUT_DEPTH) {
+    ERROR_MSG("PyConnectLayout::unpack: composite types nested too deep.\n");
+    return NULL;
+  }
+  PyConnectLayout *layout = new PyConnectLayout();
+  if (!unpackLayoutName(dataPtr, remainingBytes, layout->name) ||
+      remainingBytes < 1) {
+    ERROR_MSG("PyConnectLayout::unpack: truncated layout.\n");
+    delete layout;
+    return NULL;
+  }
+
+  int nofFields = (int)*dataPtr++;
+  remainingBytes--;
+  PyObject *fieldNames = PyTuple_New(nofFields);
+  for (int i = 0; i < nofFields; i++) {
+    PyConnectLayout *fieldLayout = NULL;
+    std::string fieldName;
+    bool valid = (remainingBytes >= 1);
+    if (valid) {
+      unsigned char typeByte = *dataPtr++;
+      remainingBytes--;
+      PyConnectType::Type type = (PyConnectType::Type)(typeByte & 0x3f);
+      fieldLayout = unpackDeclared(typeByte, dataPtr, remainingBytes, valid,
+                                   depth + 1);
+      layout->fieldTypes.push_back(type);
+      layout->fieldLayouts.push_back(fieldLayout);
+    }
+    if (!valid || !unpackLayoutName(dataPtr, remainingBytes, fieldName)) {
+      ERROR_MSG("PyConnectLayout::unpack: invalid field %d of %s.\n", i,
+                layout->name.c_str());
+      Py_DECREF(fieldNames);
+      delete layout;
+      return NULL;
+    }
+#if PY_MAJOR_VERSION >= 3
+    PyTuple_SET_ITEM(fieldNames, i, PyUnicode_FromString(fieldName.c_str()));
+#else
+    PyTuple_SET_ITEM(fieldNames, i, PyString_FromString(fieldName.c_str()));
+#endif
+  }
+
+  // values of a type that cannot be made a named tuple are plain tuples
+  PyObject *collections = PyImport_ImportModule("collections");
+  PyObject *namedTuple =
+      collections ? PyObject_GetAttrString(collections, "namedtuple") : NULL;
+  if (namedTuple) {
+    PyObject *args = Py_BuildValue("(sO)", layout->name.c_str(), fieldNames);
+    PyObject *kwds = Py_BuildValue("{s:O}", "rename", Py_True);
+    layout->tupleType = PyObject_Call(namedTuple, args, kwds);
+    Py_XDECREF(args);
+    Py_XDECREF(kwds);
+  }
+  if (!layout->tupleType) {
+    ERROR_MSG("PyConnectLayout::unpack: unable to create named tuple for "
+              "%s.\n",
+              layout->name.c_str());
+    PyErr_Clear();
+  }
+  Py_XDECREF(namedTuple);
+  Py_XDECREF(collections);
+  Py_DECREF(fieldNames);
+  return layout;
+}
+
+// composite values are given as any sequence of their fields, a named tuple
+// of the type for instance
+static int validateComposite(PyObject *obj, const PyConnectLayout *layout) {
+#if PY_MAJOR_VERSION >= 3
+  if (!layout || PyUnicode_Check(obj) || PyBytes_Check(obj) ||
+      !PySequence_Check(obj))
+#else
+  if (!layout || PyString_Check(obj) || PyUnicode_Check(obj) ||
+      !PySequence_Check(obj))
+#endif
+    return 0;
+
+  PyObject *seq = PySequence_Fast(obj, "");
+  if (!seq) {
+    PyErr_Clear();
+    return 0;
+  }
+  int total = 0;
+  if ((size_t)PySequence_Fast_GET_SIZE(seq) == layout->fieldTypes.size()) {
+    PyObject **items = PySequence_Fast_ITEMS(seq);
+    for (size_t i = 0; i < layout->fieldTypes.size(); i++) {
+      int size = PyConnectType::validateTypeAndSize(
+          items[i], layout->fieldTypes[i], layout->fieldLayouts[i]);
+      if (!size) {
+        total = 0;
+        break;
+      }
+      total += size;
+    }
+  }
+  Py_DECREF(seq);
+  return total;
+}
+
+static void packComposite(PyObject *arg, const PyConnectLayout *layout,
+                          unsigned char *&dataPtr) {
+  PyObject *seq = PySequence_Fast(arg, "");
+  if (!seq) {
+    PyErr_Clear();
+    return;
+  }
+  PyObject **items = PySequence_Fast_ITEMS(seq);
+  for (size_t i = 0; i < layout->fieldTypes.size(); i++) {
+    PyConnectType::packToStr(items[i], layout->fieldTypes[i], dataPtr,
+                             layout->fieldLayouts[i]);
+  }
+  Py_DECREF(seq);
+}
+
+static PyObject *unpackComposite(const PyConnectLayout *layout,
+                                 unsigned char *&dataPtr,
+                                 int &remainingLength) {
+  int nofFields = (int)layout->fieldTypes.size();
+  PyObject *fields = PyTuple_New(nofFields);
+  for (int i = 0; i < nofFields; i++) {
+    PyObject *field = PyConnectType::unpackStr(
+        layout->fieldTypes[i], dataPtr, remainingLength,
+        layout->fieldLayouts[i]);
+    if (!field) {
+      PyErr_Clear();
+      Py_INCREF(Py_None);
+      field = Py_None;
+    }
+    PyTuple_SET_ITEM(fields, i, field);
+  }
+  if (!layout->tupleType)
+    return fields;
+
+  PyObject *value = PyObject_Call(layout->tupleType, fields, NULL);
+  if (!value) {
+    PyErr_Clear();
+    return fields;
+  }
+  Py_DECREF(fields);
+  return value;
+}
+
+int PyConnectType::validateTypeAndSize(PyObject *obj, Type type,
+                                       const PyConnectLayout *layout) {
   if (!obj) {
     return 0; // just in case we have a NULL pointer
   }
@@ -495,6 +1157,8 @@ int PyConnectType::validateTypeAndSize(PyObject *obj, Type type) {
     if (PyString_Check(obj)) {
       int size = (int)PyString_Size(obj);
 #endif
+      if (size > MAX_STR_LENGTH) // its length cannot be packed
+        return 0;
       return (size + packedIntLen(size));
     }
     break;
@@ -503,7 +1167,32 @@ int PyConnectType::validateTypeAndSize(PyObject *obj, Type type) {
       return 1;
     break;
   case COMPOSITE:
-    return 0; // TODO: not support yet
+    return validateComposite(obj, layout);
+  case INT_ARRAY:
+  case FLOAT_ARRAY:
+  case DOUBLE_ARRAY:
+    return validateArray(obj, type, layout ? layout->length : -1);
+  case BLOB: {
+    // bytes, bytearray or anything else holding a simple buffer
+#if PY_MAJOR_VERSION >= 3
+    if (PyUnicode_Check(obj) || !PyObject_CheckBuffer(obj))
+      return 0;
+    Py_buffer view;
+    if (PyObject_GetBuffer(obj, &view, PyBUF_SIMPLE) < 0) {
+      PyErr_Clear();
+      return 0;
+    }
+    Py_ssize_t size = view.len;
+    PyBuffer_Release(&view);
+#else
+    if (!PyString_Check(obj))
+      return 0;
+    Py_ssize_t size = PyString_Size(obj);
+#endif
+    if (size > PYCONNECT_MSG_MAX_SIZE - 64)
+      return 0;
+    return (int)(sizeof(int) + size);
+  }
   default:
     return 0;
   }
@@ -529,13 +1218,30 @@ PyObject *PyConnectType::defaultValue(Type type) {
   case BOOL:
     Py_RETURN_FALSE;
     break;
+  case INT_ARRAY:
+  case FLOAT_ARRAY:
+  case DOUBLE_ARRAY: {
+    unsigned char *dataPtr = NULL;
+    int remainingLength = 0;
+    return unpackArray(type, 0, dataPtr, remainingLength);
+  } break;
+#if PY_MAJOR_VERSION >= 3
+  case BLOB:
+    return PyBytes_FromStringAndSize("", 0);
+    break;
+#else
+  case BLOB:
+    return PyString_FromStringAndSize("", 0);
+    break;
+#endif
   default:
     Py_RETURN_NONE;
   }
 }
 
 void PyConnectType::packToStr(PyObject *arg, Type type,
-                              unsigned char *&dataPtr) {
+                              unsigned char *&dataPtr,
+                              const PyConnectLayout *layout) {
   switch (type) {
   case INT: {
     int ret = (int)PyInt_AsLong(arg);
@@ -552,7 +1258,7 @@ void PyConnectType::packToStr(PyObject *arg, Type type,
   case STRING: {
 #if PY_MAJOR_VERSION >= 3
     PyObject *unicodeobj = PyUnicode_FromObject(arg);
-    char *ret = PyUnicode_AsUTF8(unicodeobj);
+    const char *ret = PyUnicode_AsUTF8(unicodeobj);
     Py_DECREF(unicodeobj);
 #else
     char *ret = PyString_AsString(arg);
@@ -564,13 +1270,45 @@ void PyConnectType::packToStr(PyObject *arg, Type type,
     (arg == Py_True) ? *dataPtr = 1 : *dataPtr = 0;
     dataPtr++;
     break;
+  case INT_ARRAY:
+  case FLOAT_ARRAY:
+  case DOUBLE_ARRAY:
+    packArray(arg, type, dataPtr);
+    break;
+  case COMPOSITE:
+    if (layout)
+      packComposite(arg, layout, dataPtr);
+    break;
+  case BLOB: {
+#if PY_MAJOR_VERSION >= 3
+    Py_buffer view;
+    if (PyObject_GetBuffer(arg, &view, PyBUF_SIMPLE) < 0) {
+      PyErr_Clear();
+      view.buf = NULL;
+      view.len = 0;
+    }
+    int len = (int)view.len;
+    packToLENumber(len, dataPtr);
+    if (len > 0)
+      memcpy(dataPtr, view.buf, len);
+    dataPtr += len;
+    if (view.buf)
+      PyBuffer_Release(&view);
+#else
+    int len = (int)PyString_Size(arg);
+    packToLENumber(len, dataPtr);
+    memcpy(dataPtr, PyString_AsString(arg), len);
+    dataPtr += len;
+#endif
+  } break;
   default:
     return;
   }
 }
 
 PyObject *PyConnectType::unpackStr(Type type, unsigned char *&dataPtr,
-                                   int &remainingLength) {
+                                   int &remainingLength,
+                                   const PyConnectLayout *layout) {
   switch (type) {
   case INT: {
     int ret = 0;
@@ -588,7 +1326,18 @@ PyObject *PyConnectType::unpackStr(Type type, unsigned char *&dataPtr,
     return PyFloat_FromDouble(ret);
   } break;
   case STRING: {
-    std::string ret = unpackString(dataPtr, remainingLength, true);
+    if (remainingLength < 1) {
+      ERROR_MSG("PyConnectType::unpackStr: truncated string.\n");
+      Py_RETURN_NONE;
+    }
+    std::string ret;
+    const char *str = NULL;
+    int len = unpackStringRef(dataPtr, remainingLength, str, true);
+    if (remainingLength < 0) {
+      ERROR_MSG("PyConnectType::unpackStr: invalid string length %d.\n", len);
+      Py_RETURN_NONE;
+    }
+    ret.assign(str, len);
 #if PY_MAJOR_VERSION >= 3
     return PyUnicode_FromString(ret.c_str());
 #else
@@ -602,6 +1351,52 @@ PyObject *PyConnectType::unpackStr(Type type, unsigned char *&dataPtr,
     else
       Py_RETURN_FALSE;
   } break;
+  case INT_ARRAY:
+  case FLOAT_ARRAY:
+  case DOUBLE_ARRAY: {
+    if (remainingLength < (int)sizeof(int)) {
+      ERROR_MSG("PyConnectType::unpackStr: truncated array.\n");
+      Py_RETURN_NONE;
+    }
+    int count = 0;
+    unpackLENumber(count, dataPtr, remainingLength);
+    // the elements must all be in what is left of the message
+    if (count < 0 || count > remainingLength / arrayElementSize(type)) {
+      ERROR_MSG("PyConnectType::unpackStr: invalid array length %d.\n", count);
+      Py_RETURN_NONE;
+    }
+    PyObject *array = unpackArray(type, count, dataPtr, remainingLength);
+    if (!array) {
+      PyErr_Clear();
+      Py_RETURN_NONE;
+    }
+    return array;
+  } break;
+  case BLOB: {
+    if (remainingLength < (int)sizeof(int)) {
+      ERROR_MSG("PyConnectType::unpackStr: truncated blob.\n");
+      Py_RETURN_NONE;
+    }
+    int len = 0;
+    unpackLENumber(len, dataPtr, remainingLength);
+    if (len < 0 || len > remainingLength) {
+      ERROR_MSG("PyConnectType::unpackStr: invalid blob length %d.\n", len);
+      Py_RETURN_NONE;
+    }
+#if PY_MAJOR_VERSION >= 3
+    PyObject *ret = PyBytes_FromStringAndSize((const char *)dataPtr, len);
+#else
+    PyObject *ret = PyString_FromStringAndSize((const char *)dataPtr, len);
+#endif
+    dataPtr += len;
+    remainingLength -= len;
+    return ret;
+  } break;
+  case COMPOSITE:
+    if (!layout)
+      Py_RETURN_NONE;
+    return unpackComposite(layout, dataPtr, remainingLength);
+    break;
   default:
     Py_RETURN_NONE;
   }
@@ -37,8 +37,11 @@
 #endif
 
 #include "Python.h"
+#include <vector>
 #else
+#include <array>
 #include <functional>
+#include <memory>
 #include <tuple>
 #include <vector>
 #endif
@@ -47,7 +50,22 @@
 #include <string.h>
 #include <string>
 
+// wrapped programs built as C++17 can take std::string_view arguments
+#if __cplusplus >= 201703L || (defined(_MSVC_LANG) && _MSVC_LANG >= 201703L)
+#include <string_view>
+#define PYCONNECT_STRING_VIEW
+#endif
+
 #define PYCONNECT_MSG_BUFFER_SIZE 10240
+#ifndef PYCONNECT_MSG_MAX_SIZE
+#define PYCONNECT_MSG_MAX_SIZE 0x4000000 // 64MB sanity limit per message
+#endif
+#ifndef PYCONNECT_MAX_LAYOUT_DEPTH
+#define PYCONNECT_MAX_LAYOUT_DEPTH 16 // composites nested in composites
+#endif
+#ifndef PYCONNECT_MAX_INFLATE_RATIO
+#define PYCONNECT_MAX_INFLATE_RATIO 1032 // deflate cannot do better
+#endif
 
 #ifdef RELEASE
 #define PYCONNECT_LOGGING_INIT
@@ -137,8 +155,38 @@ namespace pyconnect {
 
 const int MAX_STR_LENGTH = 32767;
 const char PYCONNECT_MSG_INIT = '#';
+const char PYCONNECT_MSG_INIT_V2 = '$';
 const char PYCONNECT_MSG_END = '@';
 
+// stream frame formats:
+// v1: PYCONNECT_MSG_INIT + 16 bit length + data + PYCONNECT_MSG_END
+// v2: PYCONNECT_MSG_INIT_V2 + flags byte + 32 bit length + data +
+//     PYCONNECT_MSG_END
+const int PYCONNECT_FRAME_V1_HEADER_SIZE = 1 + sizeof(short);
+const int PYCONNECT_FRAME_V2_HEADER_SIZE = 2 + sizeof(int);
+const int PYCONNECT_FRAME_V1_MAX_DATA_SIZE = 32767;
+// v2 frame flags. The data of a batch frame decrypts to a run of messages,
+// each preceded by its 32 bit length. A control frame is plain data for the
+// transport itself, starting with a control code, and is never passed on.
+// The data of a sealed frame is AES-256-GCM rather than Blowfish encrypted:
+// nonce, ciphertext and tag. That of a plain frame is not encrypted at all,
+// which only goes to peers that have agreed to it. A checksummed frame
+// ends its data with the LE CRC32C of the rest of it. The data of a
+// compressed frame decrypts to a message or batch compressed with
+// compressMessage.
+const unsigned char PYCONNECT_FRAME_BATCH = 0x1;
+const unsigned char PYCONNECT_FRAME_CONTROL = 0x2;
+const unsigned char PYCONNECT_FRAME_SEALED = 0x4;
+const unsigned char PYCONNECT_FRAME_PLAIN = 0x8;
+const unsigned char PYCONNECT_FRAME_CRC = 0x10;
+const unsigned char PYCONNECT_FRAME_COMPRESSED = 0x20;
+const int PYCONNECT_FRAME_CRC_SIZE = sizeof(unsigned int);
+const int PYCONNECT_CIPHER_BLOCK_SIZE = 8; // Blowfish
+const int PYCONNECT_AEAD_NONCE_SIZE = 12;
+const int PYCONNECT_AEAD_TAG_SIZE = 16;
+const int PYCONNECT_AEAD_OVERHEAD =
+    PYCONNECT_AEAD_NONCE_SIZE + PYCONNECT_AEAD_TAG_SIZE;
+
 typedef enum {
   MODULE_DISCOVERY = 0x1,
   MODULE_DECLARE = 0x2,
@@ -153,9 +201,18 @@ typedef enum {
   MODULE_SHUTDOWN = 0xb,
   SERVER_SHUTDOWN = 0xc,
   PEER_SERVER_DISCOVERY = 0xd, // TODO: to be implemented.
-  PEER_SERVER_MSG = 0xe
+  PEER_SERVER_MSG = 0xe,
+  ATTR_SUBSCRIPTION = 0xf
 } PyConnectMsg;
 
+// first byte of an ATTR_SUBSCRIPTION after the attribute id. A subscription
+// goes on with the deadband (LE double) and minimum interval in
+// microseconds (LE int) of the updates.
+typedef enum {
+  ATTR_UNSUBSCRIBE = 0x0,
+  ATTR_SUBSCRIBE = 0x1
+} PyConnectSubscription;
+
 typedef enum {
   NO_ERRORS = 0x0,
   NO_ATTR_METD = 0x1,
@@ -166,6 +223,10 @@ typedef enum {
   MSG_CORRUPTED = 0xf
 } PyConnectMsgStatus;
 
+#ifdef PYTHON_SERVER
+struct PyConnectLayout;
+#endif
+
 struct PyConnectType {
   typedef enum {
     INT = 0,
@@ -173,23 +234,115 @@ struct PyConnectType {
     DOUBLE = 2, // same as float for Python in fact.
     STRING = 3,
     BOOL = 4,
-    COMPOSITE = 5,
-    PyVOID = 6 // silly window compile breaks if defined as VOID
+    COMPOSITE = 5, // followed by its layout wherever the type is declared
+    PyVOID = 6, // silly window compile breaks if defined as VOID
+    // numeric arrays go as an int count followed by the values
+    INT_ARRAY = 7,
+    FLOAT_ARRAY = 8,
+    DOUBLE_ARRAY = 9,
+    BLOB = 10 // raw bytes, an int length followed by the bytes
   } Type;
 
   static const std::string typeName(const Type type);
   static const Type typeName(const char *type);
 
 #ifdef PYTHON_SERVER
-  static int validateTypeAndSize(PyObject *obj, Type type);
+  // typeName with the longest string or the length of a fixed size array
+  static const std::string typeName(const Type type,
+                                    const PyConnectLayout *layout);
+  // layout is the field layout of COMPOSITE values
+  static int validateTypeAndSize(PyObject *obj, Type type,
+                                 const PyConnectLayout *layout = NULL);
   static PyObject *defaultValue(Type type);
-  static void packToStr(PyObject *arg, Type type, unsigned char *&dataPtr);
+  static void packToStr(PyObject *arg, Type type, unsigned char *&dataPtr,
+                        const PyConnectLayout *layout = NULL);
   static PyObject *unpackStr(Type type, unsigned char *&dataPtr,
-                             int &remainingLength);
+                             int &remainingLength,
+                             const PyConnectLayout *layout = NULL);
 #endif
 };
 
+// a composite type is declared with its layout: the type name as a short
+// string, the number of fields, then for each field its type, the layout of
+// the field if it is composite itself, and its name as a short string.
+// Values are the fields packed one after the other.
+// A fixed size array is declared with PYCONNECT_FIXED_LENGTH set in its
+// type byte, followed by its length as an int.
+const unsigned char PYCONNECT_FIXED_LENGTH = 0x80;
+#ifdef PYTHON_SERVER
+struct PyConnectLayout {
+  std::string name;
+  std::vector<PyConnectType::Type> fieldTypes;
+  std::vector<PyConnectLayout *> fieldLayouts;
+  PyObject *tupleType; // named tuple the values are decoded into
+  int length; // of a fixed size array instead, 0 for a composite
+
+  PyConnectLayout() : tupleType(NULL), length(0) {}
+  ~PyConnectLayout();
+
+  // the layout at dataPtr, or NULL if it runs past the remainingBytes of
+  // the message or nests deeper than PYCONNECT_MAX_LAYOUT_DEPTH
+  static PyConnectLayout *unpack(unsigned char *&dataPtr, int &remainingBytes,
+                                 int depth = 0);
+  // whatever follows the declared typeByte: the layout of a composite, the
+  // length of a fixed size array or nothing (NULL). valid turns false if it
+  // cannot be read.
+  static PyConnectLayout *unpackDeclared(unsigned char typeByte,
+                                         unsigned char *&dataPtr,
+                                         int &remainingBytes, bool &valid,
+                                         int depth = 0);
+};
+#else
+// composite types get their layout from PYCONNECT_STRUCT, fixed size arrays
+// declare their length
+template <typename T> struct pyconnect_layout {
+  static std::string value() { return std::string(); }
+};
+template <typename T, std::size_t N> struct pyconnect_layout<std::array<T, N>> {
+  static std::string value() {
+    std::string length;
+    for (std::size_t i = 0; i < sizeof(int); i++)
+      length += (char)((N >> (8 * i)) & 0xff);
+    return length;
+  }
+};
+
+// the type byte declaring type with layout
+inline unsigned char declaredType(int type, const std::string &layout) {
+  unsigned char typeByte = (unsigned char)(type & 0x3f);
+  if (type != PyConnectType::COMPOSITE && !layout.empty())
+    typeByte |= PYCONNECT_FIXED_LENGTH;
+  return typeByte;
+}
+#endif
+
 #ifndef PYTHON_SERVER
+// raw bytes that travel as a blob. Copies of a blob share its bytes, so a
+// module can publish a buffer it owns, through a blob attribute for
+// instance, without copying it for every update. The bytes must not change
+// while a blob refers to them.
+class PyConnectBlob {
+public:
+  PyConnectBlob() : size_(0) {}
+  PyConnectBlob(const std::shared_ptr<const unsigned char> &data,
+                std::size_t size)
+      : data_(data), size_(size) {}
+  explicit PyConnectBlob(std::vector<unsigned char> &&bytes) : size_(0) {
+    std::shared_ptr<std::vector<unsigned char>> owner =
+        std::make_shared<std::vector<unsigned char>>(std::move(bytes));
+    data_ = std::shared_ptr<const unsigned char>(owner, owner->data());
+    size_ = owner->size();
+  }
+
+  const unsigned char *data() const { return data_.get(); }
+  std::size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+
+private:
+  std::shared_ptr<const unsigned char> data_;
+  std::size_t size_;
+};
+
 template <typename T> struct is_string {
   static constexpr bool value = false;
 };
@@ -207,6 +360,27 @@ template <> struct is_supported<double> : std::true_type {};
 template <> struct is_supported<bool> : std::true_type {};
 template <> struct is_supported<void> : std::true_type {};
 template <> struct is_supported<std::string> : std::true_type {};
+#ifdef PYCONNECT_STRING_VIEW
+template <> struct is_supported<std::string_view> : std::true_type {};
+#endif
+
+// std::vector and std::array of these go as numeric arrays
+template <typename T> struct array_element : std::false_type {};
+template <> struct array_element<int> : std::true_type {
+  static constexpr PyConnectType::Type type = PyConnectType::INT_ARRAY;
+};
+template <> struct array_element<float> : std::true_type {
+  static constexpr PyConnectType::Type type = PyConnectType::FLOAT_ARRAY;
+};
+template <> struct array_element<double> : std::true_type {
+  static constexpr PyConnectType::Type type = PyConnectType::DOUBLE_ARRAY;
+};
+template <typename T>
+struct is_supported<std::vector<T>> : array_element<T> {};
+template <typename T, std::size_t N>
+struct is_supported<std::array<T, N>> : array_element<T> {};
+template <> struct is_supported<std::vector<unsigned char>> : std::true_type {};
+template <> struct is_supported<PyConnectBlob> : std::true_type {};
 
 template <typename T, typename std::enable_if<is_supported<T>{}, int>::type = 0>
 struct pyconnect_type {
@@ -231,6 +405,23 @@ template <> struct pyconnect_type<double> {
 template <> struct pyconnect_type<std::string> {
   static constexpr PyConnectType::Type value = PyConnectType::STRING;
 };
+#ifdef PYCONNECT_STRING_VIEW
+template <> struct pyconnect_type<std::string_view> {
+  static constexpr PyConnectType::Type value = PyConnectType::STRING;
+};
+#endif
+template <typename T> struct pyconnect_type<std::vector<T>> {
+  static constexpr PyConnectType::Type value = array_element<T>::type;
+};
+template <typename T, std::size_t N> struct pyconnect_type<std::array<T, N>> {
+  static constexpr PyConnectType::Type value = array_element<T>::type;
+};
+template <> struct pyconnect_type<std::vector<unsigned char>> {
+  static constexpr PyConnectType::Type value = PyConnectType::BLOB;
+};
+template <> struct pyconnect_type<PyConnectBlob> {
+  static constexpr PyConnectType::Type value = PyConnectType::BLOB;
+};
 
 template <typename T>
 static const PyConnectType::Type getVarType(const T &val) {
@@ -271,6 +462,17 @@ template <> const PyConnectType::Type getVarType(const bool &) {
 template <> const PyConnectType::Type getVarType(const std::string &) {
   return PyConnectType::STRING;
 }
+template <> const PyConnectType::Type getVarType(const PyConnectBlob &) {
+  return PyConnectType::BLOB;
+}
+template <typename T>
+static const PyConnectType::Type getVarType(const std::vector<T> &) {
+  return pyconnect_type<std::vector<T>>::value;
+}
+template <typename T, std::size_t N>
+static const PyConnectType::Type getVarType(const std::array<T, N> &) {
+  return pyconnect_type<std::array<T, N>>::value;
+}
 
 template <> const char *getVarTypeName(const int &) { return "integer"; }
 template <> const char *getVarTypeName(const float &) { return "float"; }
@@ -350,6 +552,17 @@ template <typename F, typename std::enable_if<(F::arity == 0), int>::type = 0,
           std::size_t... Is>
 void get_args_type_list(std::index_sequence<Is...>, std::vector<int> &rtl) {}
 
+// the layouts of the arguments in order, empty but for composite ones
+template <typename F, std::size_t... Is>
+void get_args_layout_list(std::index_sequence<Is...>,
+                          std::vector<std::string> &rll) {
+  int dummy[] = {0, (rll.push_back(pyconnect_layout<typename std::decay<
+                         typename F::template argument<Is>::type>::type>::
+                                      value()),
+                     0)...};
+  (void)dummy;
+}
+
 #endif
 
 template <typename DataType>
@@ -390,13 +603,49 @@ static void unpackLENumber(DataType &val, unsigned char *&dataPtr,
   remainingLength -= dataLength;
 }
 
+// the values of a numeric array in one go, the elements are little endian
+// on the wire like single numbers
+template <typename DataType>
+static void packLEArray(const DataType *values, int count,
+                        unsigned char *&dataPtr) {
+#ifdef WITH_BIG_ENDIAN
+  for (int i = 0; i < count; i++)
+    packToLENumber(values[i], dataPtr);
+#else
+  if (count > 0)
+    memcpy(dataPtr, values, count * sizeof(DataType));
+  dataPtr += count * sizeof(DataType);
+#endif
+}
+
+template <typename DataType>
+static void unpackLEArray(DataType *values, int count, unsigned char *&dataPtr,
+                          int &remainingLength) {
+#ifdef WITH_BIG_ENDIAN
+  for (int i = 0; i < count; i++)
+    unpackLENumber(values[i], dataPtr, remainingLength);
+#else
+  if (count > 0)
+    memcpy(values, dataPtr, count * sizeof(DataType));
+  dataPtr += count * sizeof(DataType);
+  remainingLength -= count * sizeof(DataType);
+#endif
+}
+
 void packString(unsigned char *str, int length, unsigned char *&dataBufPtr,
                 bool extendSize = false);
 std::string unpackString(unsigned char *&dataBufPtr, int &remainingBytes,
                          bool extendSize = false);
+// the same without a copy; str points at the characters in the buffer
+int unpackStringRef(unsigned char *&dataBufPtr, int &remainingBytes,
+                    const char *&str, bool extendSize = false);
 int unpackStrToInt(unsigned char *&str, int &remainingBytes);
 int packIntToStr(int num, unsigned char *&str);
 int packedIntLen(int num);
+// CRC32C (Castagnoli) of data, continuing from crc if given. Uses the CRC
+// instructions of SSE4.2 or ARMv8 where the CPU has them.
+unsigned int crc32c(const unsigned char *data, int length,
+                    unsigned int crc = 0);
 
 #ifdef __cplusplus
 extern "C" {
@@ -409,6 +658,30 @@ int decryptMessage(const unsigned char *origMesg, int origMesgLength,
                    unsigned char **decryptedMesg, int *decryptedMesgLength);
 int encryptMessage(const unsigned char *origMesg, int origMesgLength,
                    unsigned char **encryptedMesg, int *encryptedMesgLength);
+// reentrant forms of the above, writing to the caller's buffer instead of
+// one of the calling thread. It must have room for origMesgLength +
+// PYCONNECT_CIPHER_BLOCK_SIZE bytes; decryption may also be done in place.
+int decryptMessageTo(const unsigned char *origMesg, int origMesgLength,
+                     unsigned char *decryptedMesg, int *decryptedMesgLength);
+int encryptMessageTo(const unsigned char *origMesg, int origMesgLength,
+                     unsigned char *encryptedMesg, int *encryptedMesgLength);
+// AES-256-GCM. sealMessageInPlace needs PYCONNECT_AEAD_NONCE_SIZE bytes of
+// room in front of mesg and PYCONNECT_AEAD_TAG_SIZE bytes behind it, and
+// openMessage leaves the opened message inside sealedMesg.
+int sealMessage(const unsigned char *origMesg, int origMesgLength,
+                unsigned char **sealedMesg, int *sealedMesgLength);
+int sealMessageInPlace(unsigned char *mesg, int mesgLength);
+int openMessage(unsigned char *sealedMesg, int sealedMesgLength,
+                unsigned char **openedMesg, int *openedMesgLength);
+// zlib deflate into a buffer of the calling thread. compressMessage fails
+// unless the result is smaller than the message. decompressMessage fails
+// unless the data inflates to exactly the length it declares, which must
+// be within PYCONNECT_MAX_INFLATE_RATIO of the compressed size.
+int compressMessage(const unsigned char *origMesg, int origMesgLength,
+                    unsigned char **compressedMesg, int *compressedMesgLength);
+int decompressMessage(const unsigned char *origMesg, int origMesgLength,
+                      unsigned char **decompressedMesg,
+                      int *decompressedMesgLength);
 int secureSHA256Hash(const unsigned char *password, const int pwlen,
                      unsigned char *code);
 
@@ -0,0 +1,347 @@
+/*
+ *  PyConnectIOURing.cpp
+ *
+ *  Copyright 2006, 2007 Xun Wang.
+ *  This file is part of PyConnect.
+ *
+ *  PyConnect is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  PyConnect is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef PYCONNECT_USE_IO_URING
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "PyConnectCommon.h"
+#include "PyConnectIOURing.h"
+
+namespace pyconnect {
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+  return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned toSubmit, unsigned minComplete,
+                              unsigned flags) {
+  return (int)syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags,
+                      NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg,
+                                 unsigned nrArgs) {
+  return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nrArgs);
+}
+
+IOURing::IOURing()
+    : ringFD_(-1), sqEntries_(0), cqEntries_(0), sqRing_(MAP_FAILED),
+      sqRingSize_(0), cqRing_(MAP_FAILED), cqRingSize_(0), sqes_(NULL),
+      sqHead_(NULL), sqTail_(NULL), sqMask_(0), sqeTail_(0), cqHead_(NULL),
+      cqTail_(NULL), cqMask_(0), cqes_(NULL), bufRing_(NULL), bufRingSize_(0),
+      buffers_(NULL), bufEntries_(0), bufSize_(0), bufTail_(0),
+      bufferGroup_(0) {}
+
+IOURing::~IOURing() { fini(); }
+
+bool IOURing::init(unsigned entries) {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+
+  ringFD_ = sys_io_uring_setup(entries, &params);
+  if (ringFD_ < 0) {
+    ringFD_ = -1;
+    return false;
+  }
+  sqEntries_ = params.sq_entries;
+  cqEntries_ = params.cq_entries;
+
+  sqRingSize_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cqRingSize_ =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (cqRingSize_ > sqRingSize_)
+      sqRingSize_ = cqRingSize_;
+    cqRingSize_ = 0;
+  }
+
+  sqRing_ = mmap(NULL, sqRingSize_, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, ringFD_, IORING_OFF_SQ_RING);
+  if (sqRing_ == MAP_FAILED) {
+    fini();
+    return false;
+  }
+  if (cqRingSize_ == 0) {
+    cqRing_ = sqRing_;
+  } else {
+    cqRing_ = mmap(NULL, cqRingSize_, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, ringFD_, IORING_OFF_CQ_RING);
+    if (cqRing_ == MAP_FAILED) {
+      fini();
+      return false;
+    }
+  }
+  sqes_ = (struct io_uring_sqe *)mmap(
+      NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFD_,
+      IORING_OFF_SQES);
+  if ((void *)sqes_ == MAP_FAILED) {
+    sqes_ = NULL;
+    fini();
+    return false;
+  }
+
+  char *sqPtr = (char *)sqRing_;
+  sqHead_ = (unsigned *)(sqPtr + params.sq_off.head);
+  sqTail_ = (unsigned *)(sqPtr + params.sq_off.tail);
+  sqMask_ = *(unsigned *)(sqPtr + params.sq_off.ring_mask);
+  sqeTail_ = *sqTail_;
+  // SQEs are always used in ring order, so the index array is fixed
+  unsigned *sqArray = (unsigned *)(sqPtr + params.sq_off.array);
+  for (unsigned i = 0; i < sqEntries_; i++)
+    sqArray[i] = i;
+
+  char *cqPtr = (char *)cqRing_;
+  cqHead_ = (unsigned *)(cqPtr + params.cq_off.head);
+  cqTail_ = (unsigned *)(cqPtr + params.cq_off.tail);
+  cqMask_ = *(unsigned *)(cqPtr + params.cq_off.ring_mask);
+  cqes_ = (struct io_uring_cqe *)(cqPtr + params.cq_off.cqes);
+
+  return true;
+}
+
+void IOURing::fini() {
+  if (bufRing_) {
+    if (ringFD_ != -1) {
+      struct io_uring_buf_reg reg;
+      memset(&reg, 0, sizeof(reg));
+      reg.bgid = bufferGroup_;
+      sys_io_uring_register(ringFD_, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+    }
+    munmap(bufRing_, bufRingSize_);
+    bufRing_ = NULL;
+  }
+  if (buffers_) {
+    delete[] buffers_;
+    buffers_ = NULL;
+  }
+  if (sqes_) {
+    munmap(sqes_, sqEntries_ * sizeof(struct io_uring_sqe));
+    sqes_ = NULL;
+  }
+  if (cqRing_ != MAP_FAILED && cqRing_ != sqRing_)
+    munmap(cqRing_, cqRingSize_);
+  cqRing_ = MAP_FAILED;
+  if (sqRing_ != MAP_FAILED)
+    munmap(sqRing_, sqRingSize_);
+  sqRing_ = MAP_FAILED;
+  if (ringFD_ != -1) {
+    close(ringFD_);
+    ringFD_ = -1;
+  }
+}
+
+bool IOURing::isOpSupported(int op) {
+  size_t probeSize = sizeof(struct io_uring_probe) +
+                     256 * sizeof(struct io_uring_probe_op);
+  struct io_uring_probe *probe = (struct io_uring_probe *)calloc(1, probeSize);
+  if (!probe)
+    return false;
+
+  bool supported =
+      sys_io_uring_register(ringFD_, IORING_REGISTER_PROBE, probe, 256) == 0 &&
+      op <= probe->last_op &&
+      (probe->ops[op].flags & IO_URING_OP_SUPPORTED) != 0;
+  free(probe);
+  return supported;
+}
+
+struct io_uring_sqe *IOURing::getSQE() {
+  unsigned head = __atomic_load_n(sqHead_, __ATOMIC_ACQUIRE);
+  if (sqeTail_ - head >= sqEntries_)
+    return NULL;
+
+  struct io_uring_sqe *sqe = &sqes_[sqeTail_ & sqMask_];
+  memset(sqe, 0, sizeof(*sqe));
+  sqeTail_++;
+  return sqe;
+}
+
+int IOURing::submit(unsigned waitNr) {
+  unsigned toSubmit = sqeTail_ - *sqTail_;
+  __atomic_store_n(sqTail_, sqeTail_, __ATOMIC_RELEASE);
+
+  if (toSubmit == 0 && waitNr == 0)
+    return 0;
+
+  int ret = 0;
+  do {
+    ret = sys_io_uring_enter(ringFD_, toSubmit, waitNr,
+                             waitNr ? IORING_ENTER_GETEVENTS : 0);
+  } while (ret < 0 && errno == EINTR && toSubmit > 0);
+  return ret;
+}
+
+// block until at least one completion is available
+int IOURing::waitCQE() {
+  if (peekCQE())
+    return 0;
+  return sys_io_uring_enter(ringFD_, 0, 1, IORING_ENTER_GETEVENTS);
+}
+
+struct io_uring_cqe *IOURing::peekCQE() {
+  unsigned head = *cqHead_;
+  if (head == __atomic_load_n(cqTail_, __ATOMIC_ACQUIRE))
+    return NULL;
+  return &cqes_[head & cqMask_];
+}
+
+void IOURing::seenCQE() {
+  __atomic_store_n(cqHead_, *cqHead_ + 1, __ATOMIC_RELEASE);
+}
+
+// provided buffers for receives with IOSQE_BUFFER_SELECT. A registered
+// buffer ring is preferred as handing a buffer back is then a plain store;
+// where the kernel does not fill requests from it the buffers are handed
+// over with IORING_OP_PROVIDE_BUFFERS instead, one SQE per returned buffer.
+bool IOURing::setupBufferRing(unsigned short groupID, unsigned entries,
+                              unsigned bufferSize) {
+  bufEntries_ = entries;
+  bufSize_ = bufferSize;
+  bufferGroup_ = groupID;
+  bufTail_ = 0;
+  buffers_ = new unsigned char[entries * bufferSize];
+
+  if (registerBufferRing() && bufferRingWorks())
+    return true;
+
+  if (bufRing_) {
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.bgid = bufferGroup_;
+    sys_io_uring_register(ringFD_, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+    munmap(bufRing_, bufRingSize_);
+    bufRing_ = NULL;
+  }
+  if (!isOpSupported(IORING_OP_PROVIDE_BUFFERS))
+    return false;
+
+  struct io_uring_sqe *sqe = getSQE();
+  if (!sqe)
+    return false;
+  sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+  sqe->fd = (int)entries;
+  sqe->addr = (unsigned long)buffers_;
+  sqe->len = bufSize_;
+  sqe->off = 0;
+  sqe->buf_group = bufferGroup_;
+  if (submit(1) < 0)
+    return false;
+
+  struct io_uring_cqe *cqe = peekCQE();
+  bool provided = cqe && cqe->res >= 0;
+  if (cqe)
+    seenCQE();
+  return provided;
+}
+
+bool IOURing::registerBufferRing() {
+  // entries must be a power of two
+  bufRingSize_ = bufEntries_ * sizeof(struct io_uring_buf);
+  void *ringMem = mmap(NULL, bufRingSize_, PROT_READ | PROT_WRITE,
+                       MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+  if (ringMem == MAP_FAILED)
+    return false;
+
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (unsigned long)ringMem;
+  reg.ring_entries = bufEntries_;
+  reg.bgid = bufferGroup_;
+  if (sys_io_uring_register(ringFD_, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+    munmap(ringMem, bufRingSize_);
+    return false;
+  }
+
+  bufRing_ = (struct io_uring_buf_ring *)ringMem;
+  for (unsigned i = 0; i < bufEntries_; i++) {
+    recycleBuffer((unsigned short)i);
+  }
+  return true;
+}
+
+// some kernels accept the ring registration but never hand out its buffers
+bool IOURing::bufferRingWorks() {
+  int fds[2];
+  if (pipe(fds) < 0)
+    return false;
+
+  bool works = false;
+  struct io_uring_sqe *sqe = getSQE();
+  if (sqe && write(fds[1], "", 1) == 1) {
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fds[0];
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = bufferGroup_;
+    if (submit(1) >= 0) {
+      struct io_uring_cqe *cqe = peekCQE();
+      if (cqe) {
+        unsigned int flags = cqe->flags;
+        works = (cqe->res == 1);
+        seenCQE();
+        if (flags & IORING_CQE_F_BUFFER)
+          recycleBuffer((unsigned short)(flags >> IORING_CQE_BUFFER_SHIFT));
+      }
+    }
+  }
+  close(fds[0]);
+  close(fds[1]);
+  return works;
+}
+
+unsigned char *IOURing::buffer(unsigned short bufferID) {
+  return buffers_ + (size_t)bufferID * bufSize_;
+}
+
+// hand a consumed buffer back to the kernel. Without a buffer ring this
+// queues an SQE that goes out with the next submit.
+bool IOURing::recycleBuffer(unsigned short bufferID) {
+  if (!bufRing_) {
+    struct io_uring_sqe *sqe = getSQE();
+    if (!sqe)
+      return false;
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->fd = 1;
+    sqe->addr = (unsigned long)buffer(bufferID);
+    sqe->len = bufSize_;
+    sqe->off = bufferID;
+    sqe->buf_group = bufferGroup_;
+    return true;
+  }
+  struct io_uring_buf *buf = &bufRing_->bufs[bufTail_ & (bufEntries_ - 1)];
+  buf->addr = (unsigned long)buffer(bufferID);
+  buf->len = bufSize_;
+  buf->bid = bufferID;
+  bufTail_++;
+  __atomic_store_n(&bufRing_->tail, bufTail_, __ATOMIC_RELEASE);
+  return true;
+}
+
+bool IOURing::hasPendingSQEs() { return sqeTail_ != *sqTail_; }
+
+} // namespace pyconnect
+
+#endif // PYCONNECT_USE_IO_URING
@@ -0,0 +1,95 @@
+/*
+ *  PyConnectIOURing.h
+ *
+ *  Copyright 2006, 2007 Xun Wang.
+ *  This file is part of PyConnect.
+ *
+ *  PyConnect is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  PyConnect is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PyConnectIOURing_h_DEFINED
+#define PyConnectIOURing_h_DEFINED
+
+#ifdef PYCONNECT_USE_IO_URING
+
+#include <linux/io_uring.h>
+
+namespace pyconnect {
+
+// minimal io_uring ring driven through the raw system calls, with an
+// optional group of provided buffers for multishot receives. Not thread safe;
+// callers serialise submission and completion handling themselves.
+class IOURing {
+public:
+  IOURing();
+  ~IOURing();
+
+  bool init(unsigned entries);
+  void fini();
+  bool isOpSupported(int op);
+
+  // returns a cleared SQE or NULL when the submission queue is full
+  struct io_uring_sqe *getSQE();
+  // submit queued SQEs and optionally wait for waitNr completions
+  int submit(unsigned waitNr = 0);
+  int waitCQE();
+  struct io_uring_cqe *peekCQE();
+  void seenCQE();
+
+  // true if SQEs were handed out but not submitted yet
+  bool hasPendingSQEs();
+
+  bool setupBufferRing(unsigned short groupID, unsigned entries,
+                       unsigned bufferSize);
+  unsigned char *buffer(unsigned short bufferID);
+  bool recycleBuffer(unsigned short bufferID);
+  unsigned short bufferGroup() const { return bufferGroup_; }
+
+private:
+  bool registerBufferRing();
+  bool bufferRingWorks();
+
+  int ringFD_;
+  unsigned sqEntries_;
+  unsigned cqEntries_;
+
+  void *sqRing_;
+  size_t sqRingSize_;
+  void *cqRing_;
+  size_t cqRingSize_;
+  struct io_uring_sqe *sqes_;
+
+  unsigned *sqHead_;
+  unsigned *sqTail_;
+  unsigned sqMask_;
+  unsigned sqeTail_; // SQEs handed out but not yet published
+
+  unsigned *cqHead_;
+  unsigned *cqTail_;
+  unsigned cqMask_;
+  struct io_uring_cqe *cqes_;
+
+  struct io_uring_buf_ring *bufRing_;
+  size_t bufRingSize_;
+  unsigned char *buffers_;
+  unsigned bufEntries_;
+  unsigned bufSize_;
+  unsigned short bufTail_;
+  unsigned short bufferGroup_;
+};
+
+} // namespace pyconnect
+
+#endif // PYCONNECT_USE_IO_URING
+#endif // PyConnectIOURing_h_DEFINED
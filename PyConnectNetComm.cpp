@@ -29,18 +29,24 @@
 #include <arpa/inet.h>
 #include <dirent.h>
 #include <errno.h>
-#include <fnmatch.h>
+#include <fcntl.h>
 #include <net/if.h>
 #include <netinet/in.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
-#include <sys/sysctl.h>
+#include <sys/uio.h>
 #include <unistd.h>
+#include <signal.h>
 #ifdef LINUX
+#include <poll.h>
 #include <stddef.h>
+#include <sys/inotify.h>
+#include <sys/timerfd.h>
 #endif
 #endif
+#include <chrono>
+#include <new>
 #include "PyConnectNetComm.h"
 
 #ifndef WIN32
@@ -50,9 +56,265 @@
 #ifdef WIN32
 typedef unsigned long in_addr_t;
 #endif
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+#ifndef MSG_DONTWAIT
+#define MSG_DONTWAIT 0
+#endif
 namespace pyconnect {
 
 static int kTCPMSS = 1024;
+static int kMaxReadsPerEvent = 16; // so one busy peer cannot starve others
+#ifndef LINUX
+static long long monotonicUSec() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+#endif
+#ifdef PYCONNECT_USE_REACTOR_SHARDS
+// index of the shard run by the calling thread, -1 for any other thread
+static thread_local int s_currentShard = -1;
+#endif
+// the peer whose full outbound queue the calling thread has to wait for,
+// see waitForOutboundRoom
+static thread_local SOCKET_T s_blockedFD = INVALID_SOCKET;
+// set while the calling thread runs the reactor, which must never wait for
+// a peer to drain its queue
+static thread_local bool s_onReactor = false;
+#ifdef PYCONNECT_USE_SHM
+// codes of the control frames that set up a shared memory channel
+static const unsigned char kControlShmOffer = 0x1;  // + LE ring size
+static const unsigned char kControlShmSwitch = 0x2; // sender uses the ring
+#endif
+// control frame announcing the ciphers and codecs an end takes, one bit
+// each
+static const unsigned char kControlCiphers = 0x3; // + cipher bits
+static const unsigned char kCipherAES256GCM = 0x1;
+static const unsigned char kCipherPlain = 0x2;  // trusted local peers only
+static const unsigned char kCipherCRC32C = 0x4; // plain frames checksummed
+static const unsigned char kCodecDeflate = 0x8; // network peers only
+// capability bits an end appends to its discovery and declaration messages,
+// see negotiationCaps
+static const unsigned char kCapsFramesV2 = 0x1; // reads '$' frames
+// the CRC of a checksummed frame and the end marker
+static const int kMaxFrameTrailerSize = PYCONNECT_FRAME_CRC_SIZE + 1;
+
+// grow a data buffer to hold at least required bytes, keeping the first
+// usedLength bytes intact.
+static bool reserveDataBuffer(unsigned char *&buffer, int &bufferSize,
+                              int usedLength, int required) {
+  if (buffer && bufferSize >= required)
+    return true;
+
+  int newSize = bufferSize > 0 ? bufferSize : PYCONNECT_TCP_BUFFER_SIZE;
+  while (newSize < required)
+    newSize *= 2;
+
+  unsigned char *newBuffer = new (std::nothrow) unsigned char[newSize];
+  if (!newBuffer) {
+    ERROR_MSG("PyConnectNetComm: unable to allocate %d bytes of data buffer.\n",
+              newSize);
+    return false;
+  }
+  if (buffer) {
+    if (usedLength > 0)
+      memcpy(newBuffer, buffer, usedLength);
+    delete[] buffer;
+  }
+  buffer = newBuffer;
+  bufferSize = newSize;
+  return true;
+}
+
+// pack the stream frame header for a message of dataLength bytes and return
+// the header length. v1 frame is used whenever the message fits into it and
+// needs no flags so that older peers can still read us.
+static int packFrameHeader(unsigned char *header, int dataLength,
+                           unsigned char frameFlags = 0) {
+  if (frameFlags & PYCONNECT_FRAME_CRC)
+    dataLength += PYCONNECT_FRAME_CRC_SIZE;
+  if (dataLength <= PYCONNECT_FRAME_V1_MAX_DATA_SIZE && frameFlags == 0) {
+    *header++ = PYCONNECT_MSG_INIT;
+    short opl = (short)dataLength;
+    memcpy(header, &opl, sizeof(short));
+    return PYCONNECT_FRAME_V1_HEADER_SIZE;
+  }
+  *header++ = PYCONNECT_MSG_INIT_V2;
+  *header++ = frameFlags;
+  packToLENumber(dataLength, header);
+  return PYCONNECT_FRAME_V2_HEADER_SIZE;
+}
+
+// pack what follows the message in a frame and return its length: the
+// CRC32C of the message if the frame is checksummed, then the end marker.
+static int packFrameTrailer(unsigned char *trailer, const unsigned char *data,
+                            int dataLength, unsigned char frameFlags = 0) {
+  unsigned char *trailerPtr = trailer;
+  if (frameFlags & PYCONNECT_FRAME_CRC)
+    packToLENumber(crc32c(data, dataLength), trailerPtr);
+  *trailerPtr++ = PYCONNECT_MSG_END;
+  return (int)(trailerPtr - trailer);
+}
+
+// returns 1 when a complete frame header is available, 0 when more data is
+// needed and -1 when the data does not start with a valid frame header.
+static int unpackFrameHeader(unsigned char *data, int dataLength,
+                             int &headerLength, int &frameDataLength,
+                             unsigned char *frameFlags = NULL) {
+  if (dataLength < 1)
+    return 0;
+
+  if (frameFlags)
+    *frameFlags = 0;
+  if (*data == PYCONNECT_MSG_INIT) {
+    headerLength = PYCONNECT_FRAME_V1_HEADER_SIZE;
+    if (dataLength < headerLength)
+      return 0;
+    short dataCount = 0;
+    memcpy(&dataCount, data + 1, sizeof(short));
+    frameDataLength = dataCount;
+  } else if (*data == PYCONNECT_MSG_INIT_V2) {
+    headerLength = PYCONNECT_FRAME_V2_HEADER_SIZE;
+    if (dataLength < headerLength)
+      return 0;
+    if (frameFlags)
+      *frameFlags = data[1];
+    unsigned char *lengthPtr = data + 2;
+    int dummyLen = 0;
+    unpackLENumber(frameDataLength, lengthPtr, dummyLen);
+  } else {
+    return -1;
+  }
+
+  if (frameDataLength < 0 || frameDataLength > PYCONNECT_MSG_MAX_SIZE)
+    return -1;
+
+  return 1;
+}
+
+// the capability bits at the end of a discovery or declaration message, 0
+// if it has none. They sit right before the end marker, where an older end
+// does not look for anything, so only a message one byte longer than its
+// fields add up to has them.
+static unsigned char negotiationCaps(const unsigned char *message, int size) {
+  if (size < 2 || message[size - 1] != PYCONNECT_MSG_END)
+    return 0;
+
+  int length = 1; // header
+  switch ((message[0] >> 4) & 0xf) {
+  case pyconnect::MODULE_DISCOVERY:
+    break;
+  case pyconnect::MODULE_DECLARE: {
+    length++; // module options
+    if (length >= size)
+      return 0;
+    length += 1 + message[length]; // name
+    if (length >= size)
+      return 0;
+    int descLength = message[length++]; // description, extended size
+    if (descLength & 0x80) {
+      if (length >= size)
+        return 0;
+      descLength = message[length++] << 7 | (descLength & 0x7f);
+    }
+    length += descLength;
+  } break;
+  default:
+    return 0;
+  }
+  return (size == length + 2) ? message[length] : 0;
+}
+
+// write a frame out of its three parts with a single call on a non-blocking
+// socket. Returns the number of bytes written, which may be short (or 0 if
+// the socket would block), or -1 on error.
+static int writeFrameParts(SOCKET_T fd, const unsigned char *header,
+                           int headerLength, const unsigned char *data,
+                           int size, const unsigned char *trailer,
+                           int trailerLength) {
+#ifdef WIN32
+  WSABUF bufs[3];
+  bufs[0].buf = (char *)header;
+  bufs[0].len = headerLength;
+  bufs[1].buf = (char *)data;
+  bufs[1].len = size;
+  bufs[2].buf = (char *)trailer;
+  bufs[2].len = trailerLength;
+  DWORD sentBytes = 0;
+  if (WSASend(fd, bufs, 3, &sentBytes, 0, NULL, NULL) != 0) {
+    return (WSAGetLastError() == WSAEWOULDBLOCK) ? 0 : -1;
+  }
+  return (int)sentBytes;
+#else
+  struct iovec iov[3];
+  iov[0].iov_base = (void *)header;
+  iov[0].iov_len = headerLength;
+  iov[1].iov_base = (void *)data;
+  iov[1].iov_len = size;
+  iov[2].iov_base = (void *)trailer;
+  iov[2].iov_len = trailerLength;
+
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = 3;
+
+  ssize_t sentBytes = 0;
+  do {
+    sentBytes = sendmsg(fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+  } while (sentBytes < 0 && errno == EINTR);
+
+  if (sentBytes < 0) {
+    return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+  }
+  return (int)sentBytes;
+#endif
+}
+
+#ifdef PYCONNECT_USE_SHM
+// the shared memory counterpart of writeFrameParts. Returns the number of
+// bytes written, which is short if the peer's ring is full, or -1 if the
+// peer has broken the ring.
+static int writeShmFrameParts(ShmChannel *shm, const unsigned char *header,
+                              int headerLength, const unsigned char *data,
+                              int size, const unsigned char *trailer,
+                              int trailerLength) {
+  struct iovec iov[3];
+  iov[0].iov_base = (void *)header;
+  iov[0].iov_len = headerLength;
+  iov[1].iov_base = (void *)data;
+  iov[1].iov_len = size;
+  iov[2].iov_base = (void *)trailer;
+  iov[2].iov_len = trailerLength;
+  return shm->write(iov, 3);
+}
+#endif
+
+#ifndef WIN32
+// the process id in the name of a server socket, 0 for any other file
+static int serverSocketProcID(const char *name) {
+  size_t prefixLength = strlen(PYCONNECT_CLTSOCKET_PREFIX);
+  if (strncmp(name, PYCONNECT_CLTSOCKET_PREFIX, prefixLength) != 0 ||
+      name[prefixLength] != '.')
+    return 0;
+
+  int procID = (int)strtol(name + prefixLength + 1, (char **)NULL, 10);
+  if (procID <= 0) {
+    ERROR_MSG("socket file name %s contains invalid process number\n", name);
+    return 0;
+  }
+  return procID;
+}
+
+// a signal 0 only checks the process exists, EPERM means it belongs to
+// someone else
+static bool isProcessAlive(int procID) {
+  return kill(procID, 0) == 0 || errno == EPERM;
+}
+#endif
 
 PyConnectNetComm *PyConnectNetComm::s_pPyConnectNetComm = NULL;
 
@@ -65,15 +327,69 @@ PyConnectNetComm *PyConnectNetComm::instance() {
 PyConnectNetComm::PyConnectNetComm()
     : ObjectComm(), pMP_(NULL), udpSocket_(INVALID_SOCKET),
       tcpSocket_(INVALID_SOCKET), domainSocket_(INVALID_SOCKET),
-      dgramBuffer_(NULL), clientDataBuffer_(NULL), dispatchDataBuffer_(NULL),
-      clientFDList_(NULL), maxFD_(0), netCommEnabled_(false),
+      IPCWatchFD_(INVALID_SOCKET), dgramBuffer_(NULL), clientFDList_(NULL),
+      overflowPolicy_(BLOCK_SENDER),
+      maxOutboundQueueBytes_(PYCONNECT_OUTBOUND_QUEUE_SIZE), sendBatchDepth_(0),
+      coalesceWindowUSec_(-1), coalesceTimerFD_(INVALID_SOCKET),
+      coalesceTimerArmed_(false), MPTimerFD_(INVALID_SOCKET),
+      coalesceDue_(0), MPTimerDue_(0), maxFD_(0), netCommEnabled_(false),
       IPCCommEnabled_(false), invalidUDPSock_(false), keepRunning_(true),
-      portInUse_(PYCONNECT_NETCOMM_PORT) {}
+      sealEnabled_(true), IPCPlainEnabled_(true),
+      loopbackPlainEnabled_(false), frameCRCEnabled_(true),
+      compressionEnabled_(true),
+      compressThreshold_(PYCONNECT_COMPRESS_THRESHOLD),
+      portInUse_(PYCONNECT_NETCOMM_PORT)
+#ifdef PYCONNECT_USE_EPOLL
+      ,
+      shards_(NULL), shardCount_(1), nextClientGeneration_(0)
+#endif
+#ifdef PYCONNECT_USE_REACTOR_SHARDS
+      ,
+      requestedShards_(0), shardsStopped_(false)
+#endif
+#ifdef PYCONNECT_USE_SHM
+      ,
+      shmEnabled_(true)
+#endif
+#ifdef PYCONNECT_USE_IO_URING
+      ,
+      uring_(NULL), sendRing_(NULL), sendBatchData_(NULL),
+      sendBatchDataSize_(0), sendBatchDataLength_(0)
+#endif
+{
+#ifdef PYCONNECT_USE_EPOLL
+  shards_ = new ReactorShard[1];
+  resetReactorShard(shards_[0], 0);
+#endif
+#ifdef PYCONNECT_USE_REACTOR_SHARDS
+  pthread_mutex_init(&dispatchMutex_, NULL);
+#endif
+}
 
 PyConnectNetComm::~PyConnectNetComm() {
 #ifdef WIN32
   WSACleanup();
 #endif
+#ifdef PYCONNECT_USE_EPOLL
+  for (int i = 0; i < shardCount_; i++) {
+    ReactorShard &shard = shards_[i];
+    if (shard.epollFD != -1)
+      close(shard.epollFD);
+    if (shard.wakeupFD != -1)
+      close(shard.wakeupFD);
+    delete[] shard.clientFDTable;
+  }
+  delete[] shards_;
+#endif
+#ifdef PYCONNECT_USE_REACTOR_SHARDS
+  pthread_mutex_destroy(&dispatchMutex_);
+#endif
+#ifdef PYCONNECT_USE_IO_URING
+  clearSendBatch();
+  delete uring_;
+  delete sendRing_;
+  delete[] sendBatchData_;
+#endif
 #ifdef MULTI_THREAD
 #ifdef WIN32
   DeleteCriticalSection(&g_criticalSection);
@@ -92,6 +408,66 @@ void PyConnectNetComm::init(MessageProcessor *pMP, FDSetOwner *fdOwner) {
   pFDOwner_ = fdOwner;
   updateMPID();
   FD_ZERO(&masterFDSet_);
+#ifdef PYCONNECT_USE_EPOLL
+  // own main loop users wait on their own fd set, the reactor backends are
+  // for continuousProcessing only. PYCONNECT_IO_BACKEND picks one of
+  // select, epoll or io_uring; each falls back to the next simpler one if
+  // the kernel does not support it. A sharded reactor is always epoll.
+  if (!pFDOwner_ && shards_[0].epollFD == -1) {
+    const char *backend = getenv("PYCONNECT_IO_BACKEND");
+    bool useSelect = backend && !strcmp(backend, "select");
+#ifdef PYCONNECT_USE_REACTOR_SHARDS
+    if (!useSelect && initReactorShards())
+      backend = "epoll";
+#endif
+#ifdef PYCONNECT_USE_IO_URING
+    if (!uring_ && !useSelect && !(backend && !strcmp(backend, "epoll")) &&
+        !initIOURing()) {
+      ERROR_MSG("PyConnectNetComm::init: io_uring is unavailable, "
+                "falling back to epoll.\n");
+    }
+    if (!uring_ && !useSelect && shards_[0].epollFD == -1)
+      initEpoll(shards_[0]);
+#else
+    if (!useSelect && shards_[0].epollFD == -1)
+      initEpoll(shards_[0]);
+#endif
+  }
+#endif
+  // PYCONNECT_COALESCE_USEC turns on message coalescing with the given
+  // flush window, unless setMessageCoalescing has been called already.
+  const char *coalesceWindow = getenv("PYCONNECT_COALESCE_USEC");
+  if (coalesceWindow && coalesceWindowUSec_ < 0 && atoi(coalesceWindow) > 0)
+    coalesceWindowUSec_ = atoi(coalesceWindow);
+  initCoalesceTimer();
+  initMPTimer();
+  // PYCONNECT_SEALED_FRAMES=0 keeps to Blowfish on all connections
+  const char *sealSetting = getenv("PYCONNECT_SEALED_FRAMES");
+  sealEnabled_ = !sealSetting || atoi(sealSetting) != 0;
+  // local connections to processes of our own user go unencrypted, unless
+  // PYCONNECT_IPC_PLAIN=0. PYCONNECT_LOOPBACK_PLAIN=1 does the same for
+  // TCP connections over the loopback interface.
+  const char *plainSetting = getenv("PYCONNECT_IPC_PLAIN");
+  IPCPlainEnabled_ = !plainSetting || atoi(plainSetting) != 0;
+  plainSetting = getenv("PYCONNECT_LOOPBACK_PLAIN");
+  loopbackPlainEnabled_ = plainSetting && atoi(plainSetting) != 0;
+  // plain frames carry a CRC32C of their data if both ends take it, unless
+  // PYCONNECT_FRAME_CRC=0
+  const char *crcSetting = getenv("PYCONNECT_FRAME_CRC");
+  frameCRCEnabled_ = !crcSetting || atoi(crcSetting) != 0;
+  // messages of PYCONNECT_COMPRESS_THRESHOLD bytes or more to network peers
+  // that take it go compressed, unless PYCONNECT_COMPRESSION=0. The
+  // threshold can be changed with PYCONNECT_COMPRESS_THRESHOLD.
+  const char *compressSetting = getenv("PYCONNECT_COMPRESSION");
+  compressionEnabled_ = !compressSetting || atoi(compressSetting) != 0;
+  compressSetting = getenv("PYCONNECT_COMPRESS_THRESHOLD");
+  if (compressSetting && atoi(compressSetting) > 0)
+    compressThreshold_ = atoi(compressSetting);
+#ifdef PYCONNECT_USE_SHM
+  // PYCONNECT_IPC_SHM=0 keeps local connections on their sockets
+  const char *shmSetting = getenv("PYCONNECT_IPC_SHM");
+  shmEnabled_ = !shmSetting || atoi(shmSetting) != 0;
+#endif
 #ifdef PYTHON_SERVER
   enableNetComm();
 #ifndef WIN32
@@ -100,6 +476,101 @@ void PyConnectNetComm::init(MessageProcessor *pMP, FDSetOwner *fdOwner) {
 #endif
 }
 
+#ifdef PYCONNECT_USE_EPOLL
+void PyConnectNetComm::resetReactorShard(ReactorShard &shard, int index) {
+  shard.index = index;
+  shard.epollFD = shard.wakeupFD = -1;
+  shard.clientFDTable = NULL;
+  shard.clientFDTableSize = 0;
+#ifdef PYCONNECT_USE_REACTOR_SHARDS
+  shard.tcpSocket = INVALID_SOCKET;
+  shard.mailbox = NULL;
+  shard.clientCount = 0;
+  shard.cpu = -1;
+#endif
+}
+
+bool PyConnectNetComm::initEpoll(ReactorShard &shard) {
+  shard.epollFD = epoll_create1(EPOLL_CLOEXEC);
+  shard.wakeupFD = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (shard.epollFD == -1 || shard.wakeupFD == -1) {
+    ERROR_MSG("PyConnectNetComm::init: epoll is unavailable, "
+              "falling back to select.\n");
+    if (shard.epollFD != -1)
+      close(shard.epollFD);
+    if (shard.wakeupFD != -1)
+      close(shard.wakeupFD);
+    shard.epollFD = shard.wakeupFD = -1;
+    return false;
+  }
+  struct epoll_event event;
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN;
+  event.data.fd = shard.wakeupFD;
+  epoll_ctl(shard.epollFD, EPOLL_CTL_ADD, shard.wakeupFD, &event);
+  return true;
+}
+#endif
+
+#ifdef PYCONNECT_USE_REACTOR_SHARDS
+// spread connections over count reactor threads, optionally pinned to the
+// given cpus. Must be called before init; PYCONNECT_REACTOR_THREADS and
+// PYCONNECT_REACTOR_CPUS (a comma separated cpu list) do the same from the
+// environment.
+void PyConnectNetComm::setReactorThreads(int count, const int *cpus) {
+  requestedShards_ = count > 0 ? count : 1;
+  requestedShardCPUs_.clear();
+  for (int i = 0; cpus && i < requestedShards_; i++)
+    requestedShardCPUs_.push_back(cpus[i]);
+}
+
+// set up the shards if more than one reactor thread is asked for. Returns
+// false for a single reactor.
+bool PyConnectNetComm::initReactorShards() {
+  int count = requestedShards_;
+  if (count == 0) {
+    const char *threads = getenv("PYCONNECT_REACTOR_THREADS");
+    count = threads ? atoi(threads) : 1;
+    const char *cpus = getenv("PYCONNECT_REACTOR_CPUS");
+    while (cpus && *cpus) {
+      char *end = NULL;
+      long cpu = strtol(cpus, &end, 10);
+      if (end == cpus)
+        break;
+      requestedShardCPUs_.push_back((int)cpu);
+      cpus = (*end == ',') ? end + 1 : end;
+    }
+  }
+  if (count > PYCONNECT_MAX_REACTOR_THREADS)
+    count = PYCONNECT_MAX_REACTOR_THREADS;
+  if (count <= 1)
+    return false;
+
+  ReactorShard *shards = new ReactorShard[count];
+  int ready = 0;
+  for (; ready < count; ready++) {
+    resetReactorShard(shards[ready], ready);
+    if (ready < (int)requestedShardCPUs_.size())
+      shards[ready].cpu = requestedShardCPUs_[ready];
+    if (!initEpoll(shards[ready]))
+      break;
+  }
+  if (ready < count) {
+    for (int i = 0; i < ready; i++) {
+      close(shards[i].epollFD);
+      close(shards[i].wakeupFD);
+    }
+    delete[] shards;
+    return false;
+  }
+  delete[] shards_;
+  shards_ = shards;
+  shardCount_ = count;
+  INFO_MSG("Running %d reactor threads\n", shardCount_);
+  return true;
+}
+#endif
+
 bool PyConnectNetComm::initUDPListener() {
   if ((udpSocket_ = socket(AF_INET, SOCK_DGRAM, 0)) == INVALID_SOCKET) {
     ERROR_MSG(
@@ -182,14 +653,7 @@ bool PyConnectNetComm::initUDPListener() {
     return false;
   }
 
-#ifdef WIN32
-  maxFD_++;
-#else
-  maxFD_ = max(maxFD_, udpSocket_);
-#endif
-  FD_SET(udpSocket_, &masterFDSet_);
-  if (pFDOwner_)
-    pFDOwner_->setFD(udpSocket_);
+  watchFD(udpSocket_);
 
   if (dgramBuffer_ == NULL)
     dgramBuffer_ = new unsigned char[PYCONNECT_UDP_BUFFER_SIZE];
@@ -237,6 +701,19 @@ bool PyConnectNetComm::initTCPListener() {
 
   portInUse_ = sAddr_.sin_port; // now in network byte order
 
+#ifdef PYCONNECT_USE_REACTOR_SHARDS
+  // the port is picked without SO_REUSEPORT so that it is not shared with
+  // another process; only then may the other shards bind to it as well.
+  if (shardCount_ > 1 &&
+      setsockopt(tcpSocket_, SOL_SOCKET, SO_REUSEPORT, (char *)&turnon,
+                 sizeof(turnon)) < 0) {
+    ERROR_MSG("PyConnectNetComm::initTCPListener: failed to enable reuse port "
+              "option on TCP socket.\n");
+    close(tcpSocket_);
+    return false;
+  }
+#endif
+
   if (listen(tcpSocket_, 5) < 0) {
     ERROR_MSG("PyConnectNetComm::initTCPListener: unable to listen for "
               "incoming data.\n");
@@ -249,285 +726,2766 @@ bool PyConnectNetComm::initTCPListener() {
   }
 
   INFO_MSG("Listening on TCP port %d\n", ntohs(portInUse_) & 0xffff);
-#ifdef WIN32
-  maxFD_++;
-#else
-  maxFD_ = max(maxFD_, tcpSocket_);
+  watchFD(tcpSocket_);
+#ifdef PYCONNECT_USE_REACTOR_SHARDS
+  for (int i = 1; i < shardCount_; i++) {
+    if (!initShardListener(shards_[i])) {
+      closeShardListeners();
+      unwatchFD(tcpSocket_);
+      close(tcpSocket_);
+      return false;
+    }
+  }
 #endif
-  FD_SET(tcpSocket_, &masterFDSet_);
-  if (pFDOwner_)
-    pFDOwner_->setFD(tcpSocket_);
 
-  if (clientDataBuffer_ == NULL)
-    clientDataBuffer_ = new unsigned char[PYCONNECT_TCP_BUFFER_SIZE];
+  return true;
+}
+
+#ifdef PYCONNECT_USE_REACTOR_SHARDS
+// each shard accepts on a listener of its own bound to the same port, so
+// the kernel spreads incoming connections over the reactor threads.
+bool PyConnectNetComm::initShardListener(ReactorShard &shard) {
+  shard.tcpSocket = socket(AF_INET, SOCK_STREAM, 0);
+  if (shard.tcpSocket == INVALID_SOCKET) {
+    ERROR_MSG("PyConnectNetComm::initShardListener: unable to create TCP "
+              "socket.\n");
+    return false;
+  }
 
-  if (dispatchDataBuffer_ == NULL)
-    dispatchDataBuffer_ = new unsigned char[PYCONNECT_MSG_BUFFER_SIZE];
+  int turnon = 1;
+  struct sockaddr_in addr = sAddr_; // sin_port is portInUse_ by now
+  if (setsockopt(shard.tcpSocket, SOL_SOCKET, SO_REUSEADDR, (char *)&turnon,
+                 sizeof(turnon)) < 0 ||
+      setsockopt(shard.tcpSocket, SOL_SOCKET, SO_REUSEPORT, (char *)&turnon,
+                 sizeof(turnon)) < 0 ||
+      bind(shard.tcpSocket, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(shard.tcpSocket, 5) < 0) {
+    ERROR_MSG("PyConnectNetComm::initShardListener: unable to share TCP port "
+              "%d with reactor thread %d error = %d\n",
+              ntohs(portInUse_) & 0xffff, shard.index, errno);
+    close(shard.tcpSocket);
+    shard.tcpSocket = INVALID_SOCKET;
+    return false;
+  }
 
+  struct epoll_event event;
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN;
+  event.data.fd = shard.tcpSocket;
+  epoll_ctl(shard.epollFD, EPOLL_CTL_ADD, shard.tcpSocket, &event);
   return true;
 }
 
-void PyConnectNetComm::processIncomingData(fd_set *readyFDSet) {
-  struct sockaddr_in cAddr;
-  int cLen = sizeof(cAddr);
-  SOCKET_T fd = INVALID_SOCKET;
+void PyConnectNetComm::closeShardListeners() {
+  for (int i = 1; i < shardCount_; i++) {
+    ReactorShard &shard = shards_[i];
+    if (shard.tcpSocket == INVALID_SOCKET)
+      continue;
+    epoll_ctl(shard.epollFD, EPOLL_CTL_DEL, shard.tcpSocket, NULL);
+    close(shard.tcpSocket);
+    shard.tcpSocket = INVALID_SOCKET;
+  }
+}
+#endif
 
-  if (netCommEnabled_) {
-    if (FD_ISSET(udpSocket_, readyFDSet)) {
-      int readLen = (int)recvfrom(udpSocket_, (char *)dgramBuffer_,
-                                  PYCONNECT_UDP_BUFFER_SIZE, 0,
-                                  (sockaddr *)&cAddr, (socklen_t *)&cLen);
-      if (readLen <= 0) {
-        ERROR_MSG("PyConnectNetComm::continuousProcessing: error accepting "
-                  "incoming UDP packet. error %d\n",
-                  errno);
-      } else {
-        processUDPInput(dgramBuffer_, readLen, cAddr);
-      }
-    }
-    if (FD_ISSET(tcpSocket_, readyFDSet)) {
-      // accept incoming TCP connection and read the stream
-      fd = accept(tcpSocket_, (sockaddr *)&cAddr, (socklen_t *)&cLen);
-      if (fd != INVALID_SOCKET) {
-        addFdToClientList(fd, PyConnectNetComm::NETWORK, &cAddr);
-      }
-#ifdef WIN32
-      else if (errno != WSAECONNABORTED) {
+void PyConnectNetComm::processIncomingData(fd_set *readyFDSet) {
+  bool wasOnReactor = s_onReactor;
+  s_onReactor = true;
+  // push out whatever is queued on connections that were not writable
+  // earlier. This is the only place queues drain under own main loop.
+  flushOutboundQueues();
+#ifdef LINUX
+  if (coalesceTimerFD_ != INVALID_SOCKET &&
+      FD_ISSET(coalesceTimerFD_, readyFDSet))
+    processCoalesceTimer();
+  if (MPTimerFD_ != INVALID_SOCKET && FD_ISSET(MPTimerFD_, readyFDSet))
+    processMPTimer();
 #else
-      else if (errno != ECONNABORTED) {
+  processDueTimers();
 #endif
-        ERROR_MSG("PyConnectNetComm::continuousProcessing: error accepting "
-                  "incoming TCP connection error = %d\n",
-                  errno);
-      }
-    }
+
+  if (netCommEnabled_) {
+    if (FD_ISSET(udpSocket_, readyFDSet))
+      processUDPSocket();
+    if (FD_ISSET(tcpSocket_, readyFDSet))
+      acceptClient(tcpSocket_, PyConnectNetComm::NETWORK);
   }
-  if (IPCCommEnabled_ && FD_ISSET(domainSocket_, readyFDSet)) {
-    // accept incoming local socket connection and read the stream
-    fd = accept(domainSocket_, (sockaddr *)&cAddr, (socklen_t *)&cLen);
-    if (fd != INVALID_SOCKET) {
-      addFdToClientList(fd, PyConnectNetComm::LOCALIPC, &cAddr);
-    }
-#ifdef WIN32
-    else if (errno != WSAECONNABORTED) {
-#else
-    else if (errno != ECONNABORTED) {
+  if (IPCCommEnabled_ && FD_ISSET(domainSocket_, readyFDSet))
+    acceptClient(domainSocket_, PyConnectNetComm::LOCALIPC);
+#ifndef WIN32
+  if (IPCWatchFD_ != INVALID_SOCKET && FD_ISSET(IPCWatchFD_, readyFDSet))
+    processIPCWatch();
 #endif
-      ERROR_MSG("PyConnectNetComm::continuousProcessing: error accepting "
-                "incoming local IPC connection error = %d\n",
-                errno);
-    }
-  }
 
   ClientFD *FDPtr = clientFDList_;
   ClientFD *prevFDPtr = FDPtr;
   while (FDPtr) {
-    fd = FDPtr->fd;
-    if (FD_ISSET(fd, readyFDSet)) {
-#ifdef WIN32
-      int readLen = recv(fd, (char *)clientDataBuffer_, kTCPMSS, 0);
-#else
-      int readLen = (int)read(fd, clientDataBuffer_, kTCPMSS);
+#ifdef PYCONNECT_USE_SHM
+    if (FDPtr->shm && FD_ISSET(FDPtr->shm->bellFD(), readyFDSet) &&
+        !processShmBell(FDPtr)) {
+      destroyCurrentClient(FDPtr, prevFDPtr);
+      continue;
+    }
 #endif
-      if (readLen <= 0) {
-        if (readLen == 0) {
-          INFO_MSG("Socket connection %d closed.\n", fd);
-        } else {
-          ERROR_MSG("PyConnectNetComm::continuousProcessing: "
-                    "error reading data stream on %d error = %d.\n",
-                    fd, errno);
-        }
-
-        objCommChannelShutdown(fd, true);
-        destroyCurrentClient(FDPtr, prevFDPtr);
-        continue;
-      } else {
-#ifdef MULTI_THREAD
-#ifdef WIN32
-        EnterCriticalSection(&g_criticalSection);
-#else
-        pthread_mutex_lock(&g_mutex);
-#endif
-#endif
-        setLastUsedCommChannel(fd);
-        // DEBUG_MSG( "receive data from fd %d\n", fd );
-#ifdef MULTI_THREAD
-#ifdef WIN32
-        LeaveCriticalSection(&g_criticalSection);
-#else
-        pthread_mutex_unlock(&g_mutex);
-#endif
-#endif
-        MesgProcessResult procResult = MESG_PROCESSED_OK;
-        unsigned char *dataPtr = clientDataBuffer_;
-
-        do {
-          if (*dataPtr == PYCONNECT_MSG_INIT &&
-              FDPtr->dataInfo.expectedDataLength == 0) { // new message
-            if (readLen < 4) {
-              ERROR_MSG("PyConnectNetComm::continuousProcessing: "
-                        "invalid data packet in stream on %d (too small).\n",
-                        fd);
-              break;
-            }
-            dataPtr++;
-            short dataCount = 0;
-            memcpy(&dataCount, dataPtr, sizeof(short));
-            dataPtr += sizeof(short);
-            readLen -= 3;
-            if (dataCount < 0 ||
-                dataCount >
-                    PYCONNECT_MSG_BUFFER_SIZE) { // encryption buffer size
-              ERROR_MSG("PyConnectNetComm::continuousProcessing: "
-                        "invalid data size in stream on %d.\n",
-                        fd);
-              break;
-            } else if (dataCount >
-                       (readLen - 1)) { // the message needs multiple reads
-              FDPtr->dataInfo.bufferedDataLength = readLen;
-              memcpy(FDPtr->dataInfo.bufferedData, dataPtr,
-                     FDPtr->dataInfo.bufferedDataLength);
-              FDPtr->dataInfo.expectedDataLength =
-                  dataCount - FDPtr->dataInfo.bufferedDataLength;
-              readLen = 0;
-            } else if (*(dataPtr + dataCount) ==
-                       PYCONNECT_MSG_END) { // valid message
-              pMP_->processInput(dataPtr, dataCount, FDPtr->cAddr);
-              readLen -= (dataCount + 1);
-              dataPtr += (dataCount + 1);
-            } else {
-              ERROR_MSG("PyConnectNetComm::continuousProcessing: "
-                        "invalid data packet in stream on %d.\n",
-                        fd);
-              break;
-            }
-          } else if (FDPtr->dataInfo.expectedDataLength >
-                     0) { // patch up cached data
-            unsigned char *cachedPtr = FDPtr->dataInfo.bufferedData +
-                                       FDPtr->dataInfo.bufferedDataLength;
-            if (FDPtr->dataInfo.expectedDataLength >
-                (readLen - 1)) { // continue to cache
-              memcpy(cachedPtr, dataPtr, readLen);
-              FDPtr->dataInfo.bufferedDataLength += readLen;
-              FDPtr->dataInfo.expectedDataLength -= readLen;
-              readLen = 0;
-            } else if (*(dataPtr + FDPtr->dataInfo.expectedDataLength) ==
-                       PYCONNECT_MSG_END) { // valid message
-              memcpy(cachedPtr, dataPtr, FDPtr->dataInfo.expectedDataLength);
-              pMP_->processInput(FDPtr->dataInfo.bufferedData,
-                                 FDPtr->dataInfo.bufferedDataLength +
-                                     FDPtr->dataInfo.expectedDataLength,
-                                 FDPtr->cAddr);
-
-              readLen -= (FDPtr->dataInfo.expectedDataLength + 1);
-              if (readLen > 0) {
-                dataPtr += (FDPtr->dataInfo.expectedDataLength + 1);
-              }
-              FDPtr->dataInfo.bufferedDataLength = 0;
-              FDPtr->dataInfo.expectedDataLength = 0;
-            } else {
-              ERROR_MSG("PyConnectNetComm::continuousProcessing: "
-                        "unexpected data fragment in data stream on %d.\n",
-                        fd);
-              FDPtr->dataInfo.bufferedDataLength = 0;
-              FDPtr->dataInfo.expectedDataLength = 0;
-              break;
-            }
-          } else {
-            ERROR_MSG("PyRideNetComm::continuousProcessing: "
-                      "invalid data stream on %d.\n",
-                      fd);
-            FDPtr->dataInfo.bufferedDataLength = 0;
-            FDPtr->dataInfo.expectedDataLength = 0;
-            break;
-          }
-        } while (readLen > 0);
-
-        if (procResult == MESG_TO_SHUTDOWN) {
-          objCommChannelShutdown(fd);
-          destroyCurrentClient(FDPtr, prevFDPtr);
-          continue;
-        }
-      }
+    if (FD_ISSET(FDPtr->fd, readyFDSet) && !processClientInput(FDPtr)) {
+      destroyCurrentClient(FDPtr, prevFDPtr);
+      continue;
     }
     prevFDPtr = FDPtr;
     FDPtr = FDPtr->pNext;
   }
+  s_onReactor = wasOnReactor;
 }
 
-void PyConnectNetComm::continuousProcessing() {
-  int maxFD = 0;
-  fd_set readyFDSet;
+void PyConnectNetComm::processUDPSocket() {
+  struct sockaddr_in cAddr;
+  int cLen = sizeof(cAddr);
 
-  while (keepRunning_) {
-    FD_ZERO(&readyFDSet);
-    memcpy(&readyFDSet, &masterFDSet_, sizeof(masterFDSet_));
-    maxFD = maxFD_;
+  int readLen =
+      (int)recvfrom(udpSocket_, (char *)dgramBuffer_, PYCONNECT_UDP_BUFFER_SIZE,
+                    0, (sockaddr *)&cAddr, (socklen_t *)&cLen);
+  if (readLen <= 0) {
+    ERROR_MSG("PyConnectNetComm::continuousProcessing: error accepting "
+              "incoming UDP packet. error %d\n",
+              errno);
+  } else {
+    processUDPInput(dgramBuffer_, readLen, cAddr);
+  }
+}
 
-#ifdef MULTI_THREAD
-    struct timeval timeout;
-    timeout.tv_sec = 0;
-    timeout.tv_usec = 200000; // 200ms
-#endif
+// accept incoming TCP or local socket connection and read the stream
+void PyConnectNetComm::acceptClient(SOCKET_T listenSocket, FDDomain domain) {
+  struct sockaddr_in cAddr;
+  int cLen = sizeof(cAddr);
 
-    // we must be able to interrupt select since masterFDSet_ might
-    // be updated by the main thread (i.e. calling PyConnect.connect).
-    // For this we use timeout as a solution. NOTE: an alternative
-    // solution for POSIX system might be that still using block select
-    // but send a signal from main thread to interrupt it when connect
-    // is completed.
-#if defined(MULTI_THREAD)
-    select(maxFD + 1, &readyFDSet, NULL, NULL, &timeout);
+  SOCKET_T fd = accept(listenSocket, (sockaddr *)&cAddr, (socklen_t *)&cLen);
+  if (fd != INVALID_SOCKET) {
+    addFdToClientList(fd, domain, &cAddr, 0, true);
+  }
+#ifdef WIN32
+  else if (errno != WSAECONNABORTED) {
 #else
-    select(maxFD + 1, &readyFDSet, NULL, NULL, NULL); // blocking select
+  else if (errno != ECONNABORTED) {
 #endif
+    ERROR_MSG("PyConnectNetComm::continuousProcessing: error accepting "
+              "incoming %s connection error = %d\n",
+              domain == PyConnectNetComm::NETWORK ? "TCP" : "local IPC", errno);
+  }
+}
 
-    this->processIncomingData(&readyFDSet);
+// read and dispatch data on a readable client, or data already received
+// on its behalf if given. Returns false if the client has gone and must be
+// destroyed.
+bool PyConnectNetComm::processClientInput(ClientFD *FDPtr, unsigned char *data,
+                                          int length) {
+  SOCKET_T fd = FDPtr->fd;
+  MesgProcessResult procResult = MESG_PROCESSED_OK;
+  bool received = data ? receiveBufferedData(FDPtr, data, length, procResult)
+                       : receiveClientData(FDPtr, procResult);
+  if (!received) {
+    objCommChannelShutdown(fd, true);
+    return false;
+  } else if (procResult == MESG_TO_SHUTDOWN) {
+    objCommChannelShutdown(fd);
+    return false;
   }
+  return true;
 }
 
-void PyConnectNetComm::dataPacketSender(const unsigned char *data, int size,
-                                        bool broadcast) {
-  if (broadcast) {
-    // a hack job to pass on TCP port in use in declaration messages
-    int msgType = verifyNegotiationMsg(data, size);
-    if (msgType == pyconnect::MODULE_DISCOVERY ||
-        msgType == pyconnect::MODULE_DECLARE) {
-      if (netCommEnabled_) {
-        unsigned char *modData = new unsigned char[size + sizeof(short)];
-        memcpy(modData, data, size - 1); // exclude message end char
-        unsigned char *modDataPtr = modData + size - 1;
-        memcpy(modDataPtr, (unsigned char *)&portInUse_, sizeof(short));
-        modDataPtr += sizeof(short);
-        *modDataPtr = pyconnect::PYCONNECT_MSG_END;
-        netBroadcastSend(modData, size + sizeof(short));
-        delete[] modData;
-      }
-      if (IPCCommEnabled_) {
-        localBroadcastSend(data, size);
-      }
-    } else {
-      if (netCommEnabled_)
-        netBroadcastSend(data, size);
-      if (IPCCommEnabled_)
-        localBroadcastSend(data, size);
+// hand all complete frames in data over to the message processor and
+// return the number of bytes consumed, or -1 if the stream is corrupted.
+int PyConnectNetComm::extractFrames(ClientFD *FDPtr, unsigned char *data,
+                                    int dataLength,
+                                    MesgProcessResult &procResult) {
+  unsigned char *dataPtr = data;
+  int remainingLength = dataLength;
+
+  while (remainingLength > 0 && procResult != MESG_TO_SHUTDOWN) {
+    int headerLength = 0;
+    int frameDataLength = 0;
+    unsigned char frameFlags = 0;
+    int ret = unpackFrameHeader(dataPtr, remainingLength, headerLength,
+                                frameDataLength, &frameFlags);
+    if (ret < 0) {
+      return -1;
+    } else if (ret == 0 ||
+               remainingLength < headerLength + frameDataLength + 1) {
+      break; // incomplete frame
     }
-  } else {
-    clientDataSend(data, size);
+    if (dataPtr[headerLength + frameDataLength] != PYCONNECT_MSG_END) {
+      return -1;
+    }
+    procResult = processFrame(FDPtr, dataPtr + headerLength, frameDataLength,
+                              frameFlags);
+    dataPtr += headerLength + frameDataLength + 1;
+    remainingLength -= headerLength + frameDataLength + 1;
   }
+  return dataLength - remainingLength;
 }
 
-void PyConnectNetComm::netBroadcastSend(const unsigned char *data, int size) {
-  if (size <= 0)
-    return;
+// hand the message in a frame, or each of those in a batch frame, over to
+// the message processor.
+MesgProcessResult PyConnectNetComm::processFrame(ClientFD *FDPtr,
+                                                 unsigned char *data,
+                                                 int length,
+                                                 unsigned char frameFlags) {
+  // a checksummed frame is checked and its CRC stripped before anything
+  // else looks at it
+  if (frameFlags & PYCONNECT_FRAME_CRC) {
+    if (length < PYCONNECT_FRAME_CRC_SIZE) {
+      WARNING_MSG("Truncated checksummed frame on %d, dropped.\n", FDPtr->fd);
+      return MESG_PROCESSED_OK;
+    }
+    length -= PYCONNECT_FRAME_CRC_SIZE;
+    unsigned char *crcPtr = data + length;
+    int remainingLength = PYCONNECT_FRAME_CRC_SIZE;
+    unsigned int frameCRC = 0;
+    unpackLENumber(frameCRC, crcPtr, remainingLength);
+    if (crc32c(data, length) != frameCRC) {
+      ERROR_MSG("PyConnectNetComm::processFrame: CRC mismatch on %d, frame "
+                "of %d bytes dropped.\n",
+                FDPtr->fd, length);
+      return MESG_PROCESSED_OK;
+    }
+  }
+  if (frameFlags & PYCONNECT_FRAME_CONTROL)
+    return processControlFrame(FDPtr, data, length);
+
+  // a sealed frame is opened where it is, what it holds is passed on as is,
+  // as is that of a plain frame from a peer allowed to send those. Any
+  // other frame is decrypted here rather than by the message processor,
+  // with the cipher state of this thread, so that shards only take turns
+  // for the message processor itself.
+  if (frameFlags & PYCONNECT_FRAME_PLAIN) {
+    if (!FDPtr->trusted) {
+      WARNING_MSG("Unexpected plain frame on %d, dropped.\n", FDPtr->fd);
+      return MESG_PROCESSED_OK;
+    }
+  } else if (frameFlags & PYCONNECT_FRAME_SEALED) {
+    if (openMessage(data, length, &data, &length) != 1) {
+      WARNING_MSG("Unable to open incoming sealed frame on %d.\n", FDPtr->fd);
+      return MESG_PROCESSED_OK;
+    }
+  } else if (decryptMessageTo(data, length, data, &length) != 1) {
+    WARNING_MSG("Unable to decrypt incoming frame on %d.\n", FDPtr->fd);
+    return MESG_PROCESSED_OK;
+  }
+  // a compressed frame is inflated into a buffer of this thread first
+  if ((frameFlags & PYCONNECT_FRAME_COMPRESSED) &&
+      decompressMessage(data, length, &data, &length) != 1) {
+    WARNING_MSG("Unable to decompress incoming frame on %d.\n", FDPtr->fd);
+    return MESG_PROCESSED_OK;
+  }
 
-  unsigned char *outputData = NULL;
-  int outputLength = 0;
+  if (frameFlags & PYCONNECT_FRAME_BATCH)
+    return processBatchFrame(FDPtr, data, length);
+  if (!FDPtr->framesV2 && (negotiationCaps(data, length) & kCapsFramesV2))
+    notePeerFramesV2(FDPtr->fd);
+  return processMessage(FDPtr, data, length, true);
+}
+
+// hand one message over to the message processor. Replies to it go out on
+// the last used channel.
+MesgProcessResult PyConnectNetComm::processMessage(ClientFD *FDPtr,
+                                                   unsigned char *data,
+                                                   int length,
+                                                   bool skipdecrypt) {
+#ifdef PYCONNECT_USE_REACTOR_SHARDS
+  // the message processor is not reentrant, so the shards take turns for
+  // it; this also keeps them from moving the last used channel while
+  // another one is processing. Everything up to here, reading, checking,
+  // decrypting and inflating frames, runs on the shards in parallel.
+  bool sharded = shardCount_ > 1;
+  if (sharded)
+    pthread_mutex_lock(&dispatchMutex_);
+#endif
+#ifdef MULTI_THREAD
+#ifdef WIN32
+  EnterCriticalSection(&g_criticalSection);
+#else
+  pthread_mutex_lock(&g_mutex);
+#endif
+#endif
+  setLastUsedCommChannel(FDPtr->fd);
+  // DEBUG_MSG( "receive data from fd %d\n", FDPtr->fd );
+#ifdef MULTI_THREAD
+#ifdef WIN32
+  LeaveCriticalSection(&g_criticalSection);
+#else
+  pthread_mutex_unlock(&g_mutex);
+#endif
+#endif
+  MesgProcessResult result =
+      pMP_->processInput(data, length, FDPtr->cAddr, skipdecrypt);
+#ifdef PYCONNECT_USE_REACTOR_SHARDS
+  if (sharded)
+    pthread_mutex_unlock(&dispatchMutex_);
+#endif
+  return result;
+}
+
+// a batch frame is encrypted as a whole and has been opened by now. Hand
+// the messages in it over one by one, as if each had come in a frame of its
+// own. A malformed batch is dropped from where it goes wrong.
+MesgProcessResult PyConnectNetComm::processBatchFrame(ClientFD *FDPtr,
+                                                      unsigned char *data,
+                                                      int length) {
+  unsigned char *batch = data;
+  int batchLength = length;
+
+  MesgProcessResult result = MESG_PROCESSED_OK;
+  while (batchLength > 0 && result != MESG_TO_SHUTDOWN) {
+    int mesgLength = 0;
+    if (batchLength < (int)sizeof(int))
+      mesgLength = -1;
+    else
+      unpackLENumber(mesgLength, batch, batchLength);
+    if (mesgLength <= 0 || mesgLength > batchLength) {
+      ERROR_MSG("PyConnectNetComm::processBatchFrame: invalid batch of "
+                "messages on %d.\n",
+                FDPtr->fd);
+      break;
+    }
+    result = processMessage(FDPtr, batch, mesgLength, true);
+    batch += mesgLength;
+    batchLength -= mesgLength;
+  }
+  return result;
+}
+
+// control frames are for the transport itself and are not passed on. They
+// agree on sealed frames, see announceCiphers, and set up a shared memory
+// channel on a local connection: the connecting end offers one along with
+// its descriptors, the other end maps it and answers with a switch marker,
+// and each end marks the switch of its own output the same way. Unknown
+// codes are ignored, but like any control frame tell us the peer reads
+// '$' frames.
+MesgProcessResult PyConnectNetComm::processControlFrame(ClientFD *FDPtr,
+                                                        unsigned char *data,
+                                                        int length) {
+  if (!FDPtr->framesV2)
+    notePeerFramesV2(FDPtr->fd);
+  if (length < 1)
+    return MESG_PROCESSED_OK;
+
+  unsigned char *dataPtr = data + 1;
+  int remainingLength = length - 1;
+#ifdef PYCONNECT_USE_SHM
+  ShmChannel *shm = FDPtr->shm;
+#endif
+
+  switch (data[0]) {
+  case kControlCiphers:
+    if (remainingLength < 1)
+      break;
+#ifdef MULTI_THREAD
+#ifdef WIN32
+    EnterCriticalSection(&g_criticalSection);
+#else
+    pthread_mutex_lock(&g_mutex);
+#endif
+#endif
+    FDPtr->sealed = sealEnabled_ && (*dataPtr & kCipherAES256GCM);
+    FDPtr->plain = FDPtr->trusted && (*dataPtr & kCipherPlain);
+    FDPtr->checksummed =
+        FDPtr->plain && frameCRCEnabled_ && (*dataPtr & kCipherCRC32C);
+    FDPtr->compressing = FDPtr->domain == PyConnectNetComm::NETWORK &&
+                         compressionEnabled_ && (*dataPtr & kCodecDeflate);
+#ifdef MULTI_THREAD
+#ifdef WIN32
+    LeaveCriticalSection(&g_criticalSection);
+#else
+    pthread_mutex_unlock(&g_mutex);
+#endif
+#endif
+    announceCiphers(FDPtr->fd); // answer with our own
+    break;
+#ifdef PYCONNECT_USE_SHM
+  case kControlShmOffer: {
+    int ringSize = 0;
+    if (remainingLength >= (int)sizeof(ringSize))
+      unpackLENumber(ringSize, dataPtr, remainingLength);
+    if (!shm || shm->connecting() || shm->attached())
+      break;
+    if (!shmEnabled_ || !FDPtr->trusted || ringSize <= 0 ||
+        !shm->attach(ringSize)) {
+      if (shmEnabled_) {
+        WARNING_MSG("Unable to map shared memory channel on %d, staying "
+                    "on the socket.\n",
+                    FDPtr->fd);
+      }
+#ifdef MULTI_THREAD
+      pthread_mutex_lock(&g_mutex);
+#endif
+      FDPtr->shm = NULL;
+#ifdef MULTI_THREAD
+      pthread_mutex_unlock(&g_mutex);
+#endif
+      delete shm;
+      break;
+    }
+#ifdef MULTI_THREAD
+    pthread_mutex_lock(&g_mutex);
+#endif
+    watchFD(shm->bellFD(), FDPtr);
+    shm->switchPending = true;
+    switchToShmChannel(FDPtr);
+#ifdef MULTI_THREAD
+    pthread_mutex_unlock(&g_mutex);
+#endif
+  } break;
+  case kControlShmSwitch:
+    if (!shm || !shm->attached())
+      break;
+#ifdef MULTI_THREAD
+    pthread_mutex_lock(&g_mutex);
+#endif
+    if (shm->connecting() && !shm->receiving) { // the offer was taken
+      watchFD(shm->bellFD(), FDPtr);
+      shm->switchPending = true;
+      switchToShmChannel(FDPtr);
+    }
+    shm->receiving = true;
+    // we are still reading the socket buffer, pick up what the peer has
+    // written to the ring in the meantime once we are done with it
+    shm->ringSelf();
+#ifdef MULTI_THREAD
+    pthread_mutex_unlock(&g_mutex);
+#endif
+    break;
+#endif
+  default:
+    break;
+  }
+  return MESG_PROCESSED_OK;
+}
+
+// read whatever is available on the client socket straight into its
+// receive buffer and dispatch the complete frames in place. Returns false
+// when the connection is closed or broken.
+bool PyConnectNetComm::receiveClientData(ClientFD *FDPtr,
+                                         MesgProcessResult &procResult) {
+  SocketDataBufferInfo &dataInfo = FDPtr->dataInfo;
+  SOCKET_T fd = FDPtr->fd;
+
+  for (int reads = 0; reads < kMaxReadsPerEvent; reads++) {
+    if (!reserveReceiveSpace(dataInfo))
+      return false;
+
+    int readSpace = dataInfo.bufferSize - dataInfo.dataEnd;
+#ifdef WIN32
+    int readLen = recv(fd, (char *)dataInfo.bufferedData + dataInfo.dataEnd,
+                       readSpace, 0);
+#else
+    int readLen = 0;
+#ifdef PYCONNECT_USE_SHM
+    if (FDPtr->domain == PyConnectNetComm::LOCALIPC)
+      readLen = receiveLocalData(
+          FDPtr, dataInfo.bufferedData + dataInfo.dataEnd, readSpace);
+    else
+#endif
+      readLen = (int)recv(fd, dataInfo.bufferedData + dataInfo.dataEnd,
+                          readSpace, MSG_DONTWAIT);
+    if (readLen < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      break; // drained
+#endif
+    if (readLen <= 0) {
+      if (readLen == 0) {
+        INFO_MSG("Socket connection %d closed.\n", fd);
+      } else {
+        ERROR_MSG("PyConnectNetComm::continuousProcessing: "
+                  "error reading data stream on %d error = %d.\n",
+                  fd, errno);
+      }
+      return false;
+    }
+    dataInfo.dataEnd += readLen;
+
+    if (!consumeReceiveBuffer(FDPtr, procResult))
+      break;
+
+#ifdef WIN32
+    break; // no MSG_DONTWAIT, wait for the next select
+#else
+    if (procResult == MESG_TO_SHUTDOWN || readLen < readSpace)
+      break;
+#endif
+  }
+
+  // hand large buffers back once they are drained so idle connections
+  // hold little memory.
+  if (dataInfo.dataEnd == 0 && dataInfo.bufferSize > PYCONNECT_TCP_BUFFER_SIZE)
+    releaseReceiveBuffer(dataInfo);
+
+  return true;
+}
+
+// dispatch data received into a buffer we do not own, e.g. one of the
+// io_uring provided buffers. Complete frames are processed straight from
+// it; only a trailing partial frame is copied to the client buffer.
+bool PyConnectNetComm::receiveBufferedData(ClientFD *FDPtr, unsigned char *data,
+                                           int length,
+                                           MesgProcessResult &procResult) {
+  SocketDataBufferInfo &dataInfo = FDPtr->dataInfo;
+
+  if (dataInfo.dataEnd == dataInfo.dataStart) {
+    int processedLength = extractFrames(FDPtr, data, length, procResult);
+    if (processedLength < 0) {
+      ERROR_MSG("PyConnectNetComm::continuousProcessing: "
+                "invalid data stream on %d.\n",
+                FDPtr->fd);
+      return true;
+    }
+    data += processedLength;
+    length -= processedLength;
+    if (length == 0 || procResult == MESG_TO_SHUTDOWN)
+      return true;
+  }
+
+  if (!reserveReceiveSpace(dataInfo, length))
+    return false;
+  memcpy(dataInfo.bufferedData + dataInfo.dataEnd, data, length);
+  dataInfo.dataEnd += length;
+  consumeReceiveBuffer(FDPtr, procResult);
+
+  if (dataInfo.dataEnd == 0 && dataInfo.bufferSize > PYCONNECT_TCP_BUFFER_SIZE)
+    releaseReceiveBuffer(dataInfo);
+  return true;
+}
+
+// dispatch the complete frames pending in the client buffer. Returns false
+// if the stream is corrupted, in which case the pending data is dropped.
+bool PyConnectNetComm::consumeReceiveBuffer(ClientFD *FDPtr,
+                                            MesgProcessResult &procResult) {
+  SocketDataBufferInfo &dataInfo = FDPtr->dataInfo;
+
+  int processedLength =
+      extractFrames(FDPtr, dataInfo.bufferedData + dataInfo.dataStart,
+                    dataInfo.dataEnd - dataInfo.dataStart, procResult);
+
+  if (processedLength < 0) {
+    ERROR_MSG("PyConnectNetComm::continuousProcessing: "
+              "invalid data stream on %d.\n",
+              FDPtr->fd);
+    dataInfo.dataStart = dataInfo.dataEnd = 0;
+    return false;
+  }
+  dataInfo.dataStart += processedLength;
+  if (dataInfo.dataStart == dataInfo.dataEnd)
+    dataInfo.dataStart = dataInfo.dataEnd = 0;
+  return true;
+}
+
+// make room for the next read of at least readSize bytes. Once the header
+// of the pending frame is known the buffer is sized for the whole frame, so
+// the rest of a large message is read in place.
+bool PyConnectNetComm::reserveReceiveSpace(SocketDataBufferInfo &dataInfo,
+                                           int readSize) {
+  int pendingLength = dataInfo.dataEnd - dataInfo.dataStart;
+  int required = pendingLength + (readSize > kTCPMSS ? readSize : kTCPMSS);
+
+  int headerLength = 0;
+  int frameDataLength = 0;
+  if (unpackFrameHeader(dataInfo.bufferedData + dataInfo.dataStart,
+                        pendingLength, headerLength, frameDataLength) == 1 &&
+      headerLength + frameDataLength + 1 > required) {
+    required = headerLength + frameDataLength + 1;
+  }
+
+  if (dataInfo.bufferedData &&
+      dataInfo.bufferSize - dataInfo.dataStart >= required)
+    return true;
+
+  if (dataInfo.dataStart > 0) {
+    memmove(dataInfo.bufferedData, dataInfo.bufferedData + dataInfo.dataStart,
+            pendingLength);
+    dataInfo.dataStart = 0;
+    dataInfo.dataEnd = pendingLength;
+  }
+  return reserveDataBuffer(dataInfo.bufferedData, dataInfo.bufferSize,
+                           pendingLength, required);
+}
+
+void PyConnectNetComm::releaseReceiveBuffer(SocketDataBufferInfo &dataInfo) {
+  if (dataInfo.bufferedData) {
+    delete[] dataInfo.bufferedData;
+    dataInfo.bufferedData = NULL;
+  }
+  dataInfo.dataStart = dataInfo.dataEnd = dataInfo.bufferSize = 0;
+}
+
+#ifdef PYCONNECT_USE_SHM
+// recv on a local connection, taking the descriptors of a shared memory
+// offer if they come along. They are kept until the offer itself has been
+// read; any others are closed.
+int PyConnectNetComm::receiveLocalData(ClientFD *FDPtr, unsigned char *buffer,
+                                       int length) {
+  union {
+    struct cmsghdr align;
+    char data[CMSG_SPACE(3 * sizeof(int))];
+  } control;
+  struct iovec iov;
+  iov.iov_base = buffer;
+  iov.iov_len = length;
+
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.data;
+  msg.msg_controllen = sizeof(control.data);
+
+  int readLen =
+      (int)recvmsg(FDPtr->fd, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+  if (readLen <= 0 || msg.msg_controllen == 0)
+    return readLen;
+
+  for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+       cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+      continue;
+    int fds[3];
+    int count = (int)((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+    if (count > 3)
+      count = 3;
+    memcpy(fds, CMSG_DATA(cmsg), count * sizeof(int));
+
+    // only a peer of our own user gets to hand us a segment to map
+    ShmChannel *shm = NULL;
+    if (count == 3 && !FDPtr->shm && FDPtr->trusted)
+      shm = new (std::nothrow) ShmChannel();
+    if (!shm) {
+      for (int i = 0; i < count; i++)
+        close(fds[i]);
+      continue;
+    }
+    shm->takeFDs(fds);
+#ifdef MULTI_THREAD
+    pthread_mutex_lock(&g_mutex);
+#endif
+    FDPtr->shm = shm;
+#ifdef MULTI_THREAD
+    pthread_mutex_unlock(&g_mutex);
+#endif
+  }
+  return readLen;
+}
+
+// offer the server at the other end of a local connection we made a shared
+// memory channel, once it has shown it reads '$' frames. The offer carries
+// the memfd and both bells; until the server answers, and also if it never
+// does, we keep to the socket. Only a server of our own user is offered
+// one. Caller must hold the comm mutex.
+void PyConnectNetComm::offerShmChannel(ClientFD *FDPtr) {
+  if (!FDPtr || FDPtr->shm || !shmEnabled_ || !FDPtr->trusted ||
+      !FDPtr->framesV2 || FDPtr->outQueue.head || FDPtr->broken)
+    return;
+
+  ShmChannel *shm = new (std::nothrow) ShmChannel();
+  if (!shm || !shm->create(PYCONNECT_SHM_RING_SIZE)) {
+    delete shm;
+    return;
+  }
+
+  unsigned char offer[1 + sizeof(int)];
+  unsigned char *offerPtr = offer;
+  *offerPtr++ = kControlShmOffer;
+  packToLENumber((int)PYCONNECT_SHM_RING_SIZE, offerPtr);
+
+  unsigned char header[PYCONNECT_FRAME_V2_HEADER_SIZE];
+  int headerLength =
+      packFrameHeader(header, sizeof(offer), PYCONNECT_FRAME_CONTROL);
+  const unsigned char trailer = PYCONNECT_MSG_END;
+
+  struct iovec iov[3];
+  iov[0].iov_base = header;
+  iov[0].iov_len = headerLength;
+  iov[1].iov_base = offer;
+  iov[1].iov_len = sizeof(offer);
+  iov[2].iov_base = (void *)&trailer;
+  iov[2].iov_len = 1;
+
+  union {
+    struct cmsghdr align;
+    char data[CMSG_SPACE(3 * sizeof(int))];
+  } control;
+  memset(&control, 0, sizeof(control));
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = 3;
+  msg.msg_control = control.data;
+  msg.msg_controllen = sizeof(control.data);
+
+  int fds[3];
+  shm->offeredFDs(fds);
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+  // in place before the answer can come in. Nothing is queued in front of
+  // the offer, so should it not go out whole the stream is lost.
+  FDPtr->shm = shm;
+  int sentBytes = 0;
+  do {
+    sentBytes = (int)sendmsg(FDPtr->fd, &msg, MSG_NOSIGNAL);
+  } while (sentBytes < 0 && errno == EINTR);
+  shm->closeSegment(); // the mapping stays
+
+  if (sentBytes != headerLength + (int)sizeof(offer) + 1) {
+    ERROR_MSG("PyConnectNetComm::offerShmChannel: unable to offer shared "
+              "memory channel on %d error = %d.\n",
+              FDPtr->fd, errno);
+    FDPtr->shm = NULL;
+    delete shm;
+    if (sentBytes > 0)
+      shutdownBrokenClient(FDPtr);
+  }
+}
+
+// send the switch marker as the last frame on the socket and carry on in
+// the ring. The marker has to go out in order, so wait for an empty queue;
+// should the socket take only part of it, the rest is queued and we stay on
+// the socket for good, which the peer copes with as it still reads both.
+// Caller must hold the comm mutex.
+void PyConnectNetComm::switchToShmChannel(ClientFD *FDPtr) {
+  ShmChannel *shm = FDPtr->shm;
+
+  if (FDPtr->outQueue.head || FDPtr->broken)
+    return;
+#ifdef PYCONNECT_USE_IO_URING
+  for (PendingSendList::const_iterator iter = sendBatch_.begin();
+       iter != sendBatch_.end(); ++iter) {
+    if (iter->FDPtr == FDPtr && !iter->done)
+      return; // still to go out on the socket
+  }
+#endif
+
+  unsigned char header[PYCONNECT_FRAME_V2_HEADER_SIZE];
+  int headerLength = packFrameHeader(header, 1, PYCONNECT_FRAME_CONTROL);
+  const unsigned char trailer = PYCONNECT_MSG_END;
+  int sentBytes = writeFrameParts(FDPtr->fd, header, headerLength,
+                                  &kControlShmSwitch, 1, &trailer, 1);
+  if (sentBytes < 0) {
+    ERROR_MSG("PyConnectNetComm::switchToShmChannel: error sending data on "
+              "%d error = %d.\n",
+              FDPtr->fd, errno);
+    shm->switchPending = false;
+    shutdownBrokenClient(FDPtr);
+    return;
+  }
+  if (sentBytes == 0)
+    return; // try again once the socket is writable
+
+  shm->switchPending = false;
+  if (sentBytes == headerLength + 2)
+    shm->sending = true;
+  else
+    queueFrame(FDPtr, header, headerLength, &kControlShmSwitch, 1, &trailer, 1,
+               sentBytes);
+}
+
+// the bell rings when the peer has written to our ring while we slept, or
+// made room in its own while we waited to write.
+bool PyConnectNetComm::processShmBell(ClientFD *FDPtr) {
+  ShmChannel *shm = FDPtr->shm;
+  shm->clearBell();
+
+#ifdef MULTI_THREAD
+  pthread_mutex_lock(&g_mutex);
+#endif
+  if (FDPtr->outQueue.head && !FDPtr->broken)
+    flushOutboundQueue(FDPtr);
+#ifdef MULTI_THREAD
+  pthread_mutex_unlock(&g_mutex);
+#endif
+
+  if (!shm->receiving)
+    return true;
+
+  SOCKET_T fd = FDPtr->fd;
+  MesgProcessResult procResult = MESG_PROCESSED_OK;
+  if (!receiveShmData(FDPtr, procResult)) {
+    objCommChannelShutdown(fd, true);
+    return false;
+  } else if (procResult == MESG_TO_SHUTDOWN) {
+    objCommChannelShutdown(fd);
+    return false;
+  }
+  return true;
+}
+
+// dispatch the frames in our ring in place. Only a frame that wraps around
+// the end of the ring is put together in the client buffer.
+bool PyConnectNetComm::receiveShmData(ClientFD *FDPtr,
+                                      MesgProcessResult &procResult) {
+  ShmChannel *shm = FDPtr->shm;
+
+  for (int reads = 0; reads < kMaxReadsPerEvent; reads++) {
+    unsigned char *data = NULL;
+    int length = shm->peek(data);
+    if (length < 0)
+      return false;
+    if (length == 0) {
+      if (shm->sleep())
+        return true; // drained, the peer rings when it writes again
+      continue;
+    }
+    bool received = receiveBufferedData(FDPtr, data, length, procResult);
+    shm->consume(length);
+    if (!received)
+      return false;
+    if (procResult == MESG_TO_SHUTDOWN)
+      return true;
+  }
+  shm->ringSelf(); // come back for the rest after the other clients
+  return true;
+}
+#endif
+
+void PyConnectNetComm::continuousProcessing() {
+  s_onReactor = true;
+#ifdef PYCONNECT_USE_IO_URING
+  if (uring_) {
+    uringProcessing();
+    return;
+  }
+#endif
+#ifdef PYCONNECT_USE_REACTOR_SHARDS
+  if (shardCount_ > 1) {
+    runReactorShards();
+    return;
+  }
+#endif
+#ifdef PYCONNECT_USE_EPOLL
+  if (shards_[0].epollFD != -1) {
+    epollProcessing(shards_[0]);
+    return;
+  }
+#endif
+  int maxFD = 0;
+  fd_set readyFDSet;
+  fd_set writeFDSet;
+
+  while (keepRunning_) {
+    FD_ZERO(&readyFDSet);
+    FD_ZERO(&writeFDSet);
+#ifdef MULTI_THREAD
+#ifdef WIN32
+    EnterCriticalSection(&g_criticalSection);
+#else
+    pthread_mutex_lock(&g_mutex);
+#endif
+#endif
+    memcpy(&readyFDSet, &masterFDSet_, sizeof(masterFDSet_));
+    maxFD = maxFD_;
+    // wait for writability only where there is queued output
+    for (ClientFD *FDPtr = clientFDList_; FDPtr; FDPtr = FDPtr->pNext) {
+      if (!FDPtr->outQueue.head || FDPtr->broken)
+        continue;
+#ifdef PYCONNECT_USE_SHM
+      if (FDPtr->shm && FDPtr->shm->sending)
+        continue; // its bell rings when the ring has room
+#endif
+      FD_SET(FDPtr->fd, &writeFDSet);
+    }
+#ifdef MULTI_THREAD
+#ifdef WIN32
+    LeaveCriticalSection(&g_criticalSection);
+#else
+    pthread_mutex_unlock(&g_mutex);
+#endif
+#endif
+
+#ifdef MULTI_THREAD
+    int timeoutUSec = 200000; // 200ms
+#else
+    int timeoutUSec = -1;
+#endif
+#ifndef LINUX
+    // no timer fds to wake us up, wait no longer than the next timer
+    timeoutUSec = timerTimeoutUSec(timeoutUSec);
+#endif
+    struct timeval timeout;
+    timeout.tv_sec = timeoutUSec / 1000000;
+    timeout.tv_usec = timeoutUSec % 1000000;
+
+    // we must be able to interrupt select since masterFDSet_ might
+    // be updated by the main thread (i.e. calling PyConnect.connect).
+    // For this we use timeout as a solution. NOTE: an alternative
+    // solution for POSIX system might be that still using block select
+    // but send a signal from main thread to interrupt it when connect
+    // is completed.
+    select(maxFD + 1, &readyFDSet, &writeFDSet, NULL,
+           timeoutUSec >= 0 ? &timeout : NULL);
+
+    this->processIncomingData(&readyFDSet);
+  }
+}
+
+#ifdef PYCONNECT_USE_EPOLL
+// readiness is reported per fd and mapped straight to its ClientFD, so the
+// cost of an event does not depend on the number of connections. Changes
+// to the watched fds take effect immediately; the eventfd only has to
+// break us out of epoll_wait to notice them (and fini). A sharded reactor
+// also uses it to pick up work other threads left in the shard's mailbox.
+void PyConnectNetComm::epollProcessing(ReactorShard &shard) {
+  struct epoll_event events[PYCONNECT_EPOLL_MAX_EVENTS];
+#ifdef MULTI_THREAD
+  // only the owning thread touches the table and clients of a shard, the
+  // single reactor shares them with the threads sending data
+  bool sharded = shardCount_ > 1;
+#endif
+
+  while (keepRunning_) {
+    int eventCount =
+        epoll_wait(shard.epollFD, events, PYCONNECT_EPOLL_MAX_EVENTS, -1);
+    if (eventCount < 0) {
+      if (errno == EINTR)
+        continue;
+      ERROR_MSG("PyConnectNetComm::epollProcessing: epoll_wait failed "
+                "error = %d\n",
+                errno);
+      break;
+    }
+    for (int i = 0; i < eventCount && keepRunning_; i++) {
+      SOCKET_T fd = events[i].data.fd;
+
+      if (fd == shard.wakeupFD) {
+        uint64_t count = 0;
+        if (read(shard.wakeupFD, &count, sizeof(count)) < 0 &&
+            errno != EAGAIN) {
+          ERROR_MSG("PyConnectNetComm::epollProcessing: unable to read "
+                    "wakeup event error = %d\n",
+                    errno);
+        }
+#ifdef PYCONNECT_USE_REACTOR_SHARDS
+        if (sharded)
+          drainShardMailbox(shard);
+#endif
+      } else if (fd == coalesceTimerFD_) {
+        processCoalesceTimer();
+      } else if (fd == MPTimerFD_) {
+        processMPTimer();
+      } else if (netCommEnabled_ && fd == udpSocket_) {
+        processUDPSocket();
+      } else if (netCommEnabled_ && fd == tcpSocket_) {
+        acceptClient(tcpSocket_, PyConnectNetComm::NETWORK);
+#ifdef PYCONNECT_USE_REACTOR_SHARDS
+      } else if (netCommEnabled_ && fd == shard.tcpSocket) {
+        acceptClient(shard.tcpSocket, PyConnectNetComm::NETWORK);
+#endif
+      } else if (IPCCommEnabled_ && fd == domainSocket_) {
+        acceptClient(domainSocket_, PyConnectNetComm::LOCALIPC);
+      } else if (fd == IPCWatchFD_) {
+        processIPCWatch();
+      } else {
+#ifdef MULTI_THREAD
+        if (!sharded)
+          pthread_mutex_lock(&g_mutex);
+#endif
+        ClientFD *FDPtr = shardClient(shard, fd);
+        if (FDPtr && (events[i].events & EPOLLOUT) && !FDPtr->broken)
+          flushOutboundQueue(FDPtr);
+#ifdef MULTI_THREAD
+        if (!sharded)
+          pthread_mutex_unlock(&g_mutex);
+#endif
+#ifdef PYCONNECT_USE_SHM
+        // the client's shared memory bell rather than its socket
+        if (FDPtr && fd != FDPtr->fd) {
+          SOCKET_T clientSock = FDPtr->fd;
+          if (!processShmBell(FDPtr))
+            destroyCurrentClient(clientSock);
+          continue;
+        }
+#endif
+        // a client removed earlier in this batch simply has no entry
+        if (FDPtr && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) &&
+            !processClientInput(FDPtr)) {
+          destroyCurrentClient(fd);
+        }
+      }
+    }
+  }
+}
+
+void PyConnectNetComm::wakeupReactor(ReactorShard &shard) {
+  if (shard.wakeupFD == -1)
+    return;
+
+  uint64_t count = 1;
+  if (write(shard.wakeupFD, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+    ERROR_MSG("PyConnectNetComm::wakeupReactor: unable to signal reactor "
+              "error = %d\n",
+              errno);
+  }
+}
+
+#ifdef PYCONNECT_USE_REACTOR_SHARDS
+// run shard 0 on the calling thread and the others on threads of their own
+// until fini.
+void PyConnectNetComm::runReactorShards() {
+  int started = 1;
+  for (; started < shardCount_; started++) {
+    if (pthread_create(&shards_[started].thread, NULL, reactorShardThread,
+                       &shards_[started]) != 0) {
+      ERROR_MSG("PyConnectNetComm::runReactorShards: unable to start "
+                "reactor thread %d error = %d\n",
+                started, errno);
+      break;
+    }
+  }
+  runReactorShard(shards_[0]);
+
+  for (int i = 1; i < started; i++) {
+    wakeupReactor(shards_[i]);
+    pthread_join(shards_[i].thread, NULL);
+  }
+  pthread_mutex_lock(&g_mutex);
+  shardsStopped_ = true;
+  pthread_mutex_unlock(&g_mutex);
+}
+
+void *PyConnectNetComm::reactorShardThread(void *arg) {
+  s_pPyConnectNetComm->runReactorShard(*(ReactorShard *)arg);
+  return NULL;
+}
+
+void PyConnectNetComm::runReactorShard(ReactorShard &shard) {
+  s_currentShard = shard.index;
+  s_onReactor = true;
+  if (shard.cpu >= 0) {
+    cpu_set_t cpuSet;
+    CPU_ZERO(&cpuSet);
+    CPU_SET(shard.cpu, &cpuSet);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpuSet), &cpuSet) != 0) {
+      ERROR_MSG("PyConnectNetComm::runReactorShard: unable to pin reactor "
+                "thread %d to cpu %d\n",
+                shard.index, shard.cpu);
+    }
+  }
+  epollProcessing(shard);
+  s_currentShard = -1;
+}
+
+// the shard with the fewest clients. Caller must hold the comm mutex.
+int PyConnectNetComm::pickReactorShard() {
+  int best = 0;
+  for (int i = 1; i < shardCount_; i++) {
+    if (__atomic_load_n(&shards_[i].clientCount, __ATOMIC_RELAXED) <
+        __atomic_load_n(&shards_[best].clientCount, __ATOMIC_RELAXED))
+      best = i;
+  }
+  return best;
+}
+
+// true if the calling thread may work on the client directly, i.e. it runs
+// the client's shard or there are no shard threads (any more).
+bool PyConnectNetComm::isShardOwner(ClientFD *FDPtr) {
+  return shardCount_ == 1 || shardsStopped_ ||
+         FDPtr->shard == s_currentShard;
+}
+
+// push msg onto the shard's mailbox without taking a lock. Only the push
+// onto an empty mailbox signals the shard; it has not drained the mailbox
+// since, so later messages are picked up along with the first.
+void PyConnectNetComm::postToShard(ReactorShard &shard, ShardMessage *msg) {
+  ShardMessage *head = __atomic_load_n(&shard.mailbox, __ATOMIC_RELAXED);
+  do {
+    msg->pNext = head;
+  } while (!__atomic_compare_exchange_n(&shard.mailbox, &head, msg, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+  if (!head)
+    wakeupReactor(shard);
+}
+
+// leave a frame for a client of another shard to the thread owning it.
+// Returns false if the caller is to send it itself.
+bool PyConnectNetComm::handOffFrame(ClientFD *FDPtr, const unsigned char *data,
+                                    int size, unsigned char frameFlags) {
+  if (isShardOwner(FDPtr))
+    return false;
+
+  ShardMessage *msg = new (std::nothrow) ShardMessage;
+  unsigned char *msgData = new (std::nothrow) unsigned char[size];
+  if (!msg || !msgData) {
+    ERROR_MSG("PyConnectNetComm::handOffFrame: unable to hand %d bytes over "
+              "to reactor thread %d.\n",
+              size, FDPtr->shard);
+    delete msg;
+    delete[] msgData;
+    return true;
+  }
+  memcpy(msgData, data, size);
+  msg->type = ShardMessage::SEND_FRAME;
+  msg->FDPtr = FDPtr;
+  msg->fd = FDPtr->fd;
+  msg->generation = FDPtr->generation;
+  msg->data = msgData;
+  msg->size = size;
+  msg->frameFlags = frameFlags;
+  postToShard(shards_[FDPtr->shard], msg);
+  // the owner applies the overflow policy as it queues the frame, but
+  // only the sender can wait for room
+  int queuedBytes =
+      __atomic_load_n(&FDPtr->outQueue.queuedBytes, __ATOMIC_RELAXED);
+  if (overflowPolicy_ == BLOCK_SENDER && !s_onReactor &&
+      queuedBytes + size > maxOutboundQueueBytes_)
+    s_blockedFD = FDPtr->fd;
+  return true;
+}
+
+// have the owning thread start watching a new client. Returns false if the
+// caller is to do it itself.
+bool PyConnectNetComm::handOffAdopt(ClientFD *FDPtr) {
+  if (isShardOwner(FDPtr))
+    return false;
+
+  ShardMessage *msg = new ShardMessage;
+  msg->type = ShardMessage::ADOPT_CLIENT;
+  msg->FDPtr = FDPtr;
+  msg->fd = FDPtr->fd;
+  msg->generation = FDPtr->generation;
+  msg->data = NULL;
+  msg->size = 0;
+  msg->frameFlags = 0;
+  postToShard(shards_[FDPtr->shard], msg);
+  return true;
+}
+
+// have the owning thread free a client that is off the client list, as it
+// may be using it right now. Returns false if the caller is to do it.
+bool PyConnectNetComm::handOffRelease(ClientFD *FDPtr) {
+  if (isShardOwner(FDPtr))
+    return false;
+
+  ShardMessage *msg = new ShardMessage;
+  msg->type = ShardMessage::RELEASE_CLIENT;
+  msg->FDPtr = FDPtr;
+  msg->fd = FDPtr->fd;
+  msg->generation = FDPtr->generation;
+  msg->data = NULL;
+  msg->size = 0;
+  msg->frameFlags = 0;
+  postToShard(shards_[FDPtr->shard], msg);
+  return true;
+}
+
+// carry out what other threads left for this shard, in the order they did.
+// A frame whose client has gone in the meantime is dropped.
+void PyConnectNetComm::drainShardMailbox(ReactorShard &shard) {
+  ShardMessage *msg =
+      __atomic_exchange_n(&shard.mailbox, (ShardMessage *)NULL,
+                          __ATOMIC_ACQUIRE);
+  ShardMessage *ordered = NULL;
+  while (msg) {
+    ShardMessage *next = msg->pNext;
+    msg->pNext = ordered;
+    ordered = msg;
+    msg = next;
+  }
+
+  while (ordered) {
+    msg = ordered;
+    ordered = msg->pNext;
+    switch (msg->type) {
+    case ShardMessage::ADOPT_CLIENT:
+      watchFD(msg->fd, msg->FDPtr);
+      break;
+    case ShardMessage::RELEASE_CLIENT:
+      releaseClient(msg->FDPtr);
+      break;
+    default: {
+      ClientFD *FDPtr = shardClient(shard, msg->fd);
+      if (FDPtr == msg->FDPtr && FDPtr->generation == msg->generation)
+        sendFrame(FDPtr, msg->data, msg->size, msg->frameFlags);
+      delete[] msg->data;
+      break;
+    }
+    }
+    delete msg;
+  }
+}
+#endif // PYCONNECT_USE_REACTOR_SHARDS
+#endif // PYCONNECT_USE_EPOLL
+
+#ifdef PYCONNECT_USE_IO_URING
+// completions carry the operation, the fd and, for clients, the generation
+// of the ClientFD so that a late completion for a closed and reused fd is
+// recognised.
+static const int kURingOpBits = 3;
+static const int kURingFDBits = 32;
+
+static unsigned long long uringUserData(SOCKET_T fd, unsigned int generation,
+                                        int op) {
+  return ((unsigned long long)generation << (kURingOpBits + kURingFDBits)) |
+         ((unsigned long long)(unsigned int)fd << kURingOpBits) |
+         (unsigned long long)op;
+}
+
+static SOCKET_T uringFD(unsigned long long userData) {
+  return (SOCKET_T)((userData >> kURingOpBits) & 0xffffffffULL);
+}
+
+bool PyConnectNetComm::initIOURing() {
+  uring_ = new IOURing();
+  sendRing_ = new IOURing();
+
+  bool ready = uring_->init(PYCONNECT_URING_ENTRIES) &&
+               sendRing_->init(PYCONNECT_URING_SEND_ENTRIES) &&
+               uring_->isOpSupported(IORING_OP_RECV) &&
+               uring_->isOpSupported(IORING_OP_POLL_ADD) &&
+               uring_->isOpSupported(IORING_OP_ASYNC_CANCEL) &&
+               sendRing_->isOpSupported(IORING_OP_SENDMSG) &&
+               uring_->setupBufferRing(0, PYCONNECT_URING_BUFFER_COUNT,
+                                       PYCONNECT_URING_BUFFER_SIZE) &&
+               probeMultishotRecv();
+  if (ready) {
+    shards_[0].wakeupFD = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    ready = (shards_[0].wakeupFD != -1);
+  }
+  if (!ready) {
+    delete uring_;
+    delete sendRing_;
+    uring_ = sendRing_ = NULL;
+    return false;
+  }
+  uringArm(shards_[0].wakeupFD, NULL, URING_POLL);
+  uring_->submit();
+  return true;
+}
+
+// multishot receive with provided buffers needs a newer kernel than the
+// ring itself. Try it on a socket pair; unknown flags are only reported
+// when the request runs.
+bool PyConnectNetComm::probeMultishotRecv() {
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+    return false;
+
+  bool supported = false;
+  struct io_uring_sqe *sqe = uring_->getSQE();
+  if (sqe && write(fds[1], "", 1) == 1) {
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fds[0];
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = uring_->bufferGroup();
+    sqe->user_data = URING_NONE;
+    if (uring_->submit(1) >= 0) {
+      struct io_uring_cqe *cqe = uring_->peekCQE();
+      if (cqe) {
+        unsigned int flags = cqe->flags;
+        supported = cqe->res == 1 && (flags & IORING_CQE_F_MORE) &&
+                    (flags & IORING_CQE_F_BUFFER);
+        uring_->seenCQE();
+        if (flags & IORING_CQE_F_BUFFER)
+          uring_->recycleBuffer(
+              (unsigned short)(flags >> IORING_CQE_BUFFER_SHIFT));
+      }
+    }
+  }
+  // the end of stream terminates the request if it is still armed
+  close(fds[1]);
+  close(fds[0]);
+  return supported;
+}
+
+// queue (but do not submit) the request that waits on fd: a multishot
+// receive for clients and a one shot poll for listeners, the wakeup event
+// and pending output. Caller must hold the comm mutex.
+void PyConnectNetComm::uringArm(SOCKET_T fd, ClientFD *FDPtr, URingOp op) {
+  struct io_uring_sqe *sqe = uring_->getSQE();
+  if (!sqe) {
+    uring_->submit();
+    sqe = uring_->getSQE();
+  }
+  if (!sqe) {
+    ERROR_MSG("PyConnectNetComm::uringArm: submission queue is full, "
+              "unable to watch %d\n",
+              fd);
+    return;
+  }
+  sqe->fd = fd;
+  sqe->user_data = uringUserData(fd, FDPtr ? FDPtr->generation : 0, op);
+
+  unsigned int pollEvents = POLLIN;
+  switch (op) {
+  case URING_RECV:
+    sqe->opcode = IORING_OP_RECV;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = uring_->bufferGroup();
+    return;
+  case URING_WRITABLE:
+    pollEvents = POLLOUT;
+    break;
+  default:
+    break;
+  }
+  sqe->opcode = IORING_OP_POLL_ADD;
+#ifdef WITH_BIG_ENDIAN
+  pollEvents = (pollEvents << 16) | (pollEvents >> 16);
+#endif
+  sqe->poll32_events = pollEvents;
+}
+
+// look up the live client a completion belongs to. Caller must hold the
+// comm mutex.
+PyConnectNetComm::ClientFD *
+PyConnectNetComm::uringClient(unsigned long long userData) {
+  SOCKET_T fd = uringFD(userData);
+  unsigned int generation =
+      (unsigned int)(userData >> (kURingOpBits + kURingFDBits));
+
+  ClientFD *FDPtr = shardClient(shards_[0], fd);
+  if (FDPtr && FDPtr->generation != generation)
+    return NULL;
+  return FDPtr;
+}
+
+// the completion loop. Client data arrives in buffers the kernel picked
+// from the provided buffer ring, one completion per read and without
+// re-arming, so an idle wakeup costs no system call at all beyond the
+// wait itself.
+void PyConnectNetComm::uringProcessing() {
+  while (keepRunning_) {
+    if (uring_->waitCQE() < 0) {
+      if (errno == EINTR)
+        continue;
+      ERROR_MSG("PyConnectNetComm::uringProcessing: io_uring_enter failed "
+                "error = %d\n",
+                errno);
+      break;
+    }
+    struct io_uring_cqe *cqe = NULL;
+    while (keepRunning_ && (cqe = uring_->peekCQE()) != NULL) {
+      unsigned long long userData = cqe->user_data;
+      int res = cqe->res;
+      unsigned int flags = cqe->flags;
+      uring_->seenCQE();
+      uringProcessCompletion(userData, res, flags);
+    }
+    // buffers handed back without a buffer ring
+#ifdef MULTI_THREAD
+    pthread_mutex_lock(&g_mutex);
+#endif
+    if (uring_->hasPendingSQEs())
+      uring_->submit();
+#ifdef MULTI_THREAD
+    pthread_mutex_unlock(&g_mutex);
+#endif
+  }
+}
+
+void PyConnectNetComm::uringProcessCompletion(unsigned long long userData,
+                                              int res, unsigned int flags) {
+  SOCKET_T fd = uringFD(userData);
+  int op = (int)(userData & ((1 << kURingOpBits) - 1));
+
+  if (op == URING_POLL) {
+    if (res < 0)
+      return; // cancelled along with its fd
+    if (fd == shards_[0].wakeupFD) {
+      uint64_t count = 0;
+      if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        ERROR_MSG("PyConnectNetComm::uringProcessing: unable to read "
+                  "wakeup event error = %d\n",
+                  errno);
+      }
+    } else if (fd == coalesceTimerFD_) {
+      processCoalesceTimer();
+    } else if (fd == MPTimerFD_) {
+      processMPTimer();
+    } else if (netCommEnabled_ && fd == udpSocket_) {
+      processUDPSocket();
+    } else if (netCommEnabled_ && fd == tcpSocket_) {
+      acceptClient(tcpSocket_, PyConnectNetComm::NETWORK);
+    } else if (IPCCommEnabled_ && fd == domainSocket_) {
+      acceptClient(domainSocket_, PyConnectNetComm::LOCALIPC);
+    } else if (fd == IPCWatchFD_) {
+      processIPCWatch();
+    } else {
+      return;
+    }
+#ifdef MULTI_THREAD
+    pthread_mutex_lock(&g_mutex);
+#endif
+    uringArm(fd, NULL, URING_POLL);
+    uring_->submit();
+#ifdef MULTI_THREAD
+    pthread_mutex_unlock(&g_mutex);
+#endif
+    return;
+  }
+
+  if (op == URING_READABLE) {
+    if (res < 0)
+      return; // cancelled along with its fd
+#ifdef MULTI_THREAD
+    pthread_mutex_lock(&g_mutex);
+#endif
+    ClientFD *FDPtr = uringClient(userData);
+#ifdef MULTI_THREAD
+    pthread_mutex_unlock(&g_mutex);
+#endif
+    if (!FDPtr)
+      return;
+
+    SOCKET_T clientSock = FDPtr->fd;
+    bool alive = true;
+#ifdef PYCONNECT_USE_SHM
+    if (fd != clientSock)
+      alive = processShmBell(FDPtr);
+    else
+#endif
+      alive = processClientInput(FDPtr);
+
+#ifdef MULTI_THREAD
+    pthread_mutex_lock(&g_mutex);
+#endif
+    if (alive && (FDPtr = uringClient(userData)) != NULL) {
+      uringArm(fd, FDPtr, URING_READABLE);
+      uring_->submit();
+    }
+#ifdef MULTI_THREAD
+    pthread_mutex_unlock(&g_mutex);
+#endif
+    if (!alive)
+      destroyCurrentClient(clientSock);
+    return;
+  }
+
+  unsigned short bufferID = 0;
+  unsigned char *data = NULL;
+  if (flags & IORING_CQE_F_BUFFER) {
+    bufferID = (unsigned short)(flags >> IORING_CQE_BUFFER_SHIFT);
+    data = uring_->buffer(bufferID);
+  }
+
+#ifdef MULTI_THREAD
+  pthread_mutex_lock(&g_mutex);
+#endif
+  ClientFD *FDPtr = (op == URING_NONE) ? NULL : uringClient(userData);
+  if (FDPtr && op == URING_WRITABLE) {
+    if (res >= 0 && !FDPtr->broken && flushOutboundQueue(FDPtr) &&
+        FDPtr->outQueue.head) {
+      uringArm(fd, FDPtr, URING_WRITABLE);
+      uring_->submit();
+    }
+    FDPtr = NULL;
+  }
+  if (!FDPtr && data)
+    uring_->recycleBuffer(bufferID);
+#ifdef MULTI_THREAD
+  pthread_mutex_unlock(&g_mutex);
+#endif
+
+  if (!FDPtr)
+    return;
+
+  bool alive = true;
+  if (res > 0 && data) {
+    alive = processClientInput(FDPtr, data, res);
+  } else if (res == -ENOBUFS) {
+    // the buffers are all in flight, they come back as we go through the
+    // rest of the completion queue
+  } else if (res != -ECANCELED) {
+    if (res == 0) {
+      INFO_MSG("Socket connection %d closed.\n", fd);
+    } else {
+      ERROR_MSG("PyConnectNetComm::uringProcessing: "
+                "error reading data stream on %d error = %d.\n",
+                fd, -res);
+    }
+    objCommChannelShutdown(fd, true);
+    alive = false;
+  }
+
+#ifdef MULTI_THREAD
+  pthread_mutex_lock(&g_mutex);
+#endif
+  if (data)
+    uring_->recycleBuffer(bufferID);
+  // the client may have been dropped while its input was processed
+  if (alive && !(flags & IORING_CQE_F_MORE) && res != -ECANCELED &&
+      (FDPtr = uringClient(userData)) != NULL) {
+    uringArm(fd, FDPtr, URING_RECV);
+    uring_->submit();
+  }
+#ifdef MULTI_THREAD
+  pthread_mutex_unlock(&g_mutex);
+#endif
+
+  if (!alive)
+    destroyCurrentClient(fd);
+}
+
+// hold a frame for FDPtr back until the batch is submitted. A second frame
+// for the same connection submits the batch first so the two cannot be
+// reordered. Caller must hold the comm mutex.
+void PyConnectNetComm::queuePendingSend(ClientFD *FDPtr,
+                                        const unsigned char *data, int size,
+                                        bool copyData,
+                                        unsigned char frameFlags) {
+#ifdef PYCONNECT_USE_SHM
+  if (FDPtr->shm && FDPtr->shm->switchPending)
+    switchToShmChannel(FDPtr);
+  if (FDPtr->shm && FDPtr->shm->sending) {
+    // a copy into the ring is all it takes
+    sendFrame(FDPtr, data, size, frameFlags);
+    return;
+  }
+#endif
+  for (PendingSendList::const_iterator iter = sendBatch_.begin();
+       iter != sendBatch_.end(); ++iter) {
+    if (iter->FDPtr == FDPtr) {
+      submitSendBatch();
+      break;
+    }
+  }
+
+  PendingSend pending;
+  pending.FDPtr = FDPtr;
+  pending.headerLength = packFrameHeader(pending.header, size, frameFlags);
+  pending.trailerLength =
+      packFrameTrailer(pending.trailer, data, size, frameFlags);
+  pending.frameFlags = frameFlags;
+  pending.ownedOffset = -1;
+  pending.done = false;
+  if (copyData) {
+    // the copy may move as the buffer grows, submitSendBatch finds it by
+    // its offset
+    if (!reserveDataBuffer(sendBatchData_, sendBatchDataSize_,
+                           sendBatchDataLength_, sendBatchDataLength_ + size)) {
+      sendFrame(FDPtr, data, size, frameFlags);
+      return;
+    }
+    memcpy(sendBatchData_ + sendBatchDataLength_, data, size);
+    pending.ownedOffset = sendBatchDataLength_;
+    sendBatchDataLength_ += size;
+    data = NULL;
+  }
+  pending.data = data;
+  pending.size = size;
+  sendBatch_.push_back(pending);
+}
+
+// true if a frame for FDPtr is among those prepared for the round of sends
+// from batchStart up to batchEnd.
+bool PyConnectNetComm::isSocketInRound(size_t batchStart, size_t batchEnd,
+                                       ClientFD *FDPtr) {
+  for (size_t i = batchStart; i < batchEnd; i++) {
+    if (sendBatch_[i].FDPtr == FDPtr && !sendBatch_[i].done)
+      return true;
+  }
+  return false;
+}
+
+// write out all held back frames with one io_uring_enter per
+// PYCONNECT_URING_SEND_ENTRIES frames. Sends are non-blocking, whatever a
+// socket does not take goes to its outbound queue as with sendFrame.
+// Caller must hold the comm mutex.
+void PyConnectNetComm::submitSendBatch() {
+  size_t batchStart = 0;
+
+  for (PendingSendList::iterator iter = sendBatch_.begin();
+       iter != sendBatch_.end(); ++iter) {
+    if (iter->ownedOffset >= 0)
+      iter->data = sendBatchData_ + iter->ownedOffset;
+  }
+
+  while (sendRing_ && batchStart < sendBatch_.size()) {
+    size_t batchEnd = batchStart;
+    unsigned int prepared = 0;
+    for (; batchEnd < sendBatch_.size() &&
+           prepared < PYCONNECT_URING_SEND_ENTRIES;
+         batchEnd++) {
+      PendingSend &pending = sendBatch_[batchEnd];
+      ClientFD *FDPtr = pending.FDPtr;
+      if (FDPtr->broken) {
+        pending.done = true;
+        continue;
+      }
+      if (FDPtr->outQueue.head) { // stay behind the queued frames
+        queueFrame(FDPtr, pending.header, pending.headerLength, pending.data,
+                   pending.size, pending.trailer, pending.trailerLength, 0);
+        pending.done = true;
+        continue;
+      }
+      // one send per socket and round: should it be cut short, the next
+      // frame must go behind its remainder rather than after it on the wire
+      if (isSocketInRound(batchStart, batchEnd, FDPtr))
+        break;
+      struct io_uring_sqe *sqe = sendRing_->getSQE();
+      if (!sqe)
+        break;
+      pending.iov[0].iov_base = pending.header;
+      pending.iov[0].iov_len = pending.headerLength;
+      pending.iov[1].iov_base = (void *)pending.data;
+      pending.iov[1].iov_len = pending.size;
+      pending.iov[2].iov_base = pending.trailer;
+      pending.iov[2].iov_len = pending.trailerLength;
+      memset(&pending.msg, 0, sizeof(pending.msg));
+      pending.msg.msg_iov = pending.iov;
+      pending.msg.msg_iovlen = 3;
+
+      sqe->opcode = IORING_OP_SENDMSG;
+      sqe->fd = FDPtr->fd;
+      sqe->addr = (unsigned long)&pending.msg;
+      sqe->len = 1;
+      sqe->msg_flags = MSG_NOSIGNAL | MSG_DONTWAIT;
+      sqe->user_data = batchEnd;
+      prepared++;
+    }
+
+    if ((prepared > 0 && sendRing_->submit(prepared) < 0) ||
+        batchEnd == batchStart) {
+      // nothing went out, finish the batch the plain way without the ring
+      ERROR_MSG("PyConnectNetComm::submitSendBatch: io_uring_enter failed "
+                "error = %d, sending without io_uring.\n",
+                errno);
+      delete sendRing_;
+      sendRing_ = NULL;
+      break;
+    }
+    while (prepared > 0) {
+      struct io_uring_cqe *cqe = sendRing_->peekCQE();
+      if (!cqe) {
+        sendRing_->waitCQE();
+        continue;
+      }
+      PendingSend &pending = sendBatch_[(size_t)cqe->user_data];
+      int res = cqe->res;
+      sendRing_->seenCQE();
+      pending.done = true;
+      prepared--;
+
+      if (res == pending.headerLength + pending.size + pending.trailerLength)
+        continue;
+      if (res >= 0 || res == -EAGAIN) {
+        queueFrame(pending.FDPtr, pending.header, pending.headerLength,
+                   pending.data, pending.size, pending.trailer,
+                   pending.trailerLength, res > 0 ? res : 0);
+      } else {
+        ERROR_MSG("PyConnectNetComm::submitSendBatch: error sending data on "
+                  "%d error = %d.\n",
+                  pending.FDPtr->fd, -res);
+        shutdownBrokenClient(pending.FDPtr);
+      }
+    }
+    batchStart = batchEnd;
+  }
+
+  for (; batchStart < sendBatch_.size(); batchStart++) {
+    PendingSend &pending = sendBatch_[batchStart];
+    if (!pending.done)
+      sendFrame(pending.FDPtr, pending.data, pending.size, pending.frameFlags);
+  }
+  clearSendBatch();
+}
+
+void PyConnectNetComm::clearSendBatch() {
+  sendBatch_.clear();
+  sendBatchDataLength_ = 0;
+}
+
+// forget the held back frames of a client that is going away. Caller must
+// hold the comm mutex.
+void PyConnectNetComm::dropPendingSends(ClientFD *FDPtr) {
+  PendingSendList::iterator iter = sendBatch_.begin();
+  while (iter != sendBatch_.end()) {
+    if (iter->FDPtr == FDPtr) {
+      iter = sendBatch_.erase(iter);
+    } else {
+      ++iter;
+    }
+  }
+}
+#endif // PYCONNECT_USE_IO_URING
+
+#ifdef PYCONNECT_USE_EPOLL
+// map fd to its client for the reactor, growing the table as needed
+void PyConnectNetComm::setClientFDTableEntry(ReactorShard &shard, SOCKET_T fd,
+                                             ClientFD *FDPtr) {
+  if (fd >= shard.clientFDTableSize) {
+    if (!FDPtr)
+      return;
+    int newSize = shard.clientFDTableSize > 0 ? shard.clientFDTableSize : 64;
+    while (newSize <= fd)
+      newSize *= 2;
+    ClientFD **newTable = new ClientFD *[newSize];
+    memset(newTable, 0, newSize * sizeof(ClientFD *));
+    if (shard.clientFDTable) {
+      memcpy(newTable, shard.clientFDTable,
+             shard.clientFDTableSize * sizeof(ClientFD *));
+      delete[] shard.clientFDTable;
+    }
+    shard.clientFDTable = newTable;
+    shard.clientFDTableSize = newSize;
+  }
+  shard.clientFDTable[fd] = FDPtr;
+}
+
+PyConnectNetComm::ClientFD *PyConnectNetComm::shardClient(ReactorShard &shard,
+                                                          SOCKET_T fd) {
+  return (fd < shard.clientFDTableSize) ? shard.clientFDTable[fd] : NULL;
+}
+#endif
+
+// register fd with whatever waits for its readiness: the select fd set,
+// the epoll instance, the io_uring or the application's own main loop.
+void PyConnectNetComm::watchFD(SOCKET_T fd, ClientFD *FDPtr) {
+#ifdef PYCONNECT_USE_IO_URING
+  if (uring_) {
+    if (FDPtr)
+      setClientFDTableEntry(shards_[0], fd, FDPtr);
+    URingOp op = FDPtr ? URING_RECV : URING_POLL;
+#ifdef PYCONNECT_USE_SHM
+    // descriptors passed with a shared memory offer need our own recvmsg
+    if (FDPtr &&
+        (fd != FDPtr->fd || FDPtr->domain == PyConnectNetComm::LOCALIPC))
+      op = URING_READABLE;
+#endif
+    uringArm(fd, FDPtr, op);
+    uring_->submit();
+    return;
+  }
+#endif
+#ifdef PYCONNECT_USE_EPOLL
+  ReactorShard &shard = shards_[FDPtr ? FDPtr->shard : 0];
+  if (shard.epollFD != -1) {
+    if (FDPtr)
+      setClientFDTableEntry(shard, fd, FDPtr);
+
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    // a client adopted by a shard may have queued output already
+    bool queued = FDPtr && fd == FDPtr->fd && FDPtr->outQueue.head;
+    event.events = queued ? (EPOLLIN | EPOLLOUT) : EPOLLIN;
+    event.data.fd = fd;
+    if (epoll_ctl(shard.epollFD, EPOLL_CTL_ADD, fd, &event) < 0) {
+      ERROR_MSG("PyConnectNetComm::watchFD: unable to add %d to epoll "
+                "error = %d\n",
+                fd, errno);
+    }
+    wakeupReactor(shard);
+    return;
+  }
+#endif
+  FD_SET(fd, &masterFDSet_);
+#ifdef WIN32
+  maxFD_++;
+#else
+  maxFD_ = max(maxFD_, fd);
+#endif
+  if (pFDOwner_)
+    pFDOwner_->setFD(fd);
+}
+
+void PyConnectNetComm::unwatchFD(SOCKET_T fd, ClientFD *FDPtr) {
+#ifdef PYCONNECT_USE_IO_URING
+  if (uring_) {
+    setClientFDTableEntry(shards_[0], fd, NULL);
+    // drop the pending receive or poll before fd is closed and reused.
+    // Their completions come back with -ECANCELED and are ignored.
+    struct io_uring_sqe *sqe = uring_->getSQE();
+    if (!sqe) {
+      uring_->submit();
+      sqe = uring_->getSQE();
+    }
+    if (sqe) {
+      sqe->opcode = IORING_OP_ASYNC_CANCEL;
+      sqe->fd = fd;
+      sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+      sqe->user_data = URING_NONE;
+      uring_->submit();
+    }
+    return;
+  }
+#endif
+#ifdef PYCONNECT_USE_EPOLL
+  ReactorShard &shard = shards_[FDPtr ? FDPtr->shard : 0];
+  if (shard.epollFD != -1) {
+    setClientFDTableEntry(shard, fd, NULL);
+    // fails harmlessly if fd is already closed, which removes it anyway
+    epoll_ctl(shard.epollFD, EPOLL_CTL_DEL, fd, NULL);
+    wakeupReactor(shard);
+    return;
+  }
+#endif
+  FD_CLR(fd, &masterFDSet_);
+  if (pFDOwner_)
+    pFDOwner_->clearFD(fd);
+}
+
+// ask to be told when the client can take more data. select builds its
+// write set from the queues directly, so only the reactors need to know.
+void PyConnectNetComm::setWriteInterest(ClientFD *FDPtr, bool enable) {
+#ifdef PYCONNECT_USE_SHM
+  if (FDPtr->shm && FDPtr->shm->sending)
+    return; // the peer rings our bell once it has made room
+#endif
+#ifdef PYCONNECT_USE_IO_URING
+  if (uring_) {
+    // a one shot poll, re-armed by the completion while data is queued
+    if (enable) {
+      uringArm(FDPtr->fd, FDPtr, URING_WRITABLE);
+      uring_->submit();
+    }
+    return;
+  }
+#endif
+#ifdef PYCONNECT_USE_EPOLL
+  ReactorShard &shard = shards_[FDPtr->shard];
+  if (shard.epollFD != -1) {
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = enable ? (EPOLLIN | EPOLLOUT) : EPOLLIN;
+    event.data.fd = FDPtr->fd;
+    epoll_ctl(shard.epollFD, EPOLL_CTL_MOD, FDPtr->fd, &event);
+  }
+#endif
+}
+
+void PyConnectNetComm::dataPacketSender(const unsigned char *data, int size,
+                                        bool broadcast) {
+  int msgType = verifyNegotiationMsg(data, size);
+  if (msgType != pyconnect::MODULE_DISCOVERY &&
+      msgType != pyconnect::MODULE_DECLARE) {
+    if (!broadcast) {
+      clientDataSend(data, size);
+      return;
+    }
+    if (netCommEnabled_)
+      netBroadcastSend(data, size);
+    if (IPCCommEnabled_)
+      localBroadcastSend(data, size);
+    return;
+  }
+
+  // discovery and declaration messages tell the other end what we take,
+  // see negotiationCaps
+  unsigned char *modData = new unsigned char[size + 1 + sizeof(short)];
+  memcpy(modData, data, size - 1); // exclude message end char
+  modData[size - 1] = kCapsFramesV2;
+  if (!broadcast) {
+    modData[size] = pyconnect::PYCONNECT_MSG_END;
+    clientDataSend(modData, size + 1);
+    delete[] modData;
+    return;
+  }
+  if (netCommEnabled_) {
+    // a hack job to pass on TCP port in use in declaration messages
+    unsigned char *modDataPtr = modData + size;
+    memcpy(modDataPtr, (unsigned char *)&portInUse_, sizeof(short));
+    modDataPtr += sizeof(short);
+    *modDataPtr = pyconnect::PYCONNECT_MSG_END;
+    netBroadcastSend(modData, size + 1 + sizeof(short));
+  }
+  if (IPCCommEnabled_) {
+    modData[size] = pyconnect::PYCONNECT_MSG_END;
+    localBroadcastSend(modData, size + 1);
+  }
+  delete[] modData;
+}
+
+void PyConnectNetComm::netBroadcastSend(const unsigned char *data, int size) {
+  if (size <= 0)
+    return;
+
+  unsigned char *outputData = NULL;
+  int outputLength = 0;
+
+  if (encryptMessage(data, size, &outputData, &outputLength) != 1) {
+    return;
+  }
+
+#ifdef MULTI_THREAD
+#ifdef WIN32
+  EnterCriticalSection(&g_criticalSection);
+#else
+  pthread_mutex_lock(&g_mutex);
+#endif
+#endif
+
+  if (netCommEnabled_) {
+    if (sendto(udpSocket_, (char *)outputData, outputLength, 0,
+               (struct sockaddr *)&bcAddr_, sizeof(bcAddr_)) < 0) {
+      ERROR_MSG("PyConnectNetComm::broadcastSend: Error sending UDP broadcast "
+                "packet.\n");
+    }
+  }
+
+#ifdef MULTI_THREAD
+#ifdef WIN32
+  LeaveCriticalSection(&g_criticalSection);
+#else
+  pthread_mutex_unlock(&g_mutex);
+#endif
+#endif
+}
+
+void PyConnectNetComm::localBroadcastSend(const unsigned char *data, int size) {
+#ifndef WIN32
+  if (size <= 0)
+    return;
+
+  // each server gets the message encrypted the way it has agreed to, each
+  // way done once. Messages held back for the servers go out ahead of it;
+  // their encryption reuses the same buffers, so it comes after.
+  OutgoingMessage message = {data, size, NULL, 0, NULL, 0, false};
+
+#ifdef MULTI_THREAD
+  pthread_mutex_lock(&g_mutex);
+#endif
+
+  if (coalesceWindowUSec_ >= 0) {
+    for (ClientFD *FDPtr = clientFDList_; FDPtr; FDPtr = FDPtr->pNext) {
+      if (FDPtr->domain == PyConnectNetComm::LOCALIPC)
+        flushCoalescedBatch(FDPtr);
+    }
+  }
+
+  if (IPCCommEnabled_) {
+    SOCKET_T fd = INVALID_SOCKET;
+    // make sure connections to all available servers are established.
+    // The list is kept up to date as servers come and go where the socket
+    // directory can be watched.
+    if (IPCWatchFD_ == INVALID_SOCKET)
+      consolidateIPCSockets();
+
+#ifdef PYCONNECT_USE_IO_URING
+    // frames held back by an open batch go out first
+    if (sendRing_ && !sendBatch_.empty())
+      submitSendBatch();
+#endif
+    ClientSocketList::iterator iter = liveServerSocketList_.begin();
+    while (iter != liveServerSocketList_.end()) {
+      int procID = *iter;
+      fd = findOrCreateIPCTalker(procID);
+      if (fd == INVALID_SOCKET && !isProcessAlive(procID)) {
+        // gone without cleaning up after itself
+        removeDeadIPCSocket(procID);
+        iter = liveServerSocketList_.erase(iter);
+        continue;
+      }
+      ++iter;
+      ClientFD *FDPtr = findClientByFd(fd);
+      const unsigned char *outputData = NULL;
+      int outputLength = 0;
+      unsigned char frameFlags = 0;
+      if (!FDPtr || !encryptForClient(FDPtr, message, outputData,
+                                      outputLength, frameFlags))
+        continue;
+#ifdef PYCONNECT_USE_REACTOR_SHARDS
+      if (handOffFrame(FDPtr, outputData, outputLength, frameFlags))
+        continue;
+#endif
+#ifdef PYCONNECT_USE_IO_URING
+      // one submission for all servers
+      if (sendRing_) {
+        queuePendingSend(FDPtr, outputData, outputLength, false, frameFlags);
+        continue;
+      }
+#endif
+      sendFrame(FDPtr, outputData, outputLength, frameFlags);
+    }
+#ifdef PYCONNECT_USE_IO_URING
+    if (sendRing_)
+      submitSendBatch();
+#endif
+  }
+
+#ifdef MULTI_THREAD
+  pthread_mutex_unlock(&g_mutex);
+#endif
+  waitForOutboundRoom();
+#endif // !WIN32
+}
+
+void PyConnectNetComm::clientDataSend(const unsigned char *data, int size) {
+  if (size <= 0)
+    return;
+
+  // the message is encrypted once its peer is known, unless it is held
+  // back; held back messages are encrypted together when their batch goes
+  // out.
+  OutgoingMessage message = {data, size, NULL, 0, NULL, 0, false};
+  const unsigned char *outputData = NULL;
+  int outputLength = 0;
+  unsigned char frameFlags = 0;
+
+#ifdef MULTI_THREAD
+#ifdef WIN32
+  EnterCriticalSection(&g_criticalSection);
+#else
+  pthread_mutex_lock(&g_mutex);
+#endif
+#endif
+
+  SOCKET_T mysock = findOrAddCommChanByMsgID(data);
+
+  ClientFD *FDPtr = findClientByFd(mysock);
+  bool batching = FDPtr && coalesceWindowUSec_ >= 0;
+#ifdef PYCONNECT_USE_REACTOR_SHARDS
+  // the batch held back for a client is left to the thread running its
+  // shard; other threads hand their messages over one by one
+  batching = batching && isShardOwner(FDPtr);
+#endif
+  if (batching) {
+    if (coalesceMessage(FDPtr, data, size)) {
+#ifdef MULTI_THREAD
+#ifdef WIN32
+      LeaveCriticalSection(&g_criticalSection);
+#else
+      pthread_mutex_unlock(&g_mutex);
+#endif
+#endif
+      waitForOutboundRoom(); // a full batch may have gone out
+      return;
+    }
+    // not to be batched, it goes out on its own behind the held back ones
+    flushCoalescedBatch(FDPtr);
+  }
+  if (FDPtr)
+    compressForClient(FDPtr, message);
+  if (FDPtr && !encryptForClient(FDPtr, message, outputData, outputLength,
+                                 frameFlags))
+    FDPtr = NULL;
+  if (FDPtr) {
+    // DEBUG_MSG( "dispatch data to fd %d\n", mysock );
+#ifdef PYCONNECT_USE_REACTOR_SHARDS
+    // only the thread running a shard writes to its clients
+    if (handOffFrame(FDPtr, outputData, outputLength, frameFlags)) {
+      pthread_mutex_unlock(&g_mutex);
+      waitForOutboundRoom();
+      return;
+    }
+#endif
+#ifdef PYCONNECT_USE_IO_URING
+    if (sendRing_ && sendBatchDepth_ > 0) {
+      // outputData is reused by the next message, the batch keeps a copy
+      queuePendingSend(FDPtr, outputData, outputLength, true, frameFlags);
+    } else {
+      sendFrame(FDPtr, outputData, outputLength, frameFlags);
+    }
+#else
+    sendFrame(FDPtr, outputData, outputLength, frameFlags);
+#endif
+  }
+
+#ifdef MULTI_THREAD
+#ifdef WIN32
+  LeaveCriticalSection(&g_criticalSection);
+#else
+  pthread_mutex_unlock(&g_mutex);
+#endif
+#endif
+  waitForOutboundRoom();
+}
+
+// compress a message for a single peer that takes compressed frames, if it
+// is large enough to be worth it. It stays as it is if it does not shrink.
+void PyConnectNetComm::compressForClient(ClientFD *FDPtr,
+                                         OutgoingMessage &message) {
+  unsigned char *compressed = NULL;
+  int compressedLength = 0;
+  if (!FDPtr->compressing || message.size < compressThreshold_ ||
+      compressMessage(message.data, message.size, &compressed,
+                      &compressedLength) != 1)
+    return;
+
+  message.data = compressed;
+  message.size = compressedLength;
+  message.compressed = true;
+}
+
+// encrypt message for FDPtr: not at all if both ends have agreed to plain
+// frames, checksummed instead if the peer checks them, sealed if the peer
+// has taken up sealed frames, and with Blowfish otherwise.
+bool PyConnectNetComm::encryptForClient(ClientFD *FDPtr,
+                                        OutgoingMessage &message,
+                                        const unsigned char *&outputData,
+                                        int &outputLength,
+                                        unsigned char &frameFlags) {
+  unsigned char codecFlags =
+      message.compressed ? PYCONNECT_FRAME_COMPRESSED : 0;
+  if (FDPtr->plain) {
+    outputData = message.data;
+    outputLength = message.size;
+    frameFlags = PYCONNECT_FRAME_PLAIN | codecFlags;
+    if (FDPtr->checksummed)
+      frameFlags |= PYCONNECT_FRAME_CRC;
+    return true;
+  }
+  if (FDPtr->sealed) {
+    if (!message.sealed && sealMessage(message.data, message.size,
+                                       &message.sealed,
+                                       &message.sealedLength) != 1) {
+      message.sealed = NULL;
+      return false;
+    }
+    outputData = message.sealed;
+    outputLength = message.sealedLength;
+    frameFlags = PYCONNECT_FRAME_SEALED | codecFlags;
+    return true;
+  }
+
+  if (!message.encrypted &&
+      encryptMessage(message.data, message.size, &message.encrypted,
+                     &message.encryptedLength) != 1) {
+    message.encrypted = NULL;
+    return false;
+  }
+  outputData = message.encrypted;
+  outputLength = message.encryptedLength;
+  frameFlags = codecFlags;
+  return true;
+}
+
+// send data as one stream frame. Header, payload and trailer go out with a
+// single vectored write so the payload is never copied; anything the socket
+// does not take right away is queued behind earlier frames. Caller must
+// hold the comm mutex.
+bool PyConnectNetComm::sendFrame(ClientFD *FDPtr, const unsigned char *data,
+                                 int size, unsigned char frameFlags) {
+#ifdef PYCONNECT_USE_SHM
+  if (FDPtr->shm && FDPtr->shm->switchPending && !FDPtr->broken)
+    switchToShmChannel(FDPtr);
+#endif
+  if (FDPtr->broken)
+    return false;
+
+  unsigned char header[PYCONNECT_FRAME_V2_HEADER_SIZE];
+  unsigned char trailer[kMaxFrameTrailerSize];
+  int headerLength = packFrameHeader(header, size, frameFlags);
+  int trailerLength = packFrameTrailer(trailer, data, size, frameFlags);
+  int sentBytes = 0;
+
+  if (FDPtr->outQueue.head == NULL) { // nothing in front of us
+#ifdef PYCONNECT_USE_SHM
+    if (FDPtr->shm && FDPtr->shm->sending)
+      sentBytes = writeShmFrameParts(FDPtr->shm, header, headerLength, data,
+                                     size, trailer, trailerLength);
+    else
+#endif
+      sentBytes = writeFrameParts(FDPtr->fd, header, headerLength, data, size,
+                                  trailer, trailerLength);
+    if (sentBytes < 0) {
+      ERROR_MSG("PyConnectNetComm::sendFrame: error sending data on %d "
+                "error = %d.\n",
+                FDPtr->fd, errno);
+      shutdownBrokenClient(FDPtr);
+      return false;
+    }
+    if (sentBytes == headerLength + size + trailerLength)
+      return true;
+  }
+  return queueFrame(FDPtr, header, headerLength, data, size, trailer,
+                    trailerLength, sentBytes);
+}
+
+// queue the unsent remainder of a frame, applying the overflow policy if
+// the queue is full. A partially written frame counts against the bound
+// like any other, but is always queued in full so the stream stays intact.
+// The frame is kept whole, with what has been written as the head offset,
+// so that queued frames can be told apart by their header.
+bool PyConnectNetComm::queueFrame(ClientFD *FDPtr, const unsigned char *header,
+                                  int headerLength, const unsigned char *data,
+                                  int size, const unsigned char *trailer,
+                                  int trailerLength, int sentBytes) {
+  int length = headerLength + size + trailerLength;
+
+  if (!makeRoomInOutboundQueue(FDPtr, length - sentBytes))
+    return false;
+
+  OutboundFrame *frame = new (std::nothrow) OutboundFrame;
+  unsigned char *frameData = new (std::nothrow) unsigned char[length];
+  if (!frame || !frameData) {
+    ERROR_MSG("PyConnectNetComm::queueFrame: unable to queue %d bytes on %d.\n",
+              length, FDPtr->fd);
+    delete frame;
+    delete[] frameData;
+    if (sentBytes > 0) // the peer has got half a frame
+      shutdownBrokenClient(FDPtr);
+    return false;
+  }
+
+  memcpy(frameData, header, headerLength);
+  memcpy(frameData + headerLength, data, size);
+  memcpy(frameData + headerLength + size, trailer, trailerLength);
+
+  frame->data = frameData;
+  frame->length = length;
+  frame->pNext = NULL;
+
+  // only a frame going out on an empty queue can have been partly written
+  OutboundQueue &queue = FDPtr->outQueue;
+  if (queue.tail) {
+    queue.tail->pNext = frame;
+  } else {
+    queue.head = frame;
+    queue.headOffset = sentBytes;
+    setWriteInterest(FDPtr, true);
+  }
+  queue.tail = frame;
+  queue.queuedBytes += length - sentBytes;
+  return true;
+}
+
+bool PyConnectNetComm::makeRoomInOutboundQueue(ClientFD *FDPtr, int length) {
+  OutboundQueue &queue = FDPtr->outQueue;
+
+  if (queue.queuedBytes == 0 ||
+      queue.queuedBytes + length <= maxOutboundQueueBytes_)
+    return true;
+
+  switch (overflowPolicy_) {
+  case BLOCK_SENDER:
+    // the frame is queued all the same; the sender waits once it has let
+    // go of the comm mutex. The reactor drains the queues, so it goes on
+    // with the queue over its bound instead.
+    if (!s_onReactor)
+      s_blockedFD = FDPtr->fd;
+    break;
+  case DROP_OLDEST: {
+    // frames are dropped whole; the one partially on the wire must stay,
+    // and so must control frames, which the peer cannot do without
+    OutboundFrame **framePtr =
+        (queue.headOffset > 0) ? &queue.head->pNext : &queue.head;
+    while (*framePtr && queue.queuedBytes + length > maxOutboundQueueBytes_) {
+      OutboundFrame *frame = *framePtr;
+      if (frame->length > 1 && frame->data[0] == PYCONNECT_MSG_INIT_V2 &&
+          (frame->data[1] & PYCONNECT_FRAME_CONTROL)) {
+        framePtr = &frame->pNext;
+        continue;
+      }
+      *framePtr = frame->pNext;
+      queue.queuedBytes -= frame->length;
+      delete[] frame->data;
+      delete frame;
+    }
+    queue.tail = queue.head;
+    while (queue.tail && queue.tail->pNext)
+      queue.tail = queue.tail->pNext;
+    if (!queue.head)
+      queue.headOffset = 0;
+  } break;
+  case DISCONNECT_PEER:
+    ERROR_MSG("PyConnectNetComm: outbound queue of %d is full (%d bytes), "
+              "disconnecting.\n",
+              FDPtr->fd, queue.queuedBytes);
+    shutdownBrokenClient(FDPtr);
+    return false;
+  }
+  return true;
+}
+
+// write out as much of the queue as the socket takes without blocking.
+// Returns false if the connection broke.
+bool PyConnectNetComm::flushOutboundQueue(ClientFD *FDPtr) {
+  OutboundQueue &queue = FDPtr->outQueue;
+
+  while (queue.head) {
+    OutboundFrame *frame = queue.head;
+    int sentBytes = 0;
+#ifdef PYCONNECT_USE_SHM
+    if (FDPtr->shm && FDPtr->shm->sending) {
+      struct iovec iov;
+      iov.iov_base = frame->data + queue.headOffset;
+      iov.iov_len = frame->length - queue.headOffset;
+      sentBytes = FDPtr->shm->write(&iov, 1);
+    } else
+#endif
+      sentBytes = (int)send(FDPtr->fd, (char *)frame->data + queue.headOffset,
+                            frame->length - queue.headOffset,
+                            MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (sentBytes < 0) {
+#ifdef WIN32
+      if (WSAGetLastError() == WSAEWOULDBLOCK)
+        return true;
+#else
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return true;
+#endif
+      ERROR_MSG("PyConnectNetComm::flushOutboundQueue: error sending data "
+                "on %d error = %d.\n",
+                FDPtr->fd, errno);
+      shutdownBrokenClient(FDPtr);
+      return false;
+    }
+    queue.headOffset += sentBytes;
+    queue.queuedBytes -= sentBytes;
+    if (queue.headOffset < frame->length)
+      return true; // socket buffer is full
+
+    queue.head = frame->pNext;
+    if (!queue.head) {
+      queue.tail = NULL;
+      setWriteInterest(FDPtr, false);
+    }
+    queue.headOffset = 0;
+    delete[] frame->data;
+    delete frame;
+  }
+#ifdef PYCONNECT_USE_SHM
+  if (FDPtr->shm && FDPtr->shm->switchPending)
+    switchToShmChannel(FDPtr);
+#endif
+  return true;
+}
+
+void PyConnectNetComm::flushOutboundQueues() {
+#ifdef MULTI_THREAD
+#ifdef WIN32
+  EnterCriticalSection(&g_criticalSection);
+#else
+  pthread_mutex_lock(&g_mutex);
+#endif
+#endif
+  for (ClientFD *FDPtr = clientFDList_; FDPtr; FDPtr = FDPtr->pNext) {
+    if (FDPtr->outQueue.head && !FDPtr->broken)
+      flushOutboundQueue(FDPtr);
+  }
+#ifdef MULTI_THREAD
+#ifdef WIN32
+  LeaveCriticalSection(&g_criticalSection);
+#else
+  pthread_mutex_unlock(&g_mutex);
+#endif
+#endif
+}
+
+// a sender that overfilled the outbound queue of a peer under BLOCK_SENDER
+// waits here, without the comm mutex, until the peer has taken enough of it
+// or has gone. Called by the sending functions on their way out.
+void PyConnectNetComm::waitForOutboundRoom() {
+  SOCKET_T fd = s_blockedFD;
+  bool pollSocket = true;
+
+  s_blockedFD = INVALID_SOCKET;
+  while (fd != INVALID_SOCKET) {
+#if defined(PYCONNECT_USE_SHM) || defined(PYCONNECT_USE_REACTOR_SHARDS)
+    if (!pollSocket) {
+      usleep(1000); // give the peer or the owning shard time to drain
+    } else
+#endif
+    {
+      struct pollfd pollFD;
+      pollFD.fd = fd;
+      pollFD.events = POLLOUT;
+      pollFD.revents = 0;
+      // a peer closed meanwhile shows up as an error
+#ifdef WIN32
+      if (WSAPoll(&pollFD, 1, -1) < 0)
+        return;
+#else
+      if (poll(&pollFD, 1, -1) < 0 && errno != EINTR)
+        return;
+#endif
+    }
+#ifdef MULTI_THREAD
+#ifdef WIN32
+    EnterCriticalSection(&g_criticalSection);
+#else
+    pthread_mutex_lock(&g_mutex);
+#endif
+#endif
+    ClientFD *FDPtr = findClientByFd(fd);
+    if (!FDPtr) {
+      fd = INVALID_SOCKET;
+#ifdef PYCONNECT_USE_REACTOR_SHARDS
+    } else if (!isShardOwner(FDPtr)) {
+      // only its shard writes to the peer; a stale size just means
+      // another round
+      pollSocket = false;
+      if (__atomic_load_n(&FDPtr->outQueue.queuedBytes, __ATOMIC_RELAXED) <=
+          maxOutboundQueueBytes_)
+        fd = INVALID_SOCKET;
+#endif
+    } else if (!flushOutboundQueue(FDPtr) ||
+               FDPtr->outQueue.queuedBytes <= maxOutboundQueueBytes_) {
+      fd = INVALID_SOCKET;
+    }
+#ifdef PYCONNECT_USE_SHM
+    else {
+      pollSocket = !FDPtr->shm || !FDPtr->shm->sending;
+    }
+#endif
+#ifdef MULTI_THREAD
+#ifdef WIN32
+    LeaveCriticalSection(&g_criticalSection);
+#else
+    pthread_mutex_unlock(&g_mutex);
+#endif
+#endif
+  }
+}
+
+void PyConnectNetComm::discardOutboundQueue(OutboundQueue &queue) {
+  while (queue.head) {
+    OutboundFrame *frame = queue.head;
+    queue.head = frame->pNext;
+    delete[] frame->data;
+    delete frame;
+  }
+  queue.tail = NULL;
+  queue.headOffset = queue.queuedBytes = 0;
+}
+
+// the connection can no longer be written to. Drop its queue and shut the
+// socket down; the read side then sees the close and removes the client
+// through the usual path, so it is safe to call from within processInput.
+void PyConnectNetComm::shutdownBrokenClient(ClientFD *FDPtr) {
+  FDPtr->broken = true;
+  discardOutboundQueue(FDPtr->outQueue);
+#ifdef WIN32
+  shutdown(FDPtr->fd, SD_BOTH);
+#else
+  shutdown(FDPtr->fd, SHUT_RDWR);
+#endif
+}
+
+// hold back messages to individual peers until endSendBatch so they can be
+// written out together. The io_uring backend submits the frames of a batch
+// at once; with coalescing on, the messages to each peer go out as one
+// frame. Otherwise they are sent right away.
+void PyConnectNetComm::beginSendBatch() {
+#ifdef MULTI_THREAD
+#ifdef WIN32
+  EnterCriticalSection(&g_criticalSection);
+#else
+  pthread_mutex_lock(&g_mutex);
+#endif
+#endif
+  sendBatchDepth_++;
+#ifdef MULTI_THREAD
+#ifdef WIN32
+  LeaveCriticalSection(&g_criticalSection);
+#else
+  pthread_mutex_unlock(&g_mutex);
+#endif
+#endif
+}
+
+void PyConnectNetComm::endSendBatch() {
+#ifdef MULTI_THREAD
+#ifdef WIN32
+  EnterCriticalSection(&g_criticalSection);
+#else
+  pthread_mutex_lock(&g_mutex);
+#endif
+#endif
+  if (sendBatchDepth_ > 0 && --sendBatchDepth_ == 0) {
+    if (coalesceWindowUSec_ >= 0)
+      flushCoalescedMessages();
+#ifdef PYCONNECT_USE_IO_URING
+    if (!sendBatch_.empty())
+      submitSendBatch();
+#endif
+  }
+#ifdef MULTI_THREAD
+#ifdef WIN32
+  LeaveCriticalSection(&g_criticalSection);
+#else
+  pthread_mutex_unlock(&g_mutex);
+#endif
+#endif
+}
+
+// gather the messages to each peer for up to windowUSec microseconds, or
+// until the end of a send batch, and send them encrypted as one unit in a
+// single batch frame. With a window of 0 they are held until the batch ends
+// or flushCoalescedMessages is called. Only peers that understand batch
+// frames can read them, so both ends have to agree on it.
+void PyConnectNetComm::setMessageCoalescing(bool enable, int windowUSec) {
+#ifdef MULTI_THREAD
+#ifdef WIN32
+  EnterCriticalSection(&g_criticalSection);
+#else
+  pthread_mutex_lock(&g_mutex);
+#endif
+#endif
+  if (!enable)
+    flushCoalescedMessages();
+  coalesceWindowUSec_ = enable ? (windowUSec > 0 ? windowUSec : 0) : -1;
+  if (pMP_)
+    initCoalesceTimer();
+#ifdef MULTI_THREAD
+#ifdef WIN32
+  LeaveCriticalSection(&g_criticalSection);
+#else
+  pthread_mutex_unlock(&g_mutex);
+#endif
+#endif
+}
+
+// send whatever is held back for any of the peers right away
+void PyConnectNetComm::flushCoalescedMessages() {
+#ifdef MULTI_THREAD
+#ifdef WIN32
+  EnterCriticalSection(&g_criticalSection);
+#else
+  pthread_mutex_lock(&g_mutex);
+#endif
+#endif
+  coalesceTimerArmed_ = false;
+  coalesceDue_ = 0;
+  for (ClientFD *FDPtr = clientFDList_; FDPtr; FDPtr = FDPtr->pNext)
+    flushCoalescedBatch(FDPtr);
+#ifdef MULTI_THREAD
+#ifdef WIN32
+  LeaveCriticalSection(&g_criticalSection);
+#else
+  pthread_mutex_unlock(&g_mutex);
+#endif
+#endif
+}
+
+// append a message to the batch held back for FDPtr, sending the batch
+// first if the message would overfill it. Returns false if the message is
+// too large to be batched or the peer does not read batch frames. Caller
+// must hold the comm mutex.
+bool PyConnectNetComm::coalesceMessage(ClientFD *FDPtr,
+                                       const unsigned char *data, int size) {
+  CoalesceBuffer &batch = FDPtr->coalesced;
+  int length = (int)sizeof(int) + size;
+
+  if (length > PYCONNECT_COALESCE_MAX_BYTES || FDPtr->broken ||
+      !FDPtr->framesV2)
+    return false;
+  if (batch.length + length > PYCONNECT_COALESCE_MAX_BYTES)
+    flushCoalescedBatch(FDPtr);
+  // with room for the nonce and tag to seal the batch where it is
+  if (!reserveDataBuffer(batch.data, batch.size,
+                         PYCONNECT_AEAD_NONCE_SIZE + batch.length,
+                         PYCONNECT_AEAD_NONCE_SIZE + batch.length + length +
+                             PYCONNECT_AEAD_TAG_SIZE))
+    return false;
+
+  unsigned char *dataPtr =
+      batch.data + PYCONNECT_AEAD_NONCE_SIZE + batch.length;
+  packToLENumber(size, dataPtr);
+  memcpy(dataPtr, data, size);
+  batch.length += length;
+  batch.count++;
+  armCoalesceTimer();
+  return true;
+}
+
+// compress, if it is worth it, and encrypt the messages held back for
+// FDPtr as one unit and send them in a batch frame. A lone message goes
+// out in a frame of its own. Sealing is done in place in the batch buffer
+// unless the batch has been compressed. Caller must hold the comm mutex.
+void PyConnectNetComm::flushCoalescedBatch(ClientFD *FDPtr) {
+  CoalesceBuffer &batch = FDPtr->coalesced;
+  if (batch.count == 0)
+    return;
+
+  unsigned char *data = batch.data + PYCONNECT_AEAD_NONCE_SIZE;
+  int size = batch.length;
+  unsigned char frameFlags = PYCONNECT_FRAME_BATCH;
+  if (batch.count == 1) {
+    data += sizeof(int);
+    size -= sizeof(int);
+    frameFlags = 0;
+  }
+  batch.length = batch.count = 0;
+
+  unsigned char *outputData = NULL;
+  int outputLength = 0;
+  bool compressed =
+      FDPtr->compressing && size >= compressThreshold_ &&
+      compressMessage(data, size, &outputData, &outputLength) == 1;
+  if (compressed) {
+    data = outputData;
+    size = outputLength;
+    frameFlags |= PYCONNECT_FRAME_COMPRESSED;
+  }
+  if (FDPtr->plain) {
+    outputData = data;
+    outputLength = size;
+    frameFlags |= PYCONNECT_FRAME_PLAIN;
+    if (FDPtr->checksummed)
+      frameFlags |= PYCONNECT_FRAME_CRC;
+  } else if (FDPtr->sealed && compressed) {
+    // the compression buffer has no room to seal in place
+    if (sealMessage(data, size, &outputData, &outputLength) != 1)
+      return;
+    frameFlags |= PYCONNECT_FRAME_SEALED;
+  } else if (FDPtr->sealed) {
+    if (sealMessageInPlace(data, size) != 1)
+      return;
+    outputData = data - PYCONNECT_AEAD_NONCE_SIZE;
+    outputLength = size + PYCONNECT_AEAD_OVERHEAD;
+    frameFlags |= PYCONNECT_FRAME_SEALED;
+  } else if (encryptMessage(data, size, &outputData, &outputLength) != 1) {
+    return;
+  }
+#ifdef PYCONNECT_USE_REACTOR_SHARDS
+  if (handOffFrame(FDPtr, outputData, outputLength, frameFlags))
+    return;
+#endif
+  sendFrame(FDPtr, outputData, outputLength, frameFlags);
+}
+
+// the flush window is kept by a timerfd the reactor waits on along with the
+// sockets. Without one, held back messages go out on the next pass of
+// processIncomingData. Caller must hold the comm mutex once init has run.
+void PyConnectNetComm::initCoalesceTimer() {
+#ifdef LINUX
+  if (coalesceWindowUSec_ <= 0 || coalesceTimerFD_ != INVALID_SOCKET)
+    return;
+
+  coalesceTimerFD_ =
+      timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (coalesceTimerFD_ == INVALID_SOCKET) {
+    ERROR_MSG("PyConnectNetComm::initCoalesceTimer: unable to create flush "
+              "timer error = %d, messages are held until the end of a "
+              "batch.\n",
+              errno);
+    return;
+  }
+  coalesceTimerArmed_ = false;
+  watchFD(coalesceTimerFD_);
+#endif
+}
+
+// start the flush window with the first message held back. Caller must
+// hold the comm mutex.
+void PyConnectNetComm::armCoalesceTimer() {
+#ifdef LINUX
+  if (coalesceTimerArmed_ || coalesceTimerFD_ == INVALID_SOCKET ||
+      coalesceWindowUSec_ <= 0)
+    return;
+
+  struct itimerspec expiry;
+  memset(&expiry, 0, sizeof(expiry));
+  expiry.it_value.tv_sec = coalesceWindowUSec_ / 1000000;
+  expiry.it_value.tv_nsec = (coalesceWindowUSec_ % 1000000) * 1000;
+  if (timerfd_settime(coalesceTimerFD_, 0, &expiry, NULL) == 0)
+    coalesceTimerArmed_ = true;
+#else
+  if (!coalesceDue_ && coalesceWindowUSec_ > 0)
+    coalesceDue_ = monotonicUSec() + coalesceWindowUSec_;
+#endif
+}
+
+void PyConnectNetComm::processCoalesceTimer() {
+#ifdef LINUX
+  uint64_t expirations = 0;
+  if (read(coalesceTimerFD_, &expirations, sizeof(expirations)) < 0 &&
+      errno != EAGAIN) {
+    ERROR_MSG("PyConnectNetComm::processCoalesceTimer: unable to read flush "
+              "timer error = %d\n",
+              errno);
+  }
+#endif
+  flushCoalescedMessages();
+}
+
+void PyConnectNetComm::initMPTimer() {
+#ifdef LINUX
+  if (MPTimerFD_ != INVALID_SOCKET)
+    return;
+
+  MPTimerFD_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (MPTimerFD_ == INVALID_SOCKET) {
+    ERROR_MSG("PyConnectNetComm::initMPTimer: unable to create timer "
+              "error = %d\n",
+              errno);
+    return;
+  }
+  watchFD(MPTimerFD_);
+#endif
+}
+
+bool PyConnectNetComm::setTimer(int usec) {
+#ifdef LINUX
+  if (MPTimerFD_ == INVALID_SOCKET)
+    return false;
+
+  // a zero expiry would disarm the timer
+  if (usec <= 0)
+    usec = 1;
+  struct itimerspec expiry;
+  memset(&expiry, 0, sizeof(expiry));
+  expiry.it_value.tv_sec = usec / 1000000;
+  expiry.it_value.tv_nsec = (usec % 1000000) * 1000;
+  return timerfd_settime(MPTimerFD_, 0, &expiry, NULL) == 0;
+#else
+#ifdef MULTI_THREAD
+#ifdef WIN32
+  EnterCriticalSection(&g_criticalSection);
+#else
+  pthread_mutex_lock(&g_mutex);
+#endif
+#endif
+  MPTimerDue_ = monotonicUSec() + (usec > 0 ? usec : 0);
+#ifdef MULTI_THREAD
+#ifdef WIN32
+  LeaveCriticalSection(&g_criticalSection);
+#else
+  pthread_mutex_unlock(&g_mutex);
+#endif
+#endif
+  return true;
+#endif
+}
+
+// called without the comm mutex, the message processor sends from it
+void PyConnectNetComm::processMPTimer() {
+#ifdef LINUX
+  uint64_t expirations = 0;
+  if (read(MPTimerFD_, &expirations, sizeof(expirations)) < 0 &&
+      errno != EAGAIN) {
+    ERROR_MSG("PyConnectNetComm::processMPTimer: unable to read timer "
+              "error = %d\n",
+              errno);
+  }
+#endif
+  if (!pMP_)
+    return;
+#ifdef PYCONNECT_USE_REACTOR_SHARDS
+  // the message processor is not reentrant, see processMessage
+  bool sharded = shardCount_ > 1;
+  if (sharded)
+    pthread_mutex_lock(&dispatchMutex_);
+#endif
+  pMP_->processTimer();
+#ifdef PYCONNECT_USE_REACTOR_SHARDS
+  if (sharded)
+    pthread_mutex_unlock(&dispatchMutex_);
+#endif
+}
 
-  if (encryptMessage(data, size, &outputData, &outputLength) != 1) {
-    return;
-  }
+#ifndef LINUX
+// the time in microseconds until the first of the timers kept without timer
+// fds is due, or maxUSec if that is sooner or none is set. -1 for maxUSec
+// is no limit. Caller must hold the comm mutex.
+int PyConnectNetComm::timerTimeoutUSec(int maxUSec) {
+  long long due = MPTimerDue_;
+  if (coalesceDue_ && (!due || coalesceDue_ < due))
+    due = coalesceDue_;
+  if (!due)
+    return maxUSec;
+  long long left = due - monotonicUSec();
+  if (left < 0)
+    left = 0;
+  if (maxUSec >= 0 && left > maxUSec)
+    return maxUSec;
+  return (int)left;
+}
 
+// run the timers kept without timer fds that are due. Called without the
+// comm mutex.
+void PyConnectNetComm::processDueTimers() {
 #ifdef MULTI_THREAD
 #ifdef WIN32
   EnterCriticalSection(&g_criticalSection);
@@ -535,15 +3493,11 @@ void PyConnectNetComm::netBroadcastSend(const unsigned char *data, int size) {
   pthread_mutex_lock(&g_mutex);
 #endif
 #endif
-
-  if (netCommEnabled_) {
-    if (sendto(udpSocket_, (char *)outputData, outputLength, 0,
-               (struct sockaddr *)&bcAddr_, sizeof(bcAddr_)) < 0) {
-      ERROR_MSG("PyConnectNetComm::broadcastSend: Error sending UDP broadcast "
-                "packet.\n");
-    }
-  }
-
+  long long now = monotonicUSec();
+  bool flushDue = coalesceDue_ && coalesceDue_ <= now;
+  bool timerDue = MPTimerDue_ && MPTimerDue_ <= now;
+  if (timerDue)
+    MPTimerDue_ = 0;
 #ifdef MULTI_THREAD
 #ifdef WIN32
   LeaveCriticalSection(&g_criticalSection);
@@ -551,64 +3505,37 @@ void PyConnectNetComm::netBroadcastSend(const unsigned char *data, int size) {
   pthread_mutex_unlock(&g_mutex);
 #endif
 #endif
+  if (flushDue)
+    flushCoalescedMessages();
+  if (timerDue)
+    processMPTimer();
 }
+#endif
 
-void PyConnectNetComm::localBroadcastSend(const unsigned char *data, int size) {
-#ifndef WIN32
-  if (size <= 0)
-    return;
-
-  unsigned char *outputData = NULL;
-  int outputLength = 0;
-
-  if (encryptMessage(data, size, &outputData, &outputLength) != 1) {
-    return;
-  }
-
+void PyConnectNetComm::setOutboundQueuePolicy(OverflowPolicy policy,
+                                              int maxQueuedBytes) {
 #ifdef MULTI_THREAD
+#ifdef WIN32
+  EnterCriticalSection(&g_criticalSection);
+#else
   pthread_mutex_lock(&g_mutex);
 #endif
-
-  if (IPCCommEnabled_) {
-    SOCKET_T fd = INVALID_SOCKET;
-    // make sure connections to all available servers are established
-    consolidateIPCSockets();
-
-    unsigned char *dataPtr = dispatchDataBuffer_;
-    *dataPtr++ = PYCONNECT_MSG_INIT;
-    short opl = (short)outputLength;
-    memcpy(dataPtr, &opl, sizeof(short));
-    dataPtr += sizeof(short);
-    memcpy(dataPtr, outputData, outputLength);
-    dataPtr += outputLength;
-    *dataPtr = PYCONNECT_MSG_END;
-    outputLength += (2 + sizeof(short));
-
-    for (ClientSocketList::const_iterator iter = liveServerSocketList_.begin();
-         iter != liveServerSocketList_.end(); ++iter) {
-      fd = findOrCreateIPCTalker(*iter);
-      if (fd != INVALID_SOCKET)
-        send(fd, dispatchDataBuffer_, outputLength, 0);
-    }
-  }
-
+#endif
+  overflowPolicy_ = policy;
+  maxOutboundQueueBytes_ = maxQueuedBytes;
 #ifdef MULTI_THREAD
+#ifdef WIN32
+  LeaveCriticalSection(&g_criticalSection);
+#else
   pthread_mutex_unlock(&g_mutex);
 #endif
-#endif // !WIN32
+#endif
 }
 
-void PyConnectNetComm::clientDataSend(const unsigned char *data, int size) {
-  if (size <= 0)
-    return;
-
-  unsigned char *outputData = NULL;
-  int outputLength = 0;
-
-  if (encryptMessage(data, size, &outputData, &outputLength) != 1) {
-    return;
-  }
-
+// bytes waiting to be sent on fd, or on all connections if fd is
+// INVALID_SOCKET
+int PyConnectNetComm::outboundQueueDepth(SOCKET_T fd) {
+  int queuedBytes = 0;
 #ifdef MULTI_THREAD
 #ifdef WIN32
   EnterCriticalSection(&g_criticalSection);
@@ -616,28 +3543,10 @@ void PyConnectNetComm::clientDataSend(const unsigned char *data, int size) {
   pthread_mutex_lock(&g_mutex);
 #endif
 #endif
-
-  SOCKET_T mysock = findOrAddCommChanByMsgID(data);
-
-  if (mysock != INVALID_SOCKET) {
-    // DEBUG_MSG( "dispatch data to fd %d\n", mysock );
-    unsigned char *dataPtr = dispatchDataBuffer_;
-    *dataPtr++ = PYCONNECT_MSG_INIT;
-    short opl = (short)outputLength;
-    memcpy(dataPtr, &opl, sizeof(short));
-    dataPtr += sizeof(short);
-    memcpy(dataPtr, outputData, outputLength);
-    dataPtr += outputLength;
-    *dataPtr = PYCONNECT_MSG_END;
-    outputLength += (2 + sizeof(short));
-
-#ifdef WIN32
-    send(mysock, (char *)dispatchDataBuffer_, outputLength, 0);
-#else
-    write(mysock, dispatchDataBuffer_, outputLength);
-#endif
+  for (ClientFD *FDPtr = clientFDList_; FDPtr; FDPtr = FDPtr->pNext) {
+    if (fd == INVALID_SOCKET || FDPtr->fd == fd)
+      queuedBytes += FDPtr->outQueue.queuedBytes;
   }
-
 #ifdef MULTI_THREAD
 #ifdef WIN32
   LeaveCriticalSection(&g_criticalSection);
@@ -645,15 +3554,15 @@ void PyConnectNetComm::clientDataSend(const unsigned char *data, int size) {
   pthread_mutex_unlock(&g_mutex);
 #endif
 #endif
+  return queuedBytes;
 }
 
 void PyConnectNetComm::processUDPInput(unsigned char *recBuffer, int recBytes,
                                        struct sockaddr_in &cAddr) {
-  unsigned char *message = NULL;
+  unsigned char *message = recBuffer; // decrypted in place
   int messageSize = 0;
 
-  if (decryptMessage(recBuffer, (int)recBytes, &message, (int *)&messageSize) !=
-      1) {
+  if (decryptMessageTo(recBuffer, recBytes, message, &messageSize) != 1) {
     WARNING_MSG("Unable to decrypt incoming messasge.\n");
     return;
   }
@@ -665,7 +3574,7 @@ void PyConnectNetComm::processUDPInput(unsigned char *recBuffer, int recBytes,
     break;
   case pyconnect::PEER_SERVER_MSG: {
     if (pMP_)
-      pMP_->processInput(message, messageSize, cAddr);
+      pMP_->processInput(message, messageSize, cAddr, true);
   } break;
   case pyconnect::MODULE_DECLARE:
   case pyconnect::PEER_SERVER_DISCOVERY:
@@ -684,7 +3593,9 @@ void PyConnectNetComm::processUDPInput(unsigned char *recBuffer, int recBytes,
     // DEBUG_MSG( "incoming port %d\n", ntohs( port ) & 0xffff );
     cAddr.sin_port = port;
     message[messageSize - sizeof(short) - 1] = pyconnect::PYCONNECT_MSG_END;
-    if (createTCPTalker(cAddr)) { // process udp data
+    unsigned char caps =
+        negotiationCaps(message, messageSize - (int)sizeof(short));
+    if (createTCPTalker(cAddr, caps & kCapsFramesV2)) { // process udp data
       MesgProcessResult procResult =
           pMP_->processInput(message, messageSize - sizeof(short), cAddr, true);
       if (procResult == MESG_TO_SHUTDOWN) {
@@ -712,7 +3623,10 @@ void PyConnectNetComm::processUDPInput(unsigned char *recBuffer, int recBytes,
   }
 }
 
-bool PyConnectNetComm::createTCPTalker(struct sockaddr_in &cAddr) {
+// connect to the peer at cAddr. framesV2 is set if it has told us it reads
+// '$' frames, so that we can announce our ciphers right away.
+bool PyConnectNetComm::createTCPTalker(struct sockaddr_in &cAddr,
+                                       bool framesV2) {
   SOCKET_T mySocket = socket(AF_INET, SOCK_STREAM, 0);
 
   if (mySocket == INVALID_SOCKET)
@@ -727,9 +3641,113 @@ bool PyConnectNetComm::createTCPTalker(struct sockaddr_in &cAddr) {
     return false;
   }
   addFdToClientList(mySocket, PyConnectNetComm::NETWORK, &cAddr);
+  if (framesV2)
+    notePeerFramesV2(mySocket);
   return true;
 }
 
+// the peer on fd has shown it reads '$' frames, by a capability bit in a
+// discovery or declaration message or by sending one itself. Only now is
+// it sent control and batch frames: we announce our ciphers, and the
+// connecting end of a local connection offers a shared memory channel.
+// Called without the comm mutex.
+void PyConnectNetComm::notePeerFramesV2(SOCKET_T fd) {
+#ifdef MULTI_THREAD
+#ifdef WIN32
+  EnterCriticalSection(&g_criticalSection);
+#else
+  pthread_mutex_lock(&g_mutex);
+#endif
+#endif
+  ClientFD *FDPtr = findClientByFd(fd);
+  bool known = !FDPtr || FDPtr->framesV2;
+  if (!known) {
+    FDPtr->framesV2 = true;
+#ifdef PYCONNECT_USE_SHM
+    if (FDPtr->domain == PyConnectNetComm::LOCALIPC && FDPtr->localProcID)
+      offerShmChannel(FDPtr);
+#endif
+  }
+#ifdef MULTI_THREAD
+#ifdef WIN32
+  LeaveCriticalSection(&g_criticalSection);
+#else
+  pthread_mutex_unlock(&g_mutex);
+#endif
+#endif
+  if (!known)
+    announceCiphers(fd);
+}
+
+// tell the peer on fd which ciphers we take, once it reads '$' frames.
+// Whichever end learns that first announces, even if it takes none of
+// them, and the other end answers with its own; from then on each sends
+// plain frames if both ends allow them on the connection, and seals what
+// it sends if the other can open it. Until then, and with a peer that
+// never gets there, both keep to Blowfish.
+void PyConnectNetComm::announceCiphers(SOCKET_T fd) {
+#ifdef MULTI_THREAD
+#ifdef WIN32
+  EnterCriticalSection(&g_criticalSection);
+#else
+  pthread_mutex_lock(&g_mutex);
+#endif
+#endif
+  ClientFD *FDPtr = findClientByFd(fd);
+  unsigned char ciphers = 0;
+  if (sealEnabled_)
+    ciphers |= kCipherAES256GCM;
+  if (FDPtr && FDPtr->trusted)
+    ciphers |= kCipherPlain;
+  if (FDPtr && FDPtr->trusted && frameCRCEnabled_)
+    ciphers |= kCipherCRC32C;
+  if (FDPtr && FDPtr->domain == PyConnectNetComm::NETWORK && !FDPtr->trusted)
+    ciphers |= kCodecDeflate; // we can always inflate
+  if (FDPtr && FDPtr->framesV2 && !FDPtr->ciphersAnnounced) {
+    const unsigned char announce[2] = {kControlCiphers, ciphers};
+    FDPtr->ciphersAnnounced = true;
+#ifdef PYCONNECT_USE_REACTOR_SHARDS
+    if (!handOffFrame(FDPtr, announce, sizeof(announce),
+                      PYCONNECT_FRAME_CONTROL))
+      sendFrame(FDPtr, announce, sizeof(announce), PYCONNECT_FRAME_CONTROL);
+#else
+    sendFrame(FDPtr, announce, sizeof(announce), PYCONNECT_FRAME_CONTROL);
+#endif
+  }
+#ifdef MULTI_THREAD
+#ifdef WIN32
+  LeaveCriticalSection(&g_criticalSection);
+#else
+  pthread_mutex_unlock(&g_mutex);
+#endif
+#endif
+}
+
+// plain frames are only for peers on this host running as our own user.
+// For local sockets the kernel tells us who the peer is, loopback TCP has
+// to be allowed explicitly.
+bool PyConnectNetComm::isTrustedPeer(SOCKET_T fd, FDDomain domain,
+                                     struct sockaddr_in *cAddr) {
+  if (domain == PyConnectNetComm::NETWORK) {
+    return loopbackPlainEnabled_ &&
+           (ntohl(cAddr->sin_addr.s_addr) >> 24) == 127; // 127.0.0.0/8
+  }
+  if (!IPCPlainEnabled_)
+    return false;
+#ifdef LINUX
+  struct ucred cred;
+  socklen_t credLen = sizeof(cred);
+  return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &credLen) == 0 &&
+         cred.uid == getuid();
+#elif defined(BSD_COMPAT)
+  uid_t uid = 0;
+  gid_t gid = 0;
+  return getpeereid(fd, &uid, &gid) == 0 && uid == getuid();
+#else
+  return false;
+#endif
+}
+
 #ifndef WIN32
 SOCKET_T PyConnectNetComm::findOrCreateIPCTalker(int procID) {
   SOCKET_T mySocket = findFdFromClientListByProcID(procID);
@@ -743,15 +3761,15 @@ SOCKET_T PyConnectNetComm::findOrCreateIPCTalker(int procID) {
     struct sockaddr_un dAddr;
     memset(&dAddr, 0, sizeof(dAddr));
     dAddr.sun_family = AF_UNIX;
-    sprintf(dAddr.sun_path, "%s/%s.%05d", PYCONNECT_DOMAINSOCKET_PATH,
-            PYCONNECT_CLTSOCKET_PREFIX, procID);
+    IPCSocketPath(dAddr.sun_path, sizeof(dAddr.sun_path),
+                  PYCONNECT_CLTSOCKET_PREFIX, procID);
 
     int connLen =
         int(offsetof(struct sockaddr_un, sun_path) + strlen(dAddr.sun_path));
 
     if (connect(mySocket, (struct sockaddr *)&dAddr, connLen) < 0) {
       close(mySocket);
-      mySocket = INVALID_SOCKET;
+      return INVALID_SOCKET;
     }
 
     INFO_MSG("connect to %s\n", dAddr.sun_path);
@@ -783,71 +3801,115 @@ PyConnectNetComm::findFdFromClientListByProcID(int procID) // for IPC only
   return INVALID_SOCKET;
 }
 
+void PyConnectNetComm::IPCSocketPath(char *path, size_t size,
+                                     const char *prefix, int procID) {
+  snprintf(path, size, "%s/%s.%05d", IPCPath_.c_str(), prefix, procID);
+}
+
+void PyConnectNetComm::removeDeadIPCSocket(int procID) {
+  char deadSocket[sizeof(((struct sockaddr_un *)0)->sun_path)];
+  IPCSocketPath(deadSocket, sizeof(deadSocket), PYCONNECT_CLTSOCKET_PREFIX,
+                procID);
+  INFO_MSG("Removing dead socket %s\n", deadSocket);
+  unlink(deadSocket);
+}
+
+// rebuild the list of local servers from the socket directory, removing
+// the sockets of processes that have gone. Only the sockets of PyConnect
+// processes live there, so this is one short readdir.
 void PyConnectNetComm::consolidateIPCSockets() {
-  DIR *socketDir = opendir(PYCONNECT_DOMAINSOCKET_PATH);
+  DIR *socketDir = opendir(IPCPath_.c_str());
   if (!socketDir) {
-    ERROR_MSG("Unable to access IPC path %s\n", PYCONNECT_DOMAINSOCKET_PATH);
+    ERROR_MSG("Unable to access IPC path %s\n", IPCPath_.c_str());
     return;
   }
-  char socketPattern[10];
-  sprintf(socketPattern, "%s.*", PYCONNECT_CLTSOCKET_PREFIX);
   struct dirent *dp = NULL;
-  ClientSocketList deadSocketList;
   liveServerSocketList_.clear();
 
   while ((dp = readdir(socketDir)) != NULL) {
-    if (fnmatch(socketPattern, dp->d_name, 0) == 0) {
-      // find corresponding process that create the socket
-      int procID =
-          (int)strtol(strlen(PYCONNECT_CLTSOCKET_PREFIX) + 1 + dp->d_name,
-                      (char **)NULL, 10);
-      if (procID == 0) {
-        ERROR_MSG("socket file name %s contains invalid process number\n",
-                  dp->d_name);
-        continue;
-      }
-      bool foundProc = false;
-#ifdef BSD_COMPAT
-      // check whether the process is still running
-      int kernQuery[4];
-      struct kinfo_proc kp;
-      size_t kplen = sizeof(kp);
-
-      kernQuery[0] = CTL_KERN;
-      kernQuery[1] = KERN_PROC;
-      kernQuery[2] = KERN_PROC_PID;
-      kernQuery[3] = procID;
-      foundProc =
-          ((sysctl(kernQuery, 4, &kp, &kplen, NULL, 0) == 0) && kplen > 0);
-#else // linux / solaris like
-      char procIDStr[6];
-      sprintf(procIDStr, "%d", procID);
-      DIR *procDir = opendir("/proc");
-      struct dirent *procdp = NULL;
-
-      while ((procdp = readdir(procDir)) != NULL && !foundProc) {
-        foundProc = (strcmp(procIDStr, procdp->d_name) == 0);
-      }
-      closedir(procDir);
+    int procID = serverSocketProcID(dp->d_name);
+    if (procID == 0)
+      continue;
+    if (isProcessAlive(procID))
+      liveServerSocketList_.push_back(procID);
+    else
+      removeDeadIPCSocket(procID);
+  }
+  closedir(socketDir);
+}
+
+// follow servers coming and going through the socket directory rather
+// than rescanning it for every broadcast. Without inotify the list is
+// rebuilt each time instead.
+void PyConnectNetComm::initIPCWatch() {
+#ifdef LINUX
+  IPCWatchFD_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (IPCWatchFD_ == INVALID_SOCKET)
+    return;
+  if (inotify_add_watch(IPCWatchFD_, IPCPath_.c_str(),
+                        IN_CREATE | IN_DELETE | IN_MOVED_TO | IN_MOVED_FROM) <
+      0) {
+    WARNING_MSG("Unable to watch IPC path %s error = %d\n", IPCPath_.c_str(),
+                errno);
+    close(IPCWatchFD_);
+    IPCWatchFD_ = INVALID_SOCKET;
+    return;
+  }
+  watchFD(IPCWatchFD_);
 #endif
-      if (foundProc) { // push onto a existing client list
-        liveServerSocketList_.push_back(procID);
-      } else { // push onto a dead socket list
-        deadSocketList.push_back(procID);
+}
+
+void PyConnectNetComm::processIPCWatch() {
+#ifdef LINUX
+  union {
+    struct inotify_event align;
+    char data[4096];
+  } events;
+
+#ifdef MULTI_THREAD
+  pthread_mutex_lock(&g_mutex);
+#endif
+  ssize_t length = 0;
+  while (IPCWatchFD_ != INVALID_SOCKET &&
+         (length = read(IPCWatchFD_, events.data, sizeof(events.data))) > 0) {
+    char *eventPtr = events.data;
+    while (eventPtr < events.data + length) {
+      struct inotify_event *event = (struct inotify_event *)eventPtr;
+      eventPtr += sizeof(struct inotify_event) + event->len;
+
+      if (event->mask & IN_Q_OVERFLOW) {
+        consolidateIPCSockets(); // lost track, start over
+      } else if (event->mask & IN_IGNORED) {
+        // the directory has gone, fall back to rescanning
+        unwatchFD(IPCWatchFD_);
+        close(IPCWatchFD_);
+        IPCWatchFD_ = INVALID_SOCKET;
+        break;
+      } else if (event->len > 0) {
+        int procID = serverSocketProcID(event->name);
+        if (procID != 0)
+          updateLiveServer(procID, (event->mask & (IN_CREATE | IN_MOVED_TO)));
       }
     }
   }
-  closedir(socketDir);
+#ifdef MULTI_THREAD
+  pthread_mutex_unlock(&g_mutex);
+#endif
+#endif
+}
 
-  char deadSocket[20];
-  for (ClientSocketList::const_iterator iter = deadSocketList.begin();
-       iter != deadSocketList.end(); ++iter) {
-    sprintf(deadSocket, "%s/%s.%05d", PYCONNECT_DOMAINSOCKET_PATH,
-            PYCONNECT_CLTSOCKET_PREFIX, *iter);
-    INFO_MSG("Removing dead socket %s\n", deadSocket);
-    unlink(deadSocket);
+// caller must hold the comm mutex
+void PyConnectNetComm::updateLiveServer(int procID, bool alive) {
+  for (ClientSocketList::iterator iter = liveServerSocketList_.begin();
+       iter != liveServerSocketList_.end(); ++iter) {
+    if (*iter == procID) {
+      if (!alive)
+        liveServerSocketList_.erase(iter);
+      return;
+    }
   }
-  deadSocketList.clear();
+  if (alive)
+    liveServerSocketList_.push_back(procID);
 }
 #endif // !WIN32
 
@@ -894,37 +3956,39 @@ void PyConnectNetComm::disableNetComm(bool onExit) {
 #endif
 #endif
   ClientFD *fdPtr = clientFDList_;
+  ClientFD *prevFdPtr = NULL;
   while (fdPtr) {
     if (fdPtr->domain != PyConnectNetComm::NETWORK) {
+      prevFdPtr = fdPtr;
       fdPtr = fdPtr->pNext;
       continue;
     }
 
     objCommChannelShutdown(fdPtr->fd, !onExit);
 
-#ifdef WIN32
-    shutdown(fdPtr->fd, SD_SEND);
-    closesocket(fdPtr->fd);
-#else
-    close(fdPtr->fd);
-#endif
-    if (pFDOwner_) {
-      pFDOwner_->clearFD(fdPtr->fd);
-    } else {
-      FD_CLR(fdPtr->fd, &masterFDSet_);
-#ifdef WIN32
-      maxFD_--; // not really used
-#endif
-    }
-
     ClientFD *tmpPtr = fdPtr;
     fdPtr = fdPtr->pNext;
-    delete tmpPtr;
+    if (prevFdPtr) {
+      prevFdPtr->pNext = fdPtr;
+    } else {
+      clientFDList_ = fdPtr;
+    }
+#ifdef PYCONNECT_USE_REACTOR_SHARDS
+    if (!handOffRelease(tmpPtr))
+      releaseClient(tmpPtr);
+#else
+    releaseClient(tmpPtr);
+#endif
   }
 
 #ifdef USE_MULTICAST
   setsockopt(udpSocket_, IPPROTO_IP, IP_DROP_MEMBERSHIP, (char *)&multiCastReq_,
              sizeof(multiCastReq_));
+#endif
+  unwatchFD(udpSocket_);
+  unwatchFD(tcpSocket_);
+#ifdef PYCONNECT_USE_REACTOR_SHARDS
+  closeShardListeners();
 #endif
 #ifdef WIN32
   shutdown(udpSocket_, SD_SEND);
@@ -935,10 +3999,6 @@ void PyConnectNetComm::disableNetComm(bool onExit) {
   close(udpSocket_);
   close(tcpSocket_);
 #endif
-  if (pFDOwner_) {
-    pFDOwner_->clearFD(udpSocket_);
-    pFDOwner_->clearFD(tcpSocket_);
-  }
 
   delete[] dgramBuffer_;
   dgramBuffer_ = NULL;
@@ -958,6 +4018,40 @@ void PyConnectNetComm::disableNetComm(bool onExit) {
 }
 
 #ifndef WIN32
+// a directory that was already there may have been made by someone else to
+// catch or replace our sockets. Use it only if it is a real directory of
+// ours or root's that nobody else can write to, or that is sticky so that
+// nobody else can remove what we put there.
+static bool isSafeIPCDir(const char *path) {
+  struct stat dirStat;
+  if (lstat(path, &dirStat) < 0) {
+    ERROR_MSG("PyConnectNetComm::enableIPCComm: unable to stat IPC path %s "
+              "error = %d\n",
+              path, errno);
+    return false;
+  }
+  if (!S_ISDIR(dirStat.st_mode)) {
+    ERROR_MSG("PyConnectNetComm::enableIPCComm: IPC path %s is not a "
+              "directory.\n",
+              path);
+    return false;
+  }
+  if (dirStat.st_uid != geteuid() && dirStat.st_uid != 0) {
+    ERROR_MSG("PyConnectNetComm::enableIPCComm: IPC path %s is owned by "
+              "another user.\n",
+              path);
+    return false;
+  }
+  if ((dirStat.st_mode & (S_IWGRP | S_IWOTH)) &&
+      !(dirStat.st_mode & S_ISVTX)) {
+    ERROR_MSG("PyConnectNetComm::enableIPCComm: IPC path %s is writable by "
+              "others but not sticky.\n",
+              path);
+    return false;
+  }
+  return true;
+}
+
 void PyConnectNetComm::enableIPCComm() {
   if (IPCCommEnabled_)
     return;
@@ -968,16 +4062,32 @@ void PyConnectNetComm::enableIPCComm() {
     return;
   }
 
+  // a directory of our own, shared between users like /tmp itself, so
+  // finding the other processes does not mean going through all of /tmp
+  const char *IPCPath = getenv("PYCONNECT_IPC_DIR");
+  IPCPath_ = (IPCPath && *IPCPath) ? IPCPath : PYCONNECT_DOMAINSOCKET_PATH;
+  if (mkdir(IPCPath_.c_str(), S_IRWXU | S_IRWXG | S_IRWXO | S_ISVTX) == 0) {
+    chmod(IPCPath_.c_str(), S_IRWXU | S_IRWXG | S_IRWXO | S_ISVTX);
+  } else if (errno != EEXIST) {
+    ERROR_MSG("PyConnectNetComm::enableIPCComm: unable to create IPC path "
+              "%s error = %d\n",
+              IPCPath_.c_str(), errno);
+    close(domainSocket_);
+    return;
+  }
+  if (!isSafeIPCDir(IPCPath_.c_str())) {
+    close(domainSocket_);
+    return;
+  }
+
   struct sockaddr_un dAddr;
   memset(&dAddr, 0, sizeof(dAddr));
   dAddr.sun_family = AF_UNIX;
-  sprintf(dAddr.sun_path, "%s/%s.%05d", PYCONNECT_DOMAINSOCKET_PATH,
-          PYCONNECT_SVRSOCKET_PREFIX, getpid());
+  IPCSocketPath(dAddr.sun_path, sizeof(dAddr.sun_path),
+                PYCONNECT_SVRSOCKET_PREFIX, getpid());
 
   unlink(dAddr.sun_path);
 
-  consolidateIPCSockets();
-
   int bindLen =
       int(offsetof(struct sockaddr_un, sun_path) + strlen(dAddr.sun_path));
 
@@ -1005,20 +4115,11 @@ void PyConnectNetComm::enableIPCComm() {
   chmod(dAddr.sun_path, S_IRWXU | S_IRGRP | S_IWGRP);
 
   INFO_MSG("Listening on local socket %s\n", dAddr.sun_path);
-#ifdef WIN32
-  maxFD_++;
-#else
-  maxFD_ = max(maxFD_, domainSocket_);
-#endif
-  FD_SET(domainSocket_, &masterFDSet_);
-  if (pFDOwner_)
-    pFDOwner_->setFD(domainSocket_);
+  watchFD(domainSocket_);
 
-  if (clientDataBuffer_ == NULL)
-    clientDataBuffer_ = new unsigned char[PYCONNECT_TCP_BUFFER_SIZE];
-
-  if (dispatchDataBuffer_ == NULL)
-    dispatchDataBuffer_ = new unsigned char[PYCONNECT_MSG_BUFFER_SIZE];
+  // watch first so that no server starting in between is missed
+  initIPCWatch();
+  consolidateIPCSockets();
 
   IPCCommEnabled_ = true;
 }
@@ -1035,36 +4136,43 @@ void PyConnectNetComm::disableIPCComm(bool onExit) {
   // Assertion failed: (autoInterpreterState), function PyGILState_Ensure, file
   // Python/pystate.c, line 563
   ClientFD *fdPtr = clientFDList_;
+  ClientFD *prevFdPtr = NULL;
   while (fdPtr) {
     if (fdPtr->domain != PyConnectNetComm::LOCALIPC) {
+      prevFdPtr = fdPtr;
       fdPtr = fdPtr->pNext;
       continue;
     }
 
     objCommChannelShutdown(fdPtr->fd, !onExit);
 
-    close(fdPtr->fd);
-
-    if (pFDOwner_) {
-      pFDOwner_->clearFD(fdPtr->fd);
-    } else {
-      FD_CLR(fdPtr->fd, &masterFDSet_);
-    }
-
     ClientFD *tmpPtr = fdPtr;
     fdPtr = fdPtr->pNext;
-    delete tmpPtr;
+    if (prevFdPtr) {
+      prevFdPtr->pNext = fdPtr;
+    } else {
+      clientFDList_ = fdPtr;
+    }
+#ifdef PYCONNECT_USE_REACTOR_SHARDS
+    if (!handOffRelease(tmpPtr))
+      releaseClient(tmpPtr);
+#else
+    releaseClient(tmpPtr);
+#endif
   }
 
+  unwatchFD(domainSocket_);
   close(domainSocket_);
-
-  if (pFDOwner_) {
-    pFDOwner_->clearFD(domainSocket_);
+  if (IPCWatchFD_ != INVALID_SOCKET) {
+    unwatchFD(IPCWatchFD_);
+    close(IPCWatchFD_);
+    IPCWatchFD_ = INVALID_SOCKET;
   }
+  liveServerSocketList_.clear();
 
-  char mySockPath[50];
-  sprintf(mySockPath, "%s/%s.%05d", PYCONNECT_DOMAINSOCKET_PATH,
-          PYCONNECT_SVRSOCKET_PREFIX, getpid());
+  char mySockPath[sizeof(((struct sockaddr_un *)0)->sun_path)];
+  IPCSocketPath(mySockPath, sizeof(mySockPath), PYCONNECT_SVRSOCKET_PREFIX,
+                getpid());
   INFO_MSG("Cleanup our IPC socket %s\n", mySockPath);
   unlink(mySockPath);
 
@@ -1076,7 +4184,26 @@ void PyConnectNetComm::disableIPCComm(bool onExit) {
 #endif // !WIN32
 
 void PyConnectNetComm::fini() {
+  // held back messages still go out before the connections close
+  if (coalesceWindowUSec_ >= 0)
+    flushCoalescedMessages();
+#ifdef LINUX
+  if (coalesceTimerFD_ != INVALID_SOCKET) {
+    unwatchFD(coalesceTimerFD_);
+    close(coalesceTimerFD_);
+    coalesceTimerFD_ = INVALID_SOCKET;
+  }
+  if (MPTimerFD_ != INVALID_SOCKET) {
+    unwatchFD(MPTimerFD_);
+    close(MPTimerFD_);
+    MPTimerFD_ = INVALID_SOCKET;
+  }
+#endif
   keepRunning_ = false;
+#ifdef PYCONNECT_USE_EPOLL
+  for (int i = 0; i < shardCount_; i++)
+    wakeupReactor(shards_[i]);
+#endif
 
   if (netCommEnabled_)
     disableNetComm(true);
@@ -1085,16 +4212,6 @@ void PyConnectNetComm::fini() {
     disableIPCComm(true);
 #endif
 
-  if (clientDataBuffer_) {
-    delete[] clientDataBuffer_;
-    clientDataBuffer_ = NULL;
-  }
-
-  if (dispatchDataBuffer_) {
-    delete[] dispatchDataBuffer_;
-    dispatchDataBuffer_ = NULL;
-  }
-
   endecryptFini();
 }
 
@@ -1154,10 +4271,20 @@ CommObjectStat PyConnectNetComm::createTalker(char *host, int port) {
   return COMM_SUCCESS;
 }
 
+PyConnectNetComm::ClientFD *PyConnectNetComm::findClientByFd(SOCKET_T fd) {
+  if (fd == INVALID_SOCKET)
+    return NULL;
+
+  ClientFD *FDPtr = clientFDList_;
+  while (FDPtr && FDPtr->fd != fd)
+    FDPtr = FDPtr->pNext;
+  return FDPtr;
+}
+
 // helper method to manage TCP fd list
 void PyConnectNetComm::addFdToClientList(const SOCKET_T &fd, FDDomain domain,
                                          struct sockaddr_in *cAddr,
-                                         int procID) {
+                                         int procID, bool accepted) {
 #ifdef MULTI_THREAD
 #ifdef WIN32
   EnterCriticalSection(&g_criticalSection);
@@ -1172,9 +4299,37 @@ void PyConnectNetComm::addFdToClientList(const SOCKET_T &fd, FDDomain domain,
   newFD->domain = domain;
   newFD->localProcID = procID;
   newFD->cAddr = *cAddr;
-  newFD->dataInfo.bufferedData = new unsigned char[PYCONNECT_MSG_BUFFER_SIZE];
-  newFD->dataInfo.bufferedDataLength = 0;
-  newFD->dataInfo.expectedDataLength = 0;
+  newFD->dataInfo.bufferedData = NULL; // allocated on first read
+  newFD->dataInfo.dataStart = newFD->dataInfo.dataEnd = 0;
+  newFD->dataInfo.bufferSize = 0;
+  newFD->outQueue.head = newFD->outQueue.tail = NULL;
+  newFD->outQueue.headOffset = newFD->outQueue.queuedBytes = 0;
+  newFD->coalesced.data = NULL;
+  newFD->coalesced.length = newFD->coalesced.size = newFD->coalesced.count = 0;
+  newFD->broken = false;
+  newFD->sealed = newFD->plain = newFD->ciphersAnnounced = false;
+  newFD->framesV2 = false;
+  newFD->checksummed = newFD->compressing = false;
+  newFD->trusted = isTrustedPeer(fd, domain, cAddr);
+#ifdef PYCONNECT_USE_SHM
+  newFD->shm = NULL;
+#endif
+#ifdef PYCONNECT_USE_EPOLL
+  newFD->shard = 0;
+  newFD->generation = nextClientGeneration_++ & 0x1fffffff;
+#endif
+#ifdef PYCONNECT_USE_REACTOR_SHARDS
+  if (shardCount_ > 1) {
+    // the kernel has spread TCP connections over the shard listeners
+    // already, keep them where they were accepted
+    newFD->shard =
+        (accepted && domain == PyConnectNetComm::NETWORK && s_currentShard >= 0)
+            ? s_currentShard
+            : pickReactorShard();
+    __atomic_add_fetch(&shards_[newFD->shard].clientCount, 1,
+                       __ATOMIC_RELAXED);
+  }
+#endif
 
   newFD->pNext = NULL;
   if (clientFDList_) {
@@ -1185,16 +4340,18 @@ void PyConnectNetComm::addFdToClientList(const SOCKET_T &fd, FDDomain domain,
   } else {
     clientFDList_ = newFD;
   }
-  FD_SET(fd, &masterFDSet_);
-#ifdef WIN32
-  maxFD_++;
+#ifdef PYCONNECT_USE_REACTOR_SHARDS
+  if (!handOffAdopt(newFD))
+    watchFD(fd, newFD);
 #else
-  maxFD_ = max(fd, maxFD_);
+  watchFD(fd, newFD);
 #endif
-  if (pFDOwner_)
-    pFDOwner_->setFD(fd);
 
-  setLastUsedCommChannel(fd);
+  // a connection we make is used right away. One accepted becomes the last
+  // used channel with its first message; doing it here could move the
+  // channel from under a message another reactor thread is processing.
+  if (!accepted)
+    setLastUsedCommChannel(fd);
 
 #ifdef MULTI_THREAD
 #ifdef WIN32
@@ -1203,6 +4360,16 @@ void PyConnectNetComm::addFdToClientList(const SOCKET_T &fd, FDDomain domain,
   pthread_mutex_unlock(&g_mutex);
 #endif
 #endif
+  // writes must never stall the caller, see sendFrame. Every backend
+  // works on non-blocking sockets; io_uring still waits for data on them.
+#ifdef WIN32
+  u_long nonBlocking = 1;
+  if (ioctlsocket(fd, FIONBIO, &nonBlocking) != 0) {
+#else
+  if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK) < 0) {
+#endif
+    ERROR_MSG("Unable to set socket %d non-blocking\n", fd);
+  }
   if (domain == PyConnectNetComm::NETWORK) {
     int turnon = 1;
     if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (char *)&turnon, sizeof(int)) <
@@ -1222,8 +4389,6 @@ void PyConnectNetComm::destroyCurrentClient(ClientFD *&FDPtr,
   if (FDPtr == NULL || prevFDPtr == NULL)
     return;
 
-  SOCKET_T fd = FDPtr->fd;
-
 #ifdef MULTI_THREAD
 #ifdef WIN32
   EnterCriticalSection(&g_criticalSection);
@@ -1231,36 +4396,18 @@ void PyConnectNetComm::destroyCurrentClient(ClientFD *&FDPtr,
   pthread_mutex_lock(&g_mutex);
 #endif
 #endif
-  if (FDPtr->dataInfo.bufferedData) {
-    delete[] FDPtr->dataInfo.bufferedData;
-    FDPtr->dataInfo.bufferedData = NULL;
-    FDPtr->dataInfo.bufferedDataLength = FDPtr->dataInfo.expectedDataLength = 0;
-  }
+  ClientFD *oldFDPtr = FDPtr;
 
   // clear from the FDList
   if (FDPtr == clientFDList_) { // deletion of first node
     clientFDList_ = clientFDList_->pNext;
     prevFDPtr = clientFDList_;
-    delete FDPtr;
     FDPtr = clientFDList_;
   } else {
     prevFDPtr->pNext = FDPtr->pNext;
-    delete FDPtr;
     FDPtr = prevFDPtr->pNext;
   }
-
-  if (fd != INVALID_SOCKET) {
-#ifdef WIN32
-    shutdown(fd, SD_SEND);
-    closesocket(fd);
-#else
-    close(fd);
-#endif
-    FD_CLR(fd, &masterFDSet_);
-
-    if (pFDOwner_)
-      pFDOwner_->clearFD(fd);
-  }
+  releaseClient(oldFDPtr);
 #ifdef MULTI_THREAD
 #ifdef WIN32
   LeaveCriticalSection(&g_criticalSection);
@@ -1290,29 +4437,16 @@ void PyConnectNetComm::destroyCurrentClient(SOCKET_T fd) {
     }
 
     if (FDPtr) { // found the client in the client list
-      FD_CLR(fd, &masterFDSet_);
-      if (pFDOwner_)
-        pFDOwner_->clearFD(fd);
-
       if (FDPtr == clientFDList_) {
         clientFDList_ = clientFDList_->pNext;
       } else {
         prevFDPtr->pNext = FDPtr->pNext;
       }
-
-      if (FDPtr->dataInfo.bufferedData) {
-        delete[] FDPtr->dataInfo.bufferedData;
-        FDPtr->dataInfo.bufferedData = NULL;
-        FDPtr->dataInfo.bufferedDataLength =
-            FDPtr->dataInfo.expectedDataLength = 0;
-      }
-
-      delete FDPtr;
-#ifdef WIN32
-      shutdown(fd, SD_SEND);
-      closesocket(fd);
+#ifdef PYCONNECT_USE_REACTOR_SHARDS
+      if (!handOffRelease(FDPtr))
+        releaseClient(FDPtr);
 #else
-      close(fd);
+      releaseClient(FDPtr);
 #endif
     }
   }
@@ -1326,6 +4460,41 @@ void PyConnectNetComm::destroyCurrentClient(SOCKET_T fd) {
 #endif
 }
 
+// stop watching a client already taken off the client list, close its
+// socket and free it. Sharded, only the thread running its shard may do so.
+void PyConnectNetComm::releaseClient(ClientFD *FDPtr) {
+  SOCKET_T fd = FDPtr->fd;
+
+  unwatchFD(fd, FDPtr);
+#ifdef PYCONNECT_USE_SHM
+  if (FDPtr->shm) {
+    unwatchFD(FDPtr->shm->bellFD(), FDPtr);
+    delete FDPtr->shm;
+  }
+#endif
+  releaseReceiveBuffer(FDPtr->dataInfo);
+  discardOutboundQueue(FDPtr->outQueue);
+  delete[] FDPtr->coalesced.data;
+#ifdef PYCONNECT_USE_IO_URING
+  dropPendingSends(FDPtr);
+#endif
+#ifdef PYCONNECT_USE_REACTOR_SHARDS
+  if (shardCount_ > 1)
+    __atomic_sub_fetch(&shards_[FDPtr->shard].clientCount, 1,
+                       __ATOMIC_RELAXED);
+#endif
+  delete FDPtr;
+
+  if (fd != INVALID_SOCKET) {
+#ifdef WIN32
+    shutdown(fd, SD_SEND);
+    closesocket(fd);
+#else
+    close(fd);
+#endif
+  }
+}
+
 void PyConnectNetComm::updateMPID() {
   int commAddr = 0;
   if (this->getIDFromIP(commAddr)) {
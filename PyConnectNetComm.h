@@ -31,6 +31,22 @@
 #include <netinet/tcp.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include "PyConnectShmRing.h"
+#endif
+#if defined(LINUX) && !defined(PYCONNECT_NO_EPOLL)
+#define PYCONNECT_USE_EPOLL
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#ifdef MULTI_THREAD
+#define PYCONNECT_USE_REACTOR_SHARDS
+#endif
+#endif
+#ifdef PYCONNECT_USE_IO_URING
+#ifndef PYCONNECT_USE_EPOLL
+#error "PYCONNECT_USE_IO_URING requires LINUX and the epoll backend."
+#endif
+#include <sys/uio.h>
+#include "PyConnectIOURing.h"
 #endif
 #include "PyConnectObjComm.h"
 
@@ -46,7 +62,9 @@ extern pthread_mutex_t g_mutex;
 #endif
 
 #ifndef WIN32
-#define PYCONNECT_DOMAINSOCKET_PATH "/tmp"
+#ifndef PYCONNECT_DOMAINSOCKET_PATH
+#define PYCONNECT_DOMAINSOCKET_PATH "/tmp/pyconnect" // or PYCONNECT_IPC_DIR
+#endif
 #ifdef PYTHON_SERVER
 #define PYCONNECT_SVRSOCKET_PREFIX "pysvr"
 #define PYCONNECT_CLTSOCKET_PREFIX "pyclt"
@@ -67,6 +85,23 @@ extern pthread_mutex_t g_mutex;
 #define PYCONNECT_UDP_BUFFER_SIZE 2048
 #define PYCONNECT_TCP_BUFFER_SIZE 4096
 #define PYCONNECT_MAX_TCP_SESSION 50
+#define PYCONNECT_EPOLL_MAX_EVENTS 64
+#define PYCONNECT_MAX_REACTOR_THREADS 64
+#define PYCONNECT_URING_ENTRIES 256
+#define PYCONNECT_URING_SEND_ENTRIES 64
+#define PYCONNECT_URING_BUFFER_COUNT 64 // must be a power of two
+#define PYCONNECT_URING_BUFFER_SIZE 16384
+#ifndef PYCONNECT_OUTBOUND_QUEUE_SIZE
+#define PYCONNECT_OUTBOUND_QUEUE_SIZE 0x100000 // per connection, in bytes
+#endif
+#define PYCONNECT_COALESCE_WINDOW 1000      // microseconds
+#define PYCONNECT_COALESCE_MAX_BYTES 0x4000 // a full batch goes out at once
+#ifndef PYCONNECT_COMPRESS_THRESHOLD
+#define PYCONNECT_COMPRESS_THRESHOLD 1024 // smaller messages go as they are
+#endif
+#ifndef PYCONNECT_SHM_RING_SIZE
+#define PYCONNECT_SHM_RING_SIZE 0x100000 // per direction, a power of two
+#endif
 #define PYCONNECT_COMMPORT_RANGE                                               \
   100 // this basically limits number of pythonised objects running on same
       // machine/interface
@@ -127,6 +162,9 @@ public:
 
 class PyConnectNetComm : public ObjectComm {
 public:
+  // what to do when a connection's outbound queue is full
+  enum OverflowPolicy { BLOCK_SENDER, DROP_OLDEST, DISCONNECT_PEER };
+
   static PyConnectNetComm *instance();
   virtual ~PyConnectNetComm();
 
@@ -141,6 +179,21 @@ public:
 
   void fini();
 
+  void beginSendBatch();
+  void endSendBatch();
+  bool setTimer(int usec);
+
+  void setOutboundQueuePolicy(
+      OverflowPolicy policy, int maxQueuedBytes = PYCONNECT_OUTBOUND_QUEUE_SIZE);
+  int outboundQueueDepth(SOCKET_T fd = INVALID_SOCKET);
+  void flushOutboundQueues();
+  void setMessageCoalescing(bool enable,
+                            int windowUSec = PYCONNECT_COALESCE_WINDOW);
+  void flushCoalescedMessages();
+#ifdef PYCONNECT_USE_REACTOR_SHARDS
+  void setReactorThreads(int count, const int *cpus = NULL);
+#endif
+
   void enableNetComm();
   void disableNetComm(bool onExit = false);
 #ifndef WIN32
@@ -151,10 +204,36 @@ public:
 private:
   enum FDDomain { UNKNOWN, NETWORK, LOCALIPC };
 
+  // per connection receive buffer. The socket reads straight into it and
+  // pending data occupies [dataStart, dataEnd), which is moved back to the
+  // front only when the tail runs out of room.
   struct SocketDataBufferInfo {
     unsigned char *bufferedData;
-    int expectedDataLength;
-    int bufferedDataLength;
+    int dataStart;
+    int dataEnd;
+    int bufferSize; // grows on demand to fit the largest pending frame
+  };
+
+  // frames the socket could not take yet, sent in order once it is writable
+  struct OutboundFrame {
+    unsigned char *data;
+    int length;
+    OutboundFrame *pNext;
+  };
+
+  struct OutboundQueue {
+    OutboundFrame *head;
+    OutboundFrame *tail;
+    int headOffset; // bytes of the head frame already written
+    int queuedBytes;
+  };
+
+  // plain messages held back to go out together in one batch frame
+  struct CoalesceBuffer {
+    unsigned char *data; // room for a nonce, then length prefixed messages
+    int length;
+    int size;
+    int count;
   };
 
   typedef struct sClientFD {
@@ -163,29 +242,226 @@ private:
     struct sockaddr_in cAddr; // client address, NETWORK only
     int localProcID;          // server process id, IPC only
     struct SocketDataBufferInfo dataInfo;
+    struct OutboundQueue outQueue;
+    struct CoalesceBuffer coalesced;
+    bool broken;      // shut down on a send error, reaped by the read loop
+    bool sealed;      // the peer opens sealed frames, so it gets those
+    bool plain;       // both ends take plain frames, so the peer gets those
+    bool trusted;     // a local peer of our own user, plain frames allowed
+    bool checksummed; // the peer checks plain frames with CRC32C
+    bool compressing; // the peer takes compressed frames
+    bool framesV2;    // the peer has shown it reads '$' frames
+    bool ciphersAnnounced;
+#ifdef PYCONNECT_USE_SHM
+    ShmChannel *shm; // LOCALIPC only, NULL unless one has been offered
+#endif
+#ifdef PYCONNECT_USE_EPOLL
+    int shard;               // index of the reactor shard that owns it
+    unsigned int generation; // tells a closed and reused fd apart
+#endif
     sClientFD *pNext;
   } ClientFD;
 
+#ifdef PYCONNECT_USE_EPOLL
+#ifdef PYCONNECT_USE_REACTOR_SHARDS
+  // work handed to the thread that owns a client
+  struct ShardMessage {
+    enum { SEND_FRAME, ADOPT_CLIENT, RELEASE_CLIENT } type;
+    ClientFD *FDPtr; // only dereferenced once known to be live
+    SOCKET_T fd;
+    unsigned int generation;
+    unsigned char *data; // SEND: encrypted message, owned by the message
+    int size;
+    unsigned char frameFlags;
+    ShardMessage *pNext;
+  };
+#endif
+
+  // an epoll instance and the clients it waits on. There is just the one
+  // unless the reactor is sharded, in which case each shard is run by its
+  // own thread and only that thread touches its table and its clients.
+  struct ReactorShard {
+    int index;
+    int epollFD;
+    int wakeupFD; // eventfd to break out of epoll_wait
+    ClientFD **clientFDTable; // indexed by fd
+    int clientFDTableSize;
+#ifdef PYCONNECT_USE_REACTOR_SHARDS
+    SOCKET_T tcpSocket;    // SO_REUSEPORT listener of shards other than 0
+    ShardMessage *mailbox; // lock free stack, pushed by other threads
+    int clientCount;
+    int cpu; // pinned to this cpu unless -1
+    pthread_t thread;
+#endif
+  };
+#endif
+
+#ifdef PYCONNECT_USE_IO_URING
+  // a frame held back until the end of a send batch
+  struct PendingSend {
+    ClientFD *FDPtr;
+    unsigned char header[PYCONNECT_FRAME_V2_HEADER_SIZE];
+    int headerLength;
+    const unsigned char *data;
+    int size;
+    unsigned char trailer[PYCONNECT_FRAME_CRC_SIZE + 1];
+    int trailerLength;
+    unsigned char frameFlags;
+    int ownedOffset; // of the copy of data in sendBatchData_, or -1
+    bool done;       // sent or queued, nothing left to do
+    struct iovec iov[3];
+    struct msghdr msg;
+  };
+  typedef std::vector<PendingSend> PendingSendList;
+
+  enum URingOp {
+    URING_NONE = 0,
+    URING_POLL,
+    URING_RECV,
+    URING_WRITABLE,
+    URING_READABLE // client polled and read the plain way
+  };
+#endif
+
   PyConnectNetComm();
   bool initUDPListener();
   bool initTCPListener();
 
+  // a message on its way out, encrypted on demand once for each kind of
+  // peer. Both results are in per thread buffers of the cipher functions.
+  struct OutgoingMessage {
+    const unsigned char *data;
+    int size;
+    unsigned char *encrypted;
+    int encryptedLength;
+    unsigned char *sealed;
+    int sealedLength;
+    bool compressed; // data is the compressed message, see compressForClient
+  };
+
   void clientDataSend(const unsigned char *data, int size);
+  void compressForClient(ClientFD *FDPtr, OutgoingMessage &message);
+  bool encryptForClient(ClientFD *FDPtr, OutgoingMessage &message,
+                        const unsigned char *&outputData, int &outputLength,
+                        unsigned char &frameFlags);
+  void notePeerFramesV2(SOCKET_T fd);
+  void announceCiphers(SOCKET_T fd);
+  bool isTrustedPeer(SOCKET_T fd, FDDomain domain, struct sockaddr_in *cAddr);
+  bool sendFrame(ClientFD *FDPtr, const unsigned char *data, int size,
+                 unsigned char frameFlags = 0);
+  bool queueFrame(ClientFD *FDPtr, const unsigned char *header,
+                  int headerLength, const unsigned char *data, int size,
+                  const unsigned char *trailer, int trailerLength,
+                  int sentBytes);
+  bool makeRoomInOutboundQueue(ClientFD *FDPtr, int length);
+  bool flushOutboundQueue(ClientFD *FDPtr);
+  void waitForOutboundRoom();
+  void discardOutboundQueue(OutboundQueue &queue);
+  void shutdownBrokenClient(ClientFD *FDPtr);
   void netBroadcastSend(const unsigned char *data, int size);
   void localBroadcastSend(const unsigned char *data, int size);
+  bool coalesceMessage(ClientFD *FDPtr, const unsigned char *data, int size);
+  void flushCoalescedBatch(ClientFD *FDPtr);
+  void initCoalesceTimer();
+  void armCoalesceTimer();
+  void processCoalesceTimer();
+  void initMPTimer();
+  void processMPTimer();
+#ifndef LINUX
+  int timerTimeoutUSec(int maxUSec);
+  void processDueTimers();
+#endif
 
+  void processUDPSocket();
+  void acceptClient(SOCKET_T listenSocket, FDDomain domain);
+  bool processClientInput(ClientFD *FDPtr, unsigned char *data = NULL,
+                          int length = 0);
   void processUDPInput(unsigned char *recBuffer, int recBytes,
                        struct sockaddr_in &cAddr);
-  bool createTCPTalker(struct sockaddr_in &cAddr);
+  int extractFrames(ClientFD *FDPtr, unsigned char *data, int dataLength,
+                    MesgProcessResult &procResult);
+  MesgProcessResult processFrame(ClientFD *FDPtr, unsigned char *data,
+                                 int length, unsigned char frameFlags = 0);
+  MesgProcessResult processControlFrame(ClientFD *FDPtr, unsigned char *data,
+                                        int length);
+  MesgProcessResult processMessage(ClientFD *FDPtr, unsigned char *data,
+                                   int length, bool skipdecrypt = false);
+  MesgProcessResult processBatchFrame(ClientFD *FDPtr, unsigned char *data,
+                                      int length);
+  bool receiveClientData(ClientFD *FDPtr, MesgProcessResult &procResult);
+  bool receiveBufferedData(ClientFD *FDPtr, unsigned char *data, int length,
+                           MesgProcessResult &procResult);
+  bool consumeReceiveBuffer(ClientFD *FDPtr, MesgProcessResult &procResult);
+  bool reserveReceiveSpace(SocketDataBufferInfo &dataInfo, int readSize = 0);
+  void releaseReceiveBuffer(SocketDataBufferInfo &dataInfo);
+#ifdef PYCONNECT_USE_SHM
+  int receiveLocalData(ClientFD *FDPtr, unsigned char *buffer, int length);
+  void offerShmChannel(ClientFD *FDPtr);
+  void switchToShmChannel(ClientFD *FDPtr);
+  bool processShmBell(ClientFD *FDPtr);
+  bool receiveShmData(ClientFD *FDPtr, MesgProcessResult &procResult);
+#endif
+  bool createTCPTalker(struct sockaddr_in &cAddr, bool framesV2 = false);
 #ifndef WIN32
   SOCKET_T findOrCreateIPCTalker(int procID);
   SOCKET_T findFdFromClientListByProcID(int procID);
+  void IPCSocketPath(char *path, size_t size, const char *prefix, int procID);
+  void removeDeadIPCSocket(int procID);
   void consolidateIPCSockets();
+  void initIPCWatch();
+  void processIPCWatch();
+  void updateLiveServer(int procID, bool alive);
 #endif // !WIN32
+  ClientFD *findClientByFd(SOCKET_T fd);
+  void watchFD(SOCKET_T fd, ClientFD *FDPtr = NULL);
+  void unwatchFD(SOCKET_T fd, ClientFD *FDPtr = NULL);
+  void setWriteInterest(ClientFD *FDPtr, bool enable);
+#ifdef PYCONNECT_USE_EPOLL
+  void resetReactorShard(ReactorShard &shard, int index);
+  void setClientFDTableEntry(ReactorShard &shard, SOCKET_T fd,
+                             ClientFD *FDPtr);
+  ClientFD *shardClient(ReactorShard &shard, SOCKET_T fd);
+  bool initEpoll(ReactorShard &shard);
+  void epollProcessing(ReactorShard &shard);
+  void wakeupReactor(ReactorShard &shard);
+#endif
+#ifdef PYCONNECT_USE_REACTOR_SHARDS
+  bool initReactorShards();
+  bool initShardListener(ReactorShard &shard);
+  void closeShardListeners();
+  void runReactorShards();
+  static void *reactorShardThread(void *arg);
+  void runReactorShard(ReactorShard &shard);
+  int pickReactorShard();
+  bool isShardOwner(ClientFD *FDPtr);
+  void postToShard(ReactorShard &shard, ShardMessage *msg);
+  bool handOffFrame(ClientFD *FDPtr, const unsigned char *data, int size,
+                    unsigned char frameFlags = 0);
+  bool handOffAdopt(ClientFD *FDPtr);
+  bool handOffRelease(ClientFD *FDPtr);
+  void drainShardMailbox(ReactorShard &shard);
+#endif
+#ifdef PYCONNECT_USE_IO_URING
+  bool initIOURing();
+  bool probeMultishotRecv();
+  void uringProcessing();
+  void uringProcessCompletion(unsigned long long userData, int res,
+                              unsigned int flags);
+  void uringArm(SOCKET_T fd, ClientFD *FDPtr, URingOp op);
+  ClientFD *uringClient(unsigned long long userData);
+  void queuePendingSend(ClientFD *FDPtr, const unsigned char *data, int size,
+                        bool copyData, unsigned char frameFlags = 0);
+  void submitSendBatch();
+  bool isSocketInRound(size_t batchStart, size_t batchEnd, ClientFD *FDPtr);
+  void clearSendBatch();
+  void dropPendingSends(ClientFD *FDPtr);
+#endif
   void addFdToClientList(const SOCKET_T &fd, FDDomain domain,
-                         struct sockaddr_in *cAddr, int procID = 0);
+                         struct sockaddr_in *cAddr, int procID = 0,
+                         bool accepted = false);
   void destroyCurrentClient(SOCKET_T fd);
   void destroyCurrentClient(ClientFD *&FDPtr, ClientFD *&prevFDPtr);
+  void releaseClient(ClientFD *FDPtr);
   void updateMPID();
   bool getIDFromIP(int &addr);
 
@@ -199,13 +475,25 @@ private:
   SOCKET_T udpSocket_;
   SOCKET_T tcpSocket_;
   SOCKET_T domainSocket_;
+  SOCKET_T IPCWatchFD_; // inotify on the socket directory, Linux only
 
   unsigned char *dgramBuffer_;
-  unsigned char *clientDataBuffer_;
-  unsigned char *dispatchDataBuffer_;
 
   ClientFD *clientFDList_;
 
+  OverflowPolicy overflowPolicy_;
+  int maxOutboundQueueBytes_;
+  int sendBatchDepth_;
+
+  int coalesceWindowUSec_; // -1 if coalescing is off
+  SOCKET_T coalesceTimerFD_;
+  bool coalesceTimerArmed_;
+  SOCKET_T MPTimerFD_;   // timer of the message processor, see setTimer
+  // without timer fds, when the timers are due in monotonic microseconds,
+  // 0 if unset
+  long long coalesceDue_;
+  long long MPTimerDue_;
+
   // only used in own main loop
   FDSetOwner *pFDOwner_;
   int maxFD_;
@@ -215,12 +503,42 @@ private:
   bool IPCCommEnabled_;
   bool invalidUDPSock_;
   bool keepRunning_;
+  bool sealEnabled_;         // announce and send sealed frames
+  bool IPCPlainEnabled_;      // plain frames to local peers of our own user
+  bool loopbackPlainEnabled_; // and to those on loopback TCP
+  bool frameCRCEnabled_;      // checksum plain frames with CRC32C
+  bool compressionEnabled_;   // compress large messages to network peers
+  int compressThreshold_;     // size from which a message is compressed
   unsigned short portInUse_;
+#ifdef PYCONNECT_USE_EPOLL
+  ReactorShard *shards_; // shards_[0] also watches the listeners
+  int shardCount_;
+  unsigned int nextClientGeneration_;
+#endif
+#ifdef PYCONNECT_USE_REACTOR_SHARDS
+  int requestedShards_; // 0 to go by PYCONNECT_REACTOR_THREADS
+  std::vector<int> requestedShardCPUs_;
+  bool shardsStopped_;
+  pthread_mutex_t dispatchMutex_; // the message processor is not reentrant
+#endif
+#ifdef PYCONNECT_USE_SHM
+  bool shmEnabled_; // offer and accept shared memory channels
+#endif
+#ifdef PYCONNECT_USE_IO_URING
+  IOURing *uring_;    // reactor ring, NULL if io_uring is not in use
+  IOURing *sendRing_; // batched sends, completed synchronously
+  PendingSendList sendBatch_;
+  // copies of the data of held back frames, kept from batch to batch
+  unsigned char *sendBatchData_;
+  int sendBatchDataSize_;
+  int sendBatchDataLength_;
+#endif
 #ifdef USE_MULTICAST
   struct ip_mreq multiCastReq_;
 #endif
   typedef std::vector<int> ClientSocketList; // server process id
   ClientSocketList liveServerSocketList_;
+  std::string IPCPath_; // directory of the local sockets
 };
 
 } // namespace pyconnect
@@ -42,6 +42,30 @@ void MessageProcessor::dispatchMessage(const unsigned char *data, int size,
   }
 }
 
+void MessageProcessor::beginDispatchBatch() {
+  for (CommObjectList::const_iterator citer = commObjList_.begin();
+       citer != commObjList_.end(); citer++) {
+    (*citer)->beginSendBatch();
+  }
+}
+
+void MessageProcessor::endDispatchBatch() {
+  for (CommObjectList::const_iterator citer = commObjList_.begin();
+       citer != commObjList_.end(); citer++) {
+    (*citer)->endSendBatch();
+  }
+}
+
+// the first comm object with a timer takes the request
+bool MessageProcessor::scheduleTimer(int usec) {
+  for (CommObjectList::const_iterator citer = commObjList_.begin();
+       citer != commObjList_.end(); citer++) {
+    if ((*citer)->setTimer(usec))
+      return true;
+  }
+  return false;
+}
+
 CommObjectStat MessageProcessor::connectTo(char *host, int port) {
   CommObjectStat retVal = NOT_SUPPORTED;
   for (CommObjectList::const_iterator citer = commObjList_.begin();
@@ -67,6 +67,8 @@ public:
                                          bool skipdecrypt = false) = 0;
   void addCommObject(ObjectComm *pCommObj);
   virtual void updateMPID(int id) {}
+  // called back by the comm object on the expiry of scheduleTimer
+  virtual void processTimer() {}
 
 protected:
   typedef std::vector<ObjectComm *> CommObjectList;
@@ -74,6 +76,9 @@ protected:
 
   void dispatchMessage(const unsigned char *data, int size,
                        bool broadcast = false);
+  void beginDispatchBatch();
+  void endDispatchBatch();
+  bool scheduleTimer(int usec);
   CommObjectStat connectTo(char *host, int port = 0);
   CommObjectStat setBroadcastAddr(char *addr);
 };
@@ -89,6 +94,14 @@ public:
     return NOT_SUPPORTED;
   }
   virtual void fini() {}
+  // messages sent between begin and end may be held back and written out
+  // together at endSendBatch.
+  virtual void beginSendBatch() {}
+  virtual void endSendBatch() {}
+  // have processTimer of the message processor called from the
+  // communication thread in usec microseconds or so. Returns false if
+  // there is no timer to do it.
+  virtual bool setTimer(int /*usec*/) { return false; }
 
 protected:
   MessageProcessor *pMP_;
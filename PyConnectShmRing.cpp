@@ -0,0 +1,259 @@
+/*
+ *  PyConnectShmRing.cpp
+ *
+ *  Copyright 2006, 2007 Xun Wang.
+ *  This file is part of PyConnect.
+ *
+ *  PyConnect is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  PyConnect is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "PyConnectShmRing.h"
+
+#ifdef PYCONNECT_USE_SHM
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "PyConnectCommon.h"
+
+namespace pyconnect {
+
+static const unsigned int kMaxRingSize = 0x4000000;
+
+ShmChannel::ShmChannel()
+    : receiving(false), sending(false), switchPending(false),
+      connecting_(false), segmentFD_(-1), ownBell_(-1), peerBell_(-1),
+      segment_(NULL), segmentSize_(0), ringSize_(0) {
+  tx_.header = rx_.header = NULL;
+  tx_.data = rx_.data = NULL;
+}
+
+ShmChannel::~ShmChannel() {
+  if (segment_)
+    munmap(segment_, segmentSize_);
+  closeSegment();
+  if (ownBell_ != -1)
+    close(ownBell_);
+  if (peerBell_ != -1)
+    close(peerBell_);
+}
+
+// a ring is its control block followed by its data, the data of the first
+// ring keeping the second one's control block aligned.
+size_t ShmChannel::ringSpan(unsigned int ringSize) {
+  return sizeof(ShmRingHeader) + ringSize;
+}
+
+bool ShmChannel::create(unsigned int ringSize) {
+  connecting_ = true;
+  ringSize_ = ringSize;
+  segmentSize_ = 2 * ringSpan(ringSize);
+  segmentFD_ = memfd_create("pyconnect", MFD_CLOEXEC);
+  ownBell_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  peerBell_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (segmentFD_ == -1 || ownBell_ == -1 || peerBell_ == -1 ||
+      ftruncate(segmentFD_, (off_t)segmentSize_) < 0) {
+    ERROR_MSG("ShmChannel::create: unable to set up shared memory channel "
+              "error = %d\n",
+              errno);
+    return false;
+  }
+  void *segment = mmap(NULL, segmentSize_, PROT_READ | PROT_WRITE, MAP_SHARED,
+                       segmentFD_, 0);
+  if (segment == MAP_FAILED) {
+    ERROR_MSG("ShmChannel::create: unable to map %d bytes of shared memory "
+              "error = %d\n",
+              (int)segmentSize_, errno);
+    return false;
+  }
+  segment_ = (unsigned char *)segment;
+  // a fresh memfd reads as zeros, only the sizes need filling in
+  ShmRingHeader *first = (ShmRingHeader *)segment_;
+  ShmRingHeader *second = (ShmRingHeader *)(segment_ + ringSpan(ringSize));
+  first->size = second->size = ringSize;
+
+  tx_.header = first;
+  tx_.data = segment_ + sizeof(ShmRingHeader);
+  rx_.header = second;
+  rx_.data = segment_ + ringSpan(ringSize) + sizeof(ShmRingHeader);
+  return true;
+}
+
+// the accepting end rings our bell and waits on its own, so the roles swap
+void ShmChannel::offeredFDs(int *fds) const {
+  fds[0] = segmentFD_;
+  fds[1] = peerBell_;
+  fds[2] = ownBell_;
+}
+
+void ShmChannel::closeSegment() {
+  if (segmentFD_ != -1) {
+    close(segmentFD_);
+    segmentFD_ = -1;
+  }
+}
+
+void ShmChannel::takeFDs(const int *fds) {
+  segmentFD_ = fds[0];
+  ownBell_ = fds[1];
+  peerBell_ = fds[2];
+}
+
+bool ShmChannel::attach(unsigned int ringSize) {
+  if (segment_ || segmentFD_ == -1 || ringSize == 0 ||
+      ringSize > kMaxRingSize || (ringSize & (ringSize - 1)) ||
+      ringSize % alignof(ShmRingHeader))
+    return false;
+
+  struct stat segmentStat;
+  segmentSize_ = 2 * ringSpan(ringSize);
+  if (fstat(segmentFD_, &segmentStat) < 0 ||
+      segmentStat.st_size < (off_t)segmentSize_)
+    return false;
+
+  void *segment = mmap(NULL, segmentSize_, PROT_READ | PROT_WRITE, MAP_SHARED,
+                       segmentFD_, 0);
+  closeSegment();
+  if (segment == MAP_FAILED)
+    return false;
+
+  segment_ = (unsigned char *)segment;
+  rx_.header = (ShmRingHeader *)segment_;
+  rx_.data = segment_ + sizeof(ShmRingHeader);
+  tx_.header = (ShmRingHeader *)(segment_ + ringSpan(ringSize));
+  tx_.data = segment_ + ringSpan(ringSize) + sizeof(ShmRingHeader);
+  if (rx_.header->size != ringSize || tx_.header->size != ringSize) {
+    munmap(segment_, segmentSize_);
+    segment_ = NULL;
+    return false;
+  }
+  ringSize_ = ringSize;
+  return true;
+}
+
+// the peer can write to the control blocks at any time, so only the ring
+// size checked when the channel was set up is used, and positions that
+// are more than a ring apart break the channel.
+int ShmChannel::write(const struct iovec *iov, int count) {
+  ShmRingHeader *header = tx_.header;
+  unsigned int size = ringSize_;
+  unsigned long long tail = header->tail;
+  int written = 0;
+  int part = 0;
+  size_t partOffset = 0;
+
+  while (part < count) {
+    unsigned long long head = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+    if (tail - head > size) {
+      errno = EPROTO;
+      return -1;
+    }
+    unsigned long long space = size - (tail - head);
+    while (space > 0 && part < count) {
+      size_t length = iov[part].iov_len - partOffset;
+      size_t offset = (size_t)(tail & (size - 1));
+      if (length > space)
+        length = (size_t)space;
+      if (length > size - offset)
+        length = size - offset;
+      memcpy(tx_.data + offset,
+             (unsigned char *)iov[part].iov_base + partOffset, length);
+      tail += length;
+      space -= length;
+      written += (int)length;
+      partOffset += length;
+      if (partOffset == iov[part].iov_len) {
+        part++;
+        partOffset = 0;
+      }
+    }
+    if (part == count)
+      break;
+
+    // full. Ask for a bell, unless the consumer made room in the meantime
+    // and may have looked for our request already.
+    __atomic_store_n(&header->writerWaiting, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&header->head, __ATOMIC_SEQ_CST) == head)
+      break;
+    __atomic_store_n(&header->writerWaiting, 0, __ATOMIC_RELAXED);
+  }
+
+  if (written > 0) {
+    __atomic_store_n(&header->tail, tail, __ATOMIC_SEQ_CST);
+    if (__atomic_exchange_n(&header->readerWaiting, 0, __ATOMIC_SEQ_CST))
+      ring(peerBell_);
+  }
+  return written;
+}
+
+int ShmChannel::peek(unsigned char *&data) {
+  ShmRingHeader *header = rx_.header;
+  unsigned int size = ringSize_;
+  unsigned long long head = header->head;
+  unsigned long long tail = __atomic_load_n(&header->tail, __ATOMIC_ACQUIRE);
+  if (tail - head > size) {
+    ERROR_MSG("ShmChannel::peek: ring positions %llu and %llu are more than "
+              "a ring apart\n",
+              head, tail);
+    return -1;
+  }
+  size_t offset = (size_t)(head & (size - 1));
+  size_t length = (size_t)(tail - head);
+
+  if (length > size - offset)
+    length = size - offset;
+  data = rx_.data + offset;
+  return (int)length;
+}
+
+void ShmChannel::consume(int length) {
+  ShmRingHeader *header = rx_.header;
+  __atomic_store_n(&header->head, header->head + length, __ATOMIC_SEQ_CST);
+  if (__atomic_exchange_n(&header->writerWaiting, 0, __ATOMIC_SEQ_CST))
+    ring(peerBell_);
+}
+
+bool ShmChannel::sleep() {
+  ShmRingHeader *header = rx_.header;
+  __atomic_store_n(&header->readerWaiting, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&header->tail, __ATOMIC_SEQ_CST) == header->head)
+    return true;
+  __atomic_store_n(&header->readerWaiting, 0, __ATOMIC_RELAXED);
+  return false;
+}
+
+void ShmChannel::clearBell() {
+  uint64_t count = 0;
+  if (read(ownBell_, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+    ERROR_MSG("ShmChannel::clearBell: unable to read bell error = %d\n", errno);
+  }
+}
+
+void ShmChannel::ringSelf() { ring(ownBell_); }
+
+void ShmChannel::ring(int bell) {
+  uint64_t count = 1;
+  if (::write(bell, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+    ERROR_MSG("ShmChannel::ring: unable to ring bell error = %d\n", errno);
+  }
+}
+
+} // namespace pyconnect
+
+#endif // PYCONNECT_USE_SHM
@@ -0,0 +1,107 @@
+/*
+ *  PyConnectShmRing.h
+ *
+ *  Copyright 2006, 2007 Xun Wang.
+ *  This file is part of PyConnect.
+ *
+ *  PyConnect is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  PyConnect is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PyConnectShmRing_h_DEFINED
+#define PyConnectShmRing_h_DEFINED
+
+#if defined(LINUX) && !defined(PYCONNECT_NO_SHM)
+#define PYCONNECT_USE_SHM
+
+#include <stddef.h>
+#include <sys/uio.h>
+
+namespace pyconnect {
+
+// control block of a single producer, single consumer byte ring in shared
+// memory. Positions only ever grow, the data offset is position & (size - 1).
+struct ShmRingHeader {
+  unsigned int size;
+  alignas(64) unsigned long long head; // advanced by the consumer
+  alignas(64) unsigned long long tail; // advanced by the producer
+  alignas(64) int readerWaiting;       // consumer asks for a bell on data
+  int writerWaiting;                   // producer asks for a bell on space
+};
+
+struct ShmRing {
+  ShmRingHeader *header;
+  unsigned char *data;
+};
+
+// a stream channel between two local processes made of one ring per
+// direction in a memfd segment, plus an eventfd bell for each end. An end
+// only rings the other's bell when it has said it is waiting, so a busy
+// channel costs no system calls. The connecting end creates the segment and
+// both bells and passes them over the local socket.
+class ShmChannel {
+public:
+  ShmChannel();
+  ~ShmChannel();
+
+  // connecting end
+  bool create(unsigned int ringSize);
+  void offeredFDs(int *fds) const; // segment, own bell, peer bell
+  void closeSegment();
+  bool connecting() const { return connecting_; }
+
+  // accepting end. takeFDs keeps descriptors received with the offer until
+  // attach maps the segment.
+  void takeFDs(const int *fds);
+  bool attach(unsigned int ringSize);
+  bool attached() const { return segment_ != NULL; }
+
+  // producer side. Returns the number of bytes copied, which is short when
+  // the ring is full; the peer then rings once it has made room. Returns
+  // -1 if the peer has broken the ring.
+  int write(const struct iovec *iov, int count);
+
+  // consumer side. peek returns the number of contiguous bytes readable at
+  // data, or -1 if the peer has broken the ring; sleep asks for a bell on
+  // new data and returns false if some has arrived in the meantime.
+  int peek(unsigned char *&data);
+  void consume(int length);
+  bool sleep();
+
+  int bellFD() const { return ownBell_; }
+  void clearBell();
+  void ringSelf();
+
+  bool receiving;     // reading our ring, the peer has switched over
+  bool sending;       // writing to the peer's ring instead of the socket
+  bool switchPending; // switch over once the socket queue is empty
+
+private:
+  static size_t ringSpan(unsigned int ringSize);
+  void ring(int bell);
+
+  bool connecting_;
+  int segmentFD_;
+  int ownBell_;
+  int peerBell_;
+  unsigned char *segment_;
+  size_t segmentSize_;
+  unsigned int ringSize_; // as checked at create or attach, never reread
+  ShmRing tx_;
+  ShmRing rx_;
+};
+
+} // namespace pyconnect
+
+#endif // LINUX && !PYCONNECT_NO_SHM
+#endif // PyConnectShmRing_h_DEFINED
@@ -138,22 +138,31 @@ static PyMethodDef PyConnect_methods[] = {
      METH_VARARGS, "set new broadcast address"},
     {"send_peer_message", (PyCFunction)PyConnectStub::PyConnect_send_peer_msg,
      METH_VARARGS, "send peer servers a message"},
+    {"subscribe", (PyCFunction)PyConnectStub::PyConnect_subscribe,
+     METH_VARARGS, "follow updates of an attribute of a PyConnect object"},
+    {"unsubscribe", (PyCFunction)PyConnectStub::PyConnect_unsubscribe,
+     METH_VARARGS, "stop following updates of an attribute"},
     {NULL, NULL, 0, NULL} /* sentinel */
 };
 
 PyConnectArgument::PyConnectArgument(std::string &name,
-                                     PyConnectType::Type type, bool optional)
-    : name_(name), type_(type), isOptional_(optional) {}
+                                     PyConnectType::Type type, bool optional,
+                                     PyConnectLayout *layout)
+    : name_(name), type_(type), layout_(layout), isOptional_(optional) {}
 
-PyConnectArgument::PyConnectArgument(PyConnectType::Type type, bool optional)
-    : name_(""), type_(type), isOptional_(optional) {}
+PyConnectArgument::PyConnectArgument(PyConnectType::Type type, bool optional,
+                                     PyConnectLayout *layout)
+    : name_(""), type_(type), layout_(layout), isOptional_(optional) {}
+
+PyConnectArgument::~PyConnectArgument() { delete layout_; }
 
 PyConnectAttribute::PyConnectAttribute(std::string &name,
                                        PyConnectType::Type type, bool readonly,
-                                       PyObject *initValue)
-    : PyConnectArgument(name, type), readonly_(readonly),
-      value_(initValue) // we steal reference
-{}
+                                       PyObject *initValue,
+                                       PyConnectLayout *layout)
+    : PyConnectArgument(name, type, false, layout), readonly_(readonly),
+      value_(initValue), // we steal reference
+      followed_(true), deadband_(0.0), minInterval_(0) {}
 
 PyConnectAttribute::~PyConnectAttribute() { Py_DECREF(value_); }
 
@@ -308,16 +317,18 @@ int PyConnectObject::pyInit(PyConnectObject *self, PyObject *args,
 
 void PyConnectObject::addNewAttribute(std::string &name,
                                       PyConnectType::Type type, bool readOnly,
-                                      PyObject *initValue) {
+                                      PyObject *initValue,
+                                      PyConnectLayout *layout) {
   INFO_MSG("PyConnectObject:: add new %s attribute: %s, type %d\n",
            readOnly ? "readonly" : "", name.c_str(), (int)type);
-  pPyAttrs_.push_back(new PyConnectAttribute(name, type, readOnly, initValue));
+  pPyAttrs_.push_back(
+      new PyConnectAttribute(name, type, readOnly, initValue, layout));
   PyDict_SetItemString(this->myDict_, name.c_str(), initValue);
 }
 
 void PyConnectObject::addNewMethod(std::string &metdName,
                                    PyConnectType::Type type, pyArguments &args,
-                                   int optArgs) {
+                                   int optArgs, PyConnectLayout *retLayout) {
   INFO_MSG("PyConnectObject:: add a new method: %s rettype %d "
            "args %d, optional args %d\n",
            metdName.c_str(), (int)type, (int)args.size(), optArgs);
@@ -326,7 +337,7 @@ void PyConnectObject::addNewMethod(std::string &metdName,
     INFO_MSG("\ttype %d\n", (int)args[i]->type());
   }
   PyConnectMethod *pMetd =
-      new PyConnectMethod(this, metdName, type, args, optArgs);
+      new PyConnectMethod(this, metdName, type, args, optArgs, retLayout);
   pPyMetds_.push_back(pMetd);
   PyDict_SetItemString(this->myDict_, metdName.c_str(), pMetd);
 }
@@ -443,22 +454,27 @@ int PyConnectObject::setAttribute(char *name, PyObject *value) {
       return -1;
     }
     int aind = int(aiter - pPyAttrs_.begin());
-    int valSize = PyConnectType::validateTypeAndSize(value, (*aiter)->type());
+    int valSize = PyConnectType::validateTypeAndSize(value, (*aiter)->type(),
+                                                     (*aiter)->layout());
     if (!valSize) {
       PyErr_Format(PyExc_ValueError, "value for attribute %s is not a %s",
                    (*aiter)->name().c_str(),
-                   PyConnectType::typeName((*aiter)->type()).c_str());
+                   PyConnectType::typeName((*aiter)->type(), (*aiter)->layout())
+                       .c_str());
       return -1;
     }
     unsigned char *valBuf = new unsigned char[valSize];
     unsigned char *dataPtr = valBuf;
-    PyConnectType::packToStr(value, (*aiter)->type(), dataPtr);
+    PyConnectType::packToStr(value, (*aiter)->type(), dataPtr,
+                             (*aiter)->layout());
     if (this->noCallback_) {
       Py_INCREF(value);
       (*aiter)->setValue(value);
       PyConnectStub::instance()->remoteAttrMethodCall(
           this, aind, valBuf, valSize, CALL_ATTR_METD_NOCB);
     } else {
+      // the value is taken once the module has set it, from the update or
+      // the response that follows
       PyConnectStub::instance()->remoteAttrMethodCall(this, aind, valBuf,
                                                       valSize);
     }
@@ -492,6 +508,36 @@ int PyConnectObject::setAttribute(char *name, PyObject *value) {
   return 0;
 }
 
+// tell the module whether, and with which filters, we follow the
+// attribute at index
+void PyConnectObject::syncSubscription(int index) {
+  PyConnectAttribute *attr = pPyAttrs_[index];
+  unsigned char subscription[1 + sizeof(double) + sizeof(int)];
+  unsigned char *bufPtr = subscription;
+  if (attr->isFollowed()) {
+    *bufPtr++ = ATTR_SUBSCRIBE;
+    packToLENumber(attr->deadband(), bufPtr);
+    packToLENumber(attr->minInterval(), bufPtr);
+  } else {
+    *bufPtr++ = ATTR_UNSUBSCRIBE;
+  }
+  PyConnectStub::instance()->remoteAttrMethodCall(
+      this, index, subscription, (int)(bufPtr - subscription),
+      ATTR_SUBSCRIPTION);
+}
+
+bool PyConnectObject::followAttribute(const char *name, bool followed,
+                                      double deadband, int minInterval) {
+  for (int i = 0; i < (int)pPyAttrs_.size(); i++) {
+    if (pPyAttrs_[i]->name() == name) {
+      pPyAttrs_[i]->follow(followed, deadband, minInterval);
+      syncSubscription(i);
+      return true;
+    }
+  }
+  return false;
+}
+
 void PyConnectObject::onSetAttrMetdResp(int index, int err,
                                         unsigned char *&data,
                                         int &remainingLength) {
@@ -506,8 +552,8 @@ void PyConnectObject::onSetAttrMetdResp(int index, int err,
       arg = Py_BuildValue("(i)", err);
     } else { // onSetAtt
       fname = "onSet" + fname;
-      PyObject *retVal =
-          PyConnectType::unpackStr((*aiter)->type(), data, remainingLength);
+      PyObject *retVal = PyConnectType::unpackStr(
+          (*aiter)->type(), data, remainingLength, (*aiter)->layout());
       (*aiter)->setValue(retVal);
       arg = Py_BuildValue("(O)", retVal);
     }
@@ -521,8 +567,9 @@ void PyConnectObject::onSetAttrMetdResp(int index, int err,
         arg = Py_BuildValue("(i)", err);
       } else { // onMetdComplete
         fname = "on" + fname + "Completed";
-        PyObject *retVal = PyConnectType::unpackStr((*miter)->retType(), data,
-                                                    remainingLength);
+        PyObject *retVal =
+            PyConnectType::unpackStr((*miter)->retType(), data,
+                                     remainingLength, (*miter)->retLayout());
         arg = Py_BuildValue("(O)", retVal);
         Py_DECREF(retVal);
       }
@@ -552,8 +599,8 @@ void PyConnectObject::onGetAttrResp(int index, int err, unsigned char *&data,
       arg = Py_BuildValue("(i)", err);
     } else { // onAttrUpdate
       fname = "on" + fname + "Update";
-      PyObject *retVal =
-          PyConnectType::unpackStr((*aiter)->type(), data, remainingLength);
+      PyObject *retVal = PyConnectType::unpackStr(
+          (*aiter)->type(), data, remainingLength, (*aiter)->layout());
       (*aiter)->setValue(retVal);
       arg = Py_BuildValue("(O)", retVal);
     }
@@ -901,12 +948,12 @@ MesgProcessResult PyConnectStub::processInput(unsigned char *recData,
   unsigned char *message = NULL;
   int messageSize = 0;
 
+  // decrypted in place, so it stays valid whatever other threads decrypt
+  message = recData;
   if (skipdecrypt) {
-    message = recData;
     messageSize = bytesReceived;
   } else {
-    if (decryptMessage(recData, (int)bytesReceived, &message,
-                       (int *)&messageSize) != 1) {
+    if (decryptMessageTo(recData, bytesReceived, message, &messageSize) != 1) {
       WARNING_MSG("Unable to decrypt incoming messasge.\n");
       return MESG_PROCESSED_FAILED;
     }
@@ -921,14 +968,15 @@ MesgProcessResult PyConnectStub::processInput(unsigned char *recData,
 
   message++;
   PyConnectObject *pPyModule = NULL;
-  int dummyLen = 0;
+  int remainingBytes = messageSize - 1;
   int moduleId = 0;
   if (msgType == MODULE_DECLARE) {
     char modOpt = *message++;
-    std::string mName = unpackString(message, dummyLen);
+    remainingBytes--;
+    std::string mName = unpackString(message, remainingBytes);
     pPyModule = findModuleByName(mName);
     if (pPyModule == NULL) {
-      std::string mDesc = unpackString(message, dummyLen, true);
+      std::string mDesc = unpackString(message, remainingBytes, true);
       addNewModule(mName, mDesc, modOpt, cAddr);
       return MESG_PROCESSED_OK;
     } else {
@@ -946,7 +994,7 @@ MesgProcessResult PyConnectStub::processInput(unsigned char *recData,
     return MESG_TO_SHUTDOWN;
   } else if (msgType == PEER_SERVER_MSG) {
     int peerServerID = *(message - 1) & 0xf;
-    std::string peerMsg = unpackString(message, dummyLen, true);
+    std::string peerMsg = unpackString(message, remainingBytes, true);
     // threadsafe lock
     PyGILState_STATE gstate;
     gstate = PyGILState_Ensure();
@@ -967,6 +1015,7 @@ MesgProcessResult PyConnectStub::processInput(unsigned char *recData,
   } else {
     // find appropriate module
     moduleId = (int)(*message++ & 0xf);
+    remainingBytes--;
     pPyModule = findModuleByID(moduleId);
     if (pPyModule == NULL) {
       WARNING_MSG(
@@ -983,31 +1032,74 @@ MesgProcessResult PyConnectStub::processInput(unsigned char *recData,
   case ATTR_METD_EXPOSE: {
     // DEBUG_MSG( "PyConnectStub:processInput: ATTR_METD_EXPOSE\n" );
     //  unpacking attributes
-    int nofattrs = unpackStrToInt(message, dummyLen);
+    // a layout that cannot be read drops its attribute or method and all
+    // after it, as they can no longer be found in the message
+    bool corrupted = false;
+    int nofattrs = unpackStrToInt(message, remainingBytes);
     for (int i = 0; i < nofattrs; i++) {
-      bool readOnly = !(*message >> 6);
-      PyConnectType::Type type = (PyConnectType::Type)(*message++ & 0x3f);
-      std::string attrName = unpackString(message, dummyLen);
-      PyObject *initValue = PyConnectType::unpackStr(type, message, dummyLen);
-      pPyModule->addNewAttribute(attrName, type, readOnly, initValue);
+      bool readOnly = !(*message & 0x40);
+      unsigned char typeByte = *message++;
+      remainingBytes--;
+      PyConnectType::Type type = (PyConnectType::Type)(typeByte & 0x3f);
+      bool valid = true;
+      PyConnectLayout *layout = PyConnectLayout::unpackDeclared(
+          typeByte, message, remainingBytes, valid);
+      if (!valid) {
+        corrupted = true;
+        break;
+      }
+      std::string attrName = unpackString(message, remainingBytes);
+      PyObject *initValue =
+          PyConnectType::unpackStr(type, message, remainingBytes, layout);
+      pPyModule->addNewAttribute(attrName, type, readOnly, initValue, layout);
     }
 
     // unpacking methods
-    int nofmetds = unpackStrToInt(message, dummyLen);
-    for (int i = 0; i < nofmetds; i++) {
-      PyConnectType::Type type = (PyConnectType::Type)(*message++ & 0x3f);
-      std::string metdName = unpackString(message, dummyLen);
+    int nofmetds = corrupted ? 0 : unpackStrToInt(message, remainingBytes);
+    for (int i = 0; i < nofmetds && !corrupted; i++) {
+      unsigned char typeByte = *message++;
+      remainingBytes--;
+      PyConnectType::Type type = (PyConnectType::Type)(typeByte & 0x3f);
+      bool valid = true;
+      PyConnectLayout *retLayout = PyConnectLayout::unpackDeclared(
+          typeByte, message, remainingBytes, valid);
+      if (!valid) {
+        corrupted = true;
+        break;
+      }
+      std::string metdName = unpackString(message, remainingBytes);
       int nofargs = (int)(*message++ & 0xf);
+      remainingBytes--;
       pyArguments args;
       int optArgs = 0;
       for (int j = 0; j < nofargs; j++) {
-        bool optional = !!(*message >> 6);
+        bool optional = !!(*message & 0x40);
         if (optional)
           optArgs++;
-        PyConnectType::Type type = (PyConnectType::Type)(*message++ & 0x3f);
-        args.push_back(new PyConnectArgument(type, optional));
+        unsigned char typeByte = *message++;
+        remainingBytes--;
+        PyConnectType::Type type = (PyConnectType::Type)(typeByte & 0x3f);
+        bool valid = true;
+        PyConnectLayout *layout = PyConnectLayout::unpackDeclared(
+            typeByte, message, remainingBytes, valid);
+        if (!valid) {
+          corrupted = true;
+          break;
+        }
+        args.push_back(new PyConnectArgument(type, optional, layout));
       }
-      pPyModule->addNewMethod(metdName, type, args, optArgs);
+      if (corrupted) {
+        for (size_t j = 0; j < args.size(); j++)
+          delete args[j];
+        delete retLayout;
+        break;
+      }
+      pPyModule->addNewMethod(metdName, type, args, optArgs, retLayout);
+    }
+    if (corrupted) {
+      ERROR_MSG("PythonServer::processInput invalid layout in module %d "
+                "declaration! Ignore the rest of it.\n",
+                moduleId);
     }
     PyObject *arg = Py_BuildValue("(O)", pPyModule);
     if (pow_) {
@@ -1021,10 +1113,17 @@ MesgProcessResult PyConnectStub::processInput(unsigned char *recData,
     // DEBUG_MSG( "PyConnectStub:processInput: ATTR_METD_RESP\n" );
     int err = (int)(*message++ & 0xf);
     int datalen = 0;
-    int dummyLen = 0;
+    remainingBytes--;
     unpackLENumber(datalen, message,
-                   dummyLen); // assume both server and client conform to same
-                              // interger definition
+                   remainingBytes); // assume both server and client conform
+                                    // to same interger definition
+    if (datalen < 0 || datalen > remainingBytes) {
+      ERROR_MSG("PythonServer::processInput invalid data length %d! "
+                "Ignore.\n",
+                datalen);
+      PyGILState_Release(gstate);
+      return MESG_PROCESSED_FAILED;
+    }
     int amind = unpackStrToInt(message, datalen);
     pPyModule->onSetAttrMetdResp(amind, err, message, datalen);
   } break;
@@ -1032,15 +1131,22 @@ MesgProcessResult PyConnectStub::processInput(unsigned char *recData,
     // DEBUG_MSG( "PyConnectStub:processInput: ATTR_VALUE_UPDATE\n" );
     int err = (int)(*message++ & 0xf);
     int datalen = 0;
-    int dummyLen = 0;
+    remainingBytes--;
     unpackLENumber(datalen, message,
-                   dummyLen); // assume both server and client conform to same
-                              // interger definition
+                   remainingBytes); // assume both server and client conform
+                                    // to same interger definition
+    if (datalen < 0 || datalen > remainingBytes) {
+      ERROR_MSG("PythonServer::processInput invalid data length %d! "
+                "Ignore.\n",
+                datalen);
+      PyGILState_Release(gstate);
+      return MESG_PROCESSED_FAILED;
+    }
     int amind = unpackStrToInt(message, datalen);
     pPyModule->onGetAttrResp(amind, err, message, datalen);
   } break;
   case ATTR_METD_DESC: {
-    pPyModule->onSetAttrMetdDesc(message, dummyLen);
+    pPyModule->onSetAttrMetdDesc(message, remainingBytes);
   } break;
   default:
     ERROR_MSG("PythonServer::processInput invalid message header! Ignore.\n");
@@ -1059,8 +1165,9 @@ MesgProcessResult PyConnectStub::processInput(unsigned char *recData,
 
 PyConnectMethod::PyConnectMethod(PyConnectObject *owner, std::string &name,
                                  PyConnectType::Type type, pyArguments &args,
-                                 int optArgs)
-    : owner_(owner), name_(name), type_(type), args_(args), optArgs_(optArgs) {
+                                 int optArgs, PyConnectLayout *retLayout)
+    : owner_(owner), name_(name), type_(type), retLayout_(retLayout),
+      args_(args), optArgs_(optArgs) {
   PyObject_INIT(this, &PyConnectMethodType);
 
   id_ = (int)owner_->pPyMetds_.size();
@@ -1105,11 +1212,14 @@ PyObject *PyConnectMethod::pyCall(PyObject *args) {
     PyObject **argList = new PyObject *[argSize];
     for (int i = 0; i < argSize; i++) {
       pItem = PyTuple_GetItem(args, i + 1);
-      int sizeReq = PyConnectType::validateTypeAndSize(pItem, args_[i]->type());
+      int sizeReq = PyConnectType::validateTypeAndSize(
+          pItem, args_[i]->type(), args_[i]->layout());
       if (!sizeReq) {
         PyErr_Format(PyExc_ValueError, "%s(): argument %d is not a %s",
                      name_.c_str(), i + 1,
-                     PyConnectType::typeName(args_[i]->type()).c_str());
+                     PyConnectType::typeName(args_[i]->type(),
+                                             args_[i]->layout())
+                         .c_str());
         delete[] argList;
         return NULL;
       }
@@ -1122,12 +1232,14 @@ PyObject *PyConnectMethod::pyCall(PyObject *args) {
     unsigned char *dataPtr = argsBuf;
     if (owner_->argEvalReversed_) {
       for (int i = 0; i < argSize; i++) {
-        PyConnectType::packToStr(argList[i], args_[i]->type(), dataPtr);
+        PyConnectType::packToStr(argList[i], args_[i]->type(), dataPtr,
+                                 args_[i]->layout());
         Py_XDECREF(argList[i]);
       }
     } else {
       for (int i = argSize - 1; i >= 0; i--) {
-        PyConnectType::packToStr(argList[i], args_[i]->type(), dataPtr);
+        PyConnectType::packToStr(argList[i], args_[i]->type(), dataPtr,
+                                 args_[i]->layout());
         Py_XDECREF(argList[i]);
       }
     }
@@ -1152,6 +1264,7 @@ PyConnectMethod::~PyConnectMethod() {
     delete *iter;
   }
   args_.clear();
+  delete retLayout_;
 }
 
 void PyConnectStub::sendDiscoveryMsg(bool broadcast) {
@@ -1260,6 +1373,68 @@ PyObject *PyConnectStub::PyConnect_disconnect(PyObject *self, PyObject *args) {
   Py_RETURN_NONE;
 }
 
+PyObject *PyConnectStub::PyConnect_subscribe(PyObject *self, PyObject *args) {
+  if (!s_pPyConnectStub)
+    Py_RETURN_NONE;
+
+  PyObject *obj;
+  char *attrName;
+  double deadband = 0.0;
+  double interval = 0.0;
+  if (!PyArg_ParseTuple(args, "Os|dd", &obj, &attrName, &deadband,
+                        &interval)) {
+    // PyArg_ParseTuple will set the error status.
+    return NULL;
+  }
+  if (deadband < 0.0 || interval < 0.0 || interval > 2000.0) {
+    PyErr_Format(PyExc_ValueError, "invalid deadband or interval for %s.",
+                 attrName);
+    return NULL;
+  }
+  PyConnectObject *pyConnectbj = NULL;
+  if (PyObject_IsInstance(obj, (PyObject *)&PyConnectObjectType))
+    pyConnectbj = PyConnectStub::instance()->findModuleByRef(obj);
+  if (!pyConnectbj) {
+    PyErr_Format(PyExc_LookupError,
+                 "Input argument is not a live PyConnect object.");
+    return NULL;
+  }
+  if (!pyConnectbj->followAttribute(attrName, true, deadband,
+                                    (int)(interval * 1000000))) {
+    PyErr_Format(PyExc_AttributeError, "%s has no attribute %s.",
+                 pyConnectbj->name().c_str(), attrName);
+    return NULL;
+  }
+  Py_RETURN_NONE;
+}
+
+PyObject *PyConnectStub::PyConnect_unsubscribe(PyObject *self,
+                                               PyObject *args) {
+  if (!s_pPyConnectStub)
+    Py_RETURN_NONE;
+
+  PyObject *obj;
+  char *attrName;
+  if (!PyArg_ParseTuple(args, "Os", &obj, &attrName)) {
+    // PyArg_ParseTuple will set the error status.
+    return NULL;
+  }
+  PyConnectObject *pyConnectbj = NULL;
+  if (PyObject_IsInstance(obj, (PyObject *)&PyConnectObjectType))
+    pyConnectbj = PyConnectStub::instance()->findModuleByRef(obj);
+  if (!pyConnectbj) {
+    PyErr_Format(PyExc_LookupError,
+                 "Input argument is not a live PyConnect object.");
+    return NULL;
+  }
+  if (!pyConnectbj->followAttribute(attrName, false)) {
+    PyErr_Format(PyExc_AttributeError, "%s has no attribute %s.",
+                 pyConnectbj->name().c_str(), attrName);
+    return NULL;
+  }
+  Py_RETURN_NONE;
+}
+
 PyObject *PyConnectStub::PyConnect_connect(PyObject *self, PyObject *args) {
   if (!s_pPyConnectStub)
     Py_RETURN_NONE;
@@ -1335,6 +1510,12 @@ PyObject *PyConnectStub::PyConnect_send_peer_msg(PyObject *self,
     // PyArg_ParseTuple will set the error status.
     return NULL;
   }
+  if ((int)strlen(msg) > MAX_STR_LENGTH) {
+    PyErr_Format(PyExc_ValueError,
+                 "PyConnect.send_peer_msg: message longer than %d bytes.",
+                 MAX_STR_LENGTH);
+    return NULL;
+  }
 
   s_pPyConnectStub->sendPeerMessage(msg);
 
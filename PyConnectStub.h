@@ -66,24 +66,29 @@ class PyConnectObject;
 
 class PyConnectArgument { // no description for argument yet
 public:
+  // takes over layout, the layout of a COMPOSITE type
   PyConnectArgument(std::string &name, PyConnectType::Type type,
-                    bool optional = false);
-  PyConnectArgument(PyConnectType::Type type, bool optional = false);
+                    bool optional = false, PyConnectLayout *layout = NULL);
+  PyConnectArgument(PyConnectType::Type type, bool optional = false,
+                    PyConnectLayout *layout = NULL);
+  ~PyConnectArgument();
 
   std::string &name() { return this->name_; }
   PyConnectType::Type type() const { return type_; }
+  const PyConnectLayout *layout() const { return layout_; }
   bool isOptional() const { return isOptional_; }
 
 protected:
   std::string name_;
   PyConnectType::Type type_;
+  PyConnectLayout *layout_;
   bool isOptional_;
 };
 
 class PyConnectAttribute : public PyConnectArgument {
 public:
   PyConnectAttribute(std::string &name, PyConnectType::Type type, bool readonly,
-                     PyObject *initValue);
+                     PyObject *initValue, PyConnectLayout *layout = NULL);
   ~PyConnectAttribute();
   bool isReadOnly() const { return readonly_; }
   PyObject *getValue() {
@@ -93,10 +98,24 @@ public:
   void setValue(PyObject *newValue);
   void setDescription(const std::string &desc) { desc_ = desc; }
 
+  // updates are followed unless PyConnect.unsubscribe stopped them, with
+  // the filters PyConnect.subscribe has the wrapper apply to them
+  bool isFollowed() const { return followed_; }
+  void follow(bool followed, double deadband = 0.0, int minInterval = 0) {
+    followed_ = followed;
+    deadband_ = deadband;
+    minInterval_ = minInterval;
+  }
+  double deadband() const { return deadband_; }
+  int minInterval() const { return minInterval_; }
+
 private:
   std::string desc_;
   bool readonly_;
   PyObject *value_;
+  bool followed_;
+  double deadband_;
+  int minInterval_; // in microseconds
 };
 
 typedef std::vector<PyConnectAttribute *> pyAttributes;
@@ -105,7 +124,8 @@ typedef std::vector<PyConnectArgument *> pyArguments;
 class PyConnectMethod : public PyObject {
 public:
   PyConnectMethod(PyConnectObject *owner, std::string &name,
-                  PyConnectType::Type type, pyArguments &args, int optArgs = 0);
+                  PyConnectType::Type type, pyArguments &args, int optArgs = 0,
+                  PyConnectLayout *retLayout = NULL);
   ~PyConnectMethod();
 
   int id() const { return id_; }
@@ -115,6 +135,7 @@ public:
     myMetdDef_.ml_doc = desc_.c_str();
   }
   PyConnectType::Type retType() const { return type_; }
+  const PyConnectLayout *retLayout() const { return retLayout_; }
   PyObject *methodObj() {
     Py_INCREF(metdObj_);
     return metdObj_;
@@ -128,6 +149,7 @@ private:
   std::string name_;
   std::string desc_;
   PyConnectType::Type type_;
+  PyConnectLayout *retLayout_;
   pyArguments args_;
   int optArgs_;
   int id_;
@@ -187,12 +209,17 @@ public:
                      int &remainingLength);
   void onSetAttrMetdDesc(unsigned char *&data, int &remainingLength);
   void addNewAttribute(std::string &name, PyConnectType::Type type,
-                       bool readOnly, PyObject *initValue);
+                       bool readOnly, PyObject *initValue,
+                       PyConnectLayout *layout = NULL);
   void addNewMethod(std::string &metdName, PyConnectType::Type type,
-                    pyArguments &args, int optArgs);
+                    pyArguments &args, int optArgs,
+                    PyConnectLayout *retLayout = NULL);
 
   void setNetworkAddress(struct sockaddr_in &cAddr);
 
+  bool followAttribute(const char *name, bool followed, double deadband = 0.0,
+                       int minInterval = 0);
+
 private:
   int id_;
   bool noCallback_;
@@ -205,6 +232,7 @@ private:
 
   PyObject *getAttribute(char *name);
   int setAttribute(char *name, PyObject *value);
+  void syncSubscription(int index);
 
   friend class PyConnectMethod;
 };
@@ -217,6 +245,8 @@ public:
   static PyObject *PyConnect_disconnect(PyObject *self, PyObject *args);
   static PyObject *PyConnect_set_broadcast(PyObject *self, PyObject *args);
   static PyObject *PyConnect_send_peer_msg(PyObject *self, PyObject *args);
+  static PyObject *PyConnect_subscribe(PyObject *self, PyObject *args);
+  static PyObject *PyConnect_unsubscribe(PyObject *self, PyObject *args);
 
   static PyConnectStub *init(PyOutputWriter *pow = NULL);
   static PyConnectStub *instance() { return s_pPyConnectStub; }
@@ -19,15 +19,35 @@
  */
 
 #include "PyConnectWrapper.h"
+#include <chrono>
 #include <iterator>
+#include <math.h>
+#ifndef OPENR_OBJECT
+#include <mutex>
+#endif
 
 namespace pyconnect {
 
+// descriptions go as strings, so they are cut to the longest one that can
+// be sent
+static std::string sendableDescription(const std::string &desc) {
+  if ((int)desc.length() <= MAX_STR_LENGTH)
+    return desc;
+
+  ERROR_MSG("PyConnect: description of %d bytes cut to %d.\n",
+            (int)desc.length(), MAX_STR_LENGTH);
+  return desc.substr(0, MAX_STR_LENGTH);
+}
+
 Attribute::Attribute(const char *desc, PyConnectType::Type type,
                      int (*getrawfn)(unsigned char *&), void (*getfn)(int, int),
-                     void (*setfn)(int, unsigned char *&, int &, int)) {
-  this->desc = std::string(desc);
+                     void (*setfn)(int, unsigned char *&, int &, int),
+                     const std::string &layout) {
+  this->desc = sendableDescription(desc);
   this->type = type;
+  this->layout = layout;
+  this->id_ = 0;
+  this->policy_ = NULL;
   this->attrGetFn = getfn;
   this->attrSetFn = setfn;
   this->getRawValueFn = getrawfn;
@@ -35,15 +55,16 @@ Attribute::Attribute(const char *desc, PyConnectType::Type type,
 
 Method::Method(const char *desc, PyConnectType::Type type,
                void (*accessFn)(int, unsigned char *&, int &, int),
-               Arguments &args) {
-  this->desc = std::string(desc);
+               Arguments &args, const std::string &layout) {
+  this->desc = sendableDescription(desc);
   this->type = type;
+  this->layout = layout;
   this->args_ = args;
   this->accessFn_ = accessFn;
 }
 
 Argument::Argument(const char *name, const char *desc, PyConnectType::Type type,
-                   bool isOptional) {
+                   bool isOptional, const std::string &layout) {
 #ifdef WIN32
   strncpy_s(this->name, 256, name, _TRUNCATE);
 #else
@@ -52,6 +73,7 @@ Argument::Argument(const char *name, const char *desc, PyConnectType::Type type,
 #endif
   this->desc = std::string(desc);
   this->type = type;
+  this->layout = layout;
   this->isOptional_ = isOptional;
 }
 
@@ -66,7 +88,7 @@ Method::~Method() {
 PyConnectModule::PyConnectModule(const std::string &name,
                                  const std::string &desc, OObject *oobject) {
   this->name = name;
-  this->desc = desc;
+  this->desc = sendableDescription(desc);
   this->oobject_ = oobject;
 }
 
@@ -84,8 +106,81 @@ PyConnectModule::~PyConnectModule() {
   methods.clear();
 }
 
+void PyConnectModule::buildTables() {
+  attributeTable.clear();
+  for (Attributes::iterator aiter = attributes.begin();
+       aiter != attributes.end(); aiter++) {
+    aiter->second->setId((int)attributeTable.size());
+    attributeTable.push_back(aiter->second);
+  }
+  methodTable.clear();
+  for (Methods::iterator miter = methods.begin(); miter != methods.end();
+       miter++) {
+    methodTable.push_back(miter->second);
+  }
+}
+
 PyConnectWrapper *PyConnectWrapper::s_pPyConnectWrapper = NULL;
 
+// publish policies are shared by the publishing threads and the timer
+#ifdef OPENR_OBJECT
+struct PolicyLock {};
+#else
+static std::mutex s_policyMutex;
+
+struct PolicyLock {
+  PolicyLock() { s_policyMutex.lock(); }
+  ~PolicyLock() { s_policyMutex.unlock(); }
+};
+#endif
+
+// attribute and method responses are built in a buffer of the sending
+// thread that is kept from one message to the next, so that once it has
+// grown to the largest of them sending one allocates nothing.
+struct MessageBuffer {
+  unsigned char *data;
+  int size;
+  unsigned long allocations;
+
+  MessageBuffer() : data(NULL), size(0), allocations(0) {}
+  ~MessageBuffer() { delete[] data; }
+};
+
+#ifdef OPENR_OBJECT
+static MessageBuffer s_messageBuffer;
+#else
+static thread_local MessageBuffer s_messageBuffer;
+#endif
+
+// the message buffer of the calling thread with room for at least size
+// bytes, or NULL
+static unsigned char *reserveMessageBuffer(int size) {
+  MessageBuffer &buffer = s_messageBuffer;
+  if (buffer.size >= size)
+    return buffer.data;
+
+  int newSize = buffer.size > 0 ? buffer.size : PYCONNECT_MSG_BUFFER_SIZE;
+  while (newSize < size)
+    newSize *= 2;
+
+  unsigned char *newData = new (std::nothrow) unsigned char[newSize];
+  if (!newData) {
+    ERROR_MSG("PyConnectWrapper: unable to allocate %d bytes of message "
+              "buffer.\n",
+              newSize);
+    return NULL;
+  }
+  delete[] buffer.data;
+  buffer.data = newData;
+  buffer.size = newSize;
+  buffer.allocations++;
+  return newData;
+}
+
+unsigned long PyConnectWrapper::messageBufferAllocations() {
+  return s_messageBuffer.allocations;
+}
+
 void PyConnectWrapper::init(PyConnectModule *pModule) {
   if (s_pPyConnectWrapper) {
     if (!s_pPyConnectWrapper->pPyConnectModule_)
@@ -148,7 +243,7 @@ void PyConnectWrapper::declareModuleAttrMetd(int serverId) {
   int attId = 0;
   for (Attributes::iterator aiter = pPyConnectModule_->attributes.begin();
        aiter != pPyConnectModule_->attributes.end(); aiter++) {
-    attrlens += aiter->first.length();
+    attrlens += aiter->first.length() + aiter->second->layout.length();
     attrValuePacks[attId].len =
         aiter->second->getRawValue(attrValuePacks[attId].buf);
     attrValueLens += attrValuePacks[attId].len;
@@ -163,7 +258,12 @@ void PyConnectWrapper::declareModuleAttrMetd(int serverId) {
        miter != pPyConnectModule_->methods.end(); miter++) {
     metdlens += miter->first.length();
     Method *curMetd = miter->second;
+    metdlens += curMetd->layout.length();
     metdlens += curMetd->args().size(); // argument type 1 byte per argument
+    for (Arguments::iterator iter = curMetd->args().begin();
+         iter != curMetd->args().end(); iter++) {
+      metdlens += (*iter)->layout.length();
+    }
   }
   int nofmethods = pPyConnectModule_->methods.size();
   int totalMetdSize =
@@ -193,9 +293,11 @@ void PyConnectWrapper::declareModuleAttrMetd(int serverId) {
        aiter != pPyConnectModule_->attributes.end(); aiter++) {
     Attribute *attr = aiter->second;
     char flag = (attr->isWritable() ? 1 : 0) << 6;
-    flag |= attr->type & 0x3f;
+    flag |= declaredType(attr->type, attr->layout);
     *bufPtr = flag;
     bufPtr++;
+    memcpy(bufPtr, attr->layout.data(), attr->layout.length());
+    bufPtr += attr->layout.length();
     packString((unsigned char *)aiter->first.data(), aiter->first.length(),
                bufPtr);
     memcpy(bufPtr, attrValuePacks[attId].buf, attrValuePacks[attId].len);
@@ -210,8 +312,10 @@ void PyConnectWrapper::declareModuleAttrMetd(int serverId) {
   for (Methods::iterator miter = pPyConnectModule_->methods.begin();
        miter != pPyConnectModule_->methods.end(); miter++) {
     Method *metd = miter->second;
-    *bufPtr = (unsigned char)(metd->type & 0x3f);
+    *bufPtr = declaredType(metd->type, metd->layout);
     bufPtr++;
+    memcpy(bufPtr, metd->layout.data(), metd->layout.length());
+    bufPtr += metd->layout.length();
     packString((unsigned char *)miter->first.data(), miter->first.length(),
                bufPtr);
     *bufPtr = (unsigned char)metd->args().size();
@@ -219,9 +323,11 @@ void PyConnectWrapper::declareModuleAttrMetd(int serverId) {
     for (Arguments::iterator iter = metd->args().begin();
          iter != metd->args().end(); iter++) {
       char flag = ((*iter)->isOptional() ? 1 : 0) << 6;
-      flag |= (*iter)->type & 0x3f;
+      flag |= declaredType((*iter)->type, (*iter)->layout);
       *bufPtr = flag;
       bufPtr++;
+      memcpy(bufPtr, (*iter)->layout.data(), (*iter)->layout.length());
+      bufPtr += (*iter)->layout.length();
     }
   }
 
@@ -308,12 +414,12 @@ MesgProcessResult PyConnectWrapper::processInput(unsigned char *recData,
     return MESG_PROCESSED_FAILED;
   }
 
+  // decrypted in place, so it stays valid whatever other threads decrypt
+  message = recData;
   if (skipdecrypt) {
-    message = recData;
     messageSize = bytesReceived;
   } else {
-    if (decryptMessage(recData, (int)bytesReceived, &message,
-                       (int *)&messageSize) != 1) {
+    if (decryptMessageTo(recData, bytesReceived, message, &messageSize) != 1) {
       WARNING_MSG("Unable to decrypt incoming messasge.\n");
       return MESG_PROCESSED_FAILED;
     }
@@ -367,7 +473,11 @@ MesgProcessResult PyConnectWrapper::processInput(unsigned char *recData,
         sinfo.sAddr = cAddr;
         serverMap_[serverId] = sinfo;
       } else {
+        // a fresh object on the server, which subscribes anew
+        PolicyLock lock;
         siter->second.assignedModuleID = modId;
+        siter->second.attributeUpdate = true;
+        siter->second.subscriptions.clear();
       }
 #ifndef OPENR_OBJECT
       pPyConnectModule_->oobject()->onClientConnected(serverId);
@@ -396,15 +506,23 @@ MesgProcessResult PyConnectWrapper::processInput(unsigned char *recData,
     int dummyLen = 0;
     unpackLENumber(rDataSize, message, dummyLen);
     int attrId = unpackStrToInt(message, rDataSize);
-    if (attrId < (int)pPyConnectModule_->attributes.size()) {
-      Attributes::iterator iter = pPyConnectModule_->attributes.begin();
-      advance(iter, attrId);
-      iter->second->setAttrValue(attrId, message, rDataSize, serverId);
+    int nofattrs = (int)pPyConnectModule_->attributeTable.size();
+    int metdId = attrId - nofattrs;
+    if (attrId >= 0 && attrId < nofattrs) {
+      pPyConnectModule_->attributeTable[attrId]->setAttrValue(
+          attrId, message, rDataSize, serverId);
+    } else if (metdId >= 0 &&
+               metdId < (int)pPyConnectModule_->methodTable.size()) {
+      pPyConnectModule_->methodTable[metdId]->methodCall(metdId, message,
+                                                         rDataSize, serverId);
     } else {
-      int metdId = attrId - pPyConnectModule_->attributes.size();
-      Methods::iterator iter = pPyConnectModule_->methods.begin();
-      advance(iter, metdId);
-      iter->second->methodCall(metdId, message, rDataSize, serverId);
+      ERROR_MSG("PyConnectWrapper::processInput invalid attribute or method "
+                "id %d! Ignore.\n",
+                attrId);
+      if (!noResponse_)
+        sendAttrMetdResponse(INDEX_MISMATCH, attrId, 0, NULL, serverId);
+      this->noResponse_ = false;
+      return MESG_PROCESSED_FAILED;
     }
     this->noResponse_ = false; // reset
   } break;
@@ -413,32 +531,36 @@ MesgProcessResult PyConnectWrapper::processInput(unsigned char *recData,
     int dummyLen = 0;
     unpackLENumber(rDataSize, message, dummyLen);
     int attrId = unpackStrToInt(message, rDataSize);
-    if (attrId < (int)pPyConnectModule_->attributes.size()) {
-      Attributes::iterator iter = pPyConnectModule_->attributes.begin();
-      advance(iter, attrId);
-      iter->second->getAttrValue(attrId, serverId);
+    if (attrId >= 0 && attrId < (int)pPyConnectModule_->attributeTable.size()) {
+      pPyConnectModule_->attributeTable[attrId]->getAttrValue(attrId, serverId);
     } else {
       ERROR_MSG(
           "PyConnectWrapper::processInput invalid attribute id %d! Ignore.\n",
           attrId);
     }
   } break;
+  case ATTR_SUBSCRIPTION:
+    processSubscription(serverId, siter->second, message);
+    break;
   case GET_ATTR_METD_DESC: {
     int rDataSize = 1;
     int attrId = unpackStrToInt(message, rDataSize);
-    if (attrId < (int)pPyConnectModule_->attributes.size()) {
-      Attributes::iterator iter = pPyConnectModule_->attributes.begin();
-      advance(iter, attrId);
-      sendAttrMetdResponse(NO_ERRORS, attrId, iter->second->desc.length(),
-                           (unsigned char *)iter->second->desc.data(),
-                           serverId);
+    int nofattrs = (int)pPyConnectModule_->attributeTable.size();
+    int metdId = attrId - nofattrs;
+    if (attrId >= 0 && attrId < nofattrs) {
+      Attribute *attr = pPyConnectModule_->attributeTable[attrId];
+      sendAttrMetdResponse(NO_ERRORS, attrId, attr->desc.length(),
+                           (unsigned char *)attr->desc.data(), serverId);
+    } else if (metdId >= 0 &&
+               metdId < (int)pPyConnectModule_->methodTable.size()) {
+      Method *metd = pPyConnectModule_->methodTable[metdId];
+      sendAttrMetdResponse(NO_ERRORS, metdId, metd->desc.length(),
+                           (unsigned char *)metd->desc.data(), serverId);
     } else {
-      int metdId = attrId - pPyConnectModule_->attributes.size();
-      Methods::iterator iter = pPyConnectModule_->methods.begin();
-      advance(iter, metdId);
-      sendAttrMetdResponse(NO_ERRORS, metdId, iter->second->desc.length(),
-                           (unsigned char *)iter->second->desc.data(),
-                           serverId);
+      ERROR_MSG("PyConnectWrapper::processInput invalid attribute or method "
+                "id %d! Ignore.\n",
+                attrId);
+      return MESG_PROCESSED_FAILED;
     }
   } break;
   default:
@@ -455,36 +577,26 @@ MesgProcessResult PyConnectWrapper::processInput(unsigned char *recData,
   return MESG_PROCESSED_OK;
 }
 
-PyConnectMsgStatus PyConnectWrapper::validateAttribute(int attrId,
-                                                       const char *attrName) {
+// calls are dispatched by id through the tables, whose entries were checked
+// by name as they were added, so only the id itself needs checking
+PyConnectMsgStatus PyConnectWrapper::validateAttribute(int attrId) {
   PyConnectMsgStatus status = NO_ERRORS;
-  Attributes::iterator oiter =
-      pPyConnectModule_->attributes.find(std::string(attrName));
-  Attributes::iterator iter = pPyConnectModule_->attributes.begin();
-  advance(iter, attrId);
-
-  if (oiter != iter) {
-    ERROR_MSG("PyConnectWrapper::validateAttribute attribute %s index mismatch."
+  if (attrId < 0 || attrId >= (int)pPyConnectModule_->attributeTable.size()) {
+    ERROR_MSG("PyConnectWrapper::validateAttribute attribute index mismatch. "
               "Provided index %d\n",
-              attrName, attrId);
+              attrId);
     status = INDEX_MISMATCH;
   }
 
   return status;
 }
 
-PyConnectMsgStatus PyConnectWrapper::validateMethod(int metdId,
-                                                    const char *metdName) {
+PyConnectMsgStatus PyConnectWrapper::validateMethod(int metdId) {
   PyConnectMsgStatus status = NO_ERRORS;
-  Methods::iterator oiter =
-      pPyConnectModule_->methods.find(std::string(metdName));
-  Methods::iterator iter = pPyConnectModule_->methods.begin();
-  advance(iter, metdId);
-
-  if (oiter != iter) {
-    ERROR_MSG("PyConnectWrapper::validateMethod method %s index mismatch."
+  if (metdId < 0 || metdId >= (int)pPyConnectModule_->methodTable.size()) {
+    ERROR_MSG("PyConnectWrapper::validateMethod method index mismatch. "
               "Provided index %d\n",
-              metdName, metdId);
+              metdId);
     status = INDEX_MISMATCH;
   }
   return status;
@@ -493,15 +605,30 @@ PyConnectMsgStatus PyConnectWrapper::validateMethod(int metdId,
 void PyConnectWrapper::sendAttrMetdResponse(int err, int index, int length,
                                             unsigned char *data, int serverId,
                                             PyConnectMsg msgType) {
-  unsigned char *dataBuffer = NULL;
+  unsigned char *bufPtr =
+      beginAttrMetdResponse(err, index, length, serverId, msgType);
+  if (!bufPtr)
+    return;
+
+  if (length) {
+    memcpy(bufPtr, data, length);
+    bufPtr += length;
+  }
+  endAttrMetdResponse(bufPtr);
+}
 
+// start a response in the message buffer and return where its length bytes
+// of data go, or NULL if there is no room for it.
+unsigned char *PyConnectWrapper::beginAttrMetdResponse(int err, int index,
+                                                       int length, int serverId,
+                                                       PyConnectMsg msgType) {
   int al = packedIntLen(index);
   int dataLength = length + al;
   int totalMsgSize = 4 + sizeof(int) + dataLength;
 
-  dataBuffer = new unsigned char[totalMsgSize];
-
-  unsigned char *bufPtr = dataBuffer;
+  unsigned char *bufPtr = reserveMessageBuffer(totalMsgSize);
+  if (!bufPtr)
+    return NULL;
 
   *bufPtr = (unsigned char)(msgType << 4 | (serverId & 0xf));
   bufPtr++;
@@ -512,26 +639,423 @@ void PyConnectWrapper::sendAttrMetdResponse(int err, int index, int length,
   packToLENumber(dataLength, bufPtr);
 
   packIntToStr(index, bufPtr);
-  if (length) {
-    memcpy(bufPtr, data, length);
-    bufPtr += length;
+  return bufPtr;
+}
+
+// end the response in the message buffer at bufPtr and send it
+void PyConnectWrapper::endAttrMetdResponse(unsigned char *bufPtr) {
+  *bufPtr++ = PYCONNECT_MSG_END;
+  this->dispatchMessage(s_messageBuffer.data,
+                        (int)(bufPtr - s_messageBuffer.data));
+}
+
+// end the attribute update in the message buffer at bufPtr and send it to
+// servers, unless the publish policy of the attribute holds it back. The
+// held servers get it on the timer, once their subscriptions allow.
+void PyConnectWrapper::fanOutAttrUpdate(Attribute *attr, unsigned char *bufPtr,
+                                        unsigned int servers,
+                                        unsigned int held) {
+  *bufPtr++ = PYCONNECT_MSG_END;
+  unsigned char *message = s_messageBuffer.data;
+  int messageLength = (int)(bufPtr - message);
+
+  if (held)
+    holdAttrUpdate(attr, message, messageLength, held);
+  if (!servers)
+    return;
+
+  {
+    // setPublishPolicy may replace or remove the policy meanwhile
+    PolicyLock lock;
+    PublishPolicy *policy = attr->publishPolicy();
+    if (policy && !admitAttrUpdate(policy, message, messageLength, servers))
+      return;
   }
-  *bufPtr = PYCONNECT_MSG_END;
+  sendAttrUpdate(message, messageLength, servers);
+}
 
-  this->dispatchMessage(dataBuffer, totalMsgSize);
+// send an attribute update to servers, a bit per server id. Only the
+// server id and our module id there differ from one server to the next.
+void PyConnectWrapper::sendAttrUpdate(unsigned char *message,
+                                      int messageLength,
+                                      unsigned int servers) {
+  // let the transport write the updates to all servers in one go
+  this->beginDispatchBatch();
+  for (ServerMap::const_iterator siter = serverMap_.begin();
+       siter != serverMap_.end(); siter++) {
+    if (!(servers & (1u << siter->first)))
+      continue;
+    message[0] = (unsigned char)(ATTR_VALUE_UPDATE << 4 | (siter->first & 0xf));
+    message[1] = (unsigned char)siter->second.assignedModuleID;
+    this->dispatchMessage(message, messageLength);
+  }
+  this->endDispatchBatch();
+}
 
-  delete[] dataBuffer;
+static long long monotonicUSec() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// the number a packed value of a numeric type stands for, as the deadband
+// of a subscription sees it
+static double rawNumericValue(PyConnectType::Type type, unsigned char *buf,
+                              int length) {
+  int remainingLength = length;
+  if (type == PyConnectType::INT && length == (int)sizeof(int)) {
+    int value = 0;
+    unpackLENumber(value, buf, remainingLength);
+    return value;
+  } else if (type == PyConnectType::FLOAT && length == (int)sizeof(float)) {
+    float value = 0.0;
+    unpackLENumber(value, buf, remainingLength);
+    return value;
+  } else if (type == PyConnectType::DOUBLE && length == (int)sizeof(double)) {
+    double value = 0.0;
+    unpackLENumber(value, buf, remainingLength);
+    return value;
+  } else if (type == PyConnectType::BOOL && length == 1) {
+    return (*buf != 0) ? 1.0 : 0.0;
+  }
+  return 0.0;
+}
+
+// the servers, a bit per server id, that want value as the next update of
+// attr. Servers that have not subscribed to anything want them all. The
+// servers whose minimum interval has not passed yet go to held instead.
+unsigned int PyConnectWrapper::subscribedServers(Attribute *attr,
+                                                 bool numeric, double value,
+                                                 unsigned int &held) {
+  unsigned int servers = 0;
+  long long now = 0;
+  PolicyLock lock;
+  for (ServerMap::iterator siter = serverMap_.begin();
+       siter != serverMap_.end(); siter++) {
+    ServerInfo &sinfo = siter->second;
+    if (sinfo.attributeUpdate) {
+      servers |= 1u << siter->first;
+      continue;
+    }
+    if (attr->id() >= (int)sinfo.subscriptions.size())
+      continue;
+    Subscription &sub = sinfo.subscriptions[attr->id()];
+    if (!sub.active)
+      continue;
+    if (!now)
+      now = monotonicUSec();
+    if (sub.sent) {
+      // a value back within the deadband leaves nothing to catch up on
+      if (numeric && sub.deadband > 0.0 &&
+          fabs(value - sub.lastValue) < sub.deadband) {
+        sub.held.clear();
+        continue;
+      }
+      if (now - sub.lastSent < sub.minInterval) {
+        sub.heldValue = value;
+        held |= 1u << siter->first;
+        continue;
+      }
+    }
+    sub.sent = true;
+    sub.lastSent = now;
+    sub.lastValue = value;
+    sub.held.clear();
+    servers |= 1u << siter->first;
+  }
+  return servers;
+}
+
+// keep the update for the held servers, in place of any kept before, and
+// have the timer send it when their intervals are over
+void PyConnectWrapper::holdAttrUpdate(Attribute *attr,
+                                      const unsigned char *message,
+                                      int messageLength, unsigned int held) {
+  PolicyLock lock;
+  for (ServerMap::iterator siter = serverMap_.begin();
+       siter != serverMap_.end(); siter++) {
+    if (!(held & (1u << siter->first)) ||
+        attr->id() >= (int)siter->second.subscriptions.size())
+      continue;
+    Subscription &sub = siter->second.subscriptions[attr->id()];
+    sub.held.assign(message, message + messageLength);
+    scheduleFlush(sub.lastSent + sub.minInterval);
+  }
+}
+
+// whether the server gets updates of the attribute
+bool PyConnectWrapper::followsAttribute(int serverId, int attrId) {
+  PolicyLock lock;
+  ServerMap::const_iterator siter = serverMap_.find(serverId);
+  if (siter == serverMap_.end())
+    return false;
+  const ServerInfo &sinfo = siter->second;
+  return sinfo.attributeUpdate ||
+         (attrId < (int)sinfo.subscriptions.size() &&
+          sinfo.subscriptions[attrId].active);
+}
+
+// take a subscription to, or unsubscription from, an attribute. A server
+// gets updates of every attribute it has not unsubscribed from, filtered as
+// it has subscribed to them.
+void PyConnectWrapper::processSubscription(int serverId, ServerInfo &sinfo,
+                                           unsigned char *&message) {
+  int rDataSize = 0;
+  int dummyLen = 0;
+  unpackLENumber(rDataSize, message, dummyLen);
+  int attrId = unpackStrToInt(message, rDataSize);
+  if (rDataSize < 1) {
+    ERROR_MSG("PyConnectWrapper::processSubscription truncated "
+              "subscription message! Ignore.\n");
+    return;
+  }
+  int op = *message++;
+  rDataSize--;
+
+  Subscription sub = Subscription();
+  if (op == ATTR_SUBSCRIBE) {
+    if (rDataSize < (int)(sizeof(double) + sizeof(int))) {
+      ERROR_MSG("PyConnectWrapper::processSubscription truncated "
+                "subscription to attribute %d! Ignore.\n",
+                attrId);
+      return;
+    }
+    int minInterval = 0;
+    unpackLENumber(sub.deadband, message, rDataSize);
+    unpackLENumber(minInterval, message, rDataSize);
+    sub.minInterval = minInterval;
+    sub.active = true;
+  } else if (op != ATTR_UNSUBSCRIBE) {
+    ERROR_MSG("PyConnectWrapper::processSubscription invalid subscription "
+              "%d! Ignore.\n",
+              op);
+    return;
+  }
+  int nofattrs = (int)pPyConnectModule_->attributeTable.size();
+  if (attrId < 0 || attrId >= nofattrs) {
+    ERROR_MSG("PyConnectWrapper::processSubscription invalid attribute id "
+              "%d! Ignore.\n",
+              attrId);
+    return;
+  }
+
+  // a subscriber starts from the current value, which its filters then
+  // measure the next updates against
+  Attribute *attr = pPyConnectModule_->attributeTable[attrId];
+  unsigned char *valueBuf = NULL;
+  int valueLength = 0;
+  if (sub.active) {
+    valueLength = attr->getRawValue(valueBuf);
+    sub.sent = true;
+    sub.lastSent = monotonicUSec();
+    sub.lastValue = rawNumericValue(attr->type, valueBuf, valueLength);
+  }
+  {
+    PolicyLock lock;
+    if (sinfo.attributeUpdate) {
+      Subscription unfiltered = Subscription();
+      unfiltered.active = true;
+      sinfo.attributeUpdate = false;
+      sinfo.subscriptions.assign(nofattrs, unfiltered);
+    }
+    sinfo.subscriptions[attrId] = sub;
+  }
+  if (sub.active) {
+    sendAttrMetdResponse(NO_ERRORS, attrId, valueLength, valueBuf, serverId,
+                         ATTR_VALUE_UPDATE);
+    delete[] valueBuf;
+  }
 }
 
-void PyConnectWrapper::addNewAttribute(
+// whether the update is the last one that went out under policy. The
+// server it is addressed to does not make it another value.
+static bool isLastAttrUpdate(const PublishPolicy *policy,
+                             const unsigned char *message, int messageLength) {
+  return (int)policy->lastMessage.size() == messageLength &&
+         !memcmp(policy->lastMessage.data() + 2, message + 2,
+                 messageLength - 2);
+}
+
+// note that the update went out to servers under an onChange policy
+static void rememberAttrUpdate(PublishPolicy *policy,
+                               const unsigned char *message, int messageLength,
+                               unsigned int servers) {
+  if (isLastAttrUpdate(policy, message, messageLength)) {
+    policy->lastServers |= servers;
+  } else {
+    policy->lastMessage.assign(message, message + messageLength);
+    policy->lastServers = servers;
+  }
+}
+
+// whether an update may go out now under policy, and to which of servers.
+// With onChange it only goes to the servers that have not had the value
+// yet. One that comes too soon is kept, in place of any kept before it, to
+// go out on the timer to the servers of both. Caller must hold the policy
+// lock.
+bool PyConnectWrapper::admitAttrUpdate(PublishPolicy *policy,
+                                       const unsigned char *message,
+                                       int messageLength,
+                                       unsigned int &servers) {
+  if (policy->onChange && isLastAttrUpdate(policy, message, messageLength)) {
+    // what is kept for servers that have the value already is out of date
+    policy->pendingServers &= ~(servers & policy->lastServers);
+    if (!policy->pendingServers)
+      policy->pending.clear();
+    servers &= ~policy->lastServers;
+    if (!servers)
+      return false;
+  }
+  long long now = monotonicUSec();
+  if (policy->minInterval > 0 &&
+      now - policy->lastSent < policy->minInterval) {
+    policy->pending.assign(message, message + messageLength);
+    policy->pendingServers |= servers;
+    scheduleFlush(policy->lastSent + policy->minInterval);
+    if (flushDue_)
+      return false;
+    // no timer to send it later, send it now
+    policy->pending.clear();
+    policy->pendingServers = 0;
+  }
+  policy->lastSent = now;
+  if (policy->onChange)
+    rememberAttrUpdate(policy, message, messageLength, servers);
+  return true;
+}
+
+// have the timer go off at due, unless it goes off earlier already. Caller
+// must hold the policy lock.
+void PyConnectWrapper::scheduleFlush(long long due) {
+  if (flushDue_ && flushDue_ <= due)
+    return;
+  if (this->scheduleTimer((int)(due - monotonicUSec())))
+    flushDue_ = due;
+}
+
+void PyConnectWrapper::sendHeldUpdates(std::vector<HeldUpdate> &updates) {
+  for (size_t i = 0; i < updates.size(); i++) {
+    int messageLength = (int)updates[i].message.size();
+    unsigned char *message = reserveMessageBuffer(messageLength);
+    if (!message)
+      continue;
+    memcpy(message, updates[i].message.data(), messageLength);
+    sendAttrUpdate(message, messageLength, updates[i].servers);
+  }
+}
+
+// move the update held back under policy to updates
+void PyConnectWrapper::takeHeldUpdate(PublishPolicy *policy,
+                                      std::vector<HeldUpdate> &updates) {
+  updates.push_back(HeldUpdate());
+  updates.back().servers = policy->pendingServers;
+  updates.back().message.swap(policy->pending);
+  policy->pendingServers = 0;
+}
+
+void PyConnectWrapper::processTimer() {
+  std::vector<HeldUpdate> updates;
+  {
+    PolicyLock lock;
+    long long now = monotonicUSec();
+    long long nextDue = 0;
+    flushDue_ = 0;
+    for (size_t i = 0; i < pPyConnectModule_->attributeTable.size(); i++) {
+      PublishPolicy *policy =
+          pPyConnectModule_->attributeTable[i]->publishPolicy();
+      if (!policy || policy->pending.empty())
+        continue;
+      long long due = policy->lastSent + policy->minInterval;
+      if (due > now) {
+        if (!nextDue || due < nextDue)
+          nextDue = due;
+        continue;
+      }
+      policy->lastSent = now;
+      if (policy->onChange)
+        rememberAttrUpdate(policy, policy->pending.data(),
+                           (int)policy->pending.size(),
+                           policy->pendingServers);
+      takeHeldUpdate(policy, updates);
+    }
+    for (ServerMap::iterator siter = serverMap_.begin();
+         siter != serverMap_.end(); siter++) {
+      std::vector<Subscription> &subscriptions = siter->second.subscriptions;
+      for (size_t i = 0; i < subscriptions.size(); i++) {
+        Subscription &sub = subscriptions[i];
+        if (sub.held.empty())
+          continue;
+        long long due = sub.lastSent + sub.minInterval;
+        if (due > now) {
+          if (!nextDue || due < nextDue)
+            nextDue = due;
+          continue;
+        }
+        sub.lastSent = now;
+        sub.lastValue = sub.heldValue;
+        // the policy of the attribute still has its say, it may keep the
+        // update back further or find the server has it already
+        unsigned int servers = 1u << siter->first;
+        PublishPolicy *policy =
+            pPyConnectModule_->attributeTable[i]->publishPolicy();
+        if (policy && !admitAttrUpdate(policy, sub.held.data(),
+                                       (int)sub.held.size(), servers)) {
+          sub.held.clear();
+          continue;
+        }
+        updates.push_back(HeldUpdate());
+        updates.back().servers = servers;
+        updates.back().message.swap(sub.held);
+      }
+    }
+    if (nextDue)
+      scheduleFlush(nextDue);
+  }
+  sendHeldUpdates(updates);
+}
+
+void PyConnectWrapper::setPublishPolicy(Attribute *attr, double maxRate,
+                                        bool onChange) {
+  if (!attr) {
+    ERROR_MSG("PyConnectWrapper::setPublishPolicy attribute is not "
+              "exported.\n");
+    return;
+  }
+  // an update held back under the old policy goes out now
+  std::vector<HeldUpdate> updates;
+  {
+    PolicyLock lock;
+    PublishPolicy *policy = attr->publishPolicy();
+    if (policy && !policy->pending.empty())
+      takeHeldUpdate(policy, updates);
+    if (maxRate <= 0 && !onChange) {
+      delete policy;
+      attr->setPublishPolicy(NULL);
+    } else {
+      if (!policy) {
+        policy = new PublishPolicy();
+        policy->lastSent = 0;
+        attr->setPublishPolicy(policy);
+      }
+      policy->minInterval = maxRate > 0 ? (long long)(1000000 / maxRate) : 0;
+      policy->onChange = onChange;
+      policy->lastMessage.clear();
+      policy->lastServers = 0;
+    }
+  }
+  sendHeldUpdates(updates);
+}
+
+Attribute *PyConnectWrapper::addNewAttribute(
     const char *attrName, const char *desc, PyConnectType::Type type,
     int (*getrawfn)(unsigned char *&), void (*getfn)(int, int),
-    void (*setfn)(int, unsigned char *&, int &, int)) {
+    void (*setfn)(int, unsigned char *&, int &, int),
+    const std::string &layout) {
   if (strlen(attrName) > 255) {
     ERROR_MSG("PyConnectWrapper::addNewAttribute attribute %s name length is"
               " too long. Igore\n",
               attrName);
-    return;
+    return NULL;
   }
 
   Attributes::iterator iter =
@@ -540,16 +1064,19 @@ void PyConnectWrapper::addNewAttribute(
   if (iter != pPyConnectModule_->attributes.end()) {
     ERROR_MSG("PyConnectWrapper::addNewAttribute duplicate attribute %s.\n",
               attrName);
-    return;
+    return NULL;
   }
 
-  pPyConnectModule_->attributes[std::string(attrName)] =
-      new Attribute(desc, type, getrawfn, getfn, setfn);
+  Attribute *attr = new Attribute(desc, type, getrawfn, getfn, setfn, layout);
+  pPyConnectModule_->attributes[std::string(attrName)] = attr;
+  pPyConnectModule_->buildTables();
+  return attr;
 }
 
 void PyConnectWrapper::addNewMethod(
     const char *metdName, const char *desc, PyConnectType::Type type,
-    void (*accessFn)(int, unsigned char *&, int &, int), Arguments &args) {
+    void (*accessFn)(int, unsigned char *&, int &, int), Arguments &args,
+    const std::string &layout) {
   if (strlen(metdName) > 255) {
     ERROR_MSG("PyConnectWrapper::addNewMethod method %s name length is"
               " too long. Igore\n",
@@ -567,7 +1094,8 @@ void PyConnectWrapper::addNewMethod(
   }
 
   pPyConnectModule_->methods[std::string(metdName)] =
-      new Method(desc, type, accessFn, args);
+      new Method(desc, type, accessFn, args, layout);
+  pPyConnectModule_->buildTables();
 }
 
 void PyConnectWrapper::updateMethodAccessFn(
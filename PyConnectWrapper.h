@@ -26,12 +26,14 @@
     disable : 4267) // TODO: need to detailed verification on this usage
 #endif
 
+#include <array>
 #include <iterator>
 #include <map>
 #include <string.h>
 #include <string>
 #include <type_traits>
 #include <typeinfo>
+#include <utility>
 #include <vector>
 
 #ifdef OPENR_OBJECT
@@ -55,12 +57,14 @@ public:
 typedef struct {
   std::string desc;
   PyConnectType::Type type;
+  std::string layout; // packed layout of a COMPOSITE type
 } ModuleElement;
 
 class Argument : public ModuleElement {
 public:
   Argument(const char *name, const char *desc, PyConnectType::Type type,
-           bool isOptional = false);
+           bool isOptional = false,
+           const std::string &layout = std::string());
   bool isOptional() const { return isOptional_; }
 
   char name[256];
@@ -69,11 +73,39 @@ private:
   bool isOptional_;
 };
 
+// how the updates of an attribute go out, see
+// PyConnectWrapper::setPublishPolicy
+struct PublishPolicy {
+  long long minInterval; // in microseconds, 0 for no limit
+  bool onChange;         // only values unlike the last one sent go out
+  long long lastSent;    // when the last update went out
+  std::vector<unsigned char> lastMessage; // the last update, with onChange
+  unsigned int lastServers;               // that have had lastMessage
+  std::vector<unsigned char> pending;     // the latest update held back
+  unsigned int pendingServers;            // it goes to, a bit per server id
+};
+
+// numeric value of an attribute, which subscription deadbands apply to
+template <typename T>
+typename std::enable_if<std::is_arithmetic<T>::value, bool>::type
+attrNumericValue(const T &value, double &number) {
+  number = (double)value;
+  return true;
+}
+
+template <typename T>
+typename std::enable_if<!std::is_arithmetic<T>::value, bool>::type
+attrNumericValue(const T &, double &) {
+  return false;
+}
+
 class Attribute : public ModuleElement {
 public:
   Attribute(const char *desc, PyConnectType::Type type,
             int (*getrawfn)(unsigned char *&), void (*getfn)(int, int),
-            void (*setfn)(int, unsigned char *&, int &, int) = NULL);
+            void (*setfn)(int, unsigned char *&, int &, int) = NULL,
+            const std::string &layout = std::string());
+  ~Attribute() { delete policy_; }
 
   void setAttrValue(int attrId, unsigned char *&data, int &dataLen,
                     int serverId) {
@@ -88,8 +120,14 @@ public:
 
   bool isWritable() const { return (attrSetFn != NULL); }
   const std::string &getDescription() { return this->desc; }
+  int id() const { return this->id_; }
+  void setId(int id) { this->id_ = id; }
+  PublishPolicy *publishPolicy() { return this->policy_; }
+  void setPublishPolicy(PublishPolicy *policy) { this->policy_ = policy; }
 
 private:
+  int id_;
+  PublishPolicy *policy_;
   void (*attrGetFn)(int, int);
   void (*attrSetFn)(int, unsigned char *&, int &, int);
   int (*getRawValueFn)(unsigned char *&);
@@ -98,10 +136,18 @@ private:
 typedef std::vector<Argument *> Arguments;
 typedef std::map<std::string, Attribute *> Attributes;
 
+// an exported attribute of type T, through which its updates are published
+// without looking it up
+template <typename T> struct AttributeHandle {
+  Attribute *attr;
+  AttributeHandle() : attr(NULL) {}
+};
+
 class Method : public ModuleElement {
 public:
   Method(const char *desc, PyConnectType::Type type,
-         void (*accessFn)(int, unsigned char *&, int &, int), Arguments &args);
+         void (*accessFn)(int, unsigned char *&, int &, int), Arguments &args,
+         const std::string &layout = std::string());
   ~Method();
 
   void methodCall(int id, unsigned char *&data, int &dataLength, int serverId) {
@@ -126,11 +172,18 @@ public:
   std::string name;
   Attributes attributes;
   Methods methods;
+  // the same by id, which follows the name order of the maps with the
+  // attributes first. Built as they are added, so incoming calls are
+  // dispatched without a search.
+  std::vector<Attribute *> attributeTable;
+  std::vector<Method *> methodTable;
 
   PyConnectModule(const std::string &name, const std::string &desc,
                   OObject *oobject = NULL);
   ~PyConnectModule();
 
+  void buildTables();
+
   OObject *oobject() { return this->oobject_; }
 
 private:
@@ -168,16 +221,23 @@ template <typename DataType> struct PyConnectData {
     unpackLENumber(rData, dataStr, remainingBytes);
     return rData;
   }
+  // the packed size of a value, and packing it into a buffer with that
+  // much room
+  static int dataSize(const DataType &, PyConnectMsgStatus &status) {
+    return (status == NO_ERRORS) ? sizeof(DataType) : 0;
+  }
+  static void packData(const DataType &amValue, unsigned char *&dataPtr) {
+    packToLENumber(amValue, dataPtr);
+  }
   static unsigned char *setData(const DataType &amValue, int &dataLength,
                                 PyConnectMsgStatus &status) {
-    dataLength = 0;
-    if (status != NO_ERRORS)
+    dataLength = dataSize(amValue, status);
+    if (dataLength == 0)
       return NULL;
 
-    dataLength = sizeof(DataType);
     unsigned char *dataBuf = new unsigned char[dataLength];
     unsigned char *dataPtr = dataBuf;
-    packToLENumber(amValue, dataPtr);
+    packData(amValue, dataPtr);
     return dataBuf;
   }
   static void fini(unsigned char *tmpData) {
@@ -186,13 +246,34 @@ template <typename DataType> struct PyConnectData {
   }
 };
 
+// the characters of a string argument as they lie in the received message.
+// A string that runs past the end of the message is corrupted.
+static inline int unpackStringArg(unsigned char *&dataStr, int &remainingBytes,
+                                  PyConnectMsgStatus &status,
+                                  const char *&str) {
+  if (remainingBytes <= 0) {
+    status = MSG_CORRUPTED;
+    str = "";
+    return 0;
+  }
+  int length = unpackStringRef(dataStr, remainingBytes, str, true);
+  if (remainingBytes < 0) {
+    status = MSG_CORRUPTED;
+    str = "";
+    return 0;
+  }
+  return length;
+}
+
 template <> struct PyConnectData<std::string> {
   static std::string getData(unsigned char *&dataStr, int &remainingBytes,
                              PyConnectMsgStatus &status) {
     if (status != NO_ERRORS)
       return std::string("");
 
-    return unpackString(dataStr, remainingBytes, true);
+    const char *str = NULL;
+    int length = unpackStringArg(dataStr, remainingBytes, status, str);
+    return std::string(str, length);
   }
   static std::string getData(unsigned char *&dataStr, int &remainingBytes,
                              PyConnectMsgStatus &status,
@@ -203,27 +284,273 @@ template <> struct PyConnectData<std::string> {
     if (remainingBytes <= 0)
       return defaultValue;
 
-    return unpackString(dataStr, remainingBytes, true);
+    const char *str = NULL;
+    int length = unpackStringArg(dataStr, remainingBytes, status, str);
+    return std::string(str, length);
+  }
+  // a string too long to be sent goes as an empty one
+  static int dataSize(const std::string &amValue, PyConnectMsgStatus &status) {
+    if (status != NO_ERRORS)
+      return 0;
+
+    int dataLength = amValue.length();
+    if (dataLength > MAX_STR_LENGTH) {
+      ERROR_MSG("PyConnectData::<string>SetData string is too long.\n");
+      status = STR_TOO_LONG;
+      dataLength = 0; // reset data length
+    }
+    return dataLength + packedIntLen(dataLength);
+  }
+  static void packData(const std::string &amValue, unsigned char *&dataPtr) {
+    int length = amValue.length();
+    packString((unsigned char *)amValue.data(),
+               length > MAX_STR_LENGTH ? 0 : length, dataPtr, true);
   }
   static unsigned char *setData(const std::string &amValue, int &dataLength,
                                 PyConnectMsgStatus &status) {
-    dataLength = 0;
+    dataLength = dataSize(amValue, status);
+    if (dataLength == 0)
+      return NULL;
+
+    unsigned char *dataBuf = new unsigned char[dataLength];
+    unsigned char *dataPtr = dataBuf;
+    packData(amValue, dataPtr);
+    return dataBuf;
+  }
+  static void fini(unsigned char *tmpData) {
+    if (tmpData)
+      delete[] tmpData;
+  }
+};
+
+// numeric arrays are an int count followed by the values, which are packed
+// and unpacked in one go
+template <typename ElementType> struct PyConnectArrayData {
+  // leaves room for the message header within the size limit
+  static const int kMaxCount =
+      (PYCONNECT_MSG_MAX_SIZE - 64) / (int)sizeof(ElementType);
+
+  // the count of the array at dataStr, or -1 if its values run past the end
+  // of the message
+  static int unpackCount(unsigned char *&dataStr, int &remainingBytes,
+                         PyConnectMsgStatus &status) {
+    if (remainingBytes < (int)sizeof(int)) {
+      status = MSG_CORRUPTED;
+      return -1;
+    }
+    int count = 0;
+    unpackLENumber(count, dataStr, remainingBytes);
+    if (count < 0 || count > remainingBytes / (int)sizeof(ElementType)) {
+      status = MSG_CORRUPTED;
+      return -1;
+    }
+    return count;
+  }
+  // an array too long to be sent goes as an empty one
+  static int dataSize(std::size_t count, PyConnectMsgStatus &status) {
     if (status != NO_ERRORS)
+      return 0;
+
+    if (count > (std::size_t)kMaxCount) {
+      ERROR_MSG("PyConnectData::<array>SetData array is too long.\n");
+      status = STR_TOO_LONG;
+      count = 0;
+    }
+    return (int)(sizeof(int) + count * sizeof(ElementType));
+  }
+  static void packData(const ElementType *values, std::size_t count,
+                       unsigned char *&dataPtr) {
+    int length = (count > (std::size_t)kMaxCount) ? 0 : (int)count;
+    packToLENumber(length, dataPtr);
+    packLEArray(values, length, dataPtr);
+  }
+};
+
+template <typename T> struct PyConnectData<std::vector<T>> {
+  static std::vector<T> getData(unsigned char *&dataStr, int &remainingBytes,
+                                PyConnectMsgStatus &status) {
+    std::vector<T> rData;
+    if (status != NO_ERRORS)
+      return rData;
+
+    int count =
+        PyConnectArrayData<T>::unpackCount(dataStr, remainingBytes, status);
+    if (count > 0) {
+      rData.resize(count);
+      unpackLEArray(rData.data(), count, dataStr, remainingBytes);
+    }
+    return rData;
+  }
+  static std::vector<T> getData(unsigned char *&dataStr, int &remainingBytes,
+                                PyConnectMsgStatus &status,
+                                std::vector<T> &defaultValue) {
+    if (status != NO_ERRORS)
+      return std::vector<T>();
+
+    if (remainingBytes <= 0)
+      return defaultValue;
+
+    return getData(dataStr, remainingBytes, status);
+  }
+  static int dataSize(const std::vector<T> &amValue,
+                      PyConnectMsgStatus &status) {
+    return PyConnectArrayData<T>::dataSize(amValue.size(), status);
+  }
+  static void packData(const std::vector<T> &amValue,
+                       unsigned char *&dataPtr) {
+    PyConnectArrayData<T>::packData(amValue.data(), amValue.size(), dataPtr);
+  }
+  static unsigned char *setData(const std::vector<T> &amValue,
+                                int &dataLength, PyConnectMsgStatus &status) {
+    dataLength = dataSize(amValue, status);
+    if (dataLength == 0)
       return NULL;
 
-    dataLength = amValue.length();
+    unsigned char *dataBuf = new unsigned char[dataLength];
+    unsigned char *dataPtr = dataBuf;
+    packData(amValue, dataPtr);
+    return dataBuf;
+  }
+  static void fini(unsigned char *tmpData) {
+    if (tmpData)
+      delete[] tmpData;
+  }
+};
 
-    if (dataLength > MAX_STR_LENGTH) {
-      ERROR_MSG("PyConnectData::<string>SetData string is too long.\n");
+// a fixed size array only takes an array of its own size
+template <typename T, std::size_t N> struct PyConnectData<std::array<T, N>> {
+  static std::array<T, N> getData(unsigned char *&dataStr,
+                                  int &remainingBytes,
+                                  PyConnectMsgStatus &status) {
+    std::array<T, N> rData = {};
+    if (status != NO_ERRORS)
+      return rData;
+
+    int count =
+        PyConnectArrayData<T>::unpackCount(dataStr, remainingBytes, status);
+    if (count < 0)
+      return rData;
+    if ((std::size_t)count != N) {
+      status = MSG_CORRUPTED;
+      dataStr += count * sizeof(T);
+      remainingBytes -= count * sizeof(T);
+      return rData;
+    }
+    unpackLEArray(rData.data(), count, dataStr, remainingBytes);
+    return rData;
+  }
+  static std::array<T, N> getData(unsigned char *&dataStr,
+                                  int &remainingBytes,
+                                  PyConnectMsgStatus &status,
+                                  std::array<T, N> &defaultValue) {
+    if (status != NO_ERRORS)
+      return std::array<T, N>();
+
+    if (remainingBytes <= 0)
+      return defaultValue;
+
+    return getData(dataStr, remainingBytes, status);
+  }
+  static int dataSize(const std::array<T, N> &, PyConnectMsgStatus &status) {
+    return PyConnectArrayData<T>::dataSize(N, status);
+  }
+  static void packData(const std::array<T, N> &amValue,
+                       unsigned char *&dataPtr) {
+    PyConnectArrayData<T>::packData(amValue.data(), N, dataPtr);
+  }
+  static unsigned char *setData(const std::array<T, N> &amValue,
+                                int &dataLength, PyConnectMsgStatus &status) {
+    dataLength = dataSize(amValue, status);
+    if (dataLength == 0)
+      return NULL;
+
+    unsigned char *dataBuf = new unsigned char[dataLength];
+    unsigned char *dataPtr = dataBuf;
+    packData(amValue, dataPtr);
+    return dataBuf;
+  }
+  static void fini(unsigned char *tmpData) {
+    if (tmpData)
+      delete[] tmpData;
+  }
+};
+
+// blobs are an int length followed by the bytes
+struct PyConnectBlobData {
+  static const int kMaxSize = PYCONNECT_MSG_MAX_SIZE - 64;
+
+  // the bytes of the blob at dataStr, or NULL if they run past the end of
+  // the message
+  static const unsigned char *unpack(unsigned char *&dataStr,
+                                     int &remainingBytes, int &length,
+                                     PyConnectMsgStatus &status) {
+    length = 0;
+    if (remainingBytes < (int)sizeof(int)) {
+      status = MSG_CORRUPTED;
+      return NULL;
+    }
+    unpackLENumber(length, dataStr, remainingBytes);
+    if (length < 0 || length > remainingBytes) {
+      status = MSG_CORRUPTED;
+      length = 0;
+      return NULL;
+    }
+    const unsigned char *bytes = dataStr;
+    dataStr += length;
+    remainingBytes -= length;
+    return bytes;
+  }
+  // a blob too large to be sent goes as an empty one
+  static int dataSize(std::size_t size, PyConnectMsgStatus &status) {
+    if (status != NO_ERRORS)
+      return 0;
+
+    if (size > (std::size_t)kMaxSize) {
+      ERROR_MSG("PyConnectData::<blob>SetData blob is too large.\n");
       status = STR_TOO_LONG;
-      dataLength = 0; // reset data length
+      size = 0;
     }
-    int l = packedIntLen(dataLength);
-    dataLength += l;
+    return (int)(sizeof(int) + size);
+  }
+  static void packData(const unsigned char *bytes, std::size_t size,
+                       unsigned char *&dataPtr) {
+    int length = (size > (std::size_t)kMaxSize) ? 0 : (int)size;
+    packToLENumber(length, dataPtr);
+    if (length > 0)
+      memcpy(dataPtr, bytes, length);
+    dataPtr += length;
+  }
+};
+
+template <> struct PyConnectData<std::vector<unsigned char>> {
+  static std::vector<unsigned char> getData(unsigned char *&dataStr,
+                                            int &remainingBytes,
+                                            PyConnectMsgStatus &status) {
+    if (status != NO_ERRORS)
+      return std::vector<unsigned char>();
+
+    int length = 0;
+    const unsigned char *bytes =
+        PyConnectBlobData::unpack(dataStr, remainingBytes, length, status);
+    return std::vector<unsigned char>(bytes, bytes + length);
+  }
+  static int dataSize(const std::vector<unsigned char> &amValue,
+                      PyConnectMsgStatus &status) {
+    return PyConnectBlobData::dataSize(amValue.size(), status);
+  }
+  static void packData(const std::vector<unsigned char> &amValue,
+                       unsigned char *&dataPtr) {
+    PyConnectBlobData::packData(amValue.data(), amValue.size(), dataPtr);
+  }
+  static unsigned char *setData(const std::vector<unsigned char> &amValue,
+                                int &dataLength, PyConnectMsgStatus &status) {
+    dataLength = dataSize(amValue, status);
+    if (dataLength == 0)
+      return NULL;
+
     unsigned char *dataBuf = new unsigned char[dataLength];
     unsigned char *dataPtr = dataBuf;
-    packString((unsigned char *)amValue.data(), amValue.length(), dataPtr,
-               true);
+    packData(amValue, dataPtr);
     return dataBuf;
   }
   static void fini(unsigned char *tmpData) {
@@ -232,6 +559,71 @@ template <> struct PyConnectData<std::string> {
   }
 };
 
+// a received blob gets bytes of its own, it may be kept after the call
+template <> struct PyConnectData<PyConnectBlob> {
+  static PyConnectBlob getData(unsigned char *&dataStr, int &remainingBytes,
+                               PyConnectMsgStatus &status) {
+    return PyConnectBlob(PyConnectData<std::vector<unsigned char>>::getData(
+        dataStr, remainingBytes, status));
+  }
+  static int dataSize(const PyConnectBlob &amValue,
+                      PyConnectMsgStatus &status) {
+    return PyConnectBlobData::dataSize(amValue.size(), status);
+  }
+  static void packData(const PyConnectBlob &amValue, unsigned char *&dataPtr) {
+    PyConnectBlobData::packData(amValue.data(), amValue.size(), dataPtr);
+  }
+  static unsigned char *setData(const PyConnectBlob &amValue, int &dataLength,
+                                PyConnectMsgStatus &status) {
+    dataLength = dataSize(amValue, status);
+    if (dataLength == 0)
+      return NULL;
+
+    unsigned char *dataBuf = new unsigned char[dataLength];
+    unsigned char *dataPtr = dataBuf;
+    packData(amValue, dataPtr);
+    return dataBuf;
+  }
+  static void fini(unsigned char *tmpData) {
+    if (tmpData)
+      delete[] tmpData;
+  }
+};
+
+#ifdef PYCONNECT_STRING_VIEW
+// a view into the received message, valid until the wrapped method returns
+template <> struct PyConnectData<std::string_view> {
+  static std::string_view getData(unsigned char *&dataStr, int &remainingBytes,
+                                  PyConnectMsgStatus &status) {
+    if (status != NO_ERRORS)
+      return std::string_view();
+
+    const char *str = NULL;
+    int length = unpackStringArg(dataStr, remainingBytes, status, str);
+    return std::string_view(str, length);
+  }
+  static int dataSize(const std::string_view &amValue,
+                      PyConnectMsgStatus &status) {
+    if (status != NO_ERRORS)
+      return 0;
+
+    int dataLength = amValue.length();
+    if (dataLength > MAX_STR_LENGTH) {
+      ERROR_MSG("PyConnectData::<string_view>SetData string is too long.\n");
+      status = STR_TOO_LONG;
+      dataLength = 0; // reset data length
+    }
+    return dataLength + packedIntLen(dataLength);
+  }
+  static void packData(const std::string_view &amValue,
+                       unsigned char *&dataPtr) {
+    int length = amValue.length();
+    packString((unsigned char *)amValue.data(),
+               length > MAX_STR_LENGTH ? 0 : length, dataPtr, true);
+  }
+};
+#endif
+
 template <> struct PyConnectData<bool> {
   // NOTE:: any data types apart from the basic data type are expected to have
   // their own template specialisation.
@@ -265,15 +657,21 @@ template <> struct PyConnectData<bool> {
     dataStr++;
     return rData;
   }
+  static int dataSize(const bool &, PyConnectMsgStatus &status) {
+    return (status == NO_ERRORS) ? 1 : 0;
+  }
+  static void packData(const bool &amValue, unsigned char *&dataPtr) {
+    *dataPtr++ = (unsigned char)amValue;
+  }
   static unsigned char *setData(const bool &amValue, int &dataLength,
                                 PyConnectMsgStatus &status) {
-    dataLength = 0;
-    if (status != NO_ERRORS)
+    dataLength = dataSize(amValue, status);
+    if (dataLength == 0)
       return NULL;
 
-    dataLength = 1;
     unsigned char *dataBuf = new unsigned char[dataLength];
-    *dataBuf = (unsigned char)amValue;
+    unsigned char *dataPtr = dataBuf;
+    packData(amValue, dataPtr);
     return dataBuf; // assume little endian
   }
   static void fini(unsigned char *tmpData) {
@@ -282,6 +680,145 @@ template <> struct PyConnectData<bool> {
   }
 };
 
+// the fields of a struct exposed with PYCONNECT_STRUCT. visit calls
+// visitor(name, field) for each field in the order they go on the wire.
+template <typename T> struct pyconnect_fields;
+
+// a struct goes as its fields packed one after the other
+template <typename T> struct PyConnectStructData {
+  static T getData(unsigned char *&dataStr, int &remainingBytes,
+                   PyConnectMsgStatus &status) {
+    T value = T();
+    pyconnect_fields<T>::visit(value, [&](const char *, auto &field) {
+      typedef typename std::decay<decltype(field)>::type FieldType;
+      field =
+          PyConnectData<FieldType>::getData(dataStr, remainingBytes, status);
+    });
+    return value;
+  }
+  static int dataSize(const T &amValue, PyConnectMsgStatus &status) {
+    int dataLength = 0;
+    pyconnect_fields<T>::visit(amValue, [&](const char *, const auto &field) {
+      dataLength +=
+          PyConnectData<typename std::decay<decltype(field)>::type>::dataSize(
+              field, status);
+    });
+    return (status == NO_ERRORS) ? dataLength : 0;
+  }
+  static void packData(const T &amValue, unsigned char *&dataPtr) {
+    pyconnect_fields<T>::visit(amValue, [&](const char *, const auto &field) {
+      PyConnectData<typename std::decay<decltype(field)>::type>::packData(
+          field, dataPtr);
+    });
+  }
+  static unsigned char *setData(const T &amValue, int &dataLength,
+                                PyConnectMsgStatus &status) {
+    dataLength = dataSize(amValue, status);
+    if (dataLength == 0)
+      return NULL;
+
+    unsigned char *dataBuf = new unsigned char[dataLength];
+    unsigned char *dataPtr = dataBuf;
+    packData(amValue, dataPtr);
+    return dataBuf;
+  }
+  static void fini(unsigned char *tmpData) {
+    if (tmpData)
+      delete[] tmpData;
+  }
+  // the layout declared with the type, see PyConnectType::COMPOSITE
+  static std::string layout() {
+    std::string name = pyconnect_fields<T>::name();
+    name = name.substr(name.find_last_of(':') + 1);
+    std::string fields;
+    int nofFields = 0;
+    T value = T();
+    pyconnect_fields<T>::visit(
+        value, [&](const char *fieldName, const auto &field) {
+          typedef typename std::decay<decltype(field)>::type FieldType;
+          std::string fieldLayout = pyconnect_layout<FieldType>::value();
+          fields += (char)declaredType(pyconnect_type<FieldType>::value,
+                                       fieldLayout);
+          fields += fieldLayout;
+          fields += (char)strlen(fieldName);
+          fields += fieldName;
+          nofFields++;
+        });
+    return (char)name.length() + name + (char)nofFields + fields;
+  }
+};
+
+#define PYCONNECT_EXPAND(X) X
+#define PYCONNECT_FE_1(M, X) M(X)
+#define PYCONNECT_FE_2(M, X, ...)                                              \
+  M(X) PYCONNECT_EXPAND(PYCONNECT_FE_1(M, __VA_ARGS__))
+#define PYCONNECT_FE_3(M, X, ...)                                              \
+  M(X) PYCONNECT_EXPAND(PYCONNECT_FE_2(M, __VA_ARGS__))
+#define PYCONNECT_FE_4(M, X, ...)                                              \
+  M(X) PYCONNECT_EXPAND(PYCONNECT_FE_3(M, __VA_ARGS__))
+#define PYCONNECT_FE_5(M, X, ...)                                              \
+  M(X) PYCONNECT_EXPAND(PYCONNECT_FE_4(M, __VA_ARGS__))
+#define PYCONNECT_FE_6(M, X, ...)                                              \
+  M(X) PYCONNECT_EXPAND(PYCONNECT_FE_5(M, __VA_ARGS__))
+#define PYCONNECT_FE_7(M, X, ...)                                              \
+  M(X) PYCONNECT_EXPAND(PYCONNECT_FE_6(M, __VA_ARGS__))
+#define PYCONNECT_FE_8(M, X, ...)                                              \
+  M(X) PYCONNECT_EXPAND(PYCONNECT_FE_7(M, __VA_ARGS__))
+#define PYCONNECT_FE_9(M, X, ...)                                              \
+  M(X) PYCONNECT_EXPAND(PYCONNECT_FE_8(M, __VA_ARGS__))
+#define PYCONNECT_FE_10(M, X, ...)                                             \
+  M(X) PYCONNECT_EXPAND(PYCONNECT_FE_9(M, __VA_ARGS__))
+#define PYCONNECT_FE_11(M, X, ...)                                             \
+  M(X) PYCONNECT_EXPAND(PYCONNECT_FE_10(M, __VA_ARGS__))
+#define PYCONNECT_FE_12(M, X, ...)                                             \
+  M(X) PYCONNECT_EXPAND(PYCONNECT_FE_11(M, __VA_ARGS__))
+#define PYCONNECT_FE_13(M, X, ...)                                             \
+  M(X) PYCONNECT_EXPAND(PYCONNECT_FE_12(M, __VA_ARGS__))
+#define PYCONNECT_FE_14(M, X, ...)                                             \
+  M(X) PYCONNECT_EXPAND(PYCONNECT_FE_13(M, __VA_ARGS__))
+#define PYCONNECT_FE_15(M, X, ...)                                             \
+  M(X) PYCONNECT_EXPAND(PYCONNECT_FE_14(M, __VA_ARGS__))
+#define PYCONNECT_FE_16(M, X, ...)                                             \
+  M(X) PYCONNECT_EXPAND(PYCONNECT_FE_15(M, __VA_ARGS__))
+#define PYCONNECT_FE_PICK(_1, _2, _3, _4, _5, _6, _7, _8, _9, _10, _11, _12,   \
+                          _13, _14, _15, _16, NAME, ...)                       \
+  NAME
+#define PYCONNECT_FOR_EACH(M, ...)                                             \
+  PYCONNECT_EXPAND(PYCONNECT_FE_PICK(                                          \
+      __VA_ARGS__, PYCONNECT_FE_16, PYCONNECT_FE_15, PYCONNECT_FE_14,          \
+      PYCONNECT_FE_13, PYCONNECT_FE_12, PYCONNECT_FE_11, PYCONNECT_FE_10,      \
+      PYCONNECT_FE_9, PYCONNECT_FE_8, PYCONNECT_FE_7, PYCONNECT_FE_6,          \
+      PYCONNECT_FE_5, PYCONNECT_FE_4, PYCONNECT_FE_3, PYCONNECT_FE_2,          \
+      PYCONNECT_FE_1)(M, __VA_ARGS__))
+#define PYCONNECT_STRUCT_FIELD(FIELD) visitor(#FIELD, value.FIELD);
+
+/* example, at global scope after the struct
+  struct Pose { double x, y, theta; };
+  PYCONNECT_STRUCT( Pose, x, y, theta );
+  Up to 16 fields of any supported type, structs exposed this way included.
+  Attributes, method arguments and return values of the type then reach
+  Python as named tuples.
+*/
+#define PYCONNECT_STRUCT(TYPE, ...)                                            \
+  namespace pyconnect {                                                        \
+  template <> struct is_supported<TYPE> : std::true_type {};                   \
+  template <> struct pyconnect_fields<TYPE> {                                  \
+    static const char *name() { return #TYPE; }                                \
+    template <typename T, typename V>                                          \
+    static void visit(T &value, V &&visitor) {                                 \
+      PYCONNECT_FOR_EACH(PYCONNECT_STRUCT_FIELD, __VA_ARGS__)                  \
+    }                                                                          \
+  };                                                                           \
+  template <> struct PyConnectData<TYPE> : PyConnectStructData<TYPE> {};       \
+  template <> struct pyconnect_layout<TYPE> {                                  \
+    static std::string value() { return PyConnectStructData<TYPE>::layout(); } \
+  };                                                                           \
+  static inline const PyConnectType::Type getVarType(const TYPE &) {           \
+    return PyConnectType::COMPOSITE;                                           \
+  }                                                                            \
+  }                                                                            \
+  typedef int pyconnect_struct_dummy
+
 class PyConnectWrapper : public MessageProcessor {
 public:
   MesgProcessResult processInput(unsigned char *recData, int bytesReceived,
@@ -304,22 +841,42 @@ public:
     return retLen;
   }
 
+  // the value is packed straight into the message, which is built in a
+  // buffer that is reused from one message to the next.
   template <class DataType>
   void postAttrMetdData(int amId, const DataType &amValue,
                         PyConnectMsgStatus status, int serverId,
                         PyConnectMsg msgType = ATTR_METD_RESP) {
-    int retLen = 0;
-    unsigned char *retStr =
-        PyConnectData<DataType>::setData(amValue, retLen, status);
-    this->sendAttrMetdResponse(status, amId, retLen, retStr, serverId, msgType);
-    PyConnectData<DataType>::fini(retStr);
+    int dataLength = PyConnectData<DataType>::dataSize(amValue, status);
+    unsigned char *dataPtr =
+        beginAttrMetdResponse(status, amId, dataLength, serverId, msgType);
+    if (!dataPtr)
+      return;
+    if (dataLength > 0)
+      PyConnectData<DataType>::packData(amValue, dataPtr);
+    endAttrMetdResponse(dataPtr);
   }
 
   template <class DataType, class T>
   void setAttrData(int attrId, T &&setFunc, unsigned char *&dataPtr,
                    int &remainingBytes, PyConnectMsgStatus status,
                    int serverId) {
-    setFunc(PyConnectData<DataType>::getData(dataPtr, remainingBytes, status));
+    DataType value =
+        PyConnectData<DataType>::getData(dataPtr, remainingBytes, status);
+    if (status != NO_ERRORS) {
+      ERROR_MSG("PyConnectWrapper::setAttrData: unable to set attribute %d "
+                "status = %d\n",
+                attrId, status);
+      if (!noResponse_)
+        sendAttrMetdResponse(status, attrId, 0, NULL, serverId);
+      return;
+    }
+    setFunc(std::move(value));
+    // a server that does not follow the attribute gets no update of it, so
+    // the value it set comes back in a response instead
+    if (!noResponse_ && !followsAttribute(serverId, attrId))
+      pPyConnectModule_->attributeTable[attrId]->getAttrValue(attrId,
+                                                              serverId);
   }
 
   template <class DataType>
@@ -333,37 +890,53 @@ public:
           attrName);
       return;
     }
-#ifdef SUN_COMPILER
-    int attrId = 0;
-    distance(pPyConnectModule_->attributes.begin(), oiter, attrId);
-#else
-    int attrId = distance(pPyConnectModule_->attributes.begin(), oiter);
-#endif
-    for (ServerMap::const_iterator siter = serverMap_.begin();
-         siter != serverMap_.end(); siter++) {
-      if (siter->second.attributeUpdate) {
-        postAttrMetdData(attrId, attrValue, NO_ERRORS, siter->first,
-                         ATTR_VALUE_UPDATE);
-      }
+    publishAttribute(oiter->second, attrValue);
+  }
+
+  // the value must be of the very type of the attribute
+  template <class DataType>
+  void updateAttribute(const AttributeHandle<DataType> &handle,
+                       const DataType &attrValue) {
+    if (!handle.attr) {
+      ERROR_MSG("PyConnectWrapper::updateAttribute attribute is not "
+                "exported.\n");
+      return;
     }
+    publishAttribute(handle.attr, attrValue);
   }
 
-  void addNewAttribute(const char *attrName, const char *desc,
+  // returns the new attribute, or NULL if it cannot be added
+  Attribute *addNewAttribute(const char *attrName, const char *desc,
                        PyConnectType::Type type,
                        int (*getrawfn)(unsigned char *&),
                        void (*getfn)(int, int),
-                       void (*setfn)(int, unsigned char *&, int &, int));
+                       void (*setfn)(int, unsigned char *&, int &, int),
+                       const std::string &layout = std::string());
 
   void addNewMethod(const char *metdName, const char *desc,
                     PyConnectType::Type type,
                     void (*accessFn)(int, unsigned char *&, int &, int),
-                    Arguments &args);
+                    Arguments &args,
+                    const std::string &layout = std::string());
   void updateMethodAccessFn(const char *metdName,
                             void (*accessFn)(int, unsigned char *&, int &,
                                              int));
 
-  PyConnectMsgStatus validateAttribute(int attrId, const char *attrName);
-  PyConnectMsgStatus validateMethod(int metdId, const char *metdName);
+  // updates of the attribute go out at most maxRate times a second, the
+  // latest of any in between once the interval is up; with onChange only
+  // values that differ from the last one sent go out. A maxRate of 0 sets
+  // no limit.
+  void setPublishPolicy(Attribute *attr, double maxRate, bool onChange = false);
+  template <class DataType>
+  void setPublishPolicy(const AttributeHandle<DataType> &handle,
+                        double maxRate, bool onChange = false) {
+    setPublishPolicy(handle.attr, maxRate, onChange);
+  }
+  // sends held back updates that are due
+  void processTimer();
+
+  PyConnectMsgStatus validateAttribute(int attrId);
+  PyConnectMsgStatus validateMethod(int metdId);
 
   bool noResponse() { return noResponse_; }
 
@@ -371,6 +944,9 @@ public:
   void moduleShutdown();
   static void init(PyConnectModule *pModule);
   static PyConnectWrapper *instance() { return s_pPyConnectWrapper; }
+  // number of times the calling thread has had to grow its message buffer;
+  // it stays put once the thread sends messages of sizes it has seen before
+  static unsigned long messageBufferAllocations();
 
   Arguments s_arglist;
 
@@ -380,9 +956,23 @@ private:
     unsigned char *buf;
   } AttrValuePack; // only used in declareModuleAttrMetd
 
+  // what a server has asked for of one attribute
+  typedef struct {
+    bool active;
+    bool sent;             // a value has gone out since subscribing
+    double deadband;       // least change of a numeric value that goes out
+    long long minInterval; // in microseconds
+    long long lastSent;
+    double lastValue;
+    // the latest update that came too soon, to go out on the timer
+    std::vector<unsigned char> held;
+    double heldValue;
+  } Subscription;
+
   typedef struct {
     int assignedModuleID;
-    bool attributeUpdate;
+    bool attributeUpdate; // all attributes unfiltered, until it subscribes
+    std::vector<Subscription> subscriptions; // by attribute id
     struct sockaddr_in sAddr;
   } ServerInfo;
 
@@ -391,9 +981,62 @@ private:
   ServerMap serverMap_;
   bool noResponse_;
 
+  unsigned char *beginAttrMetdResponse(int err, int index, int length,
+                                       int serverId, PyConnectMsg msgType);
+
+  typedef struct {
+    unsigned int servers;
+    std::vector<unsigned char> message;
+  } HeldUpdate;
+
+  unsigned int subscribedServers(Attribute *attr, bool numeric, double value,
+                                 unsigned int &held);
+  bool followsAttribute(int serverId, int attrId);
+  void processSubscription(int serverId, ServerInfo &sinfo,
+                           unsigned char *&message);
+  void fanOutAttrUpdate(Attribute *attr, unsigned char *bufPtr,
+                        unsigned int servers, unsigned int held);
+  void holdAttrUpdate(Attribute *attr, const unsigned char *message,
+                      int messageLength, unsigned int held);
+  void sendAttrUpdate(unsigned char *message, int messageLength,
+                      unsigned int servers);
+  bool admitAttrUpdate(PublishPolicy *policy, const unsigned char *message,
+                       int messageLength, unsigned int &servers);
+  void scheduleFlush(long long due);
+  void takeHeldUpdate(PublishPolicy *policy, std::vector<HeldUpdate> &updates);
+  void sendHeldUpdates(std::vector<HeldUpdate> &updates);
+  long long flushDue_; // of the timer for held back updates, 0 if unset
+
+  // the update is only packed if a server wants it, then once, addressed
+  // to the first such server, and readdressed to each of the others in turn
+  template <class DataType>
+  void publishAttribute(Attribute *attr, const DataType &attrValue) {
+    double number = 0.0;
+    bool numeric = attrNumericValue(attrValue, number);
+    unsigned int held = 0;
+    unsigned int servers = subscribedServers(attr, numeric, number, held);
+    if (!(servers | held))
+      return;
+    int serverId = 0;
+    while (!((servers | held) & (1u << serverId)))
+      serverId++;
+
+    PyConnectMsgStatus status = NO_ERRORS;
+    int dataLength = PyConnectData<DataType>::dataSize(attrValue, status);
+    unsigned char *dataPtr = beginAttrMetdResponse(
+        status, attr->id(), dataLength, serverId, ATTR_VALUE_UPDATE);
+    if (!dataPtr)
+      return;
+    if (dataLength > 0)
+      PyConnectData<DataType>::packData(attrValue, dataPtr);
+    fanOutAttrUpdate(attr, dataPtr, servers, held);
+  }
+  void endAttrMetdResponse(unsigned char *bufPtr);
+
   static PyConnectWrapper *s_pPyConnectWrapper;
 
-  PyConnectWrapper(PyConnectModule *pModule) : noResponse_(false) {
+  PyConnectWrapper(PyConnectModule *pModule)
+      : noResponse_(false), flushDue_(0) {
     pPyConnectModule_ = pModule;
   }
   PyConnectModule *pPyConnectModule_;
@@ -430,6 +1073,10 @@ private:
 #define PYCONNECT_RO_ATTRIBUTE(NAME, DESC)                                     \
   const char *get_attr_##NAME##_description() const { return DESC; }           \
   decltype(NAME) get_##NAME##_value() const { return this->NAME; }             \
+  static pyconnect::AttributeHandle<decltype(NAME)> &s_attr_handle_##NAME() {  \
+    static pyconnect::AttributeHandle<decltype(NAME)> handle;                  \
+    return handle;                                                             \
+  }                                                                            \
   static int s_get_raw_value_##NAME(unsigned char *&valueBuf) {                \
     return pyconnect::PyConnectWrapper::instance()->packRawAttrData(           \
         static_cast<PYCONNECT_MODULE_NAME *>(                                  \
@@ -450,8 +1097,7 @@ private:
                   ->pyConnectModule()                                          \
                   ->oobject())                                                 \
               ->get_##NAME##_value(),                                          \
-          pyconnect::PyConnectWrapper::instance()->validateAttribute(attrId,   \
-                                                                     #NAME),   \
+          pyconnect::PyConnectWrapper::instance()->validateAttribute(attrId),  \
           serverId);                                                           \
     } else {                                                                   \
       ERROR_MSG("PyConnect wrapper: unable to access attribute."               \
@@ -463,17 +1109,23 @@ private:
   void dummy_##NAME()
 
 #define EXPORT_PYCONNECT_RO_ATTRIBUTE(NAME)                                    \
-  pyconnect::PyConnectWrapper::instance()->addNewAttribute(                    \
-      #NAME, this->get_attr_##NAME##_description(),                            \
-      pyconnect::getVarType(NAME),                                             \
-      &PYCONNECT_MODULE_NAME::s_get_raw_value_##NAME,                          \
-      &PYCONNECT_MODULE_NAME::s_get_attr_##NAME, NULL);
+  PYCONNECT_MODULE_NAME::s_attr_handle_##NAME().attr =                         \
+      pyconnect::PyConnectWrapper::instance()->addNewAttribute(                \
+          #NAME, this->get_attr_##NAME##_description(),                        \
+          pyconnect::getVarType(NAME),                                         \
+          &PYCONNECT_MODULE_NAME::s_get_raw_value_##NAME,                      \
+          &PYCONNECT_MODULE_NAME::s_get_attr_##NAME, NULL,                     \
+          pyconnect::pyconnect_layout<decltype(NAME)>::value());
 
 #define PYCONNECT_RW_ATTRIBUTE(NAME, DESC)                                     \
   const char *get_attr_##NAME##_description() const { return DESC; }           \
   decltype(NAME) get_##NAME##_value() const { return this->NAME; }             \
-  void set_##NAME##_value(const decltype(NAME) &value) {                       \
-    this->NAME = value;                                                        \
+  static pyconnect::AttributeHandle<decltype(NAME)> &s_attr_handle_##NAME() {  \
+    static pyconnect::AttributeHandle<decltype(NAME)> handle;                  \
+    return handle;                                                             \
+  }                                                                            \
+  void set_##NAME##_value(decltype(NAME) value) {                              \
+    this->NAME = std::move(value);                                             \
     PYCONNECT_ATTRIBUTE_UPDATE(NAME);                                          \
   }                                                                            \
   static int s_get_raw_value_##NAME(unsigned char *&valueBuf) {                \
@@ -496,8 +1148,7 @@ private:
                   ->pyConnectModule()                                          \
                   ->oobject())                                                 \
               ->get_##NAME##_value(),                                          \
-          pyconnect::PyConnectWrapper::instance()->validateAttribute(attrId,   \
-                                                                     #NAME),   \
+          pyconnect::PyConnectWrapper::instance()->validateAttribute(attrId),  \
           serverId);                                                           \
     } else {                                                                   \
       ERROR_MSG("PyConnect wrapper: unable to access attribute."               \
@@ -521,8 +1172,7 @@ private:
                             ->oobject()),                                      \
                     _1),                                                       \
           dataStr, rBytes,                                                     \
-          pyconnect::PyConnectWrapper::instance()->validateAttribute(attrId,   \
-                                                                     #NAME),   \
+          pyconnect::PyConnectWrapper::instance()->validateAttribute(attrId),  \
           serverId);                                                           \
     } else {                                                                   \
       ERROR_MSG("PyConnect wrapper: unable to access attribute."               \
@@ -534,12 +1184,20 @@ private:
   void dummy_##NAME()
 
 #define EXPORT_PYCONNECT_RW_ATTRIBUTE(NAME)                                    \
-  pyconnect::PyConnectWrapper::instance()->addNewAttribute(                    \
-      #NAME, this->get_attr_##NAME##_description(),                            \
-      pyconnect::getVarType(NAME),                                             \
-      &PYCONNECT_MODULE_NAME::s_get_raw_value_##NAME,                          \
-      &PYCONNECT_MODULE_NAME::s_get_attr_##NAME,                               \
-      &PYCONNECT_MODULE_NAME::s_set_attr_##NAME)
+  PYCONNECT_MODULE_NAME::s_attr_handle_##NAME().attr =                         \
+      pyconnect::PyConnectWrapper::instance()->addNewAttribute(                \
+          #NAME, this->get_attr_##NAME##_description(),                        \
+          pyconnect::getVarType(NAME),                                         \
+          &PYCONNECT_MODULE_NAME::s_get_raw_value_##NAME,                      \
+          &PYCONNECT_MODULE_NAME::s_get_attr_##NAME,                           \
+          &PYCONNECT_MODULE_NAME::s_set_attr_##NAME,                           \
+          pyconnect::pyconnect_layout<decltype(NAME)>::value())
+
+// after EXPORT_PYCONNECT_RO/RW_ATTRIBUTE, e.g.
+// PYCONNECT_ATTRIBUTE_PUBLISH_POLICY( jointAngles, 30, true );
+#define PYCONNECT_ATTRIBUTE_PUBLISH_POLICY(NAME, MAXRATE, ONCHANGE)            \
+  pyconnect::PyConnectWrapper::instance()->setPublishPolicy(                   \
+      PYCONNECT_MODULE_NAME::s_attr_handle_##NAME(), MAXRATE, ONCHANGE)
 
 /* example void setHeadYaw( yaw, limit )
   EXPORT_PYCONNECT_METHOD( setHeadYaw, 'set PyConnect head yaw' );
@@ -547,11 +1205,12 @@ private:
 */
 #define PYCONNECT_ATTRIBUTE_UPDATE(NAME)                                       \
   pyconnect::PyConnectWrapper::instance()->updateAttribute(                    \
-      #NAME, static_cast<PYCONNECT_MODULE_NAME *>(                             \
-                 pyconnect::PyConnectWrapper::instance()                       \
-                     ->pyConnectModule()                                       \
-                     ->oobject())                                              \
-                 ->get_##NAME##_value());
+      PYCONNECT_MODULE_NAME::s_attr_handle_##NAME(),                           \
+      static_cast<PYCONNECT_MODULE_NAME *>(                                    \
+          pyconnect::PyConnectWrapper::instance()                              \
+              ->pyConnectModule()                                              \
+              ->oobject())                                                     \
+          ->get_##NAME##_value());
 
 template <typename Ft, typename Func, typename Obj, std::size_t... index>
 static auto custom_bind_helper(Func &&func, Obj &&obj, unsigned char *&dataStr,
@@ -579,15 +1238,16 @@ static auto custom_bind(Func &&func, Obj obj, unsigned char *&dataStr,
   return std::bind(func, obj);
 }
 
+// the bound call is taken by reference, its arguments are not copied again
 template <typename retval, typename T,
           typename std::enable_if<std::is_void<retval>{}, int>::type = 0>
-static void invoke_method_call(int metdIndex, int serverId, T fn) {
+static void invoke_method_call(int metdIndex, int serverId, T &fn) {
   fn();
 }
 
 template <typename retval, typename T,
           typename std::enable_if<!std::is_void<retval>{}, int>::type = 0>
-static void invoke_method_call(int metdIndex, int serverId, T fn) {
+static void invoke_method_call(int metdIndex, int serverId, T &fn) {
   pyconnect::PyConnectWrapper::instance()->postAttrMetdData(
       metdIndex, fn(), pyconnect::NO_ERRORS, serverId);
 }
@@ -604,29 +1264,29 @@ static void invoke_method_call(int metdIndex, int serverId, T fn) {
             ->pyConnectModule()                                                \
             ->oobject()) {                                                     \
       pyconnect::PyConnectMsgStatus status =                                   \
-          pyconnect::PyConnectWrapper::instance()->validateMethod(metdId,      \
-                                                                  #NAME);      \
+          pyconnect::PyConnectWrapper::instance()->validateMethod(metdId);     \
       if (status == pyconnect::NO_ERRORS) {                                    \
         using fntraits = pyconnect::function_traits<                           \
             std::function<decltype(&PYCONNECT_MODULE_NAME::NAME)>>;            \
         try {                                                                  \
+          auto fnc = custom_bind<fntraits>(                                    \
+              &PYCONNECT_MODULE_NAME::NAME,                                    \
+              static_cast<PYCONNECT_MODULE_NAME *>(                            \
+                  pyconnect::PyConnectWrapper::instance()                      \
+                      ->pyConnectModule()                                      \
+                      ->oobject()),                                            \
+              dataStr, rBytes, status);                                        \
+          if (status != pyconnect::NO_ERRORS) {                                \
+            ERROR_MSG("Arguments of method %s are corrupted.\n", #NAME);       \
+            if (!(pyconnect::PyConnectWrapper::instance()->noResponse())) {    \
+              pyconnect::PyConnectWrapper::instance()->sendAttrMetdResponse(   \
+                  status, metdIndex, 0, NULL, serverId);                       \
+            }                                                                  \
+            return;                                                            \
+          }                                                                    \
           if (pyconnect::PyConnectWrapper::instance()->noResponse()) {         \
-            auto fnc = custom_bind<fntraits>(                                  \
-                &PYCONNECT_MODULE_NAME::NAME,                                  \
-                static_cast<PYCONNECT_MODULE_NAME *>(                          \
-                    pyconnect::PyConnectWrapper::instance()                    \
-                        ->pyConnectModule()                                    \
-                        ->oobject()),                                          \
-                dataStr, rBytes, status);                                      \
             fnc();                                                             \
           } else {                                                             \
-            auto fnc = custom_bind<fntraits>(                                  \
-                &PYCONNECT_MODULE_NAME::NAME,                                  \
-                static_cast<PYCONNECT_MODULE_NAME *>(                          \
-                    pyconnect::PyConnectWrapper::instance()                    \
-                        ->pyConnectModule()                                    \
-                        ->oobject()),                                          \
-                dataStr, rBytes, status);                                      \
             invoke_method_call<fntraits::return_type>(metdIndex, serverId,     \
                                                       fnc);                    \
           }                                                                    \
@@ -656,18 +1316,24 @@ static void invoke_method_call(int metdIndex, int serverId, T fn) {
     std::vector<int> argtypelist;                                              \
     get_args_type_list<fntraits>(std::make_index_sequence<fntraits::arity>{},  \
                                  argtypelist);                                 \
+    std::vector<std::string> arglayoutlist;                                    \
+    get_args_layout_list<fntraits>(                                            \
+        std::make_index_sequence<fntraits::arity>{}, arglayoutlist);           \
     int asize = (int)argtypelist.size();                                       \
     for (int i = 0; i < asize; ++i) {                                          \
       pyconnect::PyConnectWrapper::instance()->s_arglist.push_back(            \
           new pyconnect::Argument(                                             \
               "", "",                                                          \
-              (pyconnect::PyConnectType::Type)argtypelist[asize - i - 1]));    \
+              (pyconnect::PyConnectType::Type)argtypelist[asize - i - 1],      \
+              false, arglayoutlist[i]));                                       \
     }                                                                          \
     pyconnect::PyConnectWrapper::instance()->addNewMethod(                     \
         #NAME, this->get_fn_##NAME##_description(),                            \
         pyconnect::pyconnect_type<fntraits::return_type>::value,               \
         &PYCONNECT_MODULE_NAME::s_call_fn_##NAME,                              \
-        pyconnect::PyConnectWrapper::instance()->s_arglist);                   \
+        pyconnect::PyConnectWrapper::instance()->s_arglist,                    \
+        pyconnect::pyconnect_layout<                                           \
+            std::decay<fntraits::return_type>::type>::value());                \
     pyconnect::PyConnectWrapper::instance()->s_arglist.clear();                \
   }
 } // namespace pyconnect
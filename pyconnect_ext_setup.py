@@ -36,11 +36,11 @@ lib_dirs = []
 osname = os.name
 if osname == 'nt':
     macro = macro + [('WIN32', None), ('WIN32_LEAN_AND_MEAN', None), ('NO_WINCOM', None)]
-    lib = lib + ['ws2_32', 'Kernel32', 'libeay32', 'advapi32', 'oleaut32', 'user32', 'gdi32']
+    lib = lib + ['ws2_32', 'Kernel32', 'libeay32', 'zlib', 'advapi32', 'oleaut32', 'user32', 'gdi32']
     inc_dirs = ['Windows/include']
     lib_dirs = ['Windows/lib']
 elif osname == 'posix':
-    lib = ['crypto', 'pthread']
+    lib = ['crypto', 'z', 'pthread']
     f = os.popen('uname -ms')
     (myos, myarch) = f.readline().split(' ')
     f.close()
@@ -52,6 +52,8 @@ elif osname == 'posix':
       macro.append(('SOLARIS', None))
     elif myos == 'Linux':
       macro.append(('LINUX', None))
+      # uncomment to build the io_uring I/O backend (Linux 6.0 or later)
+      #macro.append(('PYCONNECT_USE_IO_URING', None))
 
     for arch in BIG_ENDIAN_ARCH:
        if arch in myarch:
@@ -67,7 +69,8 @@ module1 = Extension('PyConnect',
                     library_dirs = lib_dirs,
                     libraries = lib,
                     sources = ['PyConnectPyModule.cpp','PyConnectObjComm.cpp',
-                    'PyConnectNetComm.cpp','PyConnectStub.cpp','PyConnectCommon.cpp'])
+                    'PyConnectNetComm.cpp','PyConnectStub.cpp','PyConnectCommon.cpp',
+                    'PyConnectIOURing.cpp','PyConnectShmRing.cpp'])
 
 setup (name = 'PyConnect',
        version = '0.2.4',
@@ -0,0 +1,230 @@
+/*
+ *  test_lengths.cpp
+ *  Checks that a module turns down arguments whose lengths run past the
+ *  end of the message, and that compressed frames only inflate to the
+ *  length they declare.
+ *
+ *  Copyright 2006, 2007 Xun Wang.
+ *  This file is part of PyConnect.
+ *
+ *  PyConnect is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  PyConnect is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "test_wire.hpp"
+
+using namespace pyconnect;
+
+#define PYCONNECT_MODULE_NAME LengthTest
+
+#define LENGTH_SERVER_ID 1
+#define LENGTH_MODULE_ID 3
+// methods are numbered after the attributes in the order of their names
+#define BLOBSIZE_ID 1
+#define COUNTINTS_ID 2
+#define TEXTLENGTH_ID 3
+#define COMPRESSED_LENGTH 4096
+
+class LengthTest : public OObject {
+public:
+  LengthTest();
+  ~LengthTest();
+
+  int blobSize(PyConnectBlob blob);
+  int countInts(const std::vector<int> &values);
+  int textLength(const std::string &text);
+
+private:
+  int calls; // number of method calls that got through
+
+public:
+  PYCONNECT_WRAPPER_DECLARE;
+
+  PYCONNECT_MODULE_DESCRIPTION("arguments of malformed lengths");
+
+  PYCONNECT_METHOD(blobSize, "size of a blob");
+  PYCONNECT_METHOD(countInts, "number of integers in an array");
+  PYCONNECT_METHOD(textLength, "length of a string");
+
+  PYCONNECT_RO_ATTRIBUTE(calls, "number of method calls so far");
+};
+
+LengthTest::LengthTest() : calls(0) {
+  EXPORT_PYCONNECT_MODULE;
+
+  EXPORT_PYCONNECT_RO_ATTRIBUTE(calls);
+
+  EXPORT_PYCONNECT_METHOD(blobSize);
+  EXPORT_PYCONNECT_METHOD(countInts);
+  EXPORT_PYCONNECT_METHOD(textLength);
+
+  PYCONNECT_MODULE_INIT;
+}
+
+LengthTest::~LengthTest() { PYCONNECT_MODULE_FINI; }
+
+int LengthTest::blobSize(PyConnectBlob blob) {
+  calls++;
+  return (int)blob.size();
+}
+
+int LengthTest::countInts(const std::vector<int> &values) {
+  calls++;
+  return (int)values.size();
+}
+
+int LengthTest::textLength(const std::string &text) {
+  calls++;
+  return (int)text.length();
+}
+
+// the response to a call of method with args, which must be the only
+// message the module sends for it
+static WireMessage callMethod(CapturingComm &comm, int metdId,
+                              const WireMessage &args) {
+  callAttrMetd(LENGTH_SERVER_ID, LENGTH_MODULE_ID, metdId, args.data(),
+               (int)args.size());
+  std::vector<WireMessage> responses = comm.take(ATTR_METD_RESP);
+  comm.messages.clear();
+  return responses.size() == 1 ? responses[0] : WireMessage();
+}
+
+// an int count or length, then bytes of the values that follow it
+static WireMessage lengthAndBytes(int length, int bytes) {
+  WireMessage args(sizeof(int) + bytes, 1);
+  unsigned char *argsPtr = args.data();
+  packToLENumber(length, argsPtr);
+  return args;
+}
+
+static WireMessage shortString(int length, int bytes) {
+  WireMessage args(packedIntLen(length) + bytes, 'a');
+  unsigned char *argsPtr = args.data();
+  packIntToStr(length, argsPtr);
+  return args;
+}
+
+static bool rejected(const WireMessage &response) {
+  return responseStatus(response) == MSG_CORRUPTED;
+}
+
+static int checkArguments(CapturingComm &comm, LengthTest &module) {
+  int failures = 0;
+  WireMessage response =
+      callMethod(comm, COUNTINTS_ID, lengthAndBytes(3, 12));
+  failures += check(responseStatus(response) == NO_ERRORS &&
+                        responseInt(response) == 3,
+                    "array of its full length taken");
+  response = callMethod(comm, COUNTINTS_ID, lengthAndBytes(1000, 8));
+  failures += check(rejected(response), "array count past the end rejected");
+  response = callMethod(comm, COUNTINTS_ID, lengthAndBytes(-1, 8));
+  failures += check(rejected(response), "negative array count rejected");
+  response = callMethod(comm, COUNTINTS_ID, WireMessage(2, 0));
+  failures += check(rejected(response), "truncated array count rejected");
+
+  response = callMethod(comm, BLOBSIZE_ID, lengthAndBytes(5, 5));
+  failures += check(responseStatus(response) == NO_ERRORS &&
+                        responseInt(response) == 5,
+                    "blob of its full length taken");
+  response = callMethod(comm, BLOBSIZE_ID, lengthAndBytes(100, 3));
+  failures += check(rejected(response), "blob length past the end rejected");
+
+  response = callMethod(comm, TEXTLENGTH_ID, shortString(200, 200));
+  failures += check(responseStatus(response) == NO_ERRORS &&
+                        responseInt(response) == 200,
+                    "string of its full length taken");
+  response = callMethod(comm, TEXTLENGTH_ID, shortString(200, 5));
+  failures +=
+      check(rejected(response), "string length past the end rejected");
+
+  failures += check(module.get_calls_value() == 3,
+                    "methods called only with whole arguments");
+  return failures;
+}
+
+// whether data, compressed as it was, inflates to what it was, once
+// change has been made to the compressed data
+static bool inflates(const WireMessage &data,
+                     void (*change)(WireMessage &compressed)) {
+  unsigned char *compressed = NULL;
+  int compressedLength = 0;
+  if (compressMessage(data.data(), (int)data.size(), &compressed,
+                      &compressedLength) != 1)
+    return false;
+  WireMessage frame(compressed, compressed + compressedLength);
+  if (change)
+    change(frame);
+
+  unsigned char *inflated = NULL;
+  int inflatedLength = 0;
+  return decompressMessage(frame.data(), (int)frame.size(), &inflated,
+                           &inflatedLength) == 1 &&
+         WireMessage(inflated, inflated + inflatedLength) == data;
+}
+
+static void declareLength(WireMessage &compressed, int length) {
+  unsigned char *lengthPtr = compressed.data();
+  packToLENumber(length, lengthPtr);
+}
+
+static void declareOneMore(WireMessage &compressed) {
+  declareLength(compressed, COMPRESSED_LENGTH + 1);
+}
+
+static void declareOneLess(WireMessage &compressed) {
+  declareLength(compressed, COMPRESSED_LENGTH - 1);
+}
+
+static void declareTooMuch(WireMessage &compressed) {
+  declareLength(compressed, PYCONNECT_MSG_MAX_SIZE);
+}
+
+static void cutShort(WireMessage &compressed) {
+  compressed.resize(compressed.size() - 4);
+}
+
+static void appendGarbage(WireMessage &compressed) {
+  compressed.push_back(0);
+}
+
+static int checkCompression() {
+  WireMessage data(COMPRESSED_LENGTH);
+  for (size_t i = 0; i < data.size(); i++)
+    data[i] = (unsigned char)(i % 7);
+
+  int failures = 0;
+  failures += check(inflates(data, NULL), "compressed data inflates");
+  failures += check(!inflates(data, declareOneMore),
+                    "declared length above the inflated one rejected");
+  failures += check(!inflates(data, declareOneLess),
+                    "declared length below the inflated one rejected");
+  failures += check(!inflates(data, declareTooMuch),
+                    "declared length past the inflate ratio rejected");
+  failures += check(!inflates(data, cutShort), "truncated data rejected");
+  failures +=
+      check(!inflates(data, appendGarbage), "trailing data rejected");
+  return failures;
+}
+
+PYCONNECT_LOGGING_DECLARE("testing.log");
+
+int main(int argc, char **argv) {
+  PYCONNECT_LOGGING_INIT;
+  LengthTest module;
+  static CapturingComm comm; // outlives the module, which shuts down on it
+  assignModuleId(LENGTH_SERVER_ID, LENGTH_MODULE_ID, "LengthTest");
+  comm.messages.clear();
+
+  int failures = checkArguments(comm, module);
+  failures += checkCompression();
+  return failures ? 1 : 0;
+}
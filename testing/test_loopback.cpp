@@ -0,0 +1,344 @@
+/*
+ *  test_loopback.cpp
+ *  Talks to a module over a loopback connection on the backend named on
+ *  the command line (select, epoll or io_uring), the way a server would.
+ *  A second argument has the two ends agree on sealed and compressed
+ *  frames (sealed) or on plain checksummed ones (plain) first.
+ *
+ *  Copyright 2006, 2007 Xun Wang.
+ *  This file is part of PyConnect.
+ *
+ *  PyConnect is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  PyConnect is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "PyConnectNetComm.h"
+#include "test_wire.hpp"
+
+using namespace pyconnect;
+
+#define PYCONNECT_MODULE_NAME LoopbackTest
+
+// large enough that its attributes go out in a v2 frame over several writes
+#define LOOPBACK_SAMPLE_COUNT 100000
+#define LOOPBACK_SERVER_ID 1
+#define LOOPBACK_MODULE_ID 5
+// the cipher announcement as PyConnectNetComm.cpp has it
+#define LOOPBACK_CONTROL_CIPHERS 0x3
+#define LOOPBACK_CIPHER_AES256GCM 0x1
+#define LOOPBACK_CIPHER_PLAIN 0x2
+#define LOOPBACK_CIPHER_CRC32C 0x4
+#define LOOPBACK_CODEC_DEFLATE 0x8
+#define LOOPBACK_CAPS_FRAMES_V2 0x1
+
+class LoopbackTest : public OObject {
+public:
+  LoopbackTest();
+  ~LoopbackTest();
+
+  int addUp(int a, int b) { return a + b; }
+
+private:
+  std::vector<int> samples;
+
+public:
+  PYCONNECT_NETCOMM_DECLARE;
+  PYCONNECT_WRAPPER_DECLARE;
+
+  PYCONNECT_MODULE_DESCRIPTION("loopback exercise of the comm backend");
+
+  PYCONNECT_METHOD(addUp, "add two integers");
+  PYCONNECT_RO_ATTRIBUTE(samples, "a large attribute");
+};
+
+LoopbackTest::LoopbackTest() : samples(LOOPBACK_SAMPLE_COUNT) {
+  for (int i = 0; i < LOOPBACK_SAMPLE_COUNT; i++)
+    samples[i] = i;
+
+  EXPORT_PYCONNECT_MODULE;
+
+  EXPORT_PYCONNECT_RO_ATTRIBUTE(samples);
+  EXPORT_PYCONNECT_METHOD(addUp);
+
+  PYCONNECT_NETCOMM_INIT;
+  PYCONNECT_MODULE_INIT;
+}
+
+LoopbackTest::~LoopbackTest() {
+  PYCONNECT_MODULE_FINI;
+  PYCONNECT_NETCOMM_FINI;
+}
+
+static bool sendMessage(int fd, const unsigned char *mesg, int length) {
+  unsigned char *encrypted = NULL;
+  int encryptedLength = 0;
+  if (encryptMessage(mesg, length, &encrypted, &encryptedLength) != 1)
+    return false;
+
+  std::vector<unsigned char> frame(PYCONNECT_FRAME_V1_HEADER_SIZE);
+  frame[0] = PYCONNECT_MSG_INIT;
+  short frameLength = (short)encryptedLength;
+  memcpy(&frame[1], &frameLength, sizeof(short));
+  frame.insert(frame.end(), encrypted, encrypted + encryptedLength);
+  frame.push_back(PYCONNECT_MSG_END);
+  return send(fd, frame.data(), frame.size(), 0) == (ssize_t)frame.size();
+}
+
+// a v2 control frame, which goes out as it is
+static bool sendControlFrame(int fd, const unsigned char *data, int length) {
+  std::vector<unsigned char> frame(PYCONNECT_FRAME_V2_HEADER_SIZE);
+  unsigned char *framePtr = frame.data();
+  *framePtr++ = PYCONNECT_MSG_INIT_V2;
+  *framePtr++ = PYCONNECT_FRAME_CONTROL;
+  packToLENumber(length, framePtr);
+  frame.insert(frame.end(), data, data + length);
+  frame.push_back(PYCONNECT_MSG_END);
+  return send(fd, frame.data(), frame.size(), 0) == (ssize_t)frame.size();
+}
+
+// the data of a frame as its flags have it: checked against its CRC,
+// opened, decrypted or taken as it is, then inflated
+static bool openFrame(unsigned char *data, int length, unsigned char flags,
+                      std::vector<unsigned char> &opened) {
+  if (flags & PYCONNECT_FRAME_CRC) {
+    if (length < PYCONNECT_FRAME_CRC_SIZE)
+      return false;
+    length -= PYCONNECT_FRAME_CRC_SIZE;
+    unsigned char *crcPtr = data + length;
+    int remainingLength = PYCONNECT_FRAME_CRC_SIZE;
+    unsigned int frameCRC = 0;
+    unpackLENumber(frameCRC, crcPtr, remainingLength);
+    if (crc32c(data, length) != frameCRC) {
+      printf("CRC mismatch on a frame\n");
+      return false;
+    }
+  }
+  if (flags & (PYCONNECT_FRAME_CONTROL | PYCONNECT_FRAME_PLAIN)) {
+    // taken as it is
+  } else if (flags & PYCONNECT_FRAME_SEALED) {
+    if (openMessage(data, length, &data, &length) != 1) {
+      printf("unable to open a sealed frame\n");
+      return false;
+    }
+  } else if (decryptMessage(data, length, &data, &length) != 1) {
+    printf("unable to decrypt a frame\n");
+    return false;
+  }
+  if ((flags & PYCONNECT_FRAME_COMPRESSED) &&
+      decompressMessage(data, length, &data, &length) != 1) {
+    printf("unable to inflate a frame\n");
+    return false;
+  }
+  opened.assign(data, data + length);
+  return true;
+}
+
+static std::vector<unsigned char> received; // not yet taken out in frames
+static unsigned char lastFrameFlags = 0; // of the frame last message was in
+static int announcedCiphers = -1;        // what the module takes, if known
+
+// reads frames off fd until a message of msgType turns up and returns it
+// opened, or an empty one after a few seconds without it.
+static std::vector<unsigned char> receiveMessage(int fd, int msgType) {
+  std::vector<unsigned char> messages;
+
+  for (;;) {
+    // take every complete frame out of what has been received so far
+    while (received.size() >= (size_t)PYCONNECT_FRAME_V1_HEADER_SIZE) {
+      unsigned char flags = 0;
+      int headerLength = 0;
+      int dataLength = 0;
+      if (received[0] == PYCONNECT_MSG_INIT) {
+        short frameLength = 0;
+        memcpy(&frameLength, &received[1], sizeof(short));
+        headerLength = PYCONNECT_FRAME_V1_HEADER_SIZE;
+        dataLength = frameLength;
+      } else if (received[0] == PYCONNECT_MSG_INIT_V2) {
+        if (received.size() < (size_t)PYCONNECT_FRAME_V2_HEADER_SIZE)
+          break;
+        unsigned char *lengthPtr = &received[2];
+        int dummyLen = 0;
+        flags = received[1];
+        unpackLENumber(dataLength, lengthPtr, dummyLen);
+        headerLength = PYCONNECT_FRAME_V2_HEADER_SIZE;
+      } else {
+        printf("bad frame header %d\n", received[0]);
+        return std::vector<unsigned char>();
+      }
+      if (received.size() < (size_t)(headerLength + dataLength + 1))
+        break;
+      if (received[headerLength + dataLength] != PYCONNECT_MSG_END) {
+        printf("bad frame end\n");
+        return std::vector<unsigned char>();
+      }
+      if (!openFrame(&received[headerLength], dataLength, flags, messages))
+        return std::vector<unsigned char>();
+      received.erase(received.begin(),
+                     received.begin() + headerLength + dataLength + 1);
+
+      if (flags & PYCONNECT_FRAME_CONTROL) {
+        if (messages.size() >= 2 && messages[0] == LOOPBACK_CONTROL_CIPHERS)
+          announcedCiphers = messages[1];
+        continue;
+      }
+      // a batch holds length prefixed messages
+      unsigned char *mesgPtr = messages.data();
+      int remaining = (int)messages.size();
+      while (remaining > 0) {
+        int mesgLength = remaining;
+        if (flags & PYCONNECT_FRAME_BATCH)
+          unpackLENumber(mesgLength, mesgPtr, remaining);
+        if (mesgLength <= 0 || mesgLength > remaining)
+          break;
+        if (((mesgPtr[0] >> 4) & 0xf) == msgType) {
+          lastFrameFlags = flags;
+          return std::vector<unsigned char>(mesgPtr, mesgPtr + mesgLength);
+        }
+        mesgPtr += mesgLength;
+        remaining -= mesgLength;
+      }
+    }
+
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, 5000) <= 0)
+      return std::vector<unsigned char>();
+    unsigned char buffer[8192];
+    ssize_t count = recv(fd, buffer, sizeof(buffer), 0);
+    if (count <= 0)
+      return std::vector<unsigned char>();
+    received.insert(received.end(), buffer, buffer + count);
+  }
+}
+
+static int listenOnLoopback(int &port) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  // createTalker only takes ports up to those the modules listen on
+  for (port = PYCONNECT_NETCOMM_PORT - 1; port > PYCONNECT_NETCOMM_PORT - 100;
+       port--) {
+    addr.sin_port = htons(port);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0 &&
+        listen(fd, 1) == 0)
+      return fd;
+  }
+  close(fd);
+  return -1;
+}
+
+PYCONNECT_LOGGING_DECLARE("testing.log");
+
+int main(int argc, char **argv) {
+  PYCONNECT_LOGGING_INIT;
+  if (argc > 1)
+    setenv("PYCONNECT_IO_BACKEND", argv[1], 1);
+  std::string ciphers = argc > 2 ? argv[2] : "";
+  if (ciphers == "plain")
+    setenv("PYCONNECT_LOOPBACK_PLAIN", "1", 1);
+
+  int port = 0;
+  int listenFD = listenOnLoopback(port);
+  if (listenFD < 0)
+    return check(false, "listen on loopback");
+
+  LoopbackTest module;
+  char host[] = "127.0.0.1";
+  if (PyConnectNetComm::instance()->createTalker(host, port) != COMM_SUCCESS)
+    return check(false, "connect to loopback");
+  int fd = accept(listenFD, NULL, NULL);
+  if (fd < 0)
+    return check(false, "accept the module");
+
+  std::thread processing([] { PYCONNECT_NETCOMM_PROCESS_DATA; });
+  processing.detach();
+
+  int failures = 0;
+  if (ciphers == "sealed" || ciphers == "plain") {
+    unsigned char announce[2] = {LOOPBACK_CONTROL_CIPHERS,
+                                 LOOPBACK_CIPHER_AES256GCM |
+                                     LOOPBACK_CODEC_DEFLATE};
+    if (ciphers == "plain")
+      announce[1] = LOOPBACK_CIPHER_PLAIN | LOOPBACK_CIPHER_CRC32C;
+    failures += check(sendControlFrame(fd, announce, sizeof(announce)),
+                      "announce ciphers");
+  }
+  unsigned char discovery[] = {MODULE_DISCOVERY << 4 | LOOPBACK_SERVER_ID,
+                               PYCONNECT_MSG_END};
+  failures += check(sendMessage(fd, discovery, sizeof(discovery)),
+                    "send discovery");
+  std::vector<unsigned char> declare = receiveMessage(fd, MODULE_DECLARE);
+  std::string name = "LoopbackTest";
+  failures += check(declare.size() > name.length() + 3 &&
+                        !memcmp(&declare[3], name.data(), name.length()),
+                    "module declared");
+  failures += check(declare.size() > 2 &&
+                        declare[declare.size() - 2] == LOOPBACK_CAPS_FRAMES_V2,
+                    "declaration says the module reads v2 frames");
+
+  unsigned char assign[64];
+  unsigned char *assignPtr = assign;
+  *assignPtr++ = MODULE_ASSIGN_ID << 4 | LOOPBACK_SERVER_ID;
+  *assignPtr++ = LOOPBACK_MODULE_ID;
+  packString((unsigned char *)name.data(), (int)name.length(), assignPtr);
+  *assignPtr++ = PYCONNECT_MSG_END;
+  failures += check(sendMessage(fd, assign, (int)(assignPtr - assign)),
+                    "send module id");
+  std::vector<unsigned char> expose = receiveMessage(fd, ATTR_METD_EXPOSE);
+  failures += check(expose.size() > LOOPBACK_SAMPLE_COUNT * sizeof(int) &&
+                        expose[1] == LOOPBACK_MODULE_ID,
+                    "attributes and methods exposed");
+
+  unsigned char cipherFlags = lastFrameFlags & ~PYCONNECT_FRAME_BATCH;
+  if (ciphers == "sealed") {
+    failures += check((announcedCiphers & LOOPBACK_CIPHER_AES256GCM) &&
+                          (announcedCiphers & LOOPBACK_CODEC_DEFLATE),
+                      "module takes sealed and compressed frames");
+    failures += check(cipherFlags == (PYCONNECT_FRAME_SEALED |
+                                      PYCONNECT_FRAME_COMPRESSED),
+                      "attributes sent sealed and compressed");
+  } else if (ciphers == "plain") {
+    failures += check((announcedCiphers & LOOPBACK_CIPHER_PLAIN) &&
+                          (announcedCiphers & LOOPBACK_CIPHER_CRC32C),
+                      "module takes plain checksummed frames");
+    failures +=
+        check(cipherFlags == (PYCONNECT_FRAME_PLAIN | PYCONNECT_FRAME_CRC),
+              "attributes sent plain and checksummed");
+  } else {
+    failures += check(cipherFlags == 0, "attributes sent with Blowfish");
+    failures += check(announcedCiphers < 0,
+                      "no control frames to a server that sent none");
+  }
+
+  // the module is left running, its thread has no way to stop
+  close(fd);
+  close(listenFD);
+  fflush(stdout);
+  _exit(failures ? 1 : 0);
+}
@@ -0,0 +1,97 @@
+/*
+ *  test_shm_ring.cpp
+ *  Checks that a shared memory channel keeps to the ring size it was set
+ *  up with, whatever the peer writes to the control blocks afterwards.
+ *
+ *  Copyright 2006, 2007 Xun Wang.
+ *  This file is part of PyConnect.
+ *
+ *  PyConnect is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  PyConnect is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <vector>
+
+#include "PyConnectCommon.h"
+#include "PyConnectShmRing.h"
+
+using namespace pyconnect;
+
+#define SHM_RING_SIZE 0x1000
+
+static int check(bool passed, const char *what) {
+  printf("%s: %s\n", what, passed ? "ok" : "FAILED");
+  return passed ? 0 : 1;
+}
+
+static int writeBytes(ShmChannel &channel, const unsigned char *data,
+                      int length) {
+  struct iovec iov;
+  iov.iov_base = (void *)data;
+  iov.iov_len = length;
+  return channel.write(&iov, 1);
+}
+
+PYCONNECT_LOGGING_DECLARE("testing.log");
+
+int main(int argc, char **argv) {
+  PYCONNECT_LOGGING_INIT;
+
+  ShmChannel producer;
+  ShmChannel consumer;
+  int fds[3];
+  if (!producer.create(SHM_RING_SIZE))
+    return check(false, "create a channel");
+  producer.offeredFDs(fds);
+  int consumerFDs[3] = {dup(fds[0]), dup(fds[1]), dup(fds[2])};
+  consumer.takeFDs(consumerFDs);
+  if (!consumer.attach(SHM_RING_SIZE))
+    return check(false, "attach to the channel");
+
+  // the peer's view of the ring the producer writes to, which comes first
+  void *segment = mmap(NULL, SHM_RING_SIZE + sizeof(ShmRingHeader),
+                       PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+  if (segment == MAP_FAILED)
+    return check(false, "map the channel");
+  ShmRingHeader *header = (ShmRingHeader *)segment;
+
+  int failures = 0;
+  const unsigned char hello[] = "hello";
+  unsigned char *data = NULL;
+  failures += check(writeBytes(producer, hello, 5) == 5 &&
+                        consumer.peek(data) == 5 && !memcmp(data, hello, 5),
+                    "bytes go through the ring");
+  consumer.consume(5);
+
+  // a ring size the peer makes up is not used for offsets or space
+  header->size = 0x40000000;
+  std::vector<unsigned char> burst(2 * SHM_RING_SIZE, 'x');
+  failures += check(writeBytes(producer, burst.data(), (int)burst.size()) ==
+                        SHM_RING_SIZE,
+                    "rewritten ring size ignored when writing");
+  failures += check(consumer.peek(data) == SHM_RING_SIZE - 5,
+                    "rewritten ring size ignored when reading");
+
+  header->tail = header->head + 4 * SHM_RING_SIZE;
+  failures += check(consumer.peek(data) < 0,
+                    "positions more than a ring apart rejected on reading");
+  failures += check(writeBytes(producer, hello, 5) < 0,
+                    "positions more than a ring apart rejected on writing");
+
+  munmap(segment, SHM_RING_SIZE + sizeof(ShmRingHeader));
+  return failures ? 1 : 0;
+}
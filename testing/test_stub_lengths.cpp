@@ -0,0 +1,175 @@
+/*
+ *  test_stub_lengths.cpp
+ *  Checks that the Python side decodes values and declared types only
+ *  from what is in the message, whatever lengths the message claims.
+ *
+ *  Copyright 2006, 2007 Xun Wang.
+ *  This file is part of PyConnect.
+ *
+ *  PyConnect is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  PyConnect is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "PyConnectCommon.h"
+
+using namespace pyconnect;
+
+typedef std::vector<unsigned char> WireData;
+
+static int check(bool passed, const char *what) {
+  printf("%s: %s\n", what, passed ? "ok" : "FAILED");
+  return passed ? 0 : 1;
+}
+
+// the length of the value of type decoded from data, or -1 if it is not
+// decoded. The decoding must stay within data.
+static int decodedLength(PyConnectType::Type type, const WireData &data) {
+  // a copy of its own, so reading past it is caught by a memory checker
+  unsigned char *buffer = new unsigned char[data.size() + 1];
+  memcpy(buffer, data.data(), data.size());
+  unsigned char *dataPtr = buffer;
+  int remainingLength = (int)data.size();
+
+  PyObject *value = PyConnectType::unpackStr(type, dataPtr, remainingLength);
+  int length = -1;
+  if (value && value != Py_None && remainingLength >= 0 &&
+      dataPtr <= buffer + data.size())
+    length = (int)PyObject_Length(value);
+  Py_XDECREF(value);
+  delete[] buffer;
+  return length;
+}
+
+// an int count or length, then bytes of the values that follow it
+static WireData lengthAndBytes(int length, int bytes) {
+  WireData data(sizeof(int) + bytes, 1);
+  unsigned char *dataPtr = data.data();
+  packToLENumber(length, dataPtr);
+  return data;
+}
+
+static WireData shortString(int length, int bytes) {
+  WireData data(packedIntLen(length) + bytes, 'a');
+  unsigned char *dataPtr = data.data();
+  packIntToStr(length, dataPtr);
+  return data;
+}
+
+static int checkValues() {
+  int failures = 0;
+  failures += check(decodedLength(PyConnectType::INT_ARRAY,
+                                  lengthAndBytes(3, 12)) == 3,
+                    "array of its full length decoded");
+  failures += check(decodedLength(PyConnectType::INT_ARRAY,
+                                  lengthAndBytes(1000, 8)) < 0,
+                    "array count past the end rejected");
+  failures += check(decodedLength(PyConnectType::DOUBLE_ARRAY,
+                                  lengthAndBytes(2, 12)) < 0,
+                    "array count past the end of wider values rejected");
+  failures += check(decodedLength(PyConnectType::INT_ARRAY,
+                                  lengthAndBytes(-1, 8)) < 0,
+                    "negative array count rejected");
+  failures += check(decodedLength(PyConnectType::INT_ARRAY, WireData(2)) < 0,
+                    "truncated array count rejected");
+
+  failures += check(decodedLength(PyConnectType::BLOB,
+                                  lengthAndBytes(5, 5)) == 5,
+                    "blob of its full length decoded");
+  failures += check(decodedLength(PyConnectType::BLOB,
+                                  lengthAndBytes(100, 3)) < 0,
+                    "blob length past the end rejected");
+  failures += check(decodedLength(PyConnectType::BLOB, WireData(3)) < 0,
+                    "truncated blob length rejected");
+
+  failures += check(decodedLength(PyConnectType::STRING,
+                                  shortString(200, 200)) == 200,
+                    "string of its full length decoded");
+  failures += check(decodedLength(PyConnectType::STRING,
+                                  shortString(200, 5)) < 0,
+                    "string length past the end rejected");
+  return failures;
+}
+
+static void packShortName(const char *name, WireData &layout) {
+  layout.push_back((unsigned char)strlen(name));
+  layout.insert(layout.end(), name, name + strlen(name));
+}
+
+// a composite of an int and a fixed size array of three ints, nested in
+// as many composites of a single field as depth
+static WireData nestedLayout(int depth) {
+  WireData layout;
+  packShortName("Inner", layout);
+  layout.push_back(2);
+  layout.push_back(PyConnectType::INT);
+  packShortName("count", layout);
+  layout.push_back(PyConnectType::INT_ARRAY | PYCONNECT_FIXED_LENGTH);
+  WireData length(sizeof(int));
+  unsigned char *lengthPtr = length.data();
+  packToLENumber(3, lengthPtr);
+  layout.insert(layout.end(), length.begin(), length.end());
+  packShortName("values", layout);
+
+  for (int i = 0; i < depth; i++) {
+    WireData outer;
+    packShortName("Outer", outer);
+    outer.push_back(1);
+    outer.push_back(PyConnectType::COMPOSITE);
+    outer.insert(outer.end(), layout.begin(), layout.end());
+    packShortName("inner", outer);
+    layout.swap(outer);
+  }
+  return layout;
+}
+
+// whether the layout in the first length bytes of data is decoded. The
+// decoding must stay within them.
+static bool decodesLayout(const WireData &data, int length) {
+  unsigned char *buffer = new unsigned char[length + 1];
+  memcpy(buffer, data.data(), length);
+  unsigned char *dataPtr = buffer;
+  int remainingBytes = length;
+
+  PyConnectLayout *layout = PyConnectLayout::unpack(dataPtr, remainingBytes);
+  bool decoded = layout && remainingBytes == 0 && dataPtr == buffer + length;
+  delete layout;
+  delete[] buffer;
+  return decoded;
+}
+
+static int checkLayouts() {
+  int failures = 0;
+  WireData layout = nestedLayout(2);
+  failures += check(decodesLayout(layout, (int)layout.size()),
+                    "nested layout decoded");
+
+  bool truncatedDecoded = false;
+  for (int length = 0; length < (int)layout.size(); length++)
+    truncatedDecoded |= decodesLayout(layout, length);
+  failures += check(!truncatedDecoded, "truncated layouts rejected");
+
+  layout = nestedLayout(PYCONNECT_MAX_LAYOUT_DEPTH);
+  failures += check(!decodesLayout(layout, (int)layout.size()),
+                    "layout nested too deep rejected");
+  return failures;
+}
+
+PYCONNECT_LOGGING_DECLARE("testing.log");
+
+int main(int argc, char **argv) {
+  PYCONNECT_LOGGING_INIT;
+  Py_Initialize();
+
+  int failures = checkValues();
+  failures += checkLayouts();
+  return failures ? 1 : 0;
+}
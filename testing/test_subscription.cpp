@@ -0,0 +1,185 @@
+/*
+ *  test_subscription.cpp
+ *  Checks how a module takes attribute writes and subscriptions from a
+ *  server: a write of the wrong length, an update interval held over a
+ *  burst of values, a deadband, an unsubscription, a subscription cut
+ *  short and a publish policy over a held update.
+ *
+ *  Copyright 2006, 2007 Xun Wang.
+ *  This file is part of PyConnect.
+ *
+ *  PyConnect is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  PyConnect is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <unistd.h>
+
+#include <array>
+
+#include "test_wire.hpp"
+
+using namespace pyconnect;
+
+#define PYCONNECT_MODULE_NAME SubscriptionTest
+
+#define SUBSCRIPTION_SERVER_ID 1
+#define SUBSCRIPTION_MODULE_ID 7
+// attributes are numbered in the order of their names
+#define GAINS_ID 0
+#define LEVEL_ID 1
+#define LEVEL_INTERVAL 20000 // usec
+
+class SubscriptionTest : public OObject {
+public:
+  SubscriptionTest();
+  ~SubscriptionTest();
+
+  void setLevel(int value);
+  void publishChangesOnly();
+
+private:
+  std::array<int, 3> gains;
+  int level;
+
+public:
+  PYCONNECT_WRAPPER_DECLARE;
+
+  PYCONNECT_MODULE_DESCRIPTION("attribute writes and subscriptions");
+
+  PYCONNECT_RW_ATTRIBUTE(gains, "a fixed size array");
+  PYCONNECT_RO_ATTRIBUTE(level, "a value that changes in bursts");
+};
+
+SubscriptionTest::SubscriptionTest() : level(0) {
+  gains[0] = 1;
+  gains[1] = 2;
+  gains[2] = 3;
+
+  EXPORT_PYCONNECT_MODULE;
+
+  EXPORT_PYCONNECT_RW_ATTRIBUTE(gains);
+  EXPORT_PYCONNECT_RO_ATTRIBUTE(level);
+
+  PYCONNECT_MODULE_INIT;
+}
+
+SubscriptionTest::~SubscriptionTest() { PYCONNECT_MODULE_FINI; }
+
+void SubscriptionTest::setLevel(int value) {
+  level = value;
+  PYCONNECT_ATTRIBUTE_UPDATE(level);
+}
+
+void SubscriptionTest::publishChangesOnly() {
+  PYCONNECT_ATTRIBUTE_PUBLISH_POLICY(level, 0, true);
+}
+
+// the status of a write of count values to gains. The server follows the
+// attribute, so a write that is taken comes back as an update.
+static int writeGains(CapturingComm &comm, int count, int value) {
+  WireMessage args(sizeof(int) * (count + 1));
+  unsigned char *argsPtr = args.data();
+  packToLENumber(count, argsPtr);
+  for (int i = 0; i < count; i++)
+    packToLENumber(value, argsPtr);
+  callAttrMetd(SUBSCRIPTION_SERVER_ID, SUBSCRIPTION_MODULE_ID, GAINS_ID,
+               args.data(), (int)args.size());
+
+  std::vector<WireMessage> responses = comm.take(ATTR_METD_RESP);
+  std::vector<WireMessage> updates = comm.take(ATTR_VALUE_UPDATE);
+  if (responses.size() == 1 && updates.empty())
+    return responseStatus(responses[0]);
+  return (responses.empty() && updates.size() == 1) ? NO_ERRORS : -1;
+}
+
+// the value of the single update of level sent, or -1 if there is not
+// exactly one
+static int levelUpdate(CapturingComm &comm) {
+  std::vector<WireMessage> updates = comm.take(ATTR_VALUE_UPDATE);
+  return updates.size() == 1 ? responseInt(updates[0]) : -1;
+}
+
+PYCONNECT_LOGGING_DECLARE("testing.log");
+
+int main(int argc, char **argv) {
+  PYCONNECT_LOGGING_INIT;
+  SubscriptionTest module;
+  static CapturingComm comm; // outlives the module, which shuts down on it
+  assignModuleId(SUBSCRIPTION_SERVER_ID, SUBSCRIPTION_MODULE_ID,
+                 "SubscriptionTest");
+  comm.messages.clear();
+
+  int failures = 0;
+  failures += check(writeGains(comm, 2, 9) == MSG_CORRUPTED,
+                    "array write of the wrong length rejected");
+  failures += check(module.get_gains_value()[0] == 1,
+                    "rejected write leaves the array alone");
+  failures += check(writeGains(comm, 3, 9) == NO_ERRORS &&
+                        module.get_gains_value()[2] == 9,
+                    "array write of the right length taken");
+
+  subscribe(SUBSCRIPTION_SERVER_ID, SUBSCRIPTION_MODULE_ID, LEVEL_ID, 0.0,
+            LEVEL_INTERVAL);
+  failures += check(levelUpdate(comm) == 0, "subscriber gets current value");
+  for (int i = 1; i <= 10; i++)
+    module.setLevel(i);
+  failures += check(comm.take(ATTR_VALUE_UPDATE).empty(),
+                    "burst within the interval held back");
+  PyConnectWrapper::instance()->processTimer();
+  failures += check(comm.take(ATTR_VALUE_UPDATE).empty(),
+                    "nothing sent before the interval is over");
+  usleep(LEVEL_INTERVAL + 10000);
+  PyConnectWrapper::instance()->processTimer();
+  failures += check(levelUpdate(comm) == 10, "last value of the burst sent");
+  PyConnectWrapper::instance()->processTimer();
+  failures += check(comm.take(ATTR_VALUE_UPDATE).empty(),
+                    "last value sent only once");
+
+  subscribe(SUBSCRIPTION_SERVER_ID, SUBSCRIPTION_MODULE_ID, LEVEL_ID, 5.0, 0);
+  failures += check(levelUpdate(comm) == 10, "resubscriber gets current value");
+  module.setLevel(12);
+  failures += check(comm.take(ATTR_VALUE_UPDATE).empty(),
+                    "change within the deadband held back");
+  module.setLevel(20);
+  failures += check(levelUpdate(comm) == 20, "change past the deadband sent");
+
+  unsubscribe(SUBSCRIPTION_SERVER_ID, SUBSCRIPTION_MODULE_ID, LEVEL_ID);
+  module.setLevel(30);
+  PyConnectWrapper::instance()->processTimer();
+  failures += check(comm.take(ATTR_VALUE_UPDATE).empty(),
+                    "no updates after unsubscribing");
+
+  // a subscription without its op is ignored
+  WireMessage truncated =
+      serverMessage(ATTR_SUBSCRIPTION, SUBSCRIPTION_SERVER_ID,
+                    SUBSCRIPTION_MODULE_ID, attrMetdData(LEVEL_ID, NULL, 0));
+  deliver(truncated);
+  module.setLevel(40);
+  failures += check(comm.take(ATTR_VALUE_UPDATE).empty(),
+                    "truncated subscription ignored");
+
+  // an update held back by the interval still goes through the policy
+  module.publishChangesOnly();
+  subscribe(SUBSCRIPTION_SERVER_ID, SUBSCRIPTION_MODULE_ID, LEVEL_ID, 0.0,
+            LEVEL_INTERVAL);
+  comm.take(ATTR_VALUE_UPDATE);
+  usleep(LEVEL_INTERVAL + 10000);
+  module.setLevel(50);
+  failures += check(levelUpdate(comm) == 50, "change sent under the policy");
+  module.setLevel(51);
+  module.setLevel(50);
+  usleep(LEVEL_INTERVAL + 10000);
+  PyConnectWrapper::instance()->processTimer();
+  failures += check(comm.take(ATTR_VALUE_UPDATE).empty(),
+                    "held value the server has already not sent again");
+  return failures ? 1 : 0;
+}
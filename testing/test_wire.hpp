@@ -0,0 +1,163 @@
+/*
+ *  test_wire.hpp
+ *  What the test programs need to play the server side of a module: a
+ *  communication object that keeps what the module sends, and the messages
+ *  a server would send to it.
+ *
+ *  Copyright 2006, 2007 Xun Wang.
+ *  This file is part of PyConnect.
+ *
+ *  PyConnect is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  PyConnect is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef test_wire_hpp_DEFINED
+#define test_wire_hpp_DEFINED
+
+#include <stdio.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#include "PyConnectWrapper.h"
+
+namespace pyconnect {
+
+typedef std::vector<unsigned char> WireMessage;
+
+// stands in for the network, keeping every message the module sends. The
+// test calls processTimer itself.
+class CapturingComm : public ObjectComm {
+public:
+  std::vector<WireMessage> messages;
+
+  CapturingComm() {
+    setMP(PyConnectWrapper::instance());
+    PyConnectWrapper::instance()->addCommObject(this);
+  }
+  void dataPacketSender(const unsigned char *data, int size,
+                        bool broadcast = false) {
+    messages.push_back(WireMessage(data, data + size));
+  }
+  bool setTimer(int usec) { return true; }
+
+  // the messages of msgType sent and not taken before
+  std::vector<WireMessage> take(int msgType) {
+    std::vector<WireMessage> taken;
+    std::vector<WireMessage> left;
+    for (size_t i = 0; i < messages.size(); i++) {
+      if (((messages[i][0] >> 4) & 0xf) == msgType)
+        taken.push_back(messages[i]);
+      else
+        left.push_back(messages[i]);
+    }
+    messages.swap(left);
+    return taken;
+  }
+};
+
+static inline int check(bool passed, const char *what) {
+  printf("%s: %s\n", what, passed ? "ok" : "FAILED");
+  return passed ? 0 : 1;
+}
+
+static inline void deliver(WireMessage &message) {
+  struct sockaddr_in cAddr;
+  memset(&cAddr, 0, sizeof(cAddr));
+  PyConnectWrapper::instance()->processInput(message.data(),
+                                             (int)message.size(), cAddr, true);
+}
+
+// a message from server to the module it knows as moduleId, its data
+// preceded by their length as the attribute and method messages are
+static inline WireMessage serverMessage(PyConnectMsg msgType, int serverId,
+                                        int moduleId, const WireMessage &data) {
+  WireMessage message(2 + sizeof(int) + data.size() + 1);
+  unsigned char *dataPtr = message.data();
+  *dataPtr++ = (unsigned char)(msgType << 4 | serverId);
+  *dataPtr++ = (unsigned char)moduleId;
+  packToLENumber((int)data.size(), dataPtr);
+  memcpy(dataPtr, data.data(), data.size());
+  message.back() = PYCONNECT_MSG_END;
+  return message;
+}
+
+static inline void assignModuleId(int serverId, int moduleId,
+                                  const std::string &name) {
+  WireMessage message(3 + name.length());
+  unsigned char *dataPtr = message.data();
+  *dataPtr++ = (unsigned char)(MODULE_ASSIGN_ID << 4 | serverId);
+  *dataPtr++ = (unsigned char)moduleId;
+  packString((unsigned char *)name.data(), (int)name.length(), dataPtr);
+  message.resize(dataPtr - message.data());
+  message.push_back(PYCONNECT_MSG_END);
+  deliver(message);
+}
+
+// the id of an attribute or method followed by packed arguments
+static inline WireMessage attrMetdData(int id, const unsigned char *args,
+                                       int argsLength) {
+  WireMessage data(packedIntLen(id));
+  unsigned char *dataPtr = data.data();
+  packIntToStr(id, dataPtr);
+  data.insert(data.end(), args, args + argsLength);
+  return data;
+}
+
+static inline void callAttrMetd(int serverId, int moduleId, int id,
+                                const unsigned char *args, int argsLength) {
+  WireMessage message = serverMessage(CALL_ATTR_METD, serverId, moduleId,
+                                      attrMetdData(id, args, argsLength));
+  deliver(message);
+}
+
+static inline void subscribe(int serverId, int moduleId, int attrId,
+                             double deadband, int minIntervalUSec) {
+  unsigned char args[1 + sizeof(double) + sizeof(int)];
+  unsigned char *argsPtr = args;
+  *argsPtr++ = ATTR_SUBSCRIBE;
+  packToLENumber(deadband, argsPtr);
+  packToLENumber(minIntervalUSec, argsPtr);
+  WireMessage message =
+      serverMessage(ATTR_SUBSCRIPTION, serverId, moduleId,
+                    attrMetdData(attrId, args, (int)sizeof(args)));
+  deliver(message);
+}
+
+static inline void unsubscribe(int serverId, int moduleId, int attrId) {
+  unsigned char op = ATTR_UNSUBSCRIBE;
+  WireMessage message = serverMessage(ATTR_SUBSCRIPTION, serverId, moduleId,
+                                      attrMetdData(attrId, &op, 1));
+  deliver(message);
+}
+
+// the status of a response or update of the module
+static inline int responseStatus(const WireMessage &response) {
+  return response.size() > 2 ? response[2] : -1;
+}
+
+// the int value at the end of a response or update of the module
+static inline int responseInt(const WireMessage &response) {
+  int value = 0;
+  if (response.size() > sizeof(int)) {
+    unsigned char *valuePtr =
+        (unsigned char *)response.data() + response.size() - sizeof(int) - 1;
+    int remainingBytes = sizeof(int);
+    unpackLENumber(value, valuePtr, remainingBytes);
+  }
+  return value;
+}
+
+} // namespace pyconnect
+
+#endif // test_wire_hpp_DEFINED